@@ -26,6 +26,7 @@
  */
 
 #include "audio.h"
+#include "audio_ring.h"
 #include "common.h"
 #include "config.h"
 #include <stdio.h>
@@ -55,6 +56,15 @@ extern audio_output audio_dummy;
 #ifdef CONFIG_PIPE
 extern audio_output audio_pipe;
 #endif
+#ifdef CONFIG_SHM
+extern audio_output audio_shm;
+#endif
+#ifdef CONFIG_STREAM
+extern audio_output audio_stream;
+#endif
+#ifdef CONFIG_RECORDER
+extern audio_output audio_recorder;
+#endif
 #ifdef CONFIG_STDOUT
 extern audio_output audio_stdout;
 #endif
@@ -81,6 +91,15 @@ static audio_output *outputs[] = {
 #ifdef CONFIG_PIPE
     &audio_pipe,
 #endif
+#ifdef CONFIG_SHM
+    &audio_shm,
+#endif
+#ifdef CONFIG_STREAM
+    &audio_stream,
+#endif
+#ifdef CONFIG_RECORDER
+    &audio_recorder,
+#endif
 #ifdef CONFIG_STDOUT
     &audio_stdout,
 #endif
@@ -93,12 +112,16 @@ audio_output *audio_get_output(char *name) {
   audio_output **out;
 
   // default to the first
-  if (!name)
+  if (!name) {
+    audio_ring_complete_output(outputs[0]);
     return outputs[0];
+  }
 
   for (out = outputs; *out; out++)
-    if (!strcasecmp(name, (*out)->name))
+    if (!strcasecmp(name, (*out)->name)) {
+      audio_ring_complete_output(*out);
       return *out;
+    }
 
   return NULL;
 }
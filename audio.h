@@ -52,6 +52,24 @@ typedef struct {
   // also, will return a 1 if it is actually using the mute facility, 0 otherwise
   int (*mute)(int do_mute);
 
+  // may be NULL. If implemented, the player formats its output straight into the backend's
+  // buffer rather than passing it to play(). get_buffer() finds room for the given number of frames,
+  // in one segment or, where the buffer wraps around, in two, and returns non-zero if it can't, in
+  // which case play() is used. commit_buffer() then plays the first frames of that room -- it must
+  // follow every successful get_buffer(), even if there are no frames to play.
+  int (*get_buffer)(int frames, void *segments[2], int segment_frames[2]);
+  int (*commit_buffer)(int frames);
+
+  // may be NULL. If implemented, it's called before a packet's frames are passed to play() or
+  // commit_buffer() with the local time, as from get_absolute_time_in_fp(), at which the first of
+  // them should be heard. It applies only to those frames -- others, like silence, have no time.
+  void (*presentation_time)(uint64_t time);
+
+  // may be NULL. A backend whose device takes frames in a callback of its own can hand the frames
+  // over in a ring -- see audio_ring.h. Whatever it leaves NULL of play(), flush(), delay(),
+  // rate_info(), get_buffer() and commit_buffer() is then done with the ring.
+  struct audio_ring *ring;
+
 } audio_output;
 
 audio_output *audio_get_output(char *name);
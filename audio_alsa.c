@@ -28,9 +28,11 @@
 #define ALSA_PCM_NEW_HW_PARAMS_API
 
 #include <alsa/asoundlib.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
 #include <memory.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -57,11 +59,18 @@ static int init(int argc, char **argv);
 static void deinit(void);
 static void start(int i_sample_rate, int i_sample_format);
 static int play(void *buf, int samples);
+static int get_buffer(int frames, void *segments[2], int segment_frames[2]);
+static int commit_buffer(int frames);
 static void stop(void);
 static void flush(void);
 int delay(long *the_delay);
 int get_rate_information(uint64_t *elapsed_time, uint64_t *frames_played);
 void *alsa_buffer_monitor_thread_code(void *arg);
+void *alsa_output_thread_code(void *arg);
+static int output_ring_play(void *buf, int samples);
+static int output_ring_get_buffer(int frames, void *segments[2], int segment_frames[2]);
+static int output_ring_commit_buffer(int frames);
+static int output_ring_delay(long *the_delay);
 
 static void volume(double vol);
 void do_volume(double vol);
@@ -88,6 +97,8 @@ audio_output audio_alsa = {
     .flush = &flush,
     .delay = &delay,
     .play = &play,
+    .get_buffer = &get_buffer,
+    .commit_buffer = &commit_buffer,
     .rate_info = &get_rate_information,
     .mute = NULL,        // a function will be provided if it can, and is allowed to,
                          // do hardware mute
@@ -158,6 +169,40 @@ int volume_based_mute_is_active =
 // use this to allow the use of snd_pcm_writei or snd_pcm_mmap_writei
 snd_pcm_sframes_t (*alsa_pcm_write)(snd_pcm_t *, const void *, snd_pcm_uframes_t) = snd_pcm_writei;
 
+// for writing straight into the mmap buffer -- see get_buffer() and commit_buffer()
+static snd_pcm_uframes_t mmap_offset;  // where the room starts
+static snd_pcm_uframes_t mmap_contiguous; // the frames of room before the buffer wraps around
+static void *mmap_wrap_segment;        // where the room continues after that
+static snd_pcm_sframes_t mmap_delay;   // the delay when the room was found
+static int mmap_cancel_state;
+
+// If the output thread is used, it does all the writing of frames to the device. The player puts
+// frames into a ring without taking the alsa_mutex and the thread takes them out, with the alsa_mutex
+// held, as the device makes room for them. If the ring runs dry, the thread plays silence rather than
+// let the device underrun.
+static pthread_t alsa_output_thread;
+static int alsa_output_thread_started = 0;
+static int output_wake_pipe[2] = {-1, -1};
+static int output_thread_waiting_for_frames = 0; // set while the thread waits on output_wake_pipe
+
+static char *output_ring = NULL;
+static uint64_t output_ring_frames = 0; // a power of two
+static int output_ring_frame_size = 0;
+static uint64_t output_ring_written = 0; // frames put in -- changed only by the player
+static uint64_t output_ring_read = 0;    // frames taken out -- changed only with the alsa_mutex held
+static int output_ring_active = 0;       // set by the player to play via the ring, cleared by flush()
+
+// what the output thread found when it last wrote to the device, for the player to read without
+// locking. The sequence number is odd while it's being updated.
+static struct {
+  uint32_t sequence;
+  int status;              // the status from delay_and_status(), non-zero if there's a problem
+  int running;             // set if the device is running, so the delay is going down
+  snd_pcm_sframes_t delay; // the device's delay just after the write
+  uint64_t ring_read;      // output_ring_read at the time
+  uint64_t time;
+} output_snapshot;
+
 int precision_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
                                yndk_type *using_update_timestamps);
 int standard_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
@@ -259,8 +304,82 @@ volatile uint64_t most_recent_write_time;
 
 static uint64_t frames_sent_for_playing;
 static uint64_t frame_index;
+static uint64_t measurement_due_frame_index; // the rate is next measured at or after this frame
 static int measurement_data_is_valid;
 
+// The DAC delay model. Rather than asking the device for its delay every time, it's measured every
+// alsa_delay_query_interval seconds and, in between, predicted from the last measurement, the
+// frames written since and the DAC's measured rate. If a measurement is too far from the
+// prediction, the model isn't trusted until two measurements in a row agree with it.
+// The DAC's rate is taken only from measured delays, never from predicted ones, so that the model
+// can't feed on its own predictions.
+// These are all under the control of the alsa_mutex.
+static int delay_model_anchored = 0;   // set when there's a measurement to predict from
+static int delay_model_agreements = 0; // measurements in a row that agreed with the model
+static int delay_model_measured = 0;   // set if the last delay was measured, not predicted
+static uint64_t delay_model_time;            // when the delay was last measured
+static snd_pcm_sframes_t delay_model_delay;  // what it was, plus the frames written since
+static double delay_model_rate;              // frames per second
+static uint64_t delay_model_measurements, delay_model_predictions;
+
+static void delay_model_reset(void) {
+  delay_model_anchored = 0;
+  delay_model_agreements = 0;
+}
+
+static snd_pcm_sframes_t delay_model_predict(uint64_t time_now) {
+  double elapsed = (double)(time_now - delay_model_time) / 4294967296.0; // fp to seconds
+  return delay_model_delay - (snd_pcm_sframes_t)(elapsed * delay_model_rate);
+}
+
+static int modelled_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay) {
+  uint64_t time_now = get_absolute_time_in_fp();
+  uint64_t query_interval = (uint64_t)(config.alsa_delay_query_interval * 4294967296.0);
+  if ((delay_model_agreements >= 2) && (time_now - delay_model_time < query_interval)) {
+    snd_pcm_sframes_t predicted = delay_model_predict(time_now);
+    if (predicted > 0) { // if it's expected to have run dry, ask the device
+      *state = SND_PCM_STATE_RUNNING;
+      *delay = predicted;
+      delay_model_measured = 0;
+      delay_model_predictions++;
+      return 0;
+    }
+  }
+
+  int ret = delay_and_status(state, delay, NULL);
+  delay_model_measured = (ret == 0);
+  delay_model_measurements++;
+  if ((ret == 0) && (*state == SND_PCM_STATE_RUNNING) && (config.alsa_delay_query_interval > 0.0)) {
+    if (delay_model_anchored) {
+      snd_pcm_sframes_t residual = *delay - delay_model_predict(time_now);
+      if (residual < 0)
+        residual = -residual;
+      if (residual <= config.output_rate / 500) { // two milliseconds
+        delay_model_agreements++;
+      } else {
+        if (delay_model_agreements >= 2)
+          debug(2,
+                "alsa: DAC delay model out by %ld frames -- measuring the delay until it settles.",
+                residual);
+        delay_model_agreements = 0;
+      }
+    }
+    // use the DAC's measured rate, once there's enough of a measurement to go on
+    delay_model_rate = config.output_rate;
+    uint64_t measurement_elapsed = measurement_time - measurement_start_time;
+    if ((measurement_data_is_valid) && (measurement_elapsed > ((uint64_t)10 << 32)))
+      delay_model_rate =
+          (frames_played_at_measurement_time - frames_played_at_measurement_start_time) *
+          4294967296.0 / measurement_elapsed;
+    delay_model_time = time_now;
+    delay_model_delay = *delay;
+    delay_model_anchored = 1;
+  } else {
+    delay_model_reset();
+  }
+  return ret;
+}
+
 static void help(void) {
   printf("    -d output-device    set the output device, default is \"default\".\n"
          "    -c mixer-control    set the mixer control name, default is to use no mixer.\n"
@@ -374,7 +493,8 @@ format_record fr[] = {
     {SND_PCM_FORMAT_S16_LE, 4},  {SND_PCM_FORMAT_S16_BE, 4},  {SND_PCM_FORMAT_S24, 8},
     {SND_PCM_FORMAT_S24_LE, 8},  {SND_PCM_FORMAT_S24_BE, 8},  {SND_PCM_FORMAT_S24_3LE, 6},
     {SND_PCM_FORMAT_S24_3BE, 6}, {SND_PCM_FORMAT_S32, 8},     {SND_PCM_FORMAT_S32_LE, 8},
-    {SND_PCM_FORMAT_S32_BE, 8},  {SND_PCM_FORMAT_UNKNOWN, 0}, // auto
+    {SND_PCM_FORMAT_S32_BE, 8},  {SND_PCM_FORMAT_FLOAT, 8},   // F32
+    {SND_PCM_FORMAT_UNKNOWN, 0},                              // auto
     {SND_PCM_FORMAT_UNKNOWN, 0},                              // illegal
 };
 
@@ -1008,6 +1128,7 @@ static int init(int argc, char **argv) {
   config.audio_backend_buffer_interpolation_threshold_in_seconds =
       0.120; // below this, basic interpolation will be used to save time.
   config.alsa_maximum_stall_time = 0.200; // 200 milliseconds -- if it takes longer, it's a problem
+  config.alsa_delay_query_interval = 0.100; // predict the DAC delay between measurements this far apart
   config.disable_standby_mode_silence_threshold =
       0.040; // start sending silent frames if the delay goes below this time
   config.disable_standby_mode_silence_scan_interval = 0.004; // check silence threshold this often
@@ -1023,6 +1144,7 @@ static int init(int argc, char **argv) {
   config.disable_standby_mode = disable_standby_off;
   config.keep_dac_busy = 0;
   config.use_precision_timing = YNA_AUTO;
+  config.alsa_use_output_thread = 0;
 
   // get settings from settings file first, allow them to be overridden by
   // command line options
@@ -1127,6 +1249,8 @@ static int init(int argc, char **argv) {
         config.output_format = SPS_FORMAT_S32_LE;
       else if (strcasecmp(str, "S32_BE") == 0)
         config.output_format = SPS_FORMAT_S32_BE;
+      else if (strcasecmp(str, "F32") == 0)
+        config.output_format = SPS_FORMAT_F32;
       else if (strcasecmp(str, "U8") == 0)
         config.output_format = SPS_FORMAT_U8;
       else if (strcasecmp(str, "S8") == 0)
@@ -1139,7 +1263,7 @@ static int init(int argc, char **argv) {
         warn("Invalid output format \"%s\". It should be \"auto\", \"U8\", \"S8\", "
              "\"S16\", \"S24\", \"S24_LE\", \"S24_BE\", "
              "\"S24_3LE\", \"S24_3BE\" or "
-             "\"S32\", \"S32_LE\", \"S32_BE\". It remains set to \"%s\".",
+             "\"S32\", \"S32_LE\", \"S32_BE\" or \"F32\". It remains set to \"%s\".",
              str, config.output_format_auto_requested == 1 ? "auto" : sps_format_description_string(
                                                                           config.output_format));
       }
@@ -1196,6 +1320,20 @@ static int init(int argc, char **argv) {
         config.no_mmap = 0;
       }
     }
+    /* Get the use_output_thread setting. */
+    if (config_lookup_string(config.cfg, "alsa.use_output_thread", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        config.alsa_use_output_thread = 0;
+      else if (strcasecmp(str, "yes") == 0)
+        config.alsa_use_output_thread = 1;
+      else {
+        warn("Invalid use_output_thread option choice \"%s\". It should be "
+             "\"yes\" or \"no\". "
+             "It remains set to \"no\".",
+             str);
+        config.alsa_use_output_thread = 0;
+      }
+    }
     /* Get the optional period size value */
     if (config_lookup_int(config.cfg, "alsa.period_size", &value)) {
       set_period_size_request = 1;
@@ -1235,6 +1373,17 @@ static int init(int argc, char **argv) {
       }
     }
 
+    /* Get the optional delay_query_interval setting. */
+    if (config_lookup_float(config.cfg, "alsa.delay_query_interval", &dvalue)) {
+      if (dvalue < 0.0) {
+        warn("Invalid alsa delay_query_interval setting \"%f\". It "
+             "must be 0 or greater. Default is \"%f\". No setting is made.",
+             dvalue, config.alsa_delay_query_interval);
+      } else {
+        config.alsa_delay_query_interval = dvalue;
+      }
+    }
+
     /* Get the optional disable_standby_mode_silence_threshold setting. */
     if (config_lookup_float(config.cfg, "alsa.disable_standby_mode_silence_threshold", &dvalue)) {
       if (dvalue < 0.0) {
@@ -1353,6 +1502,18 @@ static int init(int argc, char **argv) {
   most_recent_write_time = 0; // could be used by the alsa_buffer_monitor_thread_code
   pthread_create(&alsa_buffer_monitor_thread, NULL, &alsa_buffer_monitor_thread_code, NULL);
 
+  if (config.alsa_use_output_thread) {
+    if ((pipe(output_wake_pipe) == 0) && (fcntl(output_wake_pipe[0], F_SETFL, O_NONBLOCK) == 0) &&
+        (fcntl(output_wake_pipe[1], F_SETFL, O_NONBLOCK) == 0) &&
+        (pthread_create(&alsa_output_thread, NULL, &alsa_output_thread_code, NULL) == 0)) {
+      alsa_output_thread_started = 1;
+      debug(1, "alsa: writing to the output device from its own thread.");
+    } else {
+      warn("alsa: could not start the output thread -- the player will write to the device.");
+      config.alsa_use_output_thread = 0;
+    }
+  }
+
   return response;
 }
 
@@ -1365,6 +1526,16 @@ static void deinit(void) {
   pthread_cancel(alsa_buffer_monitor_thread);
   debug(3, "Join buffer monitor thread.");
   pthread_join(alsa_buffer_monitor_thread, NULL);
+  if (alsa_output_thread_started) {
+    debug(2, "Cancel output thread.");
+    pthread_cancel(alsa_output_thread);
+    pthread_join(alsa_output_thread, NULL);
+    alsa_output_thread_started = 0;
+    close(output_wake_pipe[0]);
+    close(output_wake_pipe[1]);
+    free(output_ring);
+    output_ring = NULL;
+  }
   pthread_setcancelstate(oldState, NULL);
 }
 
@@ -1580,6 +1751,8 @@ int delay(long *the_delay) {
   // the error code could be a Unix errno code or a snderror code, or
   // the sps_extra_code_output_stalled or the
   // sps_extra_code_output_state_cannot_make_ready codes
+  if ((config.alsa_use_output_thread) && (__atomic_load_n(&output_ring_active, __ATOMIC_ACQUIRE)))
+    return output_ring_delay(the_delay); // no system calls and no waiting for the device
   int ret = 0;
   *the_delay = 0;
   if (alsa_handle == NULL)
@@ -1593,7 +1766,7 @@ int delay(long *the_delay) {
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
     pthread_cleanup_debug_mutex_lock(&alsa_mutex, 10000, 0);
 
-    ret = delay_and_status(&state, &my_delay, NULL);
+    ret = modelled_delay_and_status(&state, &my_delay);
 
     debug_mutex_unlock(&alsa_mutex, 0);
     pthread_cleanup_pop(0);
@@ -1617,6 +1790,70 @@ int get_rate_information(uint64_t *elapsed_time, uint64_t *frames_played) {
   return response;
 }
 
+// keep track of the frames sent to the device -- the delay is that just before they were written
+static void frames_written(int samples, snd_pcm_sframes_t my_delay) {
+  stall_monitor_frame_count += samples;
+  delay_model_delay += samples;
+
+  if (frame_index == 0) {
+    frames_sent_for_playing = samples;
+    measurement_due_frame_index = 0;
+  } else {
+    frames_sent_for_playing += samples;
+  }
+
+  const uint64_t start_measurement_from_this_frame =
+      (2 * config.output_rate) / 352; // two seconds of frames
+
+  frame_index++;
+
+  // take the rate measurement only from a delay that was measured, and not predicted by the model
+  if ((delay_model_measured) && (frame_index >= start_measurement_from_this_frame) &&
+      (frame_index >= measurement_due_frame_index)) {
+
+    measurement_time = get_absolute_time_in_fp();
+    frames_played_at_measurement_time = frames_sent_for_playing - my_delay - samples;
+    measurement_due_frame_index = frame_index + 32;
+
+    if (measurement_data_is_valid == 0) {
+      // debug(1, "Start frame counting");
+      frames_played_at_measurement_start_time = frames_played_at_measurement_time;
+      measurement_start_time = measurement_time;
+      measurement_data_is_valid = 1;
+    }
+  }
+}
+
+static void write_failed(int ret, int samples) {
+  frame_index = 0;
+  measurement_data_is_valid = 0;
+  delay_model_reset();
+  if (ret == -EPIPE) { /* underrun */
+    debug(1, "alsa: underrun while writing %d samples to alsa device.", samples);
+    int tret = snd_pcm_recover(alsa_handle, ret, 1);
+    if (tret < 0) {
+      warn("alsa: can't recover from SND_PCM_STATE_XRUN: %s.", snd_strerror(tret));
+    }
+  } else if (ret == -ESTRPIPE) { /* suspended */
+    debug(1, "alsa: suspended while writing %d samples to alsa device.", samples);
+    int tret;
+    while ((tret = snd_pcm_resume(alsa_handle)) == -EAGAIN) {
+      sleep(1); /* wait until the suspend flag is released */
+      if (tret < 0) {
+        warn("alsa: can't recover from SND_PCM_STATE_SUSPENDED state, "
+             "snd_pcm_prepare() "
+             "failed: %s.",
+             snd_strerror(tret));
+      }
+    }
+  } else {
+    char errorstring[1024];
+    strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
+    debug(1, "alsa: error %d (\"%s\") writing %d samples to alsa device.", ret,
+          (char *)errorstring, samples);
+  }
+}
+
 int do_play(void *buf, int samples) {
   // assuming the alsa_mutex has been acquired
   // debug(3,"audio_alsa play called.");
@@ -1625,7 +1862,7 @@ int do_play(void *buf, int samples) {
 
   snd_pcm_state_t state;
   snd_pcm_sframes_t my_delay;
-  int ret = delay_and_status(&state, &my_delay, NULL);
+  int ret = modelled_delay_and_status(&state, &my_delay);
 
   if (ret == 0) { // will be non-zero if an error or a stall
 
@@ -1640,61 +1877,10 @@ int do_play(void *buf, int samples) {
 
       // debug(3, "write %d frames.", samples);
       ret = alsa_pcm_write(alsa_handle, buf, samples);
-      if (ret == samples) {
-        stall_monitor_frame_count += samples;
-
-        if (frame_index == 0) {
-          frames_sent_for_playing = samples;
-        } else {
-          frames_sent_for_playing += samples;
-        }
-
-        const uint64_t start_measurement_from_this_frame =
-            (2 * config.output_rate) / 352; // two seconds of frames
-
-        frame_index++;
-
-        if ((frame_index == start_measurement_from_this_frame) ||
-            ((frame_index > start_measurement_from_this_frame) && (frame_index % 32 == 0))) {
-
-          measurement_time = get_absolute_time_in_fp();
-          frames_played_at_measurement_time = frames_sent_for_playing - my_delay - samples;
-
-          if (frame_index == start_measurement_from_this_frame) {
-            // debug(1, "Start frame counting");
-            frames_played_at_measurement_start_time = frames_played_at_measurement_time;
-            measurement_start_time = measurement_time;
-            measurement_data_is_valid = 1;
-          }
-        }
-      } else {
-        frame_index = 0;
-        measurement_data_is_valid = 0;
-        if (ret == -EPIPE) { /* underrun */
-          debug(1, "alsa: underrun while writing %d samples to alsa device.", samples);
-          int tret = snd_pcm_recover(alsa_handle, ret, 1);
-          if (tret < 0) {
-            warn("alsa: can't recover from SND_PCM_STATE_XRUN: %s.", snd_strerror(tret));
-          }
-        } else if (ret == -ESTRPIPE) { /* suspended */
-          debug(1, "alsa: suspended while writing %d samples to alsa device.", samples);
-          int tret;
-          while ((tret = snd_pcm_resume(alsa_handle)) == -EAGAIN) {
-            sleep(1); /* wait until the suspend flag is released */
-            if (tret < 0) {
-              warn("alsa: can't recover from SND_PCM_STATE_SUSPENDED state, "
-                   "snd_pcm_prepare() "
-                   "failed: %s.",
-                   snd_strerror(tret));
-            }
-          }
-        } else {
-          char errorstring[1024];
-          strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
-          debug(1, "alsa: error %d (\"%s\") writing %d samples to alsa device.", ret,
-                (char *)errorstring, samples);
-        }
-      }
+      if (ret == samples)
+        frames_written(samples, my_delay);
+      else
+        write_failed(ret, samples);
     }
   } else {
     debug(1, "alsa: device status returns fault status %d and SND_PCM_STATE_* "
@@ -1752,9 +1938,14 @@ int do_close() {
     if ((derr = snd_pcm_close(alsa_handle)))
       debug(1, "Error %d (\"%s\") closing the output device.", derr, snd_strerror(derr));
     alsa_handle = NULL;
+    debug(2, "alsa: the DAC delay was measured %" PRIu64 " times and predicted %" PRIu64 " times.",
+          delay_model_measurements, delay_model_predictions);
+    delay_model_measurements = 0;
+    delay_model_predictions = 0;
   } else {
     debug(1, "alsa: do_close() -- output device already closed.");
   }
+  delay_model_reset();
   alsa_backend_state = abm_disconnected;
   return derr;
 }
@@ -1767,6 +1958,9 @@ int play(void *buf, int samples) {
   // connected
 
   // debug(3,"audio_alsa play called.");
+  if (config.alsa_use_output_thread)
+    return output_ring_play(buf, samples);
+
   int ret = 0;
 
   pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
@@ -1796,6 +1990,247 @@ int play(void *buf, int samples) {
   return ret;
 }
 
+// when the device is accessed by mmap, give the player room to put its frames straight into the
+// device's buffer. The alsa_mutex is held until the frames are committed.
+static int get_buffer(int frames, void *segments[2], int segment_frames[2]) {
+  if (config.alsa_use_output_thread)
+    return output_ring_get_buffer(frames, segments, segment_frames);
+  int ret = -1;
+  if ((config.no_mmap) || (frames <= 0))
+    return ret;
+
+  debug_mutex_lock(&alsa_mutex, 50000, 0);
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+
+  int oret = 0;
+  if (alsa_backend_state == abm_disconnected) {
+    oret = do_open(0); // don't try to auto setup
+    if (oret == 0)
+      debug(2, "alsa: get_buffer() -- opened output device");
+  }
+
+  if ((oret == 0) && (alsa_handle != NULL) && (alsa_pcm_write == snd_pcm_mmap_writei)) {
+    if (alsa_backend_state != abm_playing) {
+      debug(2, "alsa: get_buffer() -- alsa_backend_state => abm_playing");
+      alsa_backend_state = abm_playing;
+    }
+    snd_pcm_state_t state;
+    if ((modelled_delay_and_status(&state, &mmap_delay) == 0) &&
+        ((state == SND_PCM_STATE_PREPARED) || (state == SND_PCM_STATE_RUNNING))) {
+      // if there isn't room, let play() wait for it
+      snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa_handle);
+      if (avail >= frames) {
+        const snd_pcm_channel_area_t *areas;
+        mmap_contiguous = frames;
+        if (snd_pcm_mmap_begin(alsa_handle, &areas, &mmap_offset, &mmap_contiguous) == 0) {
+          // the access is interleaved, so all the channels are in the first area
+          char *base = (char *)areas[0].addr + areas[0].first / 8;
+          segments[0] = base + mmap_offset * (areas[0].step / 8);
+          segment_frames[0] = mmap_contiguous;
+          mmap_wrap_segment = base; // whatever doesn't fit goes at the start of the buffer
+          segments[1] = mmap_wrap_segment;
+          segment_frames[1] = frames - mmap_contiguous;
+          mmap_cancel_state = oldState;
+          ret = 0;
+        }
+      }
+    }
+  }
+
+  if (ret != 0) {
+    pthread_setcancelstate(oldState, NULL);
+    debug_mutex_unlock(&alsa_mutex, 0);
+  }
+  return ret;
+}
+
+static int commit_buffer(int frames) {
+  if (config.alsa_use_output_thread)
+    return output_ring_commit_buffer(frames);
+  snd_pcm_sframes_t ret = 0;
+  snd_pcm_uframes_t first = frames;
+  if (first > mmap_contiguous)
+    first = mmap_contiguous;
+  if (first)
+    ret = snd_pcm_mmap_commit(alsa_handle, mmap_offset, first);
+  if ((ret == (snd_pcm_sframes_t)first) && ((snd_pcm_uframes_t)frames > first)) {
+    // the rest was written at the start of the buffer
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, contiguous = frames - first;
+    ret = snd_pcm_mmap_begin(alsa_handle, &areas, &offset, &contiguous);
+    if (ret == 0) {
+      char *where = (char *)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+      if (where != mmap_wrap_segment) // shouldn't happen, but just in case
+        memmove(where, mmap_wrap_segment, contiguous * (areas[0].step / 8));
+      ret = snd_pcm_mmap_commit(alsa_handle, offset, contiguous);
+      if (ret >= 0)
+        ret += first;
+    }
+  }
+  if (frames) {
+    if (ret == frames) {
+      // unlike snd_pcm_mmap_writei(), committing doesn't start the device
+      if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(alsa_handle);
+      frames_written(frames, mmap_delay);
+    } else {
+      if (ret >= 0)
+        ret = -EIO; // a short commit
+      write_failed(ret, frames);
+    }
+  }
+  pthread_setcancelstate(mmap_cancel_state, NULL);
+  debug_mutex_unlock(&alsa_mutex, 0);
+  return ret;
+}
+
+// the output ring, used with the output thread
+
+static void output_snapshot_update(int status, int running, snd_pcm_sframes_t delay) {
+  // must be called with the alsa_mutex held
+  __atomic_store_n(&output_snapshot.sequence, output_snapshot.sequence + 1, __ATOMIC_RELAXED); // odd
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  output_snapshot.status = status;
+  output_snapshot.running = running;
+  output_snapshot.delay = delay;
+  output_snapshot.ring_read = output_ring_read;
+  output_snapshot.time = get_absolute_time_in_fp();
+  __atomic_store_n(&output_snapshot.sequence, output_snapshot.sequence + 1, __ATOMIC_RELEASE); // even
+}
+
+// the frames in the ring plus the device's delay, extrapolated from what the output thread last saw
+static int output_ring_delay(long *the_delay) {
+  uint32_t sequence;
+  int status, running;
+  snd_pcm_sframes_t device_delay;
+  uint64_t ring_read, time;
+  do {
+    while ((sequence = __atomic_load_n(&output_snapshot.sequence, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    status = output_snapshot.status;
+    running = output_snapshot.running;
+    device_delay = output_snapshot.delay;
+    ring_read = output_snapshot.ring_read;
+    time = output_snapshot.time;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&output_snapshot.sequence, __ATOMIC_RELAXED) != sequence);
+
+  *the_delay = 0;
+  if (status != 0)
+    return status;
+  if (running) {
+    uint64_t time_now = get_absolute_time_in_fp();
+    if (time_now > time)
+      device_delay -= ((time_now - time) * config.output_rate) >> 32;
+    if (device_delay < 0)
+      device_delay = 0;
+  }
+  *the_delay = (output_ring_written - ring_read) + device_delay;
+  return 0;
+}
+
+// open the device if necessary and start playing through the ring
+static int output_ring_activate(void) {
+  volatile int ret = 0; // as it's live across the setjmp in pthread_cleanup_push()
+  pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
+  if (alsa_backend_state == abm_disconnected) {
+    ret = do_open(0); // don't try to auto setup
+    if (ret == 0)
+      debug(2, "alsa: play() -- opened output device");
+  }
+  if (ret == 0) {
+    if (alsa_backend_state != abm_playing) {
+      debug(2, "alsa: play() -- alsa_backend_state => abm_playing");
+      alsa_backend_state = abm_playing;
+    }
+    // the ring holds at least a second of frames, so the player should never have to wait for room
+    uint64_t frames = 1024;
+    while (frames < (uint64_t)config.output_rate)
+      frames <<= 1;
+    if ((output_ring == NULL) || (frames != output_ring_frames) ||
+        (frame_size != output_ring_frame_size)) {
+      free(output_ring);
+      output_ring = malloc(frames * frame_size);
+      if (output_ring == NULL)
+        die("alsa: can't allocate %" PRIu64 " frames for the output ring.", frames);
+      output_ring_frames = frames;
+      output_ring_frame_size = frame_size;
+    }
+    __atomic_store_n(&output_ring_read, output_ring_written, __ATOMIC_RELEASE);
+    output_snapshot_update(0, 0, 0);
+    __atomic_store_n(&output_ring_active, 1, __ATOMIC_RELEASE);
+  }
+  debug_mutex_unlock(&alsa_mutex, 0);
+  pthread_cleanup_pop(0); // release the mutex
+  return ret;
+}
+
+static uint64_t output_ring_room(void) {
+  return output_ring_frames -
+         (output_ring_written - __atomic_load_n(&output_ring_read, __ATOMIC_ACQUIRE));
+}
+
+static void output_ring_publish(int frames) {
+  __atomic_store_n(&output_ring_written, output_ring_written + frames, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&output_thread_waiting_for_frames, 0, __ATOMIC_SEQ_CST))
+    if (write(output_wake_pipe[1], "", 1) != 1)
+      debug(3, "alsa: output thread wake-up not sent -- it must be awake already.");
+}
+
+static int output_ring_play(void *buf, int samples) {
+  // volatile, as output_ring_activate() may be inlined, and with it its pthread_cleanup_push()
+  volatile int ret = 0;
+  if (__atomic_load_n(&output_ring_active, __ATOMIC_ACQUIRE) == 0)
+    ret = output_ring_activate();
+  if ((ret == 0) && (samples > 0) && (buf != NULL)) {
+    int waits = 0;
+    while ((output_ring_room() < (uint64_t)samples) && (waits < 1000)) {
+      usleep(1000); // hardly ever happens
+      waits++;
+    }
+    if (output_ring_room() < (uint64_t)samples) {
+      debug(1, "alsa: no room in the output ring for %d frames -- they have been dropped.",
+            samples);
+      ret = -EAGAIN;
+    } else {
+      uint64_t index = output_ring_written & (output_ring_frames - 1);
+      uint64_t first = output_ring_frames - index;
+      if (first > (uint64_t)samples)
+        first = samples;
+      memcpy(output_ring + index * output_ring_frame_size, buf, first * output_ring_frame_size);
+      if ((uint64_t)samples > first)
+        memcpy(output_ring, (char *)buf + first * output_ring_frame_size,
+               (samples - first) * output_ring_frame_size);
+      output_ring_publish(samples);
+    }
+  }
+  return ret;
+}
+
+static int output_ring_get_buffer(int frames, void *segments[2], int segment_frames[2]) {
+  if ((__atomic_load_n(&output_ring_active, __ATOMIC_ACQUIRE) == 0) &&
+      (output_ring_activate() != 0))
+    return -1;
+  if ((frames <= 0) || (output_ring_room() < (uint64_t)frames))
+    return -1; // let play() wait for room
+  uint64_t index = output_ring_written & (output_ring_frames - 1);
+  uint64_t first = output_ring_frames - index;
+  if (first > (uint64_t)frames)
+    first = frames;
+  segments[0] = output_ring + index * output_ring_frame_size;
+  segment_frames[0] = first;
+  segments[1] = output_ring;
+  segment_frames[1] = frames - first;
+  return 0;
+}
+
+static int output_ring_commit_buffer(int frames) {
+  if (frames > 0)
+    output_ring_publish(frames);
+  return frames;
+}
+
 int prepare(void) {
   // this will leave the DAC open / connected.
   int ret = 0;
@@ -1821,6 +2256,11 @@ int prepare(void) {
 static void flush(void) {
   // debug(2,"audio_alsa flush called.");
   pthread_cleanup_debug_mutex_lock(&alsa_mutex, 10000, 1);
+  if (output_ring_active) {
+    // the output thread stops writing and whatever is in the ring is discarded
+    __atomic_store_n(&output_ring_active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&output_ring_read, output_ring_written, __ATOMIC_RELEASE);
+  }
   // mute_requested_internally = 1; // request a mute for backend's reasons
   // debug(2, "flush() set_mute_state");
   // set_mute_state();
@@ -1969,8 +2409,10 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
     // to be in the
     // abm_connected state in the first place...) then do the silence-filling
     // thing, if needed /* only if the output device is capable of precision delay */.
+    // the output thread, if used, looks after this itself while playing
     if ((alsa_backend_state != abm_disconnected) &&
-        (config.keep_dac_busy != 0) /* && precision_delay_available() */) {
+        (config.keep_dac_busy != 0) /* && precision_delay_available() */ &&
+        ((config.alsa_use_output_thread == 0) || (alsa_backend_state != abm_playing))) {
       int reply;
       long buffer_size = 0;
       snd_pcm_state_t state;
@@ -2036,3 +2478,144 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
   }
   pthread_exit(NULL);
 }
+
+static void output_thread_cleanup_function(void *arg) { free(*(void **)arg); }
+
+// write from the ring to the device, at most the frames given, returning how many were written
+static snd_pcm_sframes_t output_ring_write(uint64_t frames) {
+  uint64_t index = output_ring_read & (output_ring_frames - 1);
+  uint64_t first = output_ring_frames - index;
+  if (first > frames)
+    first = frames;
+  snd_pcm_sframes_t ret =
+      alsa_pcm_write(alsa_handle, output_ring + index * output_ring_frame_size, first);
+  if ((ret == (snd_pcm_sframes_t)first) && (frames > first)) {
+    snd_pcm_sframes_t rest = alsa_pcm_write(alsa_handle, output_ring, frames - first);
+    if (rest >= 0)
+      ret += rest;
+  }
+  if (ret > 0)
+    __atomic_store_n(&output_ring_read, output_ring_read + ret, __ATOMIC_RELEASE);
+  return ret;
+}
+
+void *alsa_output_thread_code(__attribute__((unused)) void *arg) {
+  // these are volatile, as they're live across the setjmp in pthread_cleanup_push()
+  char *volatile silence = NULL;
+  volatile snd_pcm_uframes_t silence_frames = 0;
+  volatile uint64_t silence_frames_played = 0;
+  struct pollfd fds[16];
+  volatile int device_fds = 0; // the number of the device's descriptors in fds, after the pipe
+  snd_pcm_t *volatile polled_handle = NULL; // the device they belong to
+  pthread_cleanup_push(output_thread_cleanup_function, (void *)&silence);
+  while (1) {
+    int timeout_ms = 100;
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    debug_mutex_lock(&alsa_mutex, 50000, 0);
+    if ((device_fds) && (polled_handle == alsa_handle)) {
+      unsigned short revents;
+      snd_pcm_poll_descriptors_revents(alsa_handle, fds + 1, device_fds, &revents);
+    }
+    device_fds = 0;
+    if ((alsa_handle != NULL) && (alsa_backend_state == abm_playing) && (output_ring_active)) {
+      snd_pcm_state_t state;
+      snd_pcm_sframes_t my_delay = 0;
+      snd_pcm_uframes_t buffer_size = 0, period_size = 0;
+      snd_pcm_get_params(alsa_handle, &buffer_size, &period_size);
+      // play silence if the device has less than this to play and there's nothing in the ring
+      snd_pcm_uframes_t low_water = period_size * 2;
+      if (low_water > buffer_size / 2)
+        low_water = buffer_size / 2;
+
+      int ret = modelled_delay_and_status(&state, &my_delay);
+      if (ret == 0) {
+        uint64_t waiting = __atomic_load_n(&output_ring_written, __ATOMIC_ACQUIRE) - output_ring_read;
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa_handle);
+        if (avail < 0) {
+          write_failed(avail, waiting);
+        } else if ((waiting) && (avail)) {
+          uint64_t frames = waiting < (uint64_t)avail ? waiting : (uint64_t)avail;
+          snd_pcm_sframes_t wret = output_ring_write(frames);
+          if (wret == (snd_pcm_sframes_t)frames) {
+            frames_written(frames, my_delay);
+            my_delay += frames;
+          } else {
+            write_failed(wret < 0 ? wret : -EIO, frames);
+          }
+        } else if ((waiting == 0) && (state == SND_PCM_STATE_RUNNING) &&
+                   (my_delay < (snd_pcm_sframes_t)low_water) && (avail)) {
+          // the player hasn't kept up, so fill in with silence rather than let the device underrun
+          snd_pcm_uframes_t frames = low_water - my_delay;
+          if (frames > (snd_pcm_uframes_t)avail)
+            frames = avail;
+          if (frames > silence_frames) {
+            free(silence);
+            silence = malloc(frames * frame_size);
+            silence_frames = silence ? frames : 0;
+          }
+          if (silence) {
+            int use_dither = 0;
+            if ((alsa_mix_ctrl == NULL) && (config.ignore_volume_control == 0) &&
+                (config.airplay_volume != 0.0))
+              use_dither = 1;
+            dither_random_number_store = generate_zero_frames(
+                silence, frames, config.output_format, use_dither, dither_random_number_store);
+            snd_pcm_sframes_t wret = alsa_pcm_write(alsa_handle, silence, frames);
+            if (wret == (snd_pcm_sframes_t)frames) {
+              frames_written(frames, my_delay);
+              my_delay += frames;
+              silence_frames_played += frames;
+              debug(3, "alsa: output thread played %lu frames of silence, %" PRIu64 " in all.",
+                    frames, silence_frames_played);
+            } else {
+              write_failed(wret < 0 ? wret : -EIO, frames);
+            }
+          }
+        }
+      }
+      int running = (snd_pcm_state(alsa_handle) == SND_PCM_STATE_RUNNING);
+      output_snapshot_update(ret, running, my_delay);
+
+      // now wait -- for the device to make room if there's more to write, otherwise for the player
+      if (__atomic_load_n(&output_ring_written, __ATOMIC_ACQUIRE) != output_ring_read) {
+        int count = snd_pcm_poll_descriptors_count(alsa_handle);
+        if ((count > 0) && (count < (int)(sizeof(fds) / sizeof(fds[0])))) {
+          device_fds = snd_pcm_poll_descriptors(alsa_handle, fds + 1, count);
+          if (device_fds < 0)
+            device_fds = 0;
+          polled_handle = alsa_handle;
+        }
+        if (device_fds == 0)
+          timeout_ms = 1;
+      } else if (running) {
+        // wake in time to play silence if the player doesn't send anything
+        timeout_ms = 1;
+        if (my_delay > (snd_pcm_sframes_t)low_water)
+          timeout_ms = ((my_delay - low_water) * 1000) / config.output_rate + 1;
+        if (timeout_ms > 100)
+          timeout_ms = 100;
+      }
+    }
+    if (device_fds == 0) {
+      __atomic_store_n(&output_thread_waiting_for_frames, 1, __ATOMIC_SEQ_CST);
+      if ((output_ring_active) &&
+          (__atomic_load_n(&output_ring_written, __ATOMIC_SEQ_CST) != output_ring_read))
+        timeout_ms = 0; // frames arrived just now
+    }
+    debug_mutex_unlock(&alsa_mutex, 0);
+    pthread_setcancelstate(oldState, NULL);
+
+    fds[0].fd = output_wake_pipe[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if ((poll(fds, device_fds + 1, timeout_ms) > 0) && (fds[0].revents & POLLIN)) {
+      char buf[64];
+      while (read(output_wake_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+    __atomic_store_n(&output_thread_waiting_for_frames, 0, __ATOMIC_SEQ_CST);
+  }
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
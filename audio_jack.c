@@ -19,15 +19,15 @@
  */
 
 #include "audio.h"
+#include "audio_ring.h"
 #include "common.h"
 #include <errno.h>
-#include <limits.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <jack/jack.h>
-#include <jack/ringbuffer.h>
 
 #ifdef CONFIG_SOXR
 #include <soxr.h>
@@ -42,16 +42,18 @@ typedef jack_default_audio_sample_t sample_t;
 // Two-channel, 32bit audio:
 static const int bytes_per_frame = NPORTS * jack_sample_size;
 
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// frames on their way to the process callback
+static audio_ring ring;
+
 int jack_init(int, char **);
 void jack_deinit(void);
 void jack_start(int, int);
 int play(void *, int);
 void jack_stop(void);
-int jack_delay(long *);
-void jack_flush(void);
+static int jack_get_buffer(int, void *[2], int[2]);
+static int jack_commit_buffer(int);
 
 audio_output audio_jack = {.name = "jack",
                            .help = NULL,
@@ -61,12 +63,15 @@ audio_output audio_jack = {.name = "jack",
                            .start = &jack_start,
                            .stop = NULL,
                            .is_running = NULL,
-                           .flush = &jack_flush,
-                           .delay = &jack_delay,
+                           .flush = NULL,
+                           .delay = NULL,
                            .play = &play,
                            .volume = NULL,
                            .parameters = NULL,
-                           .mute = NULL};
+                           .mute = NULL,
+                           .get_buffer = &jack_get_buffer,
+                           .commit_buffer = &jack_commit_buffer,
+                           .ring = &ring};
 
 // This also affects deinterlacing.
 // So make it exactly the number of incoming audio channels!
@@ -77,11 +82,7 @@ static jack_client_t *client;
 static jack_nframes_t sample_rate;
 static jack_nframes_t jack_latency;
 
-static jack_ringbuffer_t *jackbuf;
-static int flush_please = 0;
-
 static jack_latency_range_t latest_latency_range[NPORTS];
-static int64_t time_of_latest_transfer;
 
 #ifdef CONFIG_SOXR
 typedef struct soxr_quality {
@@ -112,77 +113,28 @@ static soxr_quality_spec_t quality_spec;
 static soxr_io_spec_t      io_spec;
 #endif
 
-static inline sample_t sample_conv(short sample) {
-  // It sounds correct, but I don't understand it.
-  // Zero int needs to be zero float. Check.
-  // Plus 32767 int is 1.0. Check.
-  // Minus 32767 int is -0.99997. And here my brain shuts down.
-  // In my head, it should be 1.0, and we should tolerate an overflow
-  // at minus 32768. But I'm sure there's a textbook explanation somewhere.
-  return ((sample < 0) ? (-1.0 * sample / SHRT_MIN) : (1.0 * sample / SHRT_MAX));
-}
-
-static void deinterleave(const char *interleaved_input_buffer,
-                         sample_t *jack_output_buffer[],
-                         jack_nframes_t offset, jack_nframes_t nframes) {
-  jack_nframes_t f;
-  // We're dealing with 16bit audio here:
-  sample_t *ifp = (sample_t *)interleaved_input_buffer;
-  // Zero-copy, we're working directly on the target and destination buffers,
-  // so deal with an offset for the second part of the input ringbuffer
-  for (f = offset; f < (nframes + offset); f++) {
-    for (int i = 0; i < NPORTS; i++) {
-      jack_output_buffer[i][f] = *ifp++;
-    }
-  }
-}
 
 // This is the JACK process callback. We don't decide when it runs.
 // It must be hard-realtime safe (i.e. fully deterministic, with constant CPU
 // usage. No calls to anything that could ever block: no syscalls, no screen
 // output, no file access, no mutexes...
-// The JACK ringbuffer we use to get the data in here is explicitly lock-free.
+// The ring we use to get the data in here is explicitly lock-free.
 static int process(jack_nframes_t nframes, __attribute__((unused)) void *arg) {
-  sample_t *buffer[NPORTS];
-  // Expect an array of two elements because of possible ringbuffer wrap-around:
-  jack_ringbuffer_data_t v[2] = {0};
-  jack_nframes_t i, thisbuf;
-  int frames_written = 0;
-  int frames_required = 0;
+  char *buffer[NPORTS];
+  int steps[NPORTS];
+  jack_nframes_t i;
 
   for (i = 0; i < NPORTS; i++) {
-    buffer[i] = (sample_t *)jack_port_get_buffer(port[i], nframes);
-  }
-  if (flush_please) {
-    // We just move the read pointer ahead without doing anything with the data.
-    jack_ringbuffer_read_advance(jackbuf, jack_ringbuffer_read_space(jackbuf));
-    flush_please = 0;
-    // Since we don't change nframes, the whole buffer will be zeroed later.
-  } else {
-    jack_ringbuffer_get_read_vector(jackbuf, v);
-    for (i = 0; i < 2; i++) {
-      thisbuf = v[i].len / bytes_per_frame;
-      if (thisbuf > nframes) {
-        frames_required = nframes;
-      } else {
-        frames_required = thisbuf;
-      }
-      deinterleave(v[i].buf, buffer, frames_written, frames_required);
-      frames_written += frames_required;
-      nframes -= frames_required;
-    }
-    jack_ringbuffer_read_advance(jackbuf, frames_written * bytes_per_frame);
-  }
-  // If there are any more frames to put into the buffer, fill them with
-  // silence. This is a critical underflow situation. Let's at least keep the JACK
-  // graph humming along while preventing the motorboat sound of a repeating buffer.
-  while (nframes > 0) {
-    for (i = 0; i < NPORTS; i++) {
-      buffer[i][frames_written] = 0.0;
-    }
-    frames_written++;
-    nframes--;
+    buffer[i] = (char *)jack_port_get_buffer(port[i], nframes);
+    steps[i] = jack_sample_size;
   }
+  // Deinterleave straight into the port buffers. If there aren't enough frames
+  // in the ring, the rest are silent. This is a critical underflow situation,
+  // but it keeps the JACK graph humming along while preventing the motorboat
+  // sound of a repeating buffer. A flush is done here too, since only the
+  // consumer can safely flush a lock-free ring.
+  audio_ring_read_deinterleaved(&ring, buffer, steps, NPORTS, jack_sample_size, nframes);
+  audio_ring_timestamp(&ring, jack_latency);
   return 0; // Tell JACK that all is well.
 }
 
@@ -245,16 +197,14 @@ int jack_init(__attribute__((unused)) int argc, __attribute__((unused)) char **a
   if (config.jack_client_name == NULL)
     config.jack_client_name = strdup("shairport-sync");
 
+  // JACK works in floats, so have the player make them, undithered
+  config.output_format = SPS_FORMAT_F32;
+  config.output_format_auto_requested = 0;
+
   // by default a buffer that can hold up to 4 seconds of 48kHz samples
   if (bufsz <= 0)
     bufsz = 48000 * 4 * bytes_per_frame;
 
-  jackbuf = jack_ringbuffer_create((size_t)bufsz);
-  if (jackbuf == NULL)
-    die("Can't allocate %d bytes for the JACK ringbuffer.", bufsz);
-  // Lock the ringbuffer into memory so that it never gets paged out, which would
-  // break realtime constraints.
-  jack_ringbuffer_mlock(jackbuf);
   // This mutex should not be necessary, but removing it causes segfaults on
   // shutdown. Apparently, there are multiple threads in the main program trying
   // to do stuff. FIXME: Try to consolidate into one thread and get rid of this lock.
@@ -265,10 +215,14 @@ int jack_init(__attribute__((unused)) int argc, __attribute__((unused)) char **a
     die("Could not start JACK server. JackStatus is %x", status);
   }
   sample_rate = jack_get_sample_rate(client);
+  // The ring is locked into memory so that it never gets paged out, which would
+  // break realtime constraints.
+  if (audio_ring_init(&ring, bufsz / bytes_per_frame, bytes_per_frame, sample_rate) != 0)
+    die("Can't allocate %d bytes for the JACK ringbuffer.", bufsz);
 #ifdef CONFIG_SOXR
   if (config.jack_soxr_resample_quality >= SOXR_QQ) {
     quality_spec = soxr_quality_spec(config.jack_soxr_resample_quality, 0);
-    io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_FLOAT32_I);
+    io_spec = soxr_io_spec(SOXR_FLOAT32_I, SOXR_FLOAT32_I);
   } else
 #endif
   if (sample_rate != 44100) {
@@ -344,7 +298,7 @@ void jack_deinit() {
   if (jack_client_close(client))
     warn("Error closing jack client");
   pthread_mutex_unlock(&client_mutex);
-  jack_ringbuffer_free(jackbuf);
+  audio_ring_free(&ring);
 #ifdef CONFIG_SOXR
   if (soxr) {
     soxr_delete(soxr);
@@ -357,7 +311,7 @@ void jack_start(int i_sample_rate,
                 __attribute__((unused)) int i_sample_format) {
   // Nothing to do, JACK client has already been set up at jack_init().
   // Also, we have no say over the sample rate or sample format of JACK,
-  // We convert the 16bit samples to float, and die if the sample rate is != 44k1 without soxr.
+  // The player gives us float samples, and we die if the sample rate is != 44k1 without soxr.
 #ifdef CONFIG_SOXR
   if (config.jack_soxr_resample_quality >= SOXR_QQ) {
     // we might improve a bit with soxr_clear if the sample_rate doesn't change
@@ -379,50 +333,17 @@ void jack_start(int i_sample_rate,
 #endif
 }
 
-void jack_flush() {
-  debug(2, "Only the consumer can safely flush a lock-free ringbuffer. Asking the"
-           " process callback to do it...");
-  flush_please = 1;
-}
-
-int jack_delay(long *the_delay) {
-  // Semantics change: we now look at the last transfer into the lock-free
-  // ringbuffer, not into the jack buffers directly (because locking those would
-  // violate real-time constraints). On average, that should lead to  just a
-  // constant additional latency.
-  // Without the mutex, we could get the time of what is the last transfer of data
-  // to a jack buffer, but then a transfer could occur and we would get the buffer
-  // occupancy after another transfer had occurred, so we could "lose" a full transfer
-  // (e.g. 1024 frames @ 44,100 fps ~ 23.2 milliseconds)
-  pthread_mutex_lock(&buffer_mutex);
-  int64_t time_now = get_absolute_time_in_fp();
-  int64_t delta = time_now - time_of_latest_transfer;
-  size_t audio_occupancy_now = jack_ringbuffer_read_space(jackbuf) / bytes_per_frame;
-  debug(2, "audio_occupancy_now is %d.", audio_occupancy_now);
-  pthread_mutex_unlock(&buffer_mutex);
-
-  int64_t frames_processed_since_latest_latency_check = (delta * sample_rate) >> 32;
-  // debug(1,"delta: %" PRId64 " frames.",frames_processed_since_latest_latency_check);
-  // jack_latency is set by the graph() callback, it's the average of the maximum
-  // latencies of all our output ports. Adjust this constant baseline delay according
-  // to the buffer fill level:
-  *the_delay = jack_latency + audio_occupancy_now - frames_processed_since_latest_latency_check;
-  // debug(1,"reporting a delay of %d frames",*the_delay);
-  return 0;
-}
-
 int play(void *buf, int samples) {
-  jack_ringbuffer_data_t v[2] = {0};
-  size_t i, j, c;
+  void *segments[2];
+  uint32_t segment_frames[2];
+  size_t i, j;
   jack_nframes_t thisbuf;
-  // It's ok to lock here since we're not in the realtime callback:
-  pthread_mutex_lock(&buffer_mutex);
-  jack_ringbuffer_get_write_vector(jackbuf, v);
-  short *in = (short *)buf;
+  audio_ring_write_segments(&ring, segments, segment_frames);
+  sample_t *in = (sample_t *)buf;
   sample_t *out;
   for (i = 0; i < 2; ++i) {
-    thisbuf = v[i].len / (jack_sample_size * NPORTS); // #samples per channel
-    out = (sample_t *)v[i].buf;
+    thisbuf = segment_frames[i]; // #samples per channel
+    out = (sample_t *)segments[i];
 #ifdef CONFIG_SOXR
     if (soxr) {
       size_t i_done, o_done;
@@ -441,25 +362,37 @@ int play(void *buf, int samples) {
         in += i_done * NPORTS; // advance our input buffer
         samples -= i_done;
         thisbuf -= o_done;
-        jack_ringbuffer_write_advance(jackbuf, o_done * jack_sample_size * NPORTS);
+        out += o_done * NPORTS;
+        audio_ring_write_advance(&ring, o_done);
       }
     } else {
 #endif
-    j = 0;
-    for (j = 0; j < thisbuf && samples > 0; ++j) {
-      for (c = 0; c < NPORTS; ++c)
-        out[j * NPORTS + c] = sample_conv(*in++);
-      --samples;
-    }
-    jack_ringbuffer_write_advance(jackbuf, j * jack_sample_size * NPORTS);
+    j = (size_t)samples < thisbuf ? (size_t)samples : thisbuf;
+    memcpy(out, in, j * bytes_per_frame);
+    in += j * NPORTS;
+    samples -= j;
+    audio_ring_write_advance(&ring, j);
 #ifdef CONFIG_SOXR
     }
 #endif
   }
-  time_of_latest_transfer = get_absolute_time_in_fp();
-  pthread_mutex_unlock(&buffer_mutex);
   if (samples) {
     warn("JACK ringbuffer overrun. Dropped %d samples.", samples);
   }
   return 0;
 }
+
+// Without resampling, the ring holds frames just as the player makes them, so
+// the player can write straight into it.
+static int jack_get_buffer(int frames, void *segments[2], int segment_frames[2]) {
+#ifdef CONFIG_SOXR
+  if (soxr)
+    return -1;
+#endif
+  return audio_ring_get_buffer(&ring, frames, segments, segment_frames);
+}
+
+static int jack_commit_buffer(int frames) {
+  audio_ring_write_advance(&ring, frames);
+  return 0;
+}
@@ -28,6 +28,7 @@
 // http://stackoverflow.com/questions/29977651/how-can-the-pulseaudio-asynchronous-library-be-used-to-play-raw-pcm-data
 
 #include "audio.h"
+#include "audio_ring.h"
 #include "common.h"
 #include <errno.h>
 #include <pthread.h>
@@ -36,14 +37,14 @@
 #include <string.h>
 #include <unistd.h>
 
-// note -- these are hacked and hardwired into this code.
-#define FORMAT PA_SAMPLE_S16NE
+// note -- this is hacked and hardwired into this code.
 #define RATE 44100
 
 // Four seconds buffer -- should be plenty
-#define buffer_allocation 44100 * 4 * 2 * 2
+#define buffer_allocation 44100 * 4
 
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static audio_ring ring;
+static int bytes_per_frame;
 
 /*
 static struct {
@@ -57,9 +58,6 @@ pa_threaded_mainloop *mainloop;
 pa_mainloop_api *mainloop_api;
 pa_context *context;
 pa_stream *stream;
-char *audio_lmb, *audio_umb, *audio_toq, *audio_eoq;
-size_t audio_size = buffer_allocation;
-size_t audio_occupancy;
 
 void context_state_cb(pa_context *context, void *mainloop);
 void stream_state_cb(pa_stream *s, void *mainloop);
@@ -67,6 +65,7 @@ void stream_success_cb(pa_stream *stream, int success, void *userdata);
 void stream_write_cb(pa_stream *stream, size_t requested_bytes, void *userdata);
 
 static int init(__attribute__((unused)) int argc, __attribute__((unused)) char **argv) {
+  sps_format_t pa_output_format = SPS_FORMAT_S16;
 
   // set up default values first
   config.audio_backend_buffer_desired_length = 0.35;
@@ -94,17 +93,28 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
     if (config_lookup_string(config.cfg, "pa.sink", &str)) {
       config.pa_sink = (char *)str;
     }
+
+    /* Get the output format. */
+    if (config_lookup_string(config.cfg, "pa.output_format", &str)) {
+      sps_format_t format = sps_format_from_description_string(str);
+      if ((format == SPS_FORMAT_S16) || (format == SPS_FORMAT_S24) ||
+          (format == SPS_FORMAT_S32) || (format == SPS_FORMAT_F32))
+        pa_output_format = format;
+      else
+        warn("Invalid pa output format \"%s\". It should be \"S16\", \"S24\", \"S32\" or "
+             "\"F32\". It remains set to \"%s\".",
+             str, sps_format_description_string(pa_output_format));
+    }
   }
+  config.output_format = pa_output_format;
+  config.output_format_auto_requested = 0;
+  bytes_per_frame = sps_format_bytes_per_frame(config.output_format);
 
   // finish collecting settings
 
   // allocate space for the audio buffer
-  audio_lmb = malloc(audio_size);
-  if (audio_lmb == NULL)
-    die("Can't allocate %d bytes for pulseaudio buffer.", audio_size);
-  audio_toq = audio_eoq = audio_lmb;
-  audio_umb = audio_lmb + audio_size;
-  audio_occupancy = 0;
+  if (audio_ring_init(&ring, buffer_allocation, bytes_per_frame, RATE) != 0)
+    die("Can't allocate %d frames for pulseaudio buffer.", buffer_allocation);
 
   // Get a mainloop and its context
   mainloop = pa_threaded_mainloop_new();
@@ -149,19 +159,32 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
 static void deinit(void) {
   pa_threaded_mainloop_stop(mainloop);
   pa_threaded_mainloop_free(mainloop);
+  audio_ring_free(&ring);
   // debug(1, "pa deinit done");
 }
 
 static void start(__attribute__((unused)) int sample_rate,
                   __attribute__((unused)) int sample_format) {
 
-  uint32_t buffer_size_in_bytes = (uint32_t)2 * 2 * RATE * 0.1; // hard wired in here
+  uint32_t buffer_size_in_bytes = (uint32_t)bytes_per_frame * RATE * 0.1; // hard wired in here
   // debug(1, "pa_buffer size is %u bytes.", buffer_size_in_bytes);
 
   pa_threaded_mainloop_lock(mainloop);
   // Create a playback stream
   pa_sample_spec sample_specifications;
-  sample_specifications.format = FORMAT;
+  switch (config.output_format) {
+  case SPS_FORMAT_S24:
+    sample_specifications.format = PA_SAMPLE_S24_32NE;
+    break;
+  case SPS_FORMAT_S32:
+    sample_specifications.format = PA_SAMPLE_S32NE;
+    break;
+  case SPS_FORMAT_F32:
+    sample_specifications.format = PA_SAMPLE_FLOAT32NE;
+    break;
+  default:
+    sample_specifications.format = PA_SAMPLE_S16NE;
+  }
   sample_specifications.rate = RATE;
   sample_specifications.channels = 2;
 
@@ -220,24 +243,10 @@ static void start(__attribute__((unused)) int sample_rate,
 static int play(void *buf, int samples) {
   // debug(1,"pa_play of %d samples.",samples);
   // copy the samples into the queue
-  size_t bytes_to_transfer = samples * 2 * 2;
-  size_t space_to_end_of_buffer = audio_umb - audio_eoq;
-  if (space_to_end_of_buffer >= bytes_to_transfer) {
-    memcpy(audio_eoq, buf, bytes_to_transfer);
-    audio_occupancy += bytes_to_transfer;
-    pthread_mutex_lock(&buffer_mutex);
-    audio_eoq += bytes_to_transfer;
-    pthread_mutex_unlock(&buffer_mutex);
-  } else {
-    memcpy(audio_eoq, buf, space_to_end_of_buffer);
-    buf += space_to_end_of_buffer;
-    memcpy(audio_lmb, buf, bytes_to_transfer - space_to_end_of_buffer);
-    pthread_mutex_lock(&buffer_mutex);
-    audio_occupancy += bytes_to_transfer;
-    pthread_mutex_unlock(&buffer_mutex);
-    audio_eoq = audio_lmb + bytes_to_transfer - space_to_end_of_buffer;
-  }
-  if ((audio_occupancy >= 11025 * 2 * 2) && (pa_stream_is_corked(stream))) {
+  uint32_t frames_transferred = audio_ring_write(&ring, buf, samples);
+  if (frames_transferred < (uint32_t)samples)
+    debug(1, "pulseaudio buffer overrun. Dropped %u frames.", samples - frames_transferred);
+  if ((audio_ring_occupancy(&ring) >= 11025) && (pa_stream_is_corked(stream))) {
     // debug(1,"Uncorked");
     pa_threaded_mainloop_lock(mainloop);
     pa_stream_cork(stream, 0, stream_success_cb, mainloop);
@@ -246,28 +255,6 @@ static int play(void *buf, int samples) {
   return 0;
 }
 
-int pa_delay(long *the_delay) {
-  long result = 0;
-  int reply = -ENODEV;
-  pa_usec_t latency;
-  int negative;
-  pa_threaded_mainloop_lock(mainloop);
-  int gl = pa_stream_get_latency(stream, &latency, &negative);
-  pa_threaded_mainloop_unlock(mainloop);
-  if (gl == PA_ERR_NODATA) {
-    // debug(1, "No latency data yet.");
-    reply = -ENODEV;
-  } else if (gl != 0) {
-    // debug(1,"Error %d getting latency.",gl);
-    reply = -EIO;
-  } else {
-    result = (audio_occupancy / (2 * 2)) + (latency * 44100) / 1000000;
-    reply = 0;
-  }
-  *the_delay = result;
-  return reply;
-}
-
 void flush(void) {
   // Cork the stream so it will stop playing
   pa_threaded_mainloop_lock(mainloop);
@@ -276,10 +263,9 @@ void flush(void) {
     pa_stream_flush(stream, stream_success_cb, NULL);
     pa_stream_cork(stream, 1, stream_success_cb, mainloop);
   }
+  // stream_write_cb() runs with the mainloop locked, so it can't be reading the buffer now
+  audio_ring_reset(&ring);
   pa_threaded_mainloop_unlock(mainloop);
-  audio_toq = audio_eoq = audio_lmb;
-  audio_umb = audio_lmb + audio_size;
-  audio_occupancy = 0;
 }
 
 static void stop(void) {
@@ -290,10 +276,8 @@ static void stop(void) {
     pa_stream_flush(stream, stream_success_cb, NULL);
     pa_stream_cork(stream, 1, stream_success_cb, mainloop);
   }
+  audio_ring_reset(&ring);
   pa_threaded_mainloop_unlock(mainloop);
-  audio_toq = audio_eoq = audio_lmb;
-  audio_umb = audio_lmb + audio_size;
-  audio_occupancy = 0;
 
   // debug(1,"pa stop");
   pa_stream_disconnect(stream);
@@ -308,11 +292,12 @@ audio_output audio_pa = {.name = "pa",
                          .stop = &stop,
                          .is_running = NULL,
                          .flush = &flush,
-                         .delay = &pa_delay,
+                         .delay = NULL,
                          .play = &play,
                          .volume = NULL,
                          .parameters = NULL,
-                         .mute = NULL};
+                         .mute = NULL,
+                         .ring = &ring};
 
 void context_state_cb(__attribute__((unused)) pa_context *context, void *mainloop) {
   pa_threaded_mainloop_signal(mainloop, 0);
@@ -354,54 +339,38 @@ void stream_write_cb(pa_stream *stream, size_t requested_bytes,
       }
     }
   */
-  int bytes_to_transfer = requested_bytes;
-  int bytes_transferred = 0;
-  uint8_t *buffer = NULL;
+  size_t bytes_to_transfer = requested_bytes;
+  size_t bytes_available = audio_ring_occupancy(&ring) * bytes_per_frame;
+  if (bytes_available < bytes_to_transfer) {
+    // debug(1, "Underflow? We have %d bytes but we are asked for %d bytes", bytes_available,
+    //      bytes_to_transfer);
+    pa_stream_cork(stream, 1, stream_success_cb, mainloop);
+    // debug(1, "Corked");
+    bytes_to_transfer = bytes_available;
+  }
 
-  while ((bytes_to_transfer > 0) && (audio_occupancy > 0)) {
+  while (bytes_to_transfer > 0) {
+    uint8_t *buffer = NULL;
     size_t bytes_we_can_transfer = bytes_to_transfer;
-    if (audio_occupancy < bytes_we_can_transfer) {
-      // debug(1, "Underflow? We have %d bytes but we are asked for %d bytes", audio_occupancy,
-      //      bytes_we_can_transfer);
-      pa_stream_cork(stream, 1, stream_success_cb, mainloop);
-      // debug(1, "Corked");
-      bytes_we_can_transfer = audio_occupancy;
-    }
-
-    // bytes we can transfer will never be greater than the bytes available
-
-    pa_stream_begin_write(stream, (void **)&buffer, &bytes_we_can_transfer);
-    if (bytes_we_can_transfer <= (size_t)(audio_umb - audio_toq)) {
-      // the bytes are all in a row in the audo buffer
-      memcpy(buffer, audio_toq, bytes_we_can_transfer);
-      audio_toq += bytes_we_can_transfer;
-      // lock
-      pthread_mutex_lock(&buffer_mutex);
-      audio_occupancy -= bytes_we_can_transfer;
-      pthread_mutex_unlock(&buffer_mutex);
-      // unlock
-      pa_stream_write(stream, buffer, bytes_we_can_transfer, NULL, 0LL, PA_SEEK_RELATIVE);
-      bytes_transferred += bytes_we_can_transfer;
-    } else {
-      // the bytes are in two places in the audio buffer
-      size_t first_portion_to_write = audio_umb - audio_toq;
-      if (first_portion_to_write != 0)
-        memcpy(buffer, audio_toq, first_portion_to_write);
-      uint8_t *new_buffer = buffer + first_portion_to_write;
-      memcpy(new_buffer, audio_lmb, bytes_we_can_transfer - first_portion_to_write);
-      pa_stream_write(stream, buffer, bytes_we_can_transfer, NULL, 0LL, PA_SEEK_RELATIVE);
-      bytes_transferred += bytes_we_can_transfer;
-      audio_toq = audio_lmb + bytes_we_can_transfer - first_portion_to_write;
-      // lock
-      pthread_mutex_lock(&buffer_mutex);
-      audio_occupancy -= bytes_we_can_transfer;
-      pthread_mutex_unlock(&buffer_mutex);
-      // unlock
+    // the buffer we get may be smaller than we ask for
+    if ((pa_stream_begin_write(stream, (void **)&buffer, &bytes_we_can_transfer) != 0) ||
+        (buffer == NULL))
+      break;
+    uint32_t frames = audio_ring_read(&ring, buffer, bytes_we_can_transfer / bytes_per_frame);
+    if (frames == 0) {
+      pa_stream_cancel_write(stream);
+      break;
     }
-    bytes_to_transfer -= bytes_we_can_transfer;
-    // debug(1,"audio_toq is %llx",audio_toq);
+    pa_stream_write(stream, buffer, frames * bytes_per_frame, NULL, 0LL, PA_SEEK_RELATIVE);
+    bytes_to_transfer -= frames * bytes_per_frame;
   }
 
+  // the latency takes in everything written to the stream, including what was just written
+  pa_usec_t latency;
+  int negative;
+  if ((pa_stream_get_latency(stream, &latency, &negative) == 0) && (negative == 0))
+    audio_ring_timestamp(&ring, (latency * RATE) / 1000000);
+
   // debug(1,"<<<Frames requested %d, written to pa: %d, corked status:
   // %d.",requested_bytes/4,bytes_transferred/4,pa_stream_is_corked(stream));
 }
@@ -28,66 +28,350 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for F_SETPIPE_SZ and vmsplice()
+#endif
+#endif
+
 #include "audio.h"
 #include "common.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <memory.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+// Audio is written to the pipe by a thread of its own, so that a slow reader never holds up the
+// player. play() puts frames into a queue of blocks and the writer thread takes them out, a block
+// at a time. If the queue is full, the overflow policy decides what gives way.
+
+// With vmsplice(), the pipe refers to the blocks themselves instead of taking a copy of them, so a
+// block can't be used again until the reader has taken everything in it.
+
+typedef enum { PIPE_DROP_OLDEST, PIPE_DROP_NEWEST, PIPE_BLOCK } pipe_overflow_policy;
+
+typedef struct pipe_block {
+  struct pipe_block *next;
+  char *data;
+  size_t length; // bytes of audio in the block
+  uint64_t end;  // with vmsplice(), the byte count of the pipe once the block was in it
+} pipe_block;
 
 static int fd = -1;
+static int bytes_per_frame = 4;
 
 char *pipename = NULL;
 int warned = 0;
 
-static void start(__attribute__((unused)) int sample_rate,
-                  __attribute__((unused)) int sample_format) {
+static pipe_overflow_policy overflow_policy = PIPE_DROP_OLDEST;
+static int pipe_size = 0; // in bytes; zero for half a second of audio
+static double queue_length_in_seconds = 1.0;
+static int use_vmsplice = 0;
+
+#define pipe_block_frames 4096
+
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_block_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pipe_block_freed = PTHREAD_COND_INITIALIZER;
+static pthread_t pipe_writer_thread;
+static int pipe_writer_running = 0;
 
+// these are all guarded by pipe_lock
+static pipe_block *pipe_blocks = NULL; // all of them, to be freed at the end
+static char *pipe_block_data = NULL;
+static size_t pipe_block_size;           // in bytes
+static pipe_block *free_blocks = NULL;   // a stack
+static pipe_block *queued_blocks = NULL; // oldest first
+static pipe_block *queued_blocks_tail = NULL;
+static pipe_block *spliced_blocks = NULL; // oldest first -- still referred to by the pipe
+static pipe_block *spliced_blocks_tail = NULL;
+static int reader_attached = 0;
+static uint64_t frames_dropped = 0;
+static int overflowing = 0;
+
+// the writer's own
+static uint64_t spliced_bytes = 0;
+
+static void block_free(pipe_block *block) {
+  block->length = 0;
+  block->next = free_blocks;
+  free_blocks = block;
+}
+
+static void block_append(pipe_block **head, pipe_block **tail, pipe_block *block) {
+  block->next = NULL;
+  if (*tail)
+    (*tail)->next = block;
+  else
+    *head = block;
+  *tail = block;
+}
+
+static pipe_block *block_remove_first(pipe_block **head, pipe_block **tail) {
+  pipe_block *block = *head;
+  if (block) {
+    *head = block->next;
+    if (*head == NULL)
+      *tail = NULL;
+    block->next = NULL;
+  }
+  return block;
+}
+
+static void pipe_lock_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&pipe_lock);
+}
+
+// with pipe_lock held -- give back every block the pipe has finished with
+static void release_spliced_blocks(void) {
+#ifdef __linux__
+  int in_pipe = 0;
+  if ((spliced_blocks) && (fd >= 0) && (ioctl(fd, FIONREAD, &in_pipe) == 0) &&
+      ((uint64_t)in_pipe <= spliced_bytes)) {
+    uint64_t taken = spliced_bytes - in_pipe;
+    while ((spliced_blocks) && (spliced_blocks->end <= taken))
+      block_free(block_remove_first(&spliced_blocks, &spliced_blocks_tail));
+    pthread_cond_broadcast(&pipe_block_freed);
+  }
+#endif
+}
+
+// the reader has gone away -- forget what was waiting for it and wait for another one
+static void pipe_disconnect(pipe_block *block) {
+  close(fd);
+  pthread_mutex_lock(&pipe_lock);
+  fd = -1;
+  reader_attached = 0;
+  if (block)
+    block_free(block);
+  while (queued_blocks)
+    block_free(block_remove_first(&queued_blocks, &queued_blocks_tail));
+  while (spliced_blocks)
+    block_free(block_remove_first(&spliced_blocks, &spliced_blocks_tail));
+  spliced_bytes = 0;
+  pthread_cond_broadcast(&pipe_block_freed);
+  pthread_mutex_unlock(&pipe_lock);
+  debug(1, "pipe: the reader of \"%s\" has gone away.", pipename);
+}
+
+static void pipe_connect(void) {
   // this will leave fd as -1 if a reader hasn't been attached to the pipe
   // we check that it's not a "real" error though. From the "man 2 open" page:
   // "ENXIO  O_NONBLOCK | O_WRONLY is set, the named file is a FIFO, and no process has the FIFO
   // open for reading."
-  fd = open(pipename, O_WRONLY | O_NONBLOCK);
-  if ((fd == -1) && (errno != ENXIO) && (warned == 0)) {
-    char errorstring[1024];
-    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-    debug(1, "pipe: start -- error %d (\"%s\") opening the pipe named \"%s\".", errno,
-          (char *)errorstring, pipename);
-    warn("Error %d opening the pipe named \"%s\".", errno, pipename);
-    warned = 1;
+  int new_fd = open(pipename, O_WRONLY | O_NONBLOCK);
+  if (new_fd == -1) {
+    if ((errno != ENXIO) && (warned == 0)) {
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      warn("Error %d opening the pipe named \"%s\": \"%s\".", errno, pipename, errorstring);
+      warned = 1;
+    }
+    return;
   }
+  // from here on, writes can wait -- it's only the writer thread that waits
+  int flags = fcntl(new_fd, F_GETFL);
+  if (flags != -1)
+    fcntl(new_fd, F_SETFL, flags & ~O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+  int size = fcntl(new_fd, F_SETPIPE_SZ, pipe_size);
+  if (size == -1) {
+    if (errno == EPERM)
+      debug(1, "pipe: not permitted to make the pipe \"%s\" %d bytes long -- see "
+               "/proc/sys/fs/pipe-max-size.",
+            pipename, pipe_size);
+    else
+      debug(1, "pipe: error %d setting the size of the pipe \"%s\".", errno, pipename);
+    size = fcntl(new_fd, F_GETPIPE_SZ);
+  }
+  debug(1, "pipe: a reader is attached to \"%s\", which holds %d bytes.", pipename, size);
+#else
+  debug(1, "pipe: a reader is attached to \"%s\".", pipename);
+#endif
+  pthread_mutex_lock(&pipe_lock);
+  fd = new_fd;
+  reader_attached = 1;
+  pthread_mutex_unlock(&pipe_lock);
+  warned = 0;
 }
 
-static int play(void *buf, int samples) {
-  // if the file is not open, try to open it.
-  char errorstring[1024];
-  if (fd == -1) {
-    fd = open(pipename, O_WRONLY | O_NONBLOCK);
+static void *pipe_writer_thread_function(__attribute__((unused)) void *arg) {
+  // a reader going away must show up as EPIPE here, not as a signal to the whole process
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  while (1) {
+    if (fd == -1) {
+      pipe_connect();
+      if (fd == -1) {
+        usleep(250000); // look for a reader four times a second
+        continue;
+      }
+    }
+
+    pipe_block *block;
+    pthread_mutex_lock(&pipe_lock);
+    pthread_cleanup_push(pipe_lock_cleanup_handler, NULL);
+    if (queued_blocks == NULL) {
+      if (spliced_blocks) {
+        // keep an eye on the reader's progress through the blocks the pipe still refers to
+        struct timespec time_to_wait;
+        clock_gettime(CLOCK_REALTIME, &time_to_wait);
+        time_to_wait.tv_nsec += 10000000;
+        if (time_to_wait.tv_nsec >= 1000000000) {
+          time_to_wait.tv_nsec -= 1000000000;
+          time_to_wait.tv_sec++;
+        }
+        pthread_cond_timedwait(&pipe_block_queued, &pipe_lock, &time_to_wait);
+      } else {
+        pthread_cond_wait(&pipe_block_queued, &pipe_lock);
+      }
+    }
+    // once it has been taken off the queue, the block can't be dropped by play()
+    block = block_remove_first(&queued_blocks, &queued_blocks_tail);
+    pthread_cleanup_pop(1);
+
+    if (block) {
+      size_t offset = 0;
+      while (offset < block->length) {
+        ssize_t rc;
+#ifdef __linux__
+        if (use_vmsplice) {
+          struct iovec iov = {block->data + offset, block->length - offset};
+          rc = vmsplice(fd, &iov, 1, 0);
+        } else
+#endif
+          rc = write(fd, block->data + offset, block->length - offset);
+        if (rc > 0) {
+          offset += rc;
+        } else if ((rc < 0) && (errno != EINTR)) {
+          if (errno != EPIPE) {
+            char errorstring[1024];
+            strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+            warn("Error %d writing to the pipe named \"%s\": \"%s\".", errno, pipename,
+                 errorstring);
+          }
+          break;
+        }
+      }
+      if (offset < block->length) {
+        pipe_disconnect(block);
+        continue;
+      }
+      pthread_mutex_lock(&pipe_lock);
+      if (use_vmsplice) {
+        spliced_bytes += block->length;
+        block->end = spliced_bytes;
+        block_append(&spliced_blocks, &spliced_blocks_tail, block);
+      } else {
+        block_free(block);
+        pthread_cond_broadcast(&pipe_block_freed);
+      }
+      pthread_mutex_unlock(&pipe_lock);
+    }
+    if (use_vmsplice) {
+      pthread_mutex_lock(&pipe_lock);
+      release_spliced_blocks();
+      pthread_mutex_unlock(&pipe_lock);
+    }
   }
-  // if it's got a reader, write to it.
-  if (fd > 0) {
-    int rc = non_blocking_write(fd, buf, samples * 4);
-    if ((rc < 0) && (warned == 0)) {
-      strerror_r(errno, (char *)errorstring, 1024);
-      warn("Error %d writing to the pipe named \"%s\": \"%s\".", errno, pipename, errorstring);
-      warned = 1;
+  pthread_exit(NULL);
+}
+
+// call with the pipe_lock held and cancellation disabled -- the wait is the only place play() can
+// be cancelled, and the lock is released if it is. It's kept out of play(), so that none of
+// play()'s variables are live across the setjmp in pthread_cleanup_push()
+static void wait_for_a_free_block(int cancel_state) {
+  int oldState;
+  pthread_setcancelstate(cancel_state, &oldState);
+  pthread_cleanup_push(pipe_lock_cleanup_handler, NULL);
+  pthread_cond_wait(&pipe_block_freed, &pipe_lock);
+  pthread_cleanup_pop(0);
+  pthread_setcancelstate(oldState, NULL);
+}
+
+static int play(void *buf, int samples) {
+  char *p = (char *)buf;
+  size_t bytes = (size_t)samples * bytes_per_frame;
+  int queued = 0;
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  pthread_mutex_lock(&pipe_lock);
+  // with no reader, the frames are simply discarded
+  while ((reader_attached) && (bytes > 0)) {
+    pipe_block *block = queued_blocks_tail; // never the block being written
+    if ((block == NULL) || (block->length == pipe_block_size)) {
+      if ((free_blocks == NULL) && (overflow_policy == PIPE_DROP_OLDEST) && (queued_blocks)) {
+        pipe_block *oldest = block_remove_first(&queued_blocks, &queued_blocks_tail);
+        frames_dropped += oldest->length / bytes_per_frame;
+        block_free(oldest);
+        if (overflowing == 0)
+          debug(2, "pipe: the reader of \"%s\" isn't keeping up -- dropping the oldest frames.",
+                pipename);
+        overflowing = 1;
+      } else if ((free_blocks == NULL) && (overflow_policy == PIPE_BLOCK)) {
+        wait_for_a_free_block(oldState);
+        continue;
+      }
+      block = free_blocks;
+      if (block == NULL) { // drop the frames that haven't been queued
+        frames_dropped += bytes / bytes_per_frame;
+        if (overflowing == 0)
+          debug(2, "pipe: the reader of \"%s\" isn't keeping up -- dropping the newest frames.",
+                pipename);
+        overflowing = 1;
+        break;
+      }
+      free_blocks = block->next;
+      block_append(&queued_blocks, &queued_blocks_tail, block);
     }
-  } else if ((fd == -1) && (errno != ENXIO) && (warned == 0)) {
-    strerror_r(errno, (char *)errorstring, 1024);
-    warn("Error %d opening the pipe named \"%s\": \"%s\".", errno, pipename, errorstring);
-    warned = 1;
+    size_t room = pipe_block_size - block->length;
+    size_t bytes_to_copy = bytes < room ? bytes : room;
+    memcpy(block->data + block->length, p, bytes_to_copy);
+    block->length += bytes_to_copy;
+    p += bytes_to_copy;
+    bytes -= bytes_to_copy;
+    queued = 1;
   }
-  return warned;
+  if ((overflowing) && (bytes == 0) && (free_blocks)) {
+    debug(2,
+          "pipe: the reader of \"%s\" is keeping up again -- %" PRIu64 " frames dropped so far.",
+          pipename, frames_dropped);
+    overflowing = 0;
+  }
+  if (queued)
+    pthread_cond_signal(&pipe_block_queued);
+  pthread_mutex_unlock(&pipe_lock);
+  pthread_setcancelstate(oldState, NULL);
+  return 0;
 }
 
+static void flush(void) {
+  pthread_mutex_lock(&pipe_lock);
+  while (queued_blocks)
+    block_free(block_remove_first(&queued_blocks, &queued_blocks_tail));
+  pthread_cond_broadcast(&pipe_block_freed);
+  pthread_mutex_unlock(&pipe_lock);
+}
+
+static void start(__attribute__((unused)) int sample_rate,
+                  __attribute__((unused)) int sample_format) {}
+
 static void stop(void) {
   // Don't close the pipe just because a play session has stopped.
-  //  if (fd > 0)
-  //    close(fd);
 }
 
 static int init(int argc, char **argv) {
@@ -107,13 +391,78 @@ static int init(int argc, char **argv) {
   if (config.cfg != NULL) {
     /* Get the Output Pipename. */
     const char *str;
+    int value;
+    double dvalue;
     if (config_lookup_string(config.cfg, "pipe.name", &str)) {
       pipename = (char *)str;
     }
 
     if ((pipename) && (strcasecmp(pipename, "STDOUT") == 0))
       die("Can't use \"pipe\" backend for STDOUT. Use the \"stdout\" backend instead.");
+
+    /* Get the output format. */
+    if (config_lookup_string(config.cfg, "pipe.output_format", &str)) {
+      sps_format_t format = sps_format_from_description_string(str);
+      if (format != SPS_FORMAT_INVALID) {
+        config.output_format = format;
+        config.output_format_auto_requested = 0;
+      } else {
+        warn("Invalid pipe output format \"%s\". It remains set to \"%s\".", str,
+             sps_format_description_string(config.output_format));
+      }
+    }
+
+    /* Get the size of the pipe. */
+    if (config_lookup_int(config.cfg, "pipe.pipe_size", &value)) {
+      if (value < 0)
+        warn("Invalid pipe pipe_size %d. It must be zero or positive.", value);
+      else
+        pipe_size = value;
+    }
+
+    /* Get the length of the queue. */
+    if (config_lookup_float(config.cfg, "pipe.queue_length_in_seconds", &dvalue)) {
+      if ((dvalue <= 0.0) || (dvalue > 30.0))
+        warn("Invalid pipe queue_length_in_seconds %f. It must be greater than 0.0 and no more "
+             "than 30.0. The default of %f seconds will be used.",
+             dvalue, queue_length_in_seconds);
+      else
+        queue_length_in_seconds = dvalue;
+    }
+
+    /* Get the overflow policy. */
+    if (config_lookup_string(config.cfg, "pipe.overflow_policy", &str)) {
+      if (strcasecmp(str, "drop_oldest") == 0)
+        overflow_policy = PIPE_DROP_OLDEST;
+      else if (strcasecmp(str, "drop_newest") == 0)
+        overflow_policy = PIPE_DROP_NEWEST;
+      else if (strcasecmp(str, "block") == 0)
+        overflow_policy = PIPE_BLOCK;
+      else
+        warn("Invalid pipe overflow_policy choice \"%s\". It should be \"drop_oldest\", "
+             "\"drop_newest\" or \"block\". It remains set to \"drop_oldest\".",
+             str);
+    }
+
+    /* Get the vmsplice option. */
+    if (config_lookup_string(config.cfg, "pipe.use_vmsplice", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        use_vmsplice = 0;
+      else if (strcasecmp(str, "yes") == 0)
+#ifdef __linux__
+        use_vmsplice = 1;
+#else
+        warn("The pipe use_vmsplice setting is only available on Linux.");
+#endif
+      else
+        warn("Invalid pipe use_vmsplice choice \"%s\". It should be \"yes\" or \"no\". It remains "
+             "set to \"no\".",
+             str);
+    }
   }
+  bytes_per_frame = sps_format_bytes_per_frame(config.output_format);
+  if (pipe_size == 0)
+    pipe_size = (config.output_rate * bytes_per_frame) / 2;
 
   if ((pipename == NULL) && (argc != 1))
     die("bad or missing argument(s) to pipe");
@@ -127,12 +476,43 @@ static int init(int argc, char **argv) {
 
   debug(1, "Pipename is \"%s\"", pipename);
 
+  // enough blocks for the queue and, with vmsplice(), for what the pipe itself can hold
+  pipe_block_size = (size_t)pipe_block_frames * bytes_per_frame;
+  int block_count = (int)(queue_length_in_seconds * config.output_rate) / pipe_block_frames + 1;
+  if (use_vmsplice)
+    block_count += pipe_size / pipe_block_size + 2;
+  pipe_blocks = calloc(block_count, sizeof(pipe_block));
+  if ((pipe_blocks == NULL) ||
+      (posix_memalign((void **)&pipe_block_data, 4096, block_count * pipe_block_size) != 0))
+    die("Can't allocate memory for the pipe backend's queue.");
+  int i;
+  for (i = 0; i < block_count; i++) {
+    pipe_blocks[i].data = pipe_block_data + i * pipe_block_size;
+    block_free(&pipe_blocks[i]);
+  }
+  debug(1, "pipe: the queue holds %d frames.", block_count * pipe_block_frames);
+
+  if (pthread_create(&pipe_writer_thread, NULL, &pipe_writer_thread_function, NULL) != 0)
+    die("Could not create the pipe writer thread.");
+  pipe_writer_running = 1;
+
   return 0;
 }
 
 static void deinit(void) {
-  if (fd > 0)
+  if (pipe_writer_running) {
+    pthread_cancel(pipe_writer_thread);
+    pthread_join(pipe_writer_thread, NULL);
+    pipe_writer_running = 0;
+  }
+  if (fd >= 0)
     close(fd);
+  fd = -1;
+  free(pipe_block_data);
+  free(pipe_blocks);
+  pipe_block_data = NULL;
+  pipe_blocks = NULL;
+  free_blocks = queued_blocks = queued_blocks_tail = spliced_blocks = spliced_blocks_tail = NULL;
 }
 
 static void help(void) { printf("    specify the pathname of the pipe to write to.\n"); }
@@ -145,7 +525,7 @@ audio_output audio_pipe = {.name = "pipe",
                            .start = &start,
                            .stop = &stop,
                            .is_running = NULL,
-                           .flush = NULL,
+                           .flush = &flush,
                            .delay = NULL,
                            .play = &play,
                            .volume = NULL,
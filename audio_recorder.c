@@ -0,0 +1,908 @@
+/*
+ * Audio recorder output driver. This file is part of Shairport Sync.
+ * Copyright (c) 2026 The Shairport Sync contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CONFIG_FLAC
+#include <FLAC/metadata.h>
+#include <FLAC/stream_encoder.h>
+#endif
+
+#include "audio.h"
+#include "common.h"
+
+#ifdef CONFIG_METADATA_HUB
+#include "metadata_hub.h"
+#endif
+
+// Each play session is recorded to a file of its own, in WAV or FLAC format. The file is opened
+// when the session starts and closed when it ends, when the track metadata is added to it -- so a
+// session that plays several tracks is tagged with the one playing when it ends.
+
+// The player copies frames into a queue of large blocks and a writer thread of the recorder's own
+// takes them out, converts or encodes them and writes them through a large buffer, so the player
+// never waits on the storage. If the queue fills up, frames are dropped and made up with silence
+// so that the recording keeps time.
+
+// A WAV file can't be larger than 4 GiB, as its sizes are 32-bit numbers -- about 6.7 hours of
+// S32 audio at 44,100 frames per second. A WAV recording that reaches that size carries on in a
+// new file.
+
+// The recorder can play the audio through a live backend at the same time -- it then passes
+// everything on to that backend, which looks after the timing, just as if it were used alone.
+
+#define recorder_block_frames 16384
+#define recorder_write_buffer_size (1024 * 1024)
+// leaving room for the header and the track metadata within the 32-bit RIFF chunk size
+#define wav_maximum_data_length (UINT32_MAX - 1024 * 1024)
+
+typedef enum {
+  RECORDER_AUDIO,
+  RECORDER_SESSION_START,
+  RECORDER_SESSION_END
+} recorder_block_type;
+
+typedef struct recorder_block {
+  struct recorder_block *next;
+  recorder_block_type type;
+  char *data; // NULL for the start and end of a session
+  size_t length;
+  uint64_t silence_before; // in frames, to make up for those dropped before this block
+  int rate;
+  sps_format_t format;
+} recorder_block;
+
+static char *recorder_directory = "/tmp/shairport-sync-recordings";
+static int use_flac = 0;
+static double queue_length_in_seconds = 10.0;
+static audio_output *live = NULL;
+
+static pthread_mutex_t recorder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recorder_block_queued = PTHREAD_COND_INITIALIZER;
+static pthread_t recorder_writer_thread;
+static int recorder_writer_running = 0;
+
+// these are guarded by recorder_lock
+static recorder_block *recorder_blocks = NULL; // all the audio blocks, to be freed at the end
+static char *recorder_block_data = NULL;
+static size_t recorder_block_size; // in bytes
+static recorder_block *free_blocks = NULL;
+static recorder_block *queued_blocks = NULL; // oldest first
+static recorder_block *queued_blocks_tail = NULL;
+static uint64_t frames_dropped = 0; // since the last block was queued
+static uint64_t total_frames_dropped = 0;
+
+// the player's own
+static int recording = 0;
+static int bytes_per_frame = 4;
+static void *live_segments[2];
+static int live_segment_frames[2];
+
+// the writer's own
+typedef struct {
+  char *title;
+  char *artist;
+  char *album_artist;
+  char *album;
+  char *genre;
+  char *composer;
+  char *comment;
+} recorder_track_metadata;
+
+static FILE *recording_file = NULL;
+static char *recording_pathname = NULL;
+static char *write_buffer = NULL; // for the file's stdio stream
+static char *conversion_buffer = NULL;
+static sps_format_t recording_format;
+static int recording_rate;
+static int recording_bytes_per_sample;
+static uint64_t recording_data_length;
+#ifdef CONFIG_FLAC
+static FLAC__StreamEncoder *encoder = NULL;
+static FLAC__StreamMetadata *padding = NULL;
+#endif
+
+// with recorder_lock held
+static void block_release(recorder_block *block) {
+  if (block->data) {
+    block->length = 0;
+    block->silence_before = 0;
+    block->next = free_blocks;
+    free_blocks = block;
+  } else {
+    free(block);
+  }
+}
+
+// with recorder_lock held
+static void block_queue(recorder_block *block) {
+  block->next = NULL;
+  if (queued_blocks_tail)
+    queued_blocks_tail->next = block;
+  else
+    queued_blocks = block;
+  queued_blocks_tail = block;
+  pthread_cond_signal(&recorder_block_queued);
+}
+
+static void queue_session_event(recorder_block_type type, int rate, sps_format_t format) {
+  recorder_block *block = calloc(1, sizeof(recorder_block));
+  if (block == NULL)
+    die("Can't allocate memory for the recorder.");
+  block->type = type;
+  block->rate = rate;
+  block->format = format;
+  pthread_mutex_lock(&recorder_lock);
+  block_queue(block);
+  pthread_mutex_unlock(&recorder_lock);
+}
+
+static void record(void *buf, int samples) {
+  if (recording == 0)
+    return;
+  char *p = (char *)buf;
+  size_t bytes = (size_t)samples * bytes_per_frame;
+  pthread_mutex_lock(&recorder_lock);
+  while (bytes > 0) {
+    recorder_block *block = queued_blocks_tail;
+    if ((block == NULL) || (block->type != RECORDER_AUDIO) ||
+        (block->length + bytes_per_frame > recorder_block_size)) {
+      block = free_blocks;
+      if (block == NULL) { // the writer can't keep up, so drop the frames
+        if (frames_dropped == 0)
+          debug(1, "recorder: the writer can't keep up -- dropping frames.");
+        frames_dropped += bytes / bytes_per_frame;
+        total_frames_dropped += bytes / bytes_per_frame;
+        break;
+      }
+      free_blocks = block->next;
+      block->type = RECORDER_AUDIO;
+      block->silence_before = frames_dropped;
+      frames_dropped = 0;
+      block_queue(block);
+    }
+    // whole frames only
+    size_t room = ((recorder_block_size - block->length) / bytes_per_frame) * bytes_per_frame;
+    size_t bytes_to_copy = bytes < room ? bytes : room;
+    memcpy(block->data + block->length, p, bytes_to_copy);
+    block->length += bytes_to_copy;
+    p += bytes_to_copy;
+    bytes -= bytes_to_copy;
+  }
+  pthread_mutex_unlock(&recorder_lock);
+}
+
+// reading the player's output
+
+static int sample_bits(sps_format_t format) {
+  switch (format) {
+  case SPS_FORMAT_S8:
+  case SPS_FORMAT_U8:
+    return 8;
+  case SPS_FORMAT_S16:
+  case SPS_FORMAT_S16_LE:
+  case SPS_FORMAT_S16_BE:
+    return 16;
+  case SPS_FORMAT_S24:
+  case SPS_FORMAT_S24_LE:
+  case SPS_FORMAT_S24_BE:
+  case SPS_FORMAT_S24_3LE:
+  case SPS_FORMAT_S24_3BE:
+    return 24;
+  default:
+    return 32;
+  }
+}
+
+// an integer sample, at the bit depth of the format -- F32 samples are scaled to 32 bits
+static int32_t sample_read(const uint8_t *p, sps_format_t format) {
+  int16_t s16;
+  int32_t s32;
+  float f;
+  switch (format) {
+  case SPS_FORMAT_S8:
+    return (int8_t)p[0];
+  case SPS_FORMAT_U8:
+    return (int32_t)p[0] - 128;
+  case SPS_FORMAT_S16:
+    memcpy(&s16, p, sizeof(s16));
+    return s16;
+  case SPS_FORMAT_S16_LE:
+    return (int16_t)(p[0] | (p[1] << 8));
+  case SPS_FORMAT_S16_BE:
+    return (int16_t)((p[0] << 8) | p[1]);
+  case SPS_FORMAT_S24:
+  case SPS_FORMAT_S32:
+    memcpy(&s32, p, sizeof(s32));
+    return s32;
+  case SPS_FORMAT_S24_LE:
+  case SPS_FORMAT_S24_3LE:
+    return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+  case SPS_FORMAT_S24_BE:
+    return (int32_t)((uint32_t)p[1] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 8) >> 8;
+  case SPS_FORMAT_S24_3BE:
+    return (int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8) >> 8;
+  case SPS_FORMAT_S32_LE:
+    return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                     (uint32_t)p[3] << 24);
+  case SPS_FORMAT_S32_BE:
+    return (int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+                     (uint32_t)p[3]);
+  case SPS_FORMAT_F32:
+    memcpy(&f, p, sizeof(f));
+    if (f >= 1.0)
+      return INT32_MAX;
+    if (f <= -1.0)
+      return INT32_MIN;
+    return (int32_t)(f * 2147483648.0);
+  default:
+    return 0;
+  }
+}
+
+// writing WAV files
+
+static void put_le(char **p, uint32_t value, int bytes) {
+  int i;
+  for (i = 0; i < bytes; i++)
+    *(*p)++ = (char)(value >> (8 * i));
+}
+
+static void wav_write_header(void) {
+  char header[44];
+  char *p = header;
+  int format_tag = recording_format == SPS_FORMAT_F32 ? 3 : 1; // IEEE float or PCM
+  uint32_t block_align = 2 * recording_bytes_per_sample;
+  memcpy(p, "RIFF", 4);
+  p += 4;
+  put_le(&p, recording_data_length + 36, 4);
+  memcpy(p, "WAVEfmt ", 8);
+  p += 8;
+  put_le(&p, 16, 4);
+  put_le(&p, format_tag, 2);
+  put_le(&p, 2, 2);
+  put_le(&p, recording_rate, 4);
+  put_le(&p, recording_rate * block_align, 4);
+  put_le(&p, block_align, 2);
+  put_le(&p, recording_bytes_per_sample * 8, 2);
+  memcpy(p, "data", 4);
+  p += 4;
+  put_le(&p, recording_data_length, 4);
+  fwrite(header, 1, sizeof(header), recording_file);
+}
+
+static void wav_write_frames(const char *data, size_t frames) {
+  int input_bytes_per_sample = sps_format_bytes_per_frame(recording_format) / 2;
+  int bits = sample_bits(recording_format);
+  size_t frames_per_conversion = recorder_write_buffer_size / (2 * recording_bytes_per_sample);
+  while (frames) {
+    size_t n = frames < frames_per_conversion ? frames : frames_per_conversion;
+    char *p = conversion_buffer;
+    size_t i;
+    for (i = 0; i < n * 2; i++) {
+      const uint8_t *sp = (const uint8_t *)data + i * input_bytes_per_sample;
+      if (data == NULL) {
+        put_le(&p, bits == 8 ? 128 : 0, recording_bytes_per_sample);
+      } else if (recording_format == SPS_FORMAT_F32) {
+        uint32_t f;
+        memcpy(&f, sp, sizeof(f));
+        put_le(&p, f, 4);
+      } else if (bits == 8) {
+        put_le(&p, sample_read(sp, recording_format) + 128, 1);
+      } else {
+        put_le(&p, sample_read(sp, recording_format), recording_bytes_per_sample);
+      }
+    }
+    fwrite(conversion_buffer, 1, p - conversion_buffer, recording_file);
+    recording_data_length += p - conversion_buffer;
+    if (data)
+      data += n * 2 * input_bytes_per_sample;
+    frames -= n;
+  }
+}
+
+static void wav_add_info(const char *id, const char *value, char **p) {
+  if ((value) && (strlen(value))) {
+    uint32_t length = strlen(value) + 1;
+    memcpy(*p, id, 4);
+    *p += 4;
+    put_le(p, length, 4);
+    memcpy(*p, value, length);
+    *p += length;
+    if (length & 1)
+      *(*p)++ = '\0';
+  }
+}
+
+static void wav_finish(recorder_track_metadata *metadata) {
+  if (recording_data_length & 1)
+    fputc(0, recording_file);
+  // a LIST INFO chunk with the track metadata, if there is any
+  size_t size = 12 + 7 * 8 + 2;
+  if (metadata->title)
+    size += strlen(metadata->title) + 2;
+  if (metadata->artist)
+    size += strlen(metadata->artist) + 2;
+  if (metadata->album)
+    size += strlen(metadata->album) + 2;
+  if (metadata->genre)
+    size += strlen(metadata->genre) + 2;
+  if (metadata->comment)
+    size += strlen(metadata->comment) + 2;
+  char *list = NULL;
+  if (recording_data_length + 1 + size + 36 <= UINT32_MAX) // it's left out if it won't fit
+    list = malloc(size);
+  uint64_t list_length = 0;
+  if (list) {
+    char *p = list + 12;
+    wav_add_info("INAM", metadata->title, &p);
+    wav_add_info("IART", metadata->artist, &p);
+    wav_add_info("IPRD", metadata->album, &p);
+    wav_add_info("IGNR", metadata->genre, &p);
+    wav_add_info("ICMT", metadata->comment, &p);
+    if (p != list + 12) {
+      list_length = p - list;
+      memcpy(list, "LIST", 4);
+      p = list + 4;
+      put_le(&p, list_length - 8, 4);
+      memcpy(p, "INFO", 4);
+      fwrite(list, 1, list_length, recording_file);
+    }
+    free(list);
+  }
+  // now the lengths are known, the header can be finished
+  if (fseek(recording_file, 0, SEEK_SET) == 0) {
+    wav_write_header();
+    // the RIFF chunk includes the padding and the LIST chunk too
+    char length[4];
+    char *p = length;
+    put_le(&p, recording_data_length + (recording_data_length & 1) + list_length + 36, 4);
+    fseek(recording_file, 4, SEEK_SET);
+    fwrite(length, 1, sizeof(length), recording_file);
+  }
+  fflush(recording_file);
+  fsync(fileno(recording_file));
+  fclose(recording_file);
+}
+
+#ifdef CONFIG_FLAC
+// writing FLAC files
+
+static void flac_write_frames(const char *data, size_t frames) {
+  int input_bytes_per_sample = sps_format_bytes_per_frame(recording_format) / 2;
+  int bits = sample_bits(recording_format);
+  FLAC__int32 *samples = (FLAC__int32 *)conversion_buffer;
+  size_t frames_per_conversion = recorder_write_buffer_size / (2 * sizeof(FLAC__int32));
+  while (frames) {
+    size_t n = frames < frames_per_conversion ? frames : frames_per_conversion;
+    size_t i;
+    for (i = 0; i < n * 2; i++) {
+      if (data == NULL)
+        samples[i] = 0;
+      else if (bits == 32) // down to 24 bits
+        samples[i] = sample_read((const uint8_t *)data + i * input_bytes_per_sample,
+                                 recording_format) >>
+                     8;
+      else
+        samples[i] =
+            sample_read((const uint8_t *)data + i * input_bytes_per_sample, recording_format);
+    }
+    if (!FLAC__stream_encoder_process_interleaved(encoder, samples, n))
+      debug(1, "recorder: error encoding %zu frames.", n);
+    if (data)
+      data += n * 2 * input_bytes_per_sample;
+    frames -= n;
+  }
+}
+
+static void flac_add_comment(FLAC__StreamMetadata *comments, const char *name, const char *value) {
+  FLAC__StreamMetadata_VorbisComment_Entry entry;
+  if ((value) && (strlen(value)) &&
+      (FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry, name, value)))
+    FLAC__metadata_object_vorbiscomment_append_comment(comments, entry, 0);
+}
+
+static void flac_finish(recorder_track_metadata *metadata) {
+  FLAC__stream_encoder_finish(encoder); // this closes the file
+  FLAC__stream_encoder_delete(encoder);
+  encoder = NULL;
+  FLAC__metadata_object_delete(padding);
+  padding = NULL;
+  // add the track metadata in the room left for it
+  FLAC__StreamMetadata *comments = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+  FLAC__Metadata_Chain *chain = FLAC__metadata_chain_new();
+  FLAC__Metadata_Iterator *iterator = FLAC__metadata_iterator_new();
+  if ((comments) && (chain) && (iterator) &&
+      (FLAC__metadata_chain_read(chain, recording_pathname))) {
+    flac_add_comment(comments, "TITLE", metadata->title);
+    flac_add_comment(comments, "ARTIST", metadata->artist);
+    flac_add_comment(comments, "ALBUMARTIST", metadata->album_artist);
+    flac_add_comment(comments, "ALBUM", metadata->album);
+    flac_add_comment(comments, "GENRE", metadata->genre);
+    flac_add_comment(comments, "COMPOSER", metadata->composer);
+    flac_add_comment(comments, "COMMENT", metadata->comment);
+    FLAC__metadata_iterator_init(iterator, chain); // at the STREAMINFO block
+    if (FLAC__metadata_iterator_insert_block_after(iterator, comments)) {
+      comments = NULL; // it belongs to the chain now
+      FLAC__metadata_chain_sort_padding(chain);
+      if (!FLAC__metadata_chain_write(chain, 1, 0))
+        debug(1, "recorder: couldn't add the track metadata to \"%s\".", recording_pathname);
+    }
+  }
+  if (comments)
+    FLAC__metadata_object_delete(comments);
+  if (iterator)
+    FLAC__metadata_iterator_delete(iterator);
+  if (chain)
+    FLAC__metadata_chain_delete(chain);
+}
+#endif
+
+static void recording_start(int rate, sps_format_t format) {
+  time_t now = time(NULL);
+  struct tm local;
+  char name[64];
+  strftime(name, sizeof(name), "shairport-sync-%Y%m%d-%H%M%S", localtime_r(&now, &local));
+  const char *extension = use_flac ? "flac" : "wav";
+  size_t pl = strlen(recorder_directory) + 1 + strlen(name) + 4 + 1 + strlen(extension) + 1;
+  recording_pathname = malloc(pl);
+  if (recording_pathname == NULL)
+    die("Can't allocate memory for a recording's pathname.");
+  int fd = -1;
+  int i;
+  for (i = 1; (fd < 0) && (i < 100); i++) {
+    if (i == 1)
+      snprintf(recording_pathname, pl, "%s/%s.%s", recorder_directory, name, extension);
+    else
+      snprintf(recording_pathname, pl, "%s/%s-%d.%s", recorder_directory, name, i, extension);
+    fd = open(recording_pathname, O_WRONLY | O_CREAT | O_EXCL,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if ((fd < 0) && (errno != EEXIST))
+      break;
+  }
+  if (fd >= 0)
+    recording_file = fdopen(fd, "w");
+  if (recording_file == NULL) {
+    warn("Could not create the recording \"%s\": error %d.", recording_pathname, errno);
+    if (fd >= 0)
+      close(fd);
+    free(recording_pathname);
+    recording_pathname = NULL;
+    return;
+  }
+  setvbuf(recording_file, write_buffer, _IOFBF, recorder_write_buffer_size);
+  recording_rate = rate;
+  recording_format = format;
+  recording_data_length = 0;
+
+  if (use_flac) {
+#ifdef CONFIG_FLAC
+    int bits = sample_bits(format);
+    encoder = FLAC__stream_encoder_new();
+    padding = FLAC__metadata_object_new(FLAC__METADATA_TYPE_PADDING);
+    if ((encoder == NULL) || (padding == NULL))
+      die("Can't create the recorder's FLAC encoder.");
+    padding->length = 8192; // room for the track metadata, which is added at the end
+    FLAC__stream_encoder_set_channels(encoder, 2);
+    FLAC__stream_encoder_set_bits_per_sample(encoder, bits == 32 ? 24 : bits);
+    FLAC__stream_encoder_set_sample_rate(encoder, rate);
+    FLAC__stream_encoder_set_compression_level(encoder, 5);
+    FLAC__stream_encoder_set_metadata(encoder, &padding, 1);
+    if (FLAC__stream_encoder_init_FILE(encoder, recording_file, NULL, NULL) !=
+        FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+      warn("Could not start encoding the recording \"%s\".", recording_pathname);
+      FLAC__stream_encoder_delete(encoder);
+      encoder = NULL;
+      FLAC__metadata_object_delete(padding);
+      padding = NULL;
+      fclose(recording_file);
+      recording_file = NULL;
+      return;
+    }
+#endif
+  } else {
+    int bits = sample_bits(format);
+    recording_bytes_per_sample = bits / 8;
+    wav_write_header();
+  }
+  debug(1, "recorder: recording to \"%s\".", recording_pathname);
+}
+
+static void recording_finish(void) {
+  if (recording_file) {
+    recorder_track_metadata metadata;
+    memset(&metadata, 0, sizeof(metadata));
+#ifdef CONFIG_METADATA_HUB
+    metadata_hub_read_prolog();
+    if (metadata_store.track_name)
+      metadata.title = strdup(metadata_store.track_name);
+    if (metadata_store.artist_name)
+      metadata.artist = strdup(metadata_store.artist_name);
+    if (metadata_store.album_artist_name)
+      metadata.album_artist = strdup(metadata_store.album_artist_name);
+    if (metadata_store.album_name)
+      metadata.album = strdup(metadata_store.album_name);
+    if (metadata_store.genre)
+      metadata.genre = strdup(metadata_store.genre);
+    if (metadata_store.composer)
+      metadata.composer = strdup(metadata_store.composer);
+    if (metadata_store.comment)
+      metadata.comment = strdup(metadata_store.comment);
+    metadata_hub_read_epilog();
+#endif
+#ifdef CONFIG_FLAC
+    if (use_flac)
+      flac_finish(&metadata);
+    else
+#endif
+      wav_finish(&metadata);
+    recording_file = NULL;
+    debug(1, "recorder: finished recording \"%s\".", recording_pathname);
+    free(metadata.title);
+    free(metadata.artist);
+    free(metadata.album_artist);
+    free(metadata.album);
+    free(metadata.genre);
+    free(metadata.composer);
+    free(metadata.comment);
+  }
+  free(recording_pathname);
+  recording_pathname = NULL;
+}
+
+// write frames -- or silence, if data is NULL -- to a WAV recording, carrying on in a new file
+// whenever the current one is full
+static void recording_write_wav_frames(const char *data, size_t frames) {
+  while ((frames) && (recording_file)) {
+    size_t room = (wav_maximum_data_length - recording_data_length) /
+                  (2 * recording_bytes_per_sample); // in frames
+    if (room == 0) {
+      warn("The recording \"%s\" has reached the largest size a WAV file can have. Recording "
+           "will continue in a new file.",
+           recording_pathname);
+      int rate = recording_rate;
+      sps_format_t format = recording_format;
+      recording_finish();
+      recording_start(rate, format);
+    } else {
+      size_t n = frames < room ? frames : room;
+      wav_write_frames(data, n);
+      if (data)
+        data += n * sps_format_bytes_per_frame(recording_format);
+      frames -= n;
+    }
+  }
+}
+
+static void recording_write(recorder_block *block) {
+  if (recording_file == NULL)
+    return;
+  int input_bytes_per_frame = sps_format_bytes_per_frame(recording_format);
+#ifdef CONFIG_FLAC
+  if (use_flac) {
+    if (block->silence_before)
+      flac_write_frames(NULL, block->silence_before);
+    flac_write_frames(block->data, block->length / input_bytes_per_frame);
+    return;
+  }
+#endif
+  if (block->silence_before)
+    recording_write_wav_frames(NULL, block->silence_before);
+  recording_write_wav_frames(block->data, block->length / input_bytes_per_frame);
+}
+
+// act on a block taken from the queue
+static void recorder_block_handle(recorder_block *block) {
+  switch (block->type) {
+  case RECORDER_SESSION_START:
+    recording_finish(); // if the last one was never finished
+    recording_start(block->rate, block->format);
+    break;
+  case RECORDER_SESSION_END:
+    recording_finish();
+    break;
+  default:
+    recording_write(block);
+    break;
+  }
+}
+
+static void recorder_writer_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&recorder_lock);
+}
+
+static void *recorder_writer_thread_function(__attribute__((unused)) void *arg) {
+  mode_t oldumask = umask(000);
+  int result = mkpath(recorder_directory, 0755);
+  umask(oldumask);
+  if ((result != 0) && (result != -EEXIST))
+    warn("Couldn't access or create the recordings directory \"%s\".", recorder_directory);
+
+  while (1) {
+    recorder_block *block;
+    pthread_mutex_lock(&recorder_lock);
+    pthread_cleanup_push(recorder_writer_cleanup_handler, NULL);
+    while (queued_blocks == NULL)
+      pthread_cond_wait(&recorder_block_queued, &recorder_lock);
+    pthread_cleanup_pop(0);
+    // an audio block may be being added to while it's last in the queue, so leave it till later
+    // unless the writer has nothing else to do
+    block = queued_blocks;
+    if ((block->type == RECORDER_AUDIO) && (block->next == NULL) &&
+        (block->length + bytes_per_frame <= recorder_block_size)) {
+      // take what's in it now, and leave it in the queue for more
+      block = NULL;
+    } else {
+      queued_blocks = block->next;
+      if (queued_blocks == NULL)
+        queued_blocks_tail = NULL;
+    }
+    pthread_mutex_unlock(&recorder_lock);
+
+    if (block == NULL) {
+      // let the last block fill up a bit before taking it
+      usleep(100000);
+      pthread_mutex_lock(&recorder_lock);
+      block = queued_blocks;
+      if ((block) && (block->type == RECORDER_AUDIO) && (block->length)) {
+        queued_blocks = block->next;
+        if (queued_blocks == NULL)
+          queued_blocks_tail = NULL;
+      } else {
+        block = NULL;
+      }
+      pthread_mutex_unlock(&recorder_lock);
+      if (block == NULL)
+        continue;
+    }
+
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    recorder_block_handle(block);
+    pthread_mutex_lock(&recorder_lock);
+    block_release(block);
+    pthread_mutex_unlock(&recorder_lock);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_exit(NULL);
+}
+
+static int play(void *buf, int samples) {
+  record(buf, samples);
+  if ((live) && (live->play))
+    return live->play(buf, samples);
+  return 0;
+}
+
+static int get_buffer(int frames, void *segments[2], int segment_frames[2]) {
+  int response = live->get_buffer(frames, segments, segment_frames);
+  if (response == 0) {
+    live_segments[0] = segments[0];
+    live_segments[1] = segments[1];
+    live_segment_frames[0] = segment_frames[0];
+    live_segment_frames[1] = segment_frames[1];
+  }
+  return response;
+}
+
+static int commit_buffer(int frames) {
+  int first = frames < live_segment_frames[0] ? frames : live_segment_frames[0];
+  record(live_segments[0], first);
+  if (frames > first)
+    record(live_segments[1], frames - first);
+  return live->commit_buffer(frames);
+}
+
+static void flush(void) {
+  if ((live) && (live->flush))
+    live->flush();
+}
+
+static void start(int sample_rate, int sample_format) {
+  bytes_per_frame = sps_format_bytes_per_frame(sample_format);
+  queue_session_event(RECORDER_SESSION_START, sample_rate, sample_format);
+  recording = 1;
+  if ((live) && (live->start))
+    live->start(sample_rate, sample_format);
+}
+
+static void stop(void) {
+  if ((live) && (live->stop))
+    live->stop();
+  if (recording) {
+    queue_session_event(RECORDER_SESSION_END, 0, SPS_FORMAT_UNKNOWN);
+    pthread_mutex_lock(&recorder_lock);
+    if (total_frames_dropped)
+      debug(1, "recorder: %" PRIu64 " frames were dropped from the recording.",
+            total_frames_dropped);
+    total_frames_dropped = 0;
+    frames_dropped = 0;
+    pthread_mutex_unlock(&recorder_lock);
+  }
+  recording = 0;
+}
+
+extern audio_output audio_recorder;
+
+static int init(int argc, char **argv) {
+  debug(1, "recorder init");
+  const char *live_backend_name = NULL;
+  const char *str;
+  double dvalue;
+
+  if (config.cfg != NULL) {
+    /* Get the directory for the recordings. */
+    if ((config_lookup_string(config.cfg, "recorder.directory", &str)) && (strlen(str) != 0))
+      recorder_directory = (char *)str;
+
+    /* Get the file format. */
+    if (config_lookup_string(config.cfg, "recorder.file_format", &str)) {
+      if (strcasecmp(str, "wav") == 0)
+        use_flac = 0;
+      else if (strcasecmp(str, "flac") == 0)
+#ifdef CONFIG_FLAC
+        use_flac = 1;
+#else
+        warn("FLAC recording is not available -- Shairport Sync was built without support for "
+             "it. WAV will be used.");
+#endif
+      else
+        warn("Invalid recorder file_format choice \"%s\". It should be \"wav\" or \"flac\". It "
+             "remains set to \"wav\".",
+             str);
+    }
+
+    /* Get the length of the queue. */
+    if (config_lookup_float(config.cfg, "recorder.queue_length_in_seconds", &dvalue)) {
+      if ((dvalue < 1.0) || (dvalue > 120.0))
+        warn("Invalid recorder queue_length_in_seconds %f. It must be between 1.0 and 120.0. The "
+             "default of %f seconds will be used.",
+             dvalue, queue_length_in_seconds);
+      else
+        queue_length_in_seconds = dvalue;
+    }
+
+    /* Get the live backend. */
+    if ((config_lookup_string(config.cfg, "recorder.live_backend", &str)) && (strlen(str) != 0))
+      live_backend_name = str;
+  }
+
+  if (live_backend_name) {
+    if (strcasecmp(live_backend_name, audio_recorder.name) == 0)
+      die("The recorder can't be its own live backend.");
+    live = audio_get_output((char *)live_backend_name);
+    if (live == NULL)
+      die("Invalid recorder live_backend \"%s\".", live_backend_name);
+    // the live backend sets up the audio options and the output format, as if it were used alone
+    live->init(argc, argv);
+    // and the player uses what it has, apart from the frames, which pass through the recorder
+    audio_recorder.prepare = live->prepare;
+    audio_recorder.is_running = live->is_running;
+    audio_recorder.delay = live->delay;
+    audio_recorder.rate_info = live->rate_info;
+    audio_recorder.volume = live->volume;
+    audio_recorder.parameters = live->parameters;
+    audio_recorder.mute = live->mute;
+    audio_recorder.presentation_time = live->presentation_time;
+    if (live->get_buffer) {
+      audio_recorder.get_buffer = &get_buffer;
+      audio_recorder.commit_buffer = &commit_buffer;
+    }
+    debug(1, "recorder: playing through the \"%s\" backend too.", live->name);
+  } else {
+    // set up default values first
+    config.audio_backend_buffer_desired_length = 1.0;
+    config.audio_backend_latency_offset = 0;
+
+    // do the "general" audio  options. Note, these options are in the "general" stanza!
+    parse_general_audio_options();
+
+    /* Get the output format. */
+    if ((config.cfg != NULL) &&
+        (config_lookup_string(config.cfg, "recorder.output_format", &str))) {
+      sps_format_t format = sps_format_from_description_string(str);
+      if (format != SPS_FORMAT_INVALID) {
+        config.output_format = format;
+        config.output_format_auto_requested = 0;
+      } else {
+        warn("Invalid recorder output format \"%s\". It remains set to \"%s\".", str,
+             sps_format_description_string(config.output_format));
+      }
+    }
+  }
+
+  // blocks are allocated for the largest frame there could be, 8 bytes
+  recorder_block_size = (size_t)recorder_block_frames * 8;
+  int block_count = (int)(queue_length_in_seconds * config.output_rate) / recorder_block_frames + 2;
+  recorder_blocks = calloc(block_count, sizeof(recorder_block));
+  if ((recorder_blocks == NULL) ||
+      (posix_memalign((void **)&recorder_block_data, 4096, block_count * recorder_block_size) !=
+       0) ||
+      (posix_memalign((void **)&write_buffer, 4096, recorder_write_buffer_size) != 0) ||
+      (posix_memalign((void **)&conversion_buffer, 4096, recorder_write_buffer_size) != 0))
+    die("Can't allocate memory for the recorder.");
+  int i;
+  for (i = 0; i < block_count; i++) {
+    recorder_blocks[i].data = recorder_block_data + i * recorder_block_size;
+    block_release(&recorder_blocks[i]);
+  }
+
+  if (pthread_create(&recorder_writer_thread, NULL, &recorder_writer_thread_function, NULL) != 0)
+    die("Could not create the recorder writer thread.");
+  recorder_writer_running = 1;
+  return 0;
+}
+
+static void deinit(void) {
+  if (recorder_writer_running) {
+    pthread_cancel(recorder_writer_thread);
+    pthread_join(recorder_writer_thread, NULL);
+    recorder_writer_running = 0;
+  }
+  // write out whatever is left, just as the writer would have
+  while (queued_blocks) {
+    recorder_block *block = queued_blocks;
+    queued_blocks = block->next;
+    recorder_block_handle(block);
+    block_release(block);
+  }
+  queued_blocks_tail = NULL;
+  recording_finish();
+  if ((live) && (live->deinit))
+    live->deinit();
+  free(recorder_blocks);
+  free(recorder_block_data);
+  free(write_buffer);
+  free(conversion_buffer);
+  recorder_blocks = NULL;
+  recorder_block_data = write_buffer = conversion_buffer = NULL;
+  free_blocks = NULL;
+}
+
+audio_output audio_recorder = {.name = "recorder",
+                               .help = NULL,
+                               .init = &init,
+                               .deinit = &deinit,
+                               .prepare = NULL,
+                               .start = &start,
+                               .stop = &stop,
+                               .is_running = NULL,
+                               .flush = &flush,
+                               .delay = NULL,
+                               .play = &play,
+                               .volume = NULL,
+                               .parameters = NULL,
+                               .mute = NULL};
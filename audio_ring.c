@@ -0,0 +1,347 @@
+/*
+ * A lock-free ring of audio frames for callback-driven backends. This file is part of Shairport
+ * Sync.
+ * Copyright (c) 2026 The Shairport Sync contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "audio_ring.h"
+#include "common.h"
+
+int audio_ring_init(audio_ring *ring, uint32_t minimum_frames, uint32_t frame_size,
+                    uint32_t rate) {
+  memset(ring, 0, sizeof(audio_ring));
+  ring->frames = 1024;
+  while (ring->frames < minimum_frames)
+    ring->frames = ring->frames * 2;
+  ring->frame_size = frame_size;
+  ring->rate = rate;
+  ring->buffer = calloc(ring->frames, frame_size);
+  if (ring->buffer == NULL)
+    return -ENOMEM;
+  // keep it from being paged out, which would hold up a realtime consumer
+  if (mlock(ring->buffer, (size_t)ring->frames * frame_size) != 0)
+    debug(2, "Could not lock the audio ring of %u frames into memory.", ring->frames);
+  return 0;
+}
+
+void audio_ring_free(audio_ring *ring) {
+  if (ring->buffer) {
+    munlock(ring->buffer, (size_t)ring->frames * ring->frame_size);
+    free(ring->buffer);
+    ring->buffer = NULL;
+  }
+}
+
+uint32_t audio_ring_occupancy(audio_ring *ring) {
+  uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+  uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+  uint64_t flush_to = __atomic_load_n(&ring->flush_to, __ATOMIC_ACQUIRE);
+  if (flush_to > read)
+    read = flush_to; // those frames will never be played
+  return written - read;
+}
+
+static void timing_write_begin(audio_ring *ring) {
+  __atomic_store_n(&ring->timing_sequence, ring->timing_sequence + 1, __ATOMIC_RELAXED); // odd
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void timing_write_end(audio_ring *ring) {
+  __atomic_store_n(&ring->timing_sequence, ring->timing_sequence + 1, __ATOMIC_RELEASE); // even
+}
+
+// a consistent copy of the consumer's timing
+static void timing_read(audio_ring *ring, audio_ring_timing *timing) {
+  uint32_t sequence;
+  do {
+    do
+      sequence = __atomic_load_n(&ring->timing_sequence, __ATOMIC_ACQUIRE);
+    while (sequence & 1);
+    *timing = ring->timing;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&ring->timing_sequence, __ATOMIC_RELAXED) != sequence);
+}
+
+// the producer side
+
+uint32_t audio_ring_write_segments(audio_ring *ring, void *segments[2],
+                                   uint32_t segment_frames[2]) {
+  uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+  uint32_t room = ring->frames - (ring->written - read);
+  uint32_t offset = ring->written & (ring->frames - 1);
+  segments[0] = ring->buffer + (size_t)offset * ring->frame_size;
+  segment_frames[0] = ring->frames - offset;
+  if (segment_frames[0] > room)
+    segment_frames[0] = room;
+  segments[1] = ring->buffer;
+  segment_frames[1] = room - segment_frames[0];
+  return room;
+}
+
+void audio_ring_write_advance(audio_ring *ring, uint32_t frames) {
+  __atomic_store_n(&ring->written, ring->written + frames, __ATOMIC_RELEASE);
+}
+
+uint32_t audio_ring_write(audio_ring *ring, const void *buf, uint32_t frames) {
+  void *segments[2];
+  uint32_t segment_frames[2];
+  uint32_t room = audio_ring_write_segments(ring, segments, segment_frames);
+  if (frames > room)
+    frames = room;
+  uint32_t first = frames < segment_frames[0] ? frames : segment_frames[0];
+  memcpy(segments[0], buf, (size_t)first * ring->frame_size);
+  if (frames > first)
+    memcpy(segments[1], (const char *)buf + (size_t)first * ring->frame_size,
+           (size_t)(frames - first) * ring->frame_size);
+  audio_ring_write_advance(ring, frames);
+  return frames;
+}
+
+int audio_ring_get_buffer(audio_ring *ring, int frames, void *segments[2], int segment_frames[2]) {
+  uint32_t room[2];
+  if (audio_ring_write_segments(ring, segments, room) < (uint32_t)frames)
+    return -ENOSPC;
+  segment_frames[0] = (uint32_t)frames < room[0] ? (uint32_t)frames : room[0];
+  segment_frames[1] = frames - segment_frames[0];
+  return 0;
+}
+
+void audio_ring_flush(audio_ring *ring) {
+  __atomic_store_n(&ring->flush_to, ring->written, __ATOMIC_RELEASE);
+}
+
+int audio_ring_delay(audio_ring *ring, long *the_delay) {
+  audio_ring_timing timing;
+  timing_read(ring, &timing);
+  uint64_t flush_to = __atomic_load_n(&ring->flush_to, __ATOMIC_ACQUIRE);
+  int64_t occupancy = audio_ring_occupancy(ring);
+  int64_t delay = occupancy;
+  if (timing.time) {
+    // what was left in the ring and in the device at the timestamp, less what's been played since
+    uint64_t read = timing.read > flush_to ? timing.read : flush_to;
+    int64_t elapsed_frames =
+        ((get_absolute_time_in_fp() - timing.time) * (uint64_t)ring->rate) >> 32;
+    delay = timing.latency + (int64_t)(ring->written - read) - elapsed_frames;
+    if (delay < occupancy) // what's in the ring hasn't been played yet
+      delay = occupancy;
+  }
+  *the_delay = delay;
+  return 0;
+}
+
+int audio_ring_rate_info(audio_ring *ring, uint64_t *elapsed_time, uint64_t *frames_played) {
+  audio_ring_timing timing;
+  timing_read(ring, &timing);
+  if ((timing.time == 0) || (timing.time == timing.base_time))
+    return -1;
+  *elapsed_time = timing.time - timing.base_time;
+  *frames_played = ((int64_t)timing.read - timing.latency) - timing.base_played;
+  return 0;
+}
+
+// the consumer side
+
+static uint32_t read_segments(audio_ring *ring, const char *segments[2],
+                              uint32_t segment_frames[2]) {
+  uint64_t flush_to = __atomic_load_n(&ring->flush_to, __ATOMIC_ACQUIRE);
+  if (flush_to > ring->read) {
+    __atomic_store_n(&ring->read, flush_to, __ATOMIC_RELEASE);
+    ring->flushed = 1;
+  }
+  uint32_t available = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE) - ring->read;
+  uint32_t offset = ring->read & (ring->frames - 1);
+  segments[0] = ring->buffer + (size_t)offset * ring->frame_size;
+  segment_frames[0] = ring->frames - offset;
+  if (segment_frames[0] > available)
+    segment_frames[0] = available;
+  segments[1] = ring->buffer;
+  segment_frames[1] = available - segment_frames[0];
+  return available;
+}
+
+static void read_advance(audio_ring *ring, uint32_t frames) {
+  __atomic_store_n(&ring->read, ring->read + frames, __ATOMIC_RELEASE);
+}
+
+uint32_t audio_ring_read(audio_ring *ring, void *buf, uint32_t frames) {
+  const char *segments[2];
+  uint32_t segment_frames[2];
+  uint32_t available = read_segments(ring, segments, segment_frames);
+  if (frames > available)
+    frames = available;
+  uint32_t first = frames < segment_frames[0] ? frames : segment_frames[0];
+  memcpy(buf, segments[0], (size_t)first * ring->frame_size);
+  if (frames > first)
+    memcpy((char *)buf + (size_t)first * ring->frame_size, segments[1],
+           (size_t)(frames - first) * ring->frame_size);
+  read_advance(ring, frames);
+  return frames;
+}
+
+// the common cases -- contiguous destinations of 16- or 32-bit samples -- are simple loops the
+// compiler can vectorise
+static void deinterleave(const char *source, char *destinations[], const int steps[], int channels,
+                         int sample_size, uint32_t frames) {
+  int c;
+  uint32_t f;
+  for (c = 0; c < channels; c++) {
+    if ((sample_size == 4) && (steps[c] == 4)) {
+      const uint32_t *s = (const uint32_t *)source + c;
+      uint32_t *d = (uint32_t *)destinations[c];
+      for (f = 0; f < frames; f++)
+        d[f] = s[f * channels];
+    } else if ((sample_size == 2) && (steps[c] == 2)) {
+      const uint16_t *s = (const uint16_t *)source + c;
+      uint16_t *d = (uint16_t *)destinations[c];
+      for (f = 0; f < frames; f++)
+        d[f] = s[f * channels];
+    } else {
+      const char *s = source + c * sample_size;
+      char *d = destinations[c];
+      for (f = 0; f < frames; f++)
+        memcpy(d + f * steps[c], s + f * channels * sample_size, sample_size);
+    }
+    destinations[c] += (size_t)frames * steps[c];
+  }
+}
+
+uint32_t audio_ring_read_deinterleaved(audio_ring *ring, char *destinations[], const int steps[],
+                                       int channels, int sample_size, uint32_t frames) {
+  const char *segments[2];
+  uint32_t segment_frames[2];
+  uint32_t available = read_segments(ring, segments, segment_frames);
+  uint32_t taken = frames < available ? frames : available;
+  uint32_t first = taken < segment_frames[0] ? taken : segment_frames[0];
+  deinterleave(segments[0], destinations, steps, channels, sample_size, first);
+  if (taken > first)
+    deinterleave(segments[1], destinations, steps, channels, sample_size, taken - first);
+  read_advance(ring, taken);
+  // the ring has run dry, so fill the rest with silence
+  if (frames > taken) {
+    int c;
+    uint32_t f;
+    for (c = 0; c < channels; c++) {
+      if (steps[c] == sample_size) {
+        memset(destinations[c], 0, (size_t)(frames - taken) * sample_size);
+      } else {
+        for (f = 0; f < frames - taken; f++)
+          memset(destinations[c] + f * steps[c], 0, sample_size);
+      }
+      destinations[c] += (size_t)(frames - taken) * steps[c];
+    }
+  }
+  return taken;
+}
+
+void audio_ring_timestamp(audio_ring *ring, int64_t device_latency) {
+  uint64_t time_now = get_absolute_time_in_fp();
+  timing_write_begin(ring);
+  if ((ring->timing.time == 0) || (ring->flushed)) {
+    // measure the rate of the device from here
+    ring->timing.base_time = time_now;
+    ring->timing.base_played = (int64_t)ring->read - device_latency;
+    ring->flushed = 0;
+  }
+  ring->timing.time = time_now;
+  ring->timing.read = ring->read;
+  ring->timing.latency = device_latency;
+  timing_write_end(ring);
+}
+
+void audio_ring_reset(audio_ring *ring) {
+  __atomic_store_n(&ring->read, ring->written, __ATOMIC_RELEASE);
+  timing_write_begin(ring);
+  ring->timing.time = 0;
+  ring->flushed = 0;
+  timing_write_end(ring);
+}
+
+// Functions for an audio_output that leaves some of its work to its ring. Only one output is ever
+// in use, so its ring is kept here.
+
+static audio_ring *output_ring = NULL;
+
+// the ring may run at a different rate from the player, e.g. if the backend resamples
+static long to_output_frames(long frames) {
+  if ((output_ring->rate == 0) || (output_ring->rate == (uint32_t)config.output_rate))
+    return frames;
+  return (long)(((int64_t)frames * config.output_rate) / output_ring->rate);
+}
+
+static int ring_play(void *buf, int samples) {
+  uint32_t written = audio_ring_write(output_ring, buf, samples);
+  if (written < (uint32_t)samples)
+    debug(1, "Audio ring overrun. Dropped %u frames.", samples - written);
+  return 0;
+}
+
+static void ring_flush(void) { audio_ring_flush(output_ring); }
+
+static int ring_delay(long *the_delay) {
+  long delay;
+  int response = audio_ring_delay(output_ring, &delay);
+  *the_delay = to_output_frames(delay);
+  return response;
+}
+
+static int ring_rate_info(uint64_t *elapsed_time, uint64_t *frames_played) {
+  int response = audio_ring_rate_info(output_ring, elapsed_time, frames_played);
+  if (response == 0)
+    *frames_played = to_output_frames(*frames_played);
+  return response;
+}
+
+static int ring_get_buffer(int frames, void *segments[2], int segment_frames[2]) {
+  return audio_ring_get_buffer(output_ring, frames, segments, segment_frames);
+}
+
+static int ring_commit_buffer(int frames) {
+  audio_ring_write_advance(output_ring, frames);
+  return 0;
+}
+
+void audio_ring_complete_output(audio_output *output) {
+  if (output->ring == NULL)
+    return;
+  output_ring = output->ring;
+  if (output->play == NULL) {
+    // the ring holds frames just as the player makes them, so the player can write straight in
+    output->play = &ring_play;
+    if (output->get_buffer == NULL) {
+      output->get_buffer = &ring_get_buffer;
+      output->commit_buffer = &ring_commit_buffer;
+    }
+  }
+  if (output->flush == NULL)
+    output->flush = &ring_flush;
+  if (output->delay == NULL)
+    output->delay = &ring_delay;
+  if (output->rate_info == NULL)
+    output->rate_info = &ring_rate_info;
+}
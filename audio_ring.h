@@ -0,0 +1,79 @@
+#ifndef _AUDIO_RING_H
+#define _AUDIO_RING_H
+
+#include <stdint.h>
+
+#include "audio.h"
+
+// A ring of audio frames for a backend whose device takes frames in a callback of its own.
+// There is one producer, the player thread, and one consumer, the device's callback. Neither ever
+// waits for the other, so the callback can be realtime.
+
+// Every time the consumer has taken frames, it calls audio_ring_timestamp() with the number of
+// frames the device still has to play. From that, the producer can work out the delay and the true
+// rate of the device without asking it.
+
+// Frames are held in the ring just as they'll go to the device, interleaved. Silence is all zeroes.
+
+typedef struct {
+  uint64_t time; // from get_absolute_time_in_fp(), zero if there is no timestamp
+  uint64_t read;
+  int64_t latency;
+  uint64_t base_time; // the first timestamp since the ring was started or flushed
+  int64_t base_played;
+} audio_ring_timing;
+
+typedef struct audio_ring {
+  char *buffer;
+  uint32_t frames;     // a power of two
+  uint32_t frame_size; // in bytes
+  uint32_t rate;       // the frame rate of the device
+  uint64_t written;    // the number of frames written -- changed only by the producer
+  uint64_t read;       // the number of frames read -- changed only by the consumer
+  uint64_t flush_to;   // set by the producer; the consumer skips frames up to here
+  uint32_t timing_sequence; // odd while the consumer is updating the timing
+  audio_ring_timing timing;
+  int flushed; // consumer only -- set when a flush has been done since the last timestamp
+} audio_ring;
+
+// the ring is rounded up to a power of two frames
+int audio_ring_init(audio_ring *ring, uint32_t minimum_frames, uint32_t frame_size, uint32_t rate);
+void audio_ring_free(audio_ring *ring);
+
+// for either side
+uint32_t audio_ring_occupancy(audio_ring *ring);
+
+// for the producer
+// audio_ring_write() returns the number of frames there was room for
+uint32_t audio_ring_write(audio_ring *ring, const void *buf, uint32_t frames);
+// or find the room, in one segment or, where the ring wraps around, in two, write into it and
+// then advance past what was written
+uint32_t audio_ring_write_segments(audio_ring *ring, void *segments[2], uint32_t segment_frames[2]);
+void audio_ring_write_advance(audio_ring *ring, uint32_t frames);
+// the same, for an audio_output's get_buffer() -- it fails unless there's room for all the frames
+int audio_ring_get_buffer(audio_ring *ring, int frames, void *segments[2], int segment_frames[2]);
+// the consumer drops everything written so far the next time it reads
+void audio_ring_flush(audio_ring *ring);
+// the delay, in frames of the ring, before the next frame written would be heard
+int audio_ring_delay(audio_ring *ring, long *the_delay);
+int audio_ring_rate_info(audio_ring *ring, uint64_t *elapsed_time, uint64_t *frames_played);
+
+// for the consumer
+// both return the number of frames taken from the ring
+uint32_t audio_ring_read(audio_ring *ring, void *buf, uint32_t frames);
+// the channels are spread out to the destinations, each of whose samples are steps[] bytes apart,
+// and the destinations are advanced past the frames -- frames the ring doesn't have are silent
+uint32_t audio_ring_read_deinterleaved(audio_ring *ring, char *destinations[], const int steps[],
+                                       int channels, int sample_size, uint32_t frames);
+// call this after reading, with the number of frames the device has still to play, including
+// those just read
+void audio_ring_timestamp(audio_ring *ring, int64_t device_latency);
+
+// only when the consumer is known not to be running, e.g. when the device is stopped
+void audio_ring_reset(audio_ring *ring);
+
+// if the output has a ring, fill in what it leaves NULL of play(), flush(), delay(), rate_info(),
+// get_buffer() and commit_buffer() with functions using the ring
+void audio_ring_complete_output(audio_output *output);
+
+#endif // _AUDIO_RING_H
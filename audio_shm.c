@@ -0,0 +1,301 @@
+/*
+ * Audio output to shared memory. This file is part of Shairport Sync.
+ * Copyright (c) 2026 The Shairport Sync contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "audio.h"
+#include "audio_shm.h"
+#include "common.h"
+
+static audio_shm_header *shm_header = NULL;
+static size_t shm_size;
+static char *shm_name = "/dev/shm/shairport-sync-audio";
+static double ring_length_in_seconds = 2.0;
+static audio_shm_block *blocks;
+static char *ring;
+static uint32_t bytes_per_frame = 4;
+
+// the time at which the first frame of the next play() or commit_buffer() should be heard
+static uint64_t pending_presentation_time = 0;
+
+// while no consumer reports its progress, frames are taken to be played at the nominal rate
+static uint64_t model_time = 0;
+static uint64_t model_frames = 0;
+
+static void section_write_begin(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED); // odd
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void section_write_end(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE); // even
+}
+
+static void model_reset(void) {
+  model_time = get_absolute_time_in_fp();
+  model_frames = shm_header->frames_written;
+}
+
+// announce that frames are about to be put into the ring, overwriting what's there, before any
+// of them is -- see audio_shm.h. It never goes back, even if the frames don't arrive.
+static void frames_reserve(uint64_t frames) {
+  uint64_t end = shm_header->frames_written + frames;
+  if (end > shm_header->frames_writing)
+    __atomic_store_n(&shm_header->frames_writing, end, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// the frames are in the ring -- describe them in a block and then make them available
+static void frames_add(uint32_t frames) {
+  uint64_t number = shm_header->blocks_written;
+  audio_shm_block *block = &blocks[number % audio_shm_block_count];
+  section_write_begin(&block->sequence);
+  block->frames = frames;
+  block->number = number;
+  block->first_frame = shm_header->frames_written;
+  block->presentation_time = pending_presentation_time;
+  section_write_end(&block->sequence);
+  pending_presentation_time = 0;
+  __atomic_store_n(&shm_header->blocks_written, number + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&shm_header->frames_written, shm_header->frames_written + frames,
+                   __ATOMIC_RELEASE);
+}
+
+static void presentation_time(uint64_t time) { pending_presentation_time = time; }
+
+static int play(void *buf, int samples) {
+  if ((samples <= 0) || ((uint64_t)samples > shm_header->frames))
+    return 0;
+  uint64_t position = shm_header->frames_written % shm_header->frames;
+  uint64_t first = shm_header->frames - position;
+  if (first > (uint64_t)samples)
+    first = samples;
+  frames_reserve(samples);
+  memcpy(ring + position * bytes_per_frame, buf, first * bytes_per_frame);
+  if (first < (uint64_t)samples)
+    memcpy(ring, (char *)buf + first * bytes_per_frame, (samples - first) * bytes_per_frame);
+  frames_add(samples);
+  return 0;
+}
+
+// the player can put its frames straight into the ring
+static int get_buffer(int frames, void *segments[2], int segment_frames[2]) {
+  if ((frames <= 0) || ((uint64_t)frames > shm_header->frames))
+    return -1;
+  uint64_t position = shm_header->frames_written % shm_header->frames;
+  uint64_t first = shm_header->frames - position;
+  if (first > (uint64_t)frames)
+    first = frames;
+  frames_reserve(frames); // the player writes into the ring from here on
+  segments[0] = ring + position * bytes_per_frame;
+  segment_frames[0] = first;
+  segments[1] = ring;
+  segment_frames[1] = frames - first;
+  return 0;
+}
+
+static int commit_buffer(int frames) {
+  if (frames > 0)
+    frames_add(frames);
+  else
+    pending_presentation_time = 0;
+  return 0;
+}
+
+static int delay(long *the_delay) {
+  uint64_t time_now = get_absolute_time_in_fp();
+  uint64_t written = shm_header->frames_written;
+  audio_shm_consumer consumer;
+  uint32_t sequence;
+  int tries = 0;
+  do {
+    sequence = __atomic_load_n(&shm_header->consumer.sequence, __ATOMIC_ACQUIRE);
+    memcpy(&consumer, &shm_header->consumer, sizeof(consumer));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((((sequence & 1) != 0) ||
+            (sequence != __atomic_load_n(&shm_header->consumer.sequence, __ATOMIC_RELAXED))) &&
+           (++tries < 100));
+
+  if ((tries < 100) && (consumer.update_time != 0) && (consumer.update_time <= time_now) &&
+      (time_now - consumer.update_time < ((uint64_t)1 << 32))) {
+    // a consumer has reported its progress in the last second
+    uint64_t frames_read = consumer.frames_read;
+    if (frames_read < shm_header->flush_frame)
+      frames_read = shm_header->flush_frame;
+    if (frames_read > written)
+      frames_read = written;
+    int64_t latency =
+        consumer.latency - (int64_t)(((time_now - consumer.update_time) * shm_header->rate) >> 32);
+    if (latency < 0)
+      latency = 0;
+    *the_delay = (long)(written - frames_read + latency);
+    model_time = time_now; // if the consumer goes away, carry on from here
+    model_frames = written - *the_delay;
+  } else {
+    uint64_t elapsed = time_now - model_time;
+    uint64_t frames_played = written;
+    if (elapsed < ((uint64_t)60 << 32))
+      frames_played = model_frames + ((elapsed * shm_header->rate) >> 32);
+    if (frames_played > written) { // nothing left to play
+      model_time = time_now;
+      model_frames = written;
+      frames_played = written;
+    }
+    *the_delay = (long)(written - frames_played);
+  }
+  return 0;
+}
+
+static void flush(void) {
+  __atomic_store_n(&shm_header->flush_frame, shm_header->frames_written, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&shm_header->flush_count, 1, __ATOMIC_RELEASE);
+  pending_presentation_time = 0;
+  model_reset();
+}
+
+static void start(__attribute__((unused)) int sample_rate,
+                  __attribute__((unused)) int sample_format) {
+  __atomic_add_fetch(&shm_header->play_session_count, 1, __ATOMIC_RELEASE);
+  model_reset();
+}
+
+static void stop(void) { pending_presentation_time = 0; }
+
+static int init(__attribute__((unused)) int argc, __attribute__((unused)) char **argv) {
+  debug(1, "shm init");
+  // set up default values first
+  config.audio_backend_buffer_desired_length = 0.5;
+  config.audio_backend_latency_offset = 0;
+
+  // get settings from settings file
+  // do the "general" audio  options. Note, these options are in the "general" stanza!
+  parse_general_audio_options();
+
+  if (config.cfg != NULL) {
+    const char *str;
+    double dvalue;
+    /* Get the name of the file. */
+    if (config_lookup_string(config.cfg, "shm.name", &str))
+      shm_name = (char *)str;
+
+    /* Get the output format. */
+    if (config_lookup_string(config.cfg, "shm.output_format", &str)) {
+      sps_format_t format = sps_format_from_description_string(str);
+      if (format != SPS_FORMAT_INVALID) {
+        config.output_format = format;
+        config.output_format_auto_requested = 0;
+      } else {
+        warn("Invalid shm output format \"%s\". It remains set to \"%s\".", str,
+             sps_format_description_string(config.output_format));
+      }
+    }
+
+    /* Get the length of the ring. */
+    if (config_lookup_float(config.cfg, "shm.ring_length_in_seconds", &dvalue)) {
+      if ((dvalue < 0.5) || (dvalue > 30.0))
+        warn("Invalid shm ring_length_in_seconds %f. It must be between 0.5 and 30.0. The default "
+             "of %f seconds will be used.",
+             dvalue, ring_length_in_seconds);
+      else
+        ring_length_in_seconds = dvalue;
+    }
+  }
+  bytes_per_frame = sps_format_bytes_per_frame(config.output_format);
+
+  uint64_t frames = 1;
+  while (frames < (uint64_t)(ring_length_in_seconds * config.output_rate))
+    frames <<= 1;
+  size_t header_size = (sizeof(audio_shm_header) + 4095) & ~((size_t)4095);
+  size_t blocks_size =
+      (sizeof(audio_shm_block) * audio_shm_block_count + 4095) & ~((size_t)4095);
+  shm_size = header_size + blocks_size + frames * bytes_per_frame;
+
+  int fd = open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    die("Could not open the shm backend's file \"%s\": error %d.", shm_name, errno);
+  if (ftruncate(fd, shm_size) != 0)
+    die("Could not set the size of the shm backend's file \"%s\": error %d.", shm_name, errno);
+  void *p = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    die("Could not map the shm backend's file \"%s\": error %d.", shm_name, errno);
+
+  shm_header = (audio_shm_header *)p; // the file is all zeroes to begin with
+  shm_header->version = AUDIO_SHM_VERSION;
+  shm_header->size = shm_size;
+  snprintf(shm_header->format, sizeof(shm_header->format), "%s",
+           sps_format_description_string(config.output_format));
+  shm_header->rate = config.output_rate;
+  shm_header->channels = 2;
+  shm_header->bytes_per_frame = bytes_per_frame;
+  shm_header->block_count = audio_shm_block_count;
+  shm_header->frames = frames;
+  shm_header->blocks_offset = header_size;
+  shm_header->audio_offset = header_size + blocks_size;
+  blocks = (audio_shm_block *)((char *)p + shm_header->blocks_offset);
+  ring = (char *)p + shm_header->audio_offset;
+  __atomic_store_n(&shm_header->magic, AUDIO_SHM_MAGIC, __ATOMIC_RELEASE);
+  model_reset();
+  debug(1, "shm: file \"%s\" of %zu bytes set up with a ring of %" PRIu64 " frames.", shm_name,
+        shm_size, frames);
+  return 0;
+}
+
+static void deinit(void) {
+  if (shm_header) {
+    __atomic_store_n(&shm_header->magic, 0, __ATOMIC_RELEASE);
+    munmap(shm_header, shm_size);
+    shm_header = NULL;
+    unlink(shm_name);
+  }
+}
+
+audio_output audio_shm = {.name = "shm",
+                          .help = NULL,
+                          .init = &init,
+                          .deinit = &deinit,
+                          .prepare = NULL,
+                          .start = &start,
+                          .stop = &stop,
+                          .is_running = NULL,
+                          .flush = &flush,
+                          .delay = &delay,
+                          .play = &play,
+                          .volume = NULL,
+                          .parameters = NULL,
+                          .mute = NULL,
+                          .get_buffer = &get_buffer,
+                          .commit_buffer = &commit_buffer,
+                          .presentation_time = &presentation_time};
@@ -0,0 +1,81 @@
+#ifndef _AUDIO_SHM_H
+#define _AUDIO_SHM_H
+
+#include <stdint.h>
+
+// Audio in a memory-mapped file, for local consumers -- the "shm" backend.
+
+// The file starts with an audio_shm_header. It's followed by a ring of audio_shm_block records and
+// then by the audio itself, a ring of frames, interleaved, in the format named in the header. All
+// values are in host byte order.
+
+// Frames are numbered from zero; frame n is at byte (n % frames) * bytes_per_frame of the audio
+// ring. Before the writer puts frames into the ring, it advances frames_writing past them, and
+// only after they're in the ring does it advance frames_written, so frames before frames_written
+// are ready to be read. The writer never waits, so a consumer that falls more than a ring's worth
+// of frames behind loses them, and its copy may be torn. To read frames from first_frame on, copy
+// them out, then -- after an acquire fence -- read frames_writing: if it's more than frames past
+// first_frame, some of the copied frames were being overwritten, so discard the copy. Frames
+// before flush_frame have been flushed and should not be played.
+
+// Every play() or commit_buffer() by the player makes a block, numbered from zero; block n is in
+// slot n % block_count and its number field is n once it's been written. Blocks have a sequence
+// number, which is odd while the block is being updated -- note it, wait if it's odd, copy the
+// block and check that the sequence number hasn't changed. A block gives the local time at which
+// its first frame should be heard, in the units of CLOCK_MONOTONIC as a 32.32 fixed point number
+// of seconds, or zero if it has no time of its own, like the silence sent before a play session
+// gets going. The frames of a block are played one after the other at the rate in the header.
+
+// The writer makes no system calls to update the file, so consumers should poll frames_written.
+
+// One consumer can report its progress in the consumer section, which it updates like a block:
+// make the sequence number odd, update it, then make it even. frames_read is the number of the
+// next frame it will take from the ring and latency is the number of frames it has taken but not
+// yet played. update_time is when it last made a report, in the same units as presentation times.
+// The delay the backend reports to the player then comes from that consumer, so the player keeps
+// in sync with it. If there's no report for a second, the backend assumes frames are being played
+// at the nominal rate.
+
+#define AUDIO_SHM_MAGIC 'sspc'
+#define AUDIO_SHM_VERSION 1
+
+#define audio_shm_block_count 1024
+
+typedef struct {
+  uint32_t sequence;
+  uint32_t frames;
+  uint64_t number;
+  uint64_t first_frame;       // the number of the block's first frame
+  uint64_t presentation_time; // zero if it has no time of its own
+} audio_shm_block; // 32 bytes
+
+typedef struct {
+  uint32_t sequence;
+  uint32_t reserved;
+  uint64_t frames_read;
+  int64_t latency;
+  uint64_t update_time;
+} audio_shm_consumer;
+
+typedef struct {
+  uint32_t magic; // written last when the file is set up, so check it first
+  uint32_t version;
+  uint64_t size; // the size of the file
+  char format[16]; // e.g. "S16_LE" or "F32" -- see the alsa output_format setting
+  uint32_t rate;
+  uint32_t channels;
+  uint32_t bytes_per_frame;
+  uint32_t block_count;
+  uint64_t frames; // the number of frames in the audio ring, a power of two
+  uint64_t blocks_offset; // where the ring of blocks starts
+  uint64_t audio_offset;  // where the ring of frames starts
+  uint64_t frames_written; // the number of the next frame to be written
+  uint64_t frames_writing; // frames before this may be being written -- never less than the above
+  uint64_t blocks_written; // the number of the next block to be written
+  uint64_t flush_frame;
+  uint32_t flush_count; // incremented on every flush
+  uint32_t play_session_count; // incremented when a play session starts
+  audio_shm_consumer consumer;
+} audio_shm_header;
+
+#endif // _AUDIO_SHM_H
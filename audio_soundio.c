@@ -1,4 +1,5 @@
 #include "audio.h"
+#include "audio_ring.h"
 #include "common.h"
 #include <memory.h>
 #include <stdio.h>
@@ -10,59 +11,45 @@
 struct SoundIoOutStream *outstream;
 struct SoundIo *soundio;
 struct SoundIoDevice *device;
-struct SoundIoRingBuffer *ring_buffer = NULL;
+static audio_ring ring;
 
 static int min_int(int a, int b) { return (a < b) ? a : b; }
 
 static void write_callback(struct SoundIoOutStream *outstream, int frame_count_min,
                            int frame_count_max) {
   struct SoundIoChannelArea *areas;
-  // int frame_count;
+  char *destinations[SOUNDIO_MAX_CHANNELS];
+  int steps[SOUNDIO_MAX_CHANNELS];
   int err;
 
-  char *read_ptr = soundio_ring_buffer_read_ptr(ring_buffer);
-  int fill_bytes = soundio_ring_buffer_fill_count(ring_buffer);
-  int fill_count = fill_bytes / outstream->bytes_per_frame;
+  int fill_count = audio_ring_occupancy(&ring);
 
-  debug(3, "[--->>] frame_count_min: %d , frame_count_max: %d , fill_bytes: %d , fill_count: %d , "
+  debug(3, "[--->>] frame_count_min: %d , frame_count_max: %d , fill_count: %d , "
            "outstream->bytes_per_frame: %d",
-        frame_count_min, frame_count_max, fill_bytes, fill_count, outstream->bytes_per_frame);
+        frame_count_min, frame_count_max, fill_count, outstream->bytes_per_frame);
 
-  if (frame_count_min > fill_count) {
-    int frame_count = frame_count_min;
-    if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count))) {
-      debug(0, "[--->>] begin write error: %s", soundio_strerror(err));
-    }
-    for (int frame = 0; frame < frame_count; frame += 1) {
-      for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-        memset(areas[ch].ptr, 0, outstream->bytes_per_sample);
-        areas[ch].ptr += areas[ch].step;
-      }
-    }
-    if ((err = soundio_outstream_end_write(outstream)))
-      debug(0, "[--->>] end write error: %s", soundio_strerror(err));
-    return;
-  }
-
-  int read_count = min_int(frame_count_max, fill_count);
-  int frames_left = read_count;
+  // take all we have, but at least the minimum -- what the ring doesn't have is made silent
+  int frames_left = min_int(frame_count_max, fill_count);
+  if (frames_left < frame_count_min)
+    frames_left = frame_count_min;
 
   while (frames_left > 0) {
     int frame_count = frames_left;
 
-    if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count)))
+    if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count))) {
       debug(0, "[--->>] begin write error: %s", soundio_strerror(err));
+      break;
+    }
 
     if (frame_count <= 0)
       break;
 
-    for (int frame = 0; frame < frame_count; frame += 1) {
-      for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-        memcpy(areas[ch].ptr, read_ptr, outstream->bytes_per_sample);
-        areas[ch].ptr += areas[ch].step;
-        read_ptr += outstream->bytes_per_sample;
-      }
+    for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
+      destinations[ch] = areas[ch].ptr;
+      steps[ch] = areas[ch].step;
     }
+    audio_ring_read_deinterleaved(&ring, destinations, steps, outstream->layout.channel_count,
+                                  outstream->bytes_per_sample, frame_count);
 
     if ((err = soundio_outstream_end_write(outstream)))
       debug(0, "[--->>] end write error: %s", soundio_strerror(err));
@@ -70,8 +57,9 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
     frames_left -= frame_count;
   }
 
-  debug(3, "[--->>]  Wrote: %d", read_count * outstream->bytes_per_frame);
-  soundio_ring_buffer_advance_read_ptr(ring_buffer, read_count * outstream->bytes_per_frame);
+  double latency;
+  if (soundio_outstream_get_latency(outstream, &latency) == 0)
+    audio_ring_timestamp(&ring, latency * outstream->sample_rate);
 }
 
 static void underflow_callback(__attribute__((unused)) struct SoundIoOutStream *outstream) {
@@ -119,7 +107,7 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
 }
 
 static void deinit(void) {
-  soundio_ring_buffer_destroy(ring_buffer);
+  audio_ring_free(&ring);
   soundio_device_unref(device);
   soundio_destroy(soundio);
   debug(0, "soundio audio deinit\n");
@@ -146,13 +134,10 @@ static void start(int sample_rate, int sample_format) {
   if (outstream->layout_error)
     debug(0, "unable to set channel layout: %s\n", soundio_strerror(outstream->layout_error));
 
-  int capacity = outstream->sample_rate * outstream->bytes_per_frame;
-  ring_buffer = soundio_ring_buffer_create(soundio, capacity);
-  if (!ring_buffer)
+  // a second's worth
+  if (audio_ring_init(&ring, outstream->sample_rate, outstream->bytes_per_frame,
+                      outstream->sample_rate) != 0)
     debug(0, "unable to create ring buffer: out of memory");
-  char *buf = soundio_ring_buffer_write_ptr(ring_buffer);
-  memset(buf, 0, capacity);
-  soundio_ring_buffer_advance_write_ptr(ring_buffer, capacity);
 
   if ((err = soundio_outstream_start(outstream))) {
     debug(0, "unable to start outstream: %s", soundio_strerror(err));
@@ -161,28 +146,6 @@ static void start(int sample_rate, int sample_format) {
   debug(1, "libsoundio output started\n");
 }
 
-static int play(void *buf, int samples) {
-  // int err;
-  int free_bytes = soundio_ring_buffer_free_count(ring_buffer);
-  int written_bytes = 0;
-  int write_bytes = 0;
-  int left_bytes = samples * outstream->bytes_per_frame;
-  char *write_ptr = soundio_ring_buffer_write_ptr(ring_buffer);
-
-  debug(3, "[<<---] samples: %d , size: %d", samples, left_bytes);
-  write_bytes = min_int(left_bytes, free_bytes);
-  debug(3, "[<<---] left_bytes: %d, write_bytes: %d, free_bytes: %d\n", left_bytes, write_bytes,
-        free_bytes);
-
-  if (write_bytes) {
-    memcpy(write_ptr, buf, write_bytes);
-    written_bytes += write_bytes;
-    soundio_ring_buffer_advance_write_ptr(ring_buffer, write_bytes);
-    debug(3, "[<<---] Written to buffer : %d\n", written_bytes);
-  }
-  return 0;
-}
-
 static void parameters(audio_parameters *info) {
   info->minimum_volume_dB = -30.0;
   info->maximum_volume_dB = 0.0;
@@ -194,15 +157,10 @@ static void parameters(audio_parameters *info) {
 
 static void stop(void) {
   soundio_outstream_destroy(outstream);
-  soundio_ring_buffer_clear(ring_buffer);
+  audio_ring_free(&ring);
   debug(1, "libsoundio output stopped\n");
 }
 
-static void flush(void) {
-  soundio_ring_buffer_clear(ring_buffer);
-  debug(1, "libsoundio output flushed\n");
-}
-
 static void help(void) { printf(" There are no options for libsoundio.\n"); }
 
 audio_output audio_soundio = {.name = "soundio",
@@ -213,9 +171,10 @@ audio_output audio_soundio = {.name = "soundio",
                               .start = &start,
                               .stop = &stop,
                               .is_running = NULL,
-                              .flush = &flush,
+                              .flush = NULL,
                               .delay = NULL,
-                              .play = &play,
+                              .play = NULL,
                               .volume = NULL,
                               .parameters = &parameters,
-                              .mute = NULL};
+                              .mute = NULL,
+                              .ring = &ring};
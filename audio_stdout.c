@@ -37,6 +37,7 @@
 #include <unistd.h>
 
 static int fd = -1;
+static int bytes_per_frame = 4;
 
 static void start(__attribute__((unused)) int sample_rate,
                   __attribute__((unused)) int sample_format) {
@@ -46,7 +47,7 @@ static void start(__attribute__((unused)) int sample_rate,
 static int play(void *buf, int samples) {
   char errorstring[1024];
   int warned = 0;
-  int rc = write(fd, buf, samples * 4);
+  int rc = write(fd, buf, samples * bytes_per_frame);
   if ((rc < 0) && (warned == 0)) {
     strerror_r(errno, (char *)errorstring, 1024);
     warn("Error %d writing to stdout: \"%s\".", errno, errorstring);
@@ -67,6 +68,22 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
   // get settings from settings file
   // do the "general" audio  options. Note, these options are in the "general" stanza!
   parse_general_audio_options();
+
+  if (config.cfg != NULL) {
+    /* Get the output format. */
+    const char *str;
+    if (config_lookup_string(config.cfg, "stdout.output_format", &str)) {
+      sps_format_t format = sps_format_from_description_string(str);
+      if (format != SPS_FORMAT_INVALID) {
+        config.output_format = format;
+        config.output_format_auto_requested = 0;
+      } else {
+        warn("Invalid stdout output format \"%s\". It remains set to \"%s\".", str,
+             sps_format_description_string(config.output_format));
+      }
+    }
+  }
+  bytes_per_frame = sps_format_bytes_per_frame(config.output_format);
   return 0;
 }
 
@@ -0,0 +1,646 @@
+/*
+ * Audio output to network clients. This file is part of Shairport Sync.
+ * Copyright (c) 2026 The Shairport Sync contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef CONFIG_FLAC
+#include <FLAC/stream_encoder.h>
+#endif
+
+#include "audio.h"
+#include "audio_stream.h"
+#include "common.h"
+
+// The player's output goes to every client of the backend, each of which has a queue of its own
+// so that one that's slow doesn't hold up the player or the others. When a client's queue is
+// full, new messages are dropped for that client until there's room again. Messages are written
+// to the clients by a thread of the backend's own.
+
+// Frames go out as soon as the player has them, which is audio_backend_buffer_desired_length
+// seconds before they should be heard, each with its presentation time -- it's up to the clients
+// to play them at the right time.
+
+typedef struct {
+  int fd;
+  char *queue;
+  size_t queue_start;
+  size_t queue_occupancy;
+  uint64_t messages_dropped;
+  int dropping;
+} stream_client;
+
+#define stream_maximum_clients 64
+
+static int port = 0;
+static char *socket_name = NULL;
+static int maximum_clients = 8;
+static double queue_length_in_seconds = 2.0;
+static int use_flac = 0;
+
+static int tcp_fd = -1;
+static int unix_fd = -1;
+static int wakeup_fds[2] = {-1, -1};
+static int bytes_per_frame = 4;
+static size_t queue_size;
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t stream_server_thread;
+static int stream_server_running = 0;
+
+// these are guarded by stream_lock
+static stream_client *clients = NULL;
+static int client_count = 0;
+static char *flac_header = NULL; // the FLAC stream header, for new clients
+static size_t flac_header_length = 0;
+
+// the player's own
+static uint64_t frame_count = 0; // the number of the next frame
+static uint64_t pending_presentation_time = 0;
+
+#ifdef CONFIG_FLAC
+static FLAC__StreamEncoder *encoder = NULL;
+static FLAC__int32 *flac_samples = NULL;
+static size_t flac_samples_size = 0; // in frames
+static uint64_t flac_frame_count = 0; // the number of the next frame out of the encoder
+static int flac_discarding = 0;       // set while the encoder is restarted at a flush
+// the presentation time of the frames out of the encoder is worked out from the latest known one
+static uint64_t anchor_frame = 0;
+static uint64_t anchor_time = 0;
+#endif
+
+// with stream_lock held
+static void client_enqueue(stream_client *client, const char *p, size_t length) {
+  size_t end = (client->queue_start + client->queue_occupancy) % queue_size;
+  size_t first = queue_size - end;
+  if (first > length)
+    first = length;
+  memcpy(client->queue + end, p, first);
+  if (first < length)
+    memcpy(client->queue, p + first, length - first);
+  client->queue_occupancy += length;
+}
+
+// with stream_lock held
+static void client_send(stream_client *client, const audio_stream_header *header,
+                        const void *payload) {
+  if (queue_size - client->queue_occupancy < AUDIO_STREAM_HEADER_LENGTH + header->length) {
+    client->messages_dropped++;
+    if (client->dropping == 0)
+      debug(2, "stream: client on fd %d isn't keeping up -- dropping messages.", client->fd);
+    client->dropping = 1;
+    return;
+  }
+  if (client->dropping)
+    debug(2, "stream: client on fd %d is keeping up again -- %" PRIu64 " messages dropped so far.",
+          client->fd, client->messages_dropped);
+  client->dropping = 0;
+  char buf[AUDIO_STREAM_HEADER_LENGTH];
+  audio_stream_header_pack(header, buf);
+  client_enqueue(client, buf, AUDIO_STREAM_HEADER_LENGTH);
+  if (header->length)
+    client_enqueue(client, payload, header->length);
+}
+
+static void send_to_all(uint32_t type, uint64_t first_frame, uint32_t frames,
+                        uint64_t presentation_time, const void *payload, size_t length) {
+  audio_stream_header header = {.magic = AUDIO_STREAM_MAGIC,
+                                .type = type,
+                                .length = length,
+                                .frames = frames,
+                                .first_frame = first_frame,
+                                .presentation_time = presentation_time};
+  pthread_mutex_lock(&stream_lock);
+  int i;
+  for (i = 0; i < client_count; i++)
+    client_send(&clients[i], &header, payload);
+  int any = client_count;
+  pthread_mutex_unlock(&stream_lock);
+  if (any) {
+    char c = 0;
+    if (write(wakeup_fds[1], &c, 1) < 0) // wake up the server thread
+      debug(3, "stream: error %d waking up the server thread.", errno);
+  }
+}
+
+#ifdef CONFIG_FLAC
+static FLAC__StreamEncoderWriteStatus
+flac_write_callback(__attribute__((unused)) const FLAC__StreamEncoder *flac_encoder,
+                    const FLAC__byte buffer[], size_t bytes, uint32_t samples,
+                    __attribute__((unused)) uint32_t current_frame,
+                    __attribute__((unused)) void *client_data) {
+  if (flac_discarding) // frames from before a flush, or a repeat of the stream header
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  if (samples == 0) { // part of the stream header, written while the encoder is set up
+    pthread_mutex_lock(&stream_lock);
+    char *new_header = realloc(flac_header, flac_header_length + bytes);
+    if (new_header) {
+      memcpy(new_header + flac_header_length, buffer, bytes);
+      flac_header = new_header;
+      flac_header_length += bytes;
+    }
+    pthread_mutex_unlock(&stream_lock);
+    return new_header ? FLAC__STREAM_ENCODER_WRITE_STATUS_OK
+                      : FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+  }
+  uint64_t time = 0;
+  if (anchor_time)
+    time = anchor_time +
+           (((int64_t)(flac_frame_count - anchor_frame) << 32) / (int64_t)config.output_rate);
+  send_to_all('audi', flac_frame_count, samples, time, buffer, bytes);
+  flac_frame_count += samples;
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static void flac_encode(void *buf, int samples) {
+  if ((size_t)samples > flac_samples_size) {
+    FLAC__int32 *new_samples = realloc(flac_samples, samples * 2 * sizeof(FLAC__int32));
+    if (new_samples == NULL)
+      die("Can't allocate memory for the stream backend's FLAC encoder.");
+    flac_samples = new_samples;
+    flac_samples_size = samples;
+  }
+  int i;
+  if (config.output_format == SPS_FORMAT_S24) {
+    int32_t *p = (int32_t *)buf;
+    for (i = 0; i < samples * 2; i++)
+      flac_samples[i] = p[i];
+  } else {
+    int16_t *p = (int16_t *)buf;
+    for (i = 0; i < samples * 2; i++)
+      flac_samples[i] = p[i];
+  }
+  if (pending_presentation_time) {
+    anchor_frame = frame_count;
+    anchor_time = pending_presentation_time;
+  }
+  if (!FLAC__stream_encoder_process_interleaved(encoder, flac_samples, samples))
+    debug(1, "stream: error encoding %d frames.", samples);
+}
+
+static void flac_encoder_start(void) {
+  FLAC__stream_encoder_set_channels(encoder, 2);
+  FLAC__stream_encoder_set_bits_per_sample(encoder,
+                                           config.output_format == SPS_FORMAT_S24 ? 24 : 16);
+  FLAC__stream_encoder_set_sample_rate(encoder, config.output_rate);
+  FLAC__stream_encoder_set_compression_level(encoder, 5);
+  FLAC__stream_encoder_set_blocksize(encoder, 1152); // about 26 ms at 44,100 frames per second
+  FLAC__stream_encoder_set_streamable_subset(encoder, 1);
+  if (FLAC__stream_encoder_init_stream(encoder, flac_write_callback, NULL, NULL, NULL, NULL) !=
+      FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    die("Can't start the stream backend's FLAC encoder.");
+}
+
+// The encoder holds on to frames until it has a block of them. At a flush, they're thrown away
+// and the encoder is started afresh -- its settings are lost when it's finished, and the stream
+// header it writes again is the same as before, so it isn't sent.
+static void flac_encoder_restart(void) {
+  flac_discarding = 1;
+  FLAC__stream_encoder_finish(encoder);
+  flac_encoder_start();
+  flac_discarding = 0;
+  flac_frame_count = frame_count;
+  anchor_time = 0;
+}
+#endif
+
+static void presentation_time(uint64_t time) { pending_presentation_time = time; }
+
+static int play(void *buf, int samples) {
+#ifdef CONFIG_FLAC
+  if (use_flac)
+    flac_encode(buf, samples);
+  else
+#endif
+    send_to_all('audi', frame_count, samples, pending_presentation_time, buf,
+                (size_t)samples * bytes_per_frame);
+  frame_count += samples;
+  pending_presentation_time = 0;
+  return 0;
+}
+
+static void flush(void) {
+#ifdef CONFIG_FLAC
+  if (use_flac)
+    flac_encoder_restart();
+#endif
+  send_to_all('flsh', frame_count, 0, 0, NULL, 0);
+  pending_presentation_time = 0;
+}
+
+static void start(__attribute__((unused)) int sample_rate,
+                  __attribute__((unused)) int sample_format) {}
+
+static void stop(void) {}
+
+// with stream_lock held
+static void client_add(int fd) {
+  if (client_count == maximum_clients) {
+    debug(1, "stream: refusing a client -- there are already %d.", client_count);
+    close(fd);
+    return;
+  }
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1)
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int value = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)); // fails harmlessly on Unix
+  stream_client *client = &clients[client_count];
+  memset(client, 0, sizeof(stream_client));
+  client->fd = fd;
+  client->queue = malloc(queue_size);
+  if (client->queue == NULL) {
+    warn("Can't allocate memory for a stream client's queue.");
+    close(fd);
+    return;
+  }
+  client_count++;
+
+  audio_stream_format format = {.rate = config.output_rate,
+                                .channels = 2,
+                                .bytes_per_frame = bytes_per_frame,
+                                .framing = use_flac ? 'flac' : 'raw '};
+  snprintf(format.format, sizeof(format.format), "%s",
+           sps_format_description_string(config.output_format));
+  char buf[AUDIO_STREAM_FORMAT_LENGTH];
+  audio_stream_format_pack(&format, buf);
+  audio_stream_header header = {
+      .magic = AUDIO_STREAM_MAGIC, .type = 'form', .length = AUDIO_STREAM_FORMAT_LENGTH};
+  client_send(client, &header, buf);
+  if (use_flac) {
+    header.type = 'flac';
+    header.length = flac_header_length;
+    client_send(client, &header, flac_header);
+  }
+  debug(1, "stream: client on fd %d added.", fd);
+}
+
+// with stream_lock held
+static void client_remove(int i) {
+  debug(1, "stream: client on fd %d removed.", clients[i].fd);
+  close(clients[i].fd);
+  free(clients[i].queue);
+  clients[i] = clients[--client_count];
+}
+
+static void *stream_server_thread_function(__attribute__((unused)) void *arg) {
+  // a client going away must show up as EPIPE here, not as a signal to the whole process
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  struct pollfd fds[stream_maximum_clients + 3];
+  int remove[stream_maximum_clients];
+  int i;
+  while (1) {
+    int nfds = 0;
+    fds[nfds].fd = wakeup_fds[0];
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = tcp_fd;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = unix_fd;
+    fds[nfds++].events = POLLIN;
+    pthread_mutex_lock(&stream_lock);
+    int clients_polled = client_count;
+    for (i = 0; i < client_count; i++) {
+      fds[nfds].fd = clients[i].fd;
+      fds[nfds++].events = POLLIN | (clients[i].queue_occupancy ? POLLOUT : 0);
+    }
+    pthread_mutex_unlock(&stream_lock);
+
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno != EINTR)
+        debug(1, "stream: error %d polling the clients.", errno);
+      continue;
+    }
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+
+    if (fds[0].revents & POLLIN) {
+      char buf[256];
+      if (read(wakeup_fds[0], buf, sizeof(buf)) < 0)
+        debug(3, "stream: error %d reading the wakeup pipe.", errno);
+    }
+
+    // clients are only added and removed by this thread, so they're where they were when polled
+    for (i = 0; i < clients_polled; i++) {
+      struct pollfd *pfd = &fds[3 + i];
+      stream_client *client = &clients[i];
+      remove[i] = 0;
+      if (pfd->revents & (POLLERR | POLLNVAL)) {
+        remove[i] = 1;
+      } else if (pfd->revents & (POLLIN | POLLHUP)) {
+        // clients have nothing to say, so this is the client going away
+        char buf[256];
+        ssize_t rc = read(client->fd, buf, sizeof(buf));
+        if ((rc == 0) || ((rc < 0) && (errno != EAGAIN) && (errno != EINTR)))
+          remove[i] = 1;
+      }
+      if ((remove[i] == 0) && (pfd->revents & POLLOUT)) {
+        // the producer only ever adds to the queue, so what's there can be sent without the lock
+        pthread_mutex_lock(&stream_lock);
+        size_t length = client->queue_occupancy;
+        pthread_mutex_unlock(&stream_lock);
+        if (length > queue_size - client->queue_start)
+          length = queue_size - client->queue_start;
+        ssize_t rc = write(client->fd, client->queue + client->queue_start, length);
+        if (rc > 0) {
+          pthread_mutex_lock(&stream_lock);
+          client->queue_start = (client->queue_start + rc) % queue_size;
+          client->queue_occupancy -= rc;
+          pthread_mutex_unlock(&stream_lock);
+        } else if ((rc < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+          remove[i] = 1;
+        }
+      }
+    }
+    pthread_mutex_lock(&stream_lock);
+    for (i = clients_polled - 1; i >= 0; i--) // from the end, as removal moves the last client
+      if (remove[i])
+        client_remove(i);
+    for (i = 1; i < 3; i++)
+      if ((fds[i].fd >= 0) && (fds[i].revents & POLLIN)) {
+        int fd = accept(fds[i].fd, NULL, NULL);
+        if (fd >= 0)
+          client_add(fd);
+        else
+          debug(1, "stream: error %d accepting a client.", errno);
+      }
+    pthread_mutex_unlock(&stream_lock);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_exit(NULL);
+}
+
+static int listen_on_port(void) {
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  int value = 1;
+  if (fd >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    value = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value));
+    struct sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd < 0) { // no IPv6, perhaps
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    value = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  if (listen(fd, 8) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int listen_on_socket_name(void) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, socket_name);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  unlink(socket_name); // left over from before, perhaps
+  if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(fd, 8) != 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int init(__attribute__((unused)) int argc, __attribute__((unused)) char **argv) {
+  debug(1, "stream init");
+  // set up default values first
+  config.audio_backend_buffer_desired_length = 0.5;
+  config.audio_backend_latency_offset = 0;
+
+  // get settings from settings file
+  // do the "general" audio  options. Note, these options are in the "general" stanza!
+  parse_general_audio_options();
+
+  if (config.cfg != NULL) {
+    const char *str;
+    int value;
+    double dvalue;
+
+    /* Get the port. */
+    if (config_lookup_int(config.cfg, "stream.port", &value)) {
+      if ((value < 0) || (value > 65535))
+        die("Invalid stream port number %d. It should be between 0 and 65535.", value);
+      else
+        port = value;
+    }
+
+    /* Get the name of the Unix socket. */
+    if ((config_lookup_string(config.cfg, "stream.socket_name", &str)) && (strlen(str) != 0))
+      socket_name = (char *)str;
+
+    /* Get the output format. */
+    if (config_lookup_string(config.cfg, "stream.output_format", &str)) {
+      sps_format_t format = sps_format_from_description_string(str);
+      if (format != SPS_FORMAT_INVALID) {
+        config.output_format = format;
+        config.output_format_auto_requested = 0;
+      } else {
+        warn("Invalid stream output format \"%s\". It remains set to \"%s\".", str,
+             sps_format_description_string(config.output_format));
+      }
+    }
+
+    /* Get the framing. */
+    if (config_lookup_string(config.cfg, "stream.framing", &str)) {
+      if (strcasecmp(str, "raw") == 0)
+        use_flac = 0;
+      else if (strcasecmp(str, "flac") == 0)
+#ifdef CONFIG_FLAC
+        use_flac = 1;
+#else
+        warn("FLAC framing of the stream is not available -- Shairport Sync was built without "
+             "support for it. Raw framing will be used.");
+#endif
+      else
+        warn("Invalid stream framing choice \"%s\". It should be \"raw\" or \"flac\". It remains "
+             "set to \"raw\".",
+             str);
+    }
+
+    /* Get the maximum number of clients. */
+    if (config_lookup_int(config.cfg, "stream.maximum_clients", &value)) {
+      if ((value < 1) || (value > stream_maximum_clients))
+        warn("Invalid stream maximum_clients %d. It must be between 1 and %d. The default of %d "
+             "will be used.",
+             value, stream_maximum_clients, maximum_clients);
+      else
+        maximum_clients = value;
+    }
+
+    /* Get the length of each client's queue. */
+    if (config_lookup_float(config.cfg, "stream.queue_length_in_seconds", &dvalue)) {
+      if ((dvalue <= 0.0) || (dvalue > 30.0))
+        warn("Invalid stream queue_length_in_seconds %f. It must be greater than 0.0 and no "
+             "more than 30.0. The default of %f seconds will be used.",
+             dvalue, queue_length_in_seconds);
+      else
+        queue_length_in_seconds = dvalue;
+    }
+  }
+
+  if ((port == 0) && (socket_name == NULL))
+    die("The stream backend needs a port or a socket_name to listen on.");
+
+  if ((use_flac) && (config.output_format != SPS_FORMAT_S16) &&
+      (config.output_format != SPS_FORMAT_S24)) {
+    if (config.output_format_auto_requested == 0)
+      warn("FLAC framing of the stream needs an output format of \"S16\" or \"S24\". \"S16\" "
+           "will be used.");
+    config.output_format = SPS_FORMAT_S16;
+    config.output_format_auto_requested = 0;
+  }
+  bytes_per_frame = sps_format_bytes_per_frame(config.output_format);
+  // room for the audio and the headers, a message for every 352 frames or so -- worked out in
+  // floating point, as a header is much less than a byte per frame
+  queue_size = (size_t)(queue_length_in_seconds * config.output_rate *
+                        (bytes_per_frame * 352.0 + AUDIO_STREAM_HEADER_LENGTH) / 352.0) +
+               65536;
+
+#ifdef CONFIG_FLAC
+  if (use_flac) {
+    encoder = FLAC__stream_encoder_new();
+    if (encoder == NULL)
+      die("Can't create the stream backend's FLAC encoder.");
+    flac_encoder_start();
+  }
+#endif
+
+  clients = calloc(maximum_clients, sizeof(stream_client));
+  if (clients == NULL)
+    die("Can't allocate memory for the stream backend's clients.");
+  if (pipe(wakeup_fds) != 0)
+    die("Can't create the stream backend's wakeup pipe.");
+  fcntl(wakeup_fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakeup_fds[1], F_SETFL, O_NONBLOCK);
+
+  if (port) {
+    tcp_fd = listen_on_port();
+    if (tcp_fd < 0)
+      die("The stream backend can't listen on port %d: error %d.", port, errno);
+    debug(1, "stream: listening on port %d.", port);
+  }
+  if (socket_name) {
+    unix_fd = listen_on_socket_name();
+    if (unix_fd < 0)
+      die("The stream backend can't listen on \"%s\": error %d.", socket_name, errno);
+    debug(1, "stream: listening on \"%s\".", socket_name);
+  }
+
+  if (pthread_create(&stream_server_thread, NULL, &stream_server_thread_function, NULL) != 0)
+    die("Could not create the stream server thread.");
+  stream_server_running = 1;
+  return 0;
+}
+
+static void deinit(void) {
+  if (stream_server_running) {
+    pthread_cancel(stream_server_thread);
+    pthread_join(stream_server_thread, NULL);
+    stream_server_running = 0;
+  }
+  while (client_count)
+    client_remove(client_count - 1);
+  if (tcp_fd >= 0)
+    close(tcp_fd);
+  if (unix_fd >= 0) {
+    close(unix_fd);
+    unlink(socket_name);
+  }
+  tcp_fd = unix_fd = -1;
+#ifdef CONFIG_FLAC
+  if (encoder) {
+    FLAC__stream_encoder_delete(encoder);
+    encoder = NULL;
+  }
+  free(flac_samples);
+  flac_samples = NULL;
+#endif
+  free(flac_header);
+  flac_header = NULL;
+  free(clients);
+  clients = NULL;
+}
+
+audio_output audio_stream = {.name = "stream",
+                             .help = NULL,
+                             .init = &init,
+                             .deinit = &deinit,
+                             .prepare = NULL,
+                             .start = &start,
+                             .stop = &stop,
+                             .is_running = NULL,
+                             .flush = &flush,
+                             .delay = NULL,
+                             .play = &play,
+                             .volume = NULL,
+                             .parameters = NULL,
+                             .mute = NULL,
+                             .presentation_time = &presentation_time};
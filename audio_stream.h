@@ -0,0 +1,101 @@
+#ifndef _AUDIO_STREAM_H
+#define _AUDIO_STREAM_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+// The stream format, in which the "stream" backend sends audio to each of its clients over TCP or
+// a Unix socket.
+
+// Each message is sent as a fixed-size header followed by its payload.
+// All the header fields are unsigned integers in network byte order:
+
+//  0  magic             -- 'sspa', to help a reader find its place
+//  4  type              -- 'form', 'flac', 'audi' or 'flsh' -- see below
+//  8  length            -- the length of the payload
+// 12  frames            -- the number of frames of audio in an 'audi' message
+// 16  first_frame       -- 64 bits, the number of the first frame of an 'audi' message
+// 24  presentation_time -- 64 bits, the local time at which that frame should be heard
+
+// Frames are numbered from zero when Shairport Sync starts. A gap in the numbers means frames were
+// dropped because the client didn't keep up. Presentation times are CLOCK_MONOTONIC, as a 32.32
+// fixed point number of seconds, on the host running Shairport Sync, or zero if the frames have no
+// time of their own, like silence. The frames of a message are played one after the other at the
+// nominal rate.
+
+// A client is sent a 'form' message first. Its payload is a packed audio_stream_format.
+// With FLAC framing, it is followed by a 'flac' message holding the FLAC stream header -- "fLaC"
+// and the STREAMINFO block -- and every 'audi' message then holds whole FLAC frames. Otherwise,
+// 'audi' messages hold raw frames, interleaved, in the format named in the 'form' message.
+// A 'flsh' message means that frames before its first_frame have been flushed -- any of them not
+// yet played should be discarded. With FLAC framing, the FLAC encoder is restarted at a flush, so
+// the frame numbers within the FLAC frames start again from zero.
+
+#define AUDIO_STREAM_MAGIC 'sspa'
+#define AUDIO_STREAM_HEADER_LENGTH 32
+#define AUDIO_STREAM_FORMAT_LENGTH 32
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t length;
+  uint32_t frames;
+  uint64_t first_frame;
+  uint64_t presentation_time;
+} audio_stream_header; // in host byte order
+
+typedef struct {
+  uint32_t rate;
+  uint32_t channels;
+  uint32_t bytes_per_frame; // of raw frames
+  uint32_t framing;         // 'raw ' or 'flac'
+  char format[16];          // e.g. "S16_LE" or "F32" -- see the alsa output_format setting
+} audio_stream_format; // in host byte order
+
+static inline void audio_stream_header_pack(const audio_stream_header *header, char *buf) {
+  uint32_t v[8];
+  v[0] = htonl(header->magic);
+  v[1] = htonl(header->type);
+  v[2] = htonl(header->length);
+  v[3] = htonl(header->frames);
+  v[4] = htonl(header->first_frame >> 32);
+  v[5] = htonl(header->first_frame & 0xffffffff);
+  v[6] = htonl(header->presentation_time >> 32);
+  v[7] = htonl(header->presentation_time & 0xffffffff);
+  memcpy(buf, v, AUDIO_STREAM_HEADER_LENGTH);
+}
+
+static inline void audio_stream_header_unpack(const char *buf, audio_stream_header *header) {
+  uint32_t v[8];
+  memcpy(v, buf, AUDIO_STREAM_HEADER_LENGTH);
+  header->magic = ntohl(v[0]);
+  header->type = ntohl(v[1]);
+  header->length = ntohl(v[2]);
+  header->frames = ntohl(v[3]);
+  header->first_frame = ((uint64_t)ntohl(v[4]) << 32) | ntohl(v[5]);
+  header->presentation_time = ((uint64_t)ntohl(v[6]) << 32) | ntohl(v[7]);
+}
+
+static inline void audio_stream_format_pack(const audio_stream_format *format, char *buf) {
+  uint32_t v[4];
+  v[0] = htonl(format->rate);
+  v[1] = htonl(format->channels);
+  v[2] = htonl(format->bytes_per_frame);
+  v[3] = htonl(format->framing);
+  memcpy(buf, v, sizeof(v));
+  memcpy(buf + sizeof(v), format->format, sizeof(format->format));
+}
+
+static inline void audio_stream_format_unpack(const char *buf, audio_stream_format *format) {
+  uint32_t v[4];
+  memcpy(v, buf, sizeof(v));
+  format->rate = ntohl(v[0]);
+  format->channels = ntohl(v[1]);
+  format->bytes_per_frame = ntohl(v[2]);
+  format->framing = ntohl(v[3]);
+  memcpy(format->format, buf + sizeof(v), sizeof(format->format));
+  format->format[sizeof(format->format) - 1] = '\0';
+}
+
+#endif // _AUDIO_STREAM_H
@@ -29,9 +29,12 @@
 #include "common.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <memory.h>
 #include <poll.h>
 #include <popt.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -97,8 +100,9 @@ static pthread_mutex_t debug_timing_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t the_conn_lock = PTHREAD_MUTEX_INITIALIZER;
 
 const char *sps_format_description_string_array[] = {
-    "unknown", "S8",      "U8",      "S16", "S16_LE", "S16_BE", "S24",  "S24_LE",
-    "S24_BE",  "S24_3LE", "S24_3BE", "S32", "S32_LE", "S32_BE", "auto", "invalid"};
+    "unknown",  "S8",       "U8",       "S16",      "S16_LE",   "S16_BE",   "S24",      "S24_LE",
+    "S24_BE",   "S24_3LE",  "S24_3BE",  "S32",      "S32_LE",   "S32_BE",   "F32",      "auto",
+    "invalid"};
 
 const char *sps_format_description_string(sps_format_t format) {
   if ((format >= SPS_FORMAT_UNKNOWN) && (format <= SPS_FORMAT_AUTO))
@@ -107,6 +111,35 @@ const char *sps_format_description_string(sps_format_t format) {
     return sps_format_description_string_array[SPS_FORMAT_INVALID];
 }
 
+sps_format_t sps_format_from_description_string(const char *description) {
+  sps_format_t format;
+  for (format = SPS_FORMAT_S8; format < SPS_FORMAT_AUTO; format++)
+    if (strcasecmp(description, sps_format_description_string_array[format]) == 0)
+      return format;
+  return SPS_FORMAT_INVALID;
+}
+
+int sps_format_bytes_per_frame(sps_format_t format) {
+  switch (format) {
+  case SPS_FORMAT_S8:
+  case SPS_FORMAT_U8:
+    return 2;
+  case SPS_FORMAT_S24_3LE:
+  case SPS_FORMAT_S24_3BE:
+    return 6;
+  case SPS_FORMAT_S24:
+  case SPS_FORMAT_S24_LE:
+  case SPS_FORMAT_S24_BE:
+  case SPS_FORMAT_S32:
+  case SPS_FORMAT_S32_LE:
+  case SPS_FORMAT_S32_BE:
+  case SPS_FORMAT_F32:
+    return 8;
+  default:
+    return 4;
+  }
+}
+
 // true if Shairport Sync is supposed to be sending output to the output device, false otherwise
 
 static volatile int requested_connection_state_to_output = 1;
@@ -716,121 +749,359 @@ int config_set_lookup_bool(config_t *cfg, char *where, int *dst) {
   }
 }
 
-void command_set_volume(double volume) {
-  // this has a cancellation point if waiting is enabled
-  if (config.cmd_set_volume) {
-    /*Spawn a child to run the program.*/
-    pid_t pid = fork();
-    if (pid == 0) { /* child process */
-      size_t command_buffer_size = strlen(config.cmd_set_volume) + 32;
-      char *command_buffer = (char *)malloc(command_buffer_size);
-      if (command_buffer == NULL) {
-        inform("Couldn't allocate memory for set_volume argument string");
-      } else {
-        memset(command_buffer, 0, command_buffer_size);
-        snprintf(command_buffer, command_buffer_size, "%s %f", config.cmd_set_volume, volume);
-        // debug(1,"command_buffer is \"%s\".",command_buffer);
-        int argC;
-        char **argV;
-        // debug(1,"set_volume command found.");
-        if (poptParseArgvString(command_buffer, &argC, (const char ***)&argV) != 0) {
-          // note that argV should be free()'d after use, but we expect this fork to exit
-          // eventually.
-          warn("Can't decipher on-set-volume command arguments \"%s\".", command_buffer);
-          free(argV);
-          free(command_buffer);
-        } else {
-          free(command_buffer);
-          // debug(1,"Executing on-set-volume command %s with %d arguments.",argV[0],argC);
-          execv(argV[0], argV);
-          warn("Execution of on-set-volume command \"%s\" failed to start", config.cmd_set_volume);
-          // debug(1, "Error executing on-set-volume command %s", config.cmd_set_volume);
-          exit(EXIT_FAILURE); /* only if execv fails */
-        }
-      }
+// Hooks -- the commands run before play begins, after it ends, when the volume changes and so on
+// -- are started with posix_spawn by a supervisor thread, so that the whole process, with its
+// buffers and threads, isn't forked for every one, and so that the thread asking for a hook
+// never waits for it unless it has to. The supervisor reaps the hooks and reports how they
+// exited and how long they took.
+
+// Once the supervisor is running, it's the only reaper of child processes -- the SIGCHLD handler
+// just wakes it, through a pipe, so that it doesn't poll. It reaps all the children that have
+// exited, and reports on the ones that are hooks, so a hook's status is never taken by anyone else.
+
+// Volume hooks are run one at a time. If the volume changes while a volume hook is running, only
+// the latest volume is kept, to be run when the current one finishes, so that dragging a slider
+// doesn't leave a backlog of hooks behind it.
+
+#define hook_output_size 256
+
+typedef struct hook_job {
+  struct hook_job *next;
+  char *command; // the full command line
+  char **argv;   // from poptParseArgvString -- free it with free()
+  int is_volume_hook;
+  int capture_output; // if set, the hook's standard output is read into output by the caller...
+  int output_fd;      // ...from here, once the hook has started
+  char output[hook_output_size];
+  int waited_for; // if set, a caller is waiting for the hook to finish
+  int abandoned;  // if set, the waiting caller has been cancelled, so the supervisor frees it
+  int done;
+  int superseded; // set if a later volume hook was run instead
+  pid_t pid;
+  uint64_t start_time;
+} hook_job;
+
+static pthread_mutex_t hook_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hook_done = PTHREAD_COND_INITIALIZER;
+static int hook_wakeup_pipe[2] = {-1, -1};
+static volatile sig_atomic_t hook_wakeup_fd = -1; // the write end, once the supervisor is running
+static pthread_once_t hook_supervisor_once = PTHREAD_ONCE_INIT;
+static pthread_t hook_supervisor_thread;
+static int hook_supervisor_running = 0;
+static hook_job *hooks_waiting = NULL;     // in order of arrival
+static hook_job *hooks_running = NULL;
+static hook_job *volume_hook_waiting = NULL; // the latest volume hook, if one is running already
+static int volume_hook_running = 0;
+extern char **environ;
+
+static void hook_job_free(hook_job *job) {
+  if (job->output_fd >= 0)
+    close(job->output_fd);
+  free(job->argv);
+  free(job->command);
+  free(job);
+}
 
-    } else {
-      if (config.cmd_blocking) { /* pid!=0 means parent process and if blocking is true, wait for
-                                    process to finish */
-        pid_t rc = waitpid(pid, 0, 0); /* wait for child to exit */
-        if (rc != pid) {
-          warn("Execution of on-set-volume command returned an error.");
-          debug(1, "on-set-volume command %s finished with error %d", config.cmd_set_volume, errno);
-        }
-      }
-      // debug(1,"Continue after on-set-volume command");
+// call with the hook_lock held
+static void hook_job_finished(hook_job *job) {
+  if (job->is_volume_hook) {
+    volume_hook_running = 0;
+    if (volume_hook_waiting) {
+      // the latest volume goes to the front of the queue
+      volume_hook_waiting->next = hooks_waiting;
+      hooks_waiting = volume_hook_waiting;
+      volume_hook_waiting = NULL;
     }
   }
+  if ((job->waited_for) && (job->abandoned == 0)) {
+    job->done = 1;
+    pthread_cond_broadcast(&hook_done);
+  } else {
+    hook_job_free(job);
+  }
 }
 
-void command_start(void) {
-  // this has a cancellation point if waiting is enabled or a response is awaited
-  if (config.cmd_start) {
-    pid_t pid;
-    int pipes[2];
+static void hook_report(hook_job *job, int status) {
+  uint64_t duration = get_absolute_time_in_fp() - job->start_time;
+  double seconds = (1.0 * ((duration * 1000) >> 32)) / 1000;
+  if (WIFEXITED(status)) {
+    if (WEXITSTATUS(status) == 0)
+      debug(2, "Command \"%s\" finished after %.3f seconds.", job->command, seconds);
+    else
+      debug(1, "Command \"%s\" exited with status %d after %.3f seconds.", job->command,
+            WEXITSTATUS(status), seconds);
+  } else if (WIFSIGNALED(status)) {
+    debug(1, "Command \"%s\" was terminated by signal %d after %.3f seconds.", job->command,
+          WTERMSIG(status), seconds);
+  }
+}
 
-    if (config.cmd_start_returns_output && pipe(pipes) != 0) {
-      warn("Unable to allocate pipe for popen of start command.");
+// call with the hook_lock held; it's released while the hook is being started
+static void hook_launch(hook_job *job) {
+  int pipes[2] = {-1, -1};
+  posix_spawn_file_actions_t file_actions;
+  posix_spawnattr_t attributes;
+  sigset_t no_signals;
+  pthread_mutex_unlock(&hook_lock);
+
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawnattr_init(&attributes);
+  // don't pass on the signal mask of whichever thread started the supervisor
+  sigemptyset(&no_signals);
+  posix_spawnattr_setsigmask(&attributes, &no_signals);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+  if (job->capture_output) {
+    if (pipe(pipes) != 0) {
+      warn("Unable to allocate pipe for the output of command \"%s\".", job->command);
       debug(1, "pipe finished with error %d", errno);
-      return;
+    } else {
+      // so that no other child inherits the pipe -- dup2 clears this on the hook's stdout
+      fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+      fcntl(pipes[1], F_SETFD, FD_CLOEXEC);
+      posix_spawn_file_actions_addclose(&file_actions, pipes[0]);
+      posix_spawn_file_actions_adddup2(&file_actions, pipes[1], STDOUT_FILENO);
+      posix_spawn_file_actions_addclose(&file_actions, pipes[1]);
     }
-    /*Spawn a child to run the program.*/
-    pid = fork();
-    if (pid == 0) { /* child process */
-      int argC;
-      char **argV;
-
-      if (config.cmd_start_returns_output) {
-        close(pipes[0]);
-        if (dup2(pipes[1], 1) < 0) {
-          warn("Unable to reopen pipe as stdout for popen of start command");
-          debug(1, "dup2 finished with error %d", errno);
-          close(pipes[1]);
-          return;
-        }
+  }
+  job->start_time = get_absolute_time_in_fp();
+  int rc = posix_spawn(&job->pid, job->argv[0], &file_actions, &attributes, job->argv, environ);
+  posix_spawn_file_actions_destroy(&file_actions);
+  posix_spawnattr_destroy(&attributes);
+  if (pipes[1] >= 0)
+    close(pipes[1]);
+  if (rc != 0) {
+    warn("Execution of command \"%s\" failed to start", job->command);
+    debug(1, "Error %d executing command \"%s\".", rc, job->command);
+    job->pid = -1;
+  }
+
+  pthread_mutex_lock(&hook_lock);
+  if (pipes[0] >= 0) {
+    // The caller reads the hook's output, not the supervisor, which would otherwise be held up
+    // until the hook -- or anything it leaves running in the background -- closes its stdout.
+    if ((job->pid != -1) && (job->abandoned == 0)) {
+      job->output_fd = pipes[0];
+      pthread_cond_broadcast(&hook_done);
+    } else {
+      close(pipes[0]);
+    }
+  }
+  if (job->pid == -1) {
+    hook_job_finished(job);
+  } else {
+    job->next = hooks_running;
+    hooks_running = job;
+  }
+}
+
+// wake the supervisor, returning 0 if it isn't running -- this is called by the SIGCHLD handler,
+// so it must be async-signal-safe
+int hook_supervisor_wake(void) {
+  int fd = hook_wakeup_fd;
+  if (fd < 0)
+    return 0;
+  int saved_errno = errno;
+  // if the pipe is full, a wakeup is pending already
+  if (write(fd, "", 1) < 0) {
+  }
+  errno = saved_errno;
+  return 1;
+}
+
+void *hook_supervisor_thread_function(__attribute__((unused)) void *arg) {
+  pthread_mutex_lock(&hook_lock);
+  while (1) {
+    // reap every child that has exited, reporting on the hooks among them
+    int status;
+    pid_t pid;
+    while ((pid = waitpid((pid_t)(-1), &status, WNOHANG)) > 0) {
+      hook_job **jp = &hooks_running;
+      while ((*jp) && ((*jp)->pid != pid))
+        jp = &(*jp)->next;
+      if (*jp) {
+        hook_job *job = *jp;
+        *jp = job->next;
+        hook_report(job, status);
+        hook_job_finished(job);
       }
+    }
+    if (hooks_waiting) {
+      hook_job *job = hooks_waiting;
+      hooks_waiting = job->next;
+      if (job->is_volume_hook)
+        volume_hook_running = 1;
+      hook_launch(job);
+    } else {
+      // wait for a hook to be added or a child to exit
+      char buffer[64];
+      pthread_mutex_unlock(&hook_lock);
+      if (read(hook_wakeup_pipe[0], buffer, sizeof(buffer)) < 0) {
+        if (errno != EINTR)
+          die("Error %d waiting for a command to be added or to finish.", errno);
+      }
+      pthread_mutex_lock(&hook_lock);
+    }
+  }
+  pthread_mutex_unlock(&hook_lock);
+  pthread_exit(NULL);
+}
 
-      // debug(1,"on-start command found.");
-      if (poptParseArgvString(config.cmd_start, &argC, (const char ***)&argV) !=
-          0) // note that argV should be free()'d after use, but we expect this fork to exit
-             // eventually.
-        debug(1, "Can't decipher on-start command arguments");
-      else {
-        // debug(1,"Executing on-start command %s with %d arguments.",argV[0],argC);
-        execv(argV[0], argV);
-        warn("Execution of on-start command failed to start");
-        debug(1, "Error executing on-start command %s", config.cmd_start);
-        exit(EXIT_FAILURE); /* only if execv fails */
+static void hook_supervisor_start(void) {
+  if (pipe(hook_wakeup_pipe) != 0) {
+    debug(1, "Failed to create the command supervisor's pipe -- error %d.", errno);
+    return;
+  }
+  // the hooks mustn't inherit it
+  fcntl(hook_wakeup_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(hook_wakeup_pipe[1], F_SETFD, FD_CLOEXEC);
+  // the write end mustn't block, as it's written to by the SIGCHLD handler
+  fcntl(hook_wakeup_pipe[1], F_SETFL, fcntl(hook_wakeup_pipe[1], F_GETFL) | O_NONBLOCK);
+  if (pthread_create(&hook_supervisor_thread, NULL, hook_supervisor_thread_function, NULL)) {
+    debug(1, "Failed to create the command supervisor thread!");
+    close(hook_wakeup_pipe[0]);
+    close(hook_wakeup_pipe[1]);
+  } else {
+    hook_supervisor_running = 1;
+    hook_wakeup_fd = hook_wakeup_pipe[1]; // from now on, the supervisor reaps the children
+    hook_supervisor_wake(); // in case a child exited before now
+  }
+}
+
+static void hook_wait_cleanup(void *arg) {
+  hook_job *job = (hook_job *)arg;
+  // the caller has been cancelled -- free the job if it's finished, or leave it to the supervisor
+  if (job->done)
+    hook_job_free(job);
+  else
+    job->abandoned = 1;
+  pthread_mutex_unlock(&hook_lock);
+}
+
+static void hook_output_cleanup(void *arg) {
+  hook_job *job = (hook_job *)arg;
+  close(job->output_fd);
+  job->output_fd = -1;
+  pthread_mutex_lock(&hook_lock); // as hook_wait_cleanup expects it to be held
+}
+
+// queue a hook, and wait for it to finish if asked to, returning zero if it ran
+// if output is given, the hook's standard output is returned there
+static int hook_run(const char *command, int is_volume_hook, int wait, char *output,
+                    size_t output_size) {
+  pthread_once(&hook_supervisor_once, hook_supervisor_start);
+  if (hook_supervisor_running == 0)
+    return -1;
+  hook_job *job = calloc(1, sizeof(hook_job));
+  if (job == NULL) {
+    warn("Couldn't allocate memory to run command \"%s\".", command);
+    return -1;
+  }
+  job->output_fd = -1;
+  job->command = strdup(command);
+  int argC;
+  if ((job->command == NULL) ||
+      (poptParseArgvString(command, &argC, (const char ***)&job->argv) != 0)) {
+    warn("Can't decipher command arguments in \"%s\".", command);
+    hook_job_free(job);
+    return -1;
+  }
+  job->is_volume_hook = is_volume_hook;
+  job->capture_output = (output != NULL);
+  job->waited_for = wait || (output != NULL);
+  job->pid = -1;
+
+  int result = 0;
+  pthread_mutex_lock(&hook_lock);
+  if ((is_volume_hook) && (volume_hook_running)) {
+    if (volume_hook_waiting) {
+      debug(3, "Command \"%s\" superseded by \"%s\".", volume_hook_waiting->command, command);
+      // a caller waiting for the superseded hook is released, as its value was overtaken
+      hook_job *superseded = volume_hook_waiting;
+      volume_hook_waiting = NULL;
+      superseded->superseded = 1;
+      if ((superseded->waited_for) && (superseded->abandoned == 0)) {
+        superseded->done = 1;
+        pthread_cond_broadcast(&hook_done);
+      } else {
+        hook_job_free(superseded);
       }
+    }
+    volume_hook_waiting = job;
+  } else {
+    hook_job **jp = &hooks_waiting;
+    while (*jp)
+      jp = &(*jp)->next;
+    *jp = job;
+    hook_supervisor_wake();
+  }
+  if (job->waited_for) {
+    pthread_cleanup_push(hook_wait_cleanup, (void *)job);
+    while ((job->done == 0) && (job->output_fd < 0))
+      pthread_cond_wait(&hook_done, &hook_lock); // a cancellation point
+    if (job->output_fd >= 0) {
+      // take the hook's output, as much of it as fits
+      pthread_mutex_unlock(&hook_lock);
+      pthread_cleanup_push(hook_output_cleanup, (void *)job);
+      size_t len = 0;
+      ssize_t n;
+      while ((len < sizeof(job->output) - 1) &&
+             (((n = read(job->output_fd, job->output + len, sizeof(job->output) - 1 - len)) >
+               0) ||
+              ((n < 0) && (errno == EINTR)))) // read() is a cancellation point
+        if (n > 0)
+          len += n;
+      job->output[len] = '\0';
+      pthread_cleanup_pop(1); // closes the pipe and takes the hook_lock again
+    }
+    while (job->done == 0)
+      pthread_cond_wait(&hook_done, &hook_lock);
+    pthread_cleanup_pop(0);
+    if (output)
+      snprintf(output, output_size, "%s", job->output);
+    if ((job->pid == -1) && (job->superseded == 0))
+      result = -1; // it didn't start
+    hook_job_free(job);
+  }
+  pthread_mutex_unlock(&hook_lock);
+  return result;
+}
+
+void command_set_volume(double volume) {
+  // this has a cancellation point if waiting is enabled
+  if (config.cmd_set_volume) {
+    size_t command_buffer_size = strlen(config.cmd_set_volume) + 32;
+    char *command_buffer = (char *)malloc(command_buffer_size);
+    if (command_buffer == NULL) {
+      inform("Couldn't allocate memory for set_volume argument string");
     } else {
-      if (config.cmd_blocking || config.cmd_start_returns_output) { /* pid!=0 means parent process
-                                    and if blocking is true, wait for
-                                    process to finish */
-        pid_t rc = waitpid(pid, 0, 0);                              /* wait for child to exit */
-        if ((rc != pid) && (errno != ECHILD)) {
-          // In this context, ECHILD means that the child process has already completed, I think!
-          warn("Execution of on-start command returned an error.");
-          debug(1, "on-start command %s finished with error %d", config.cmd_start, errno);
-        }
-        if (config.cmd_start_returns_output) {
-          static char buffer[256];
-          int len;
-          close(pipes[1]);
-          len = read(pipes[0], buffer, 255);
-          close(pipes[0]);
-          buffer[len] = '\0';
-          if (buffer[len - 1] == '\n')
-            buffer[len - 1] = '\0'; // strip trailing newlines
-          debug(1, "received '%s' as the device to use from the on-start command", buffer);
+      snprintf(command_buffer, command_buffer_size, "%s %f", config.cmd_set_volume, volume);
+      // debug(1,"command_buffer is \"%s\".",command_buffer);
+      hook_run(command_buffer, 1, config.cmd_blocking, NULL, 0);
+      free(command_buffer);
+    }
+  }
+}
+
+void command_start(void) {
+  // this has a cancellation point if waiting is enabled or a response is awaited
+  if (config.cmd_start) {
+    if (config.cmd_start_returns_output) {
+      static char buffer[hook_output_size]; // the output device name is kept, not copied
+      if (hook_run(config.cmd_start, 0, 1, buffer, sizeof(buffer)) == 0) {
+        size_t len = strlen(buffer);
+        if ((len > 0) && (buffer[len - 1] == '\n'))
+          buffer[len - 1] = '\0'; // strip trailing newlines
+        debug(1, "received '%s' as the device to use from the on-start command", buffer);
 #ifdef CONFIG_ALSA
-          set_alsa_out_dev(buffer);
+        set_alsa_out_dev(buffer);
 #endif
-        }
       }
-      // debug(1,"Continue after on-start command");
+    } else {
+      hook_run(config.cmd_start, 0, config.cmd_blocking, NULL, 0);
     }
   }
 }
+
 void command_execute(const char *command, const char *extra_argument, const int block) {
   // this has a cancellation point if waiting is enabled
   if (command) {
@@ -841,35 +1112,7 @@ void command_execute(const char *command, const char *extra_argument, const int
       snprintf(new_command_buffer, sizeof(new_command_buffer), "%s %s", command, extra_argument);
       full_command = new_command_buffer;
     }
-
-    /*Spawn a child to run the program.*/
-    pid_t pid = fork();
-    if (pid == 0) { /* child process */
-      int argC;
-      char **argV;
-      if (poptParseArgvString(full_command, &argC, (const char ***)&argV) !=
-          0) // note that argV should be free()'d after use, but we expect this fork to exit
-             // eventually.
-        debug(1, "Can't decipher command arguments in \"%s\".", full_command);
-      else {
-        // debug(1,"Executing command %s",full_command);
-        execv(argV[0], argV);
-        warn("Execution of command \"%s\" failed to start", full_command);
-        debug(1, "Error executing command \"%s\".", full_command);
-        exit(EXIT_FAILURE); /* only if execv fails */
-      }
-    } else {
-      if (block) { /* pid!=0 means parent process and if blocking is true, wait for
-                                    process to finish */
-        pid_t rc = waitpid(pid, 0, 0); /* wait for child to exit */
-        if ((rc != pid) && (errno != ECHILD)) {
-          // In this context, ECHILD means that the child process has already completed, I think!
-          warn("Execution of command \"%s\" returned an error.", full_command);
-          debug(1, "Command \"%s\" finished with error %d", full_command, errno);
-        }
-      }
-      // debug(1,"Continue after on-unfixable command");
-    }
+    hook_run(full_command, 0, block, NULL, 0);
   }
 }
 
@@ -1409,6 +1652,7 @@ int64_t generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t f
   case SPS_FORMAT_S32:
   case SPS_FORMAT_S32_LE:
   case SPS_FORMAT_S32_BE:
+  case SPS_FORMAT_F32:
     dither_mask = (int64_t)1 << (64 - 32);
     break;
   case SPS_FORMAT_S24:
@@ -1460,6 +1704,10 @@ int64_t generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t f
     int sample_length; // this is the length of the sample
 
     switch (format) {
+    case SPS_FORMAT_F32:
+      *(float *)op = 0.0; // a float sink has no need of dither
+      sample_length = 4;
+      break;
     case SPS_FORMAT_S32:
       hyper_sample >>= (64 - 32);
       *(int32_t *)op = hyper_sample;
@@ -93,11 +93,15 @@ typedef enum {
   SPS_FORMAT_S32,
   SPS_FORMAT_S32_LE,
   SPS_FORMAT_S32_BE,
+  SPS_FORMAT_F32, // 32-bit float in the processor's byte order, with full scale at +/-1.0
   SPS_FORMAT_AUTO,
   SPS_FORMAT_INVALID,
 } sps_format_t;
 
 const char *sps_format_description_string(sps_format_t format);
+// returns SPS_FORMAT_INVALID if the name isn't that of a format
+sps_format_t sps_format_from_description_string(const char *description);
+int sps_format_bytes_per_frame(sps_format_t format); // a frame is two channels
 
 typedef struct {
   double resend_control_first_check_time; // wait this long before asking for a missing packet to be resent
@@ -125,6 +129,9 @@ typedef struct {
   char *metadata_sockaddr;
   int metadata_sockport;
   size_t metadata_sockmsglength;
+  int metadata_pipe_binary_format;   // if zero, XML is written to the pipe
+  int metadata_socket_binary_format; // if zero, the standard format is used on the socket
+  char *metadata_shm_filename; // if set, metadata and status are also published in this file
   int get_coverart;
 #endif
 #ifdef CONFIG_MQTT
@@ -141,6 +148,7 @@ typedef struct {
   int mqtt_publish_raw;
   int mqtt_publish_parsed;
   int mqtt_publish_cover;
+  int mqtt_publish_retained; // if set, state topics are published as retained messages
   int mqtt_enable_remote;
 #endif
   uint8_t hw_addr[6];
@@ -239,7 +247,9 @@ typedef struct {
   int loudness;
   float loudness_reference_volume_db;
   int alsa_use_hardware_mute;
+  int alsa_use_output_thread; // write to the output device from a thread of its own
   double alsa_maximum_stall_time;
+  double alsa_delay_query_interval; // between these, the DAC's delay is predicted, not queried
   disable_standby_mode_type disable_standby_mode;
   volatile int keep_dac_busy;
   yna_type use_precision_timing; // defaults to no
@@ -254,6 +264,8 @@ typedef struct {
 #ifdef CONFIG_METADATA_HUB
   char *cover_art_cache_dir;
   int retain_coverart;
+  int cover_art_cache_maximum_entries; // if cover art is retained; zero means no limit
+  size_t cover_art_cache_maximum_size; // in bytes, if cover art is retained; zero means no limit
 
   int scan_interval_when_active;   // number of seconds between DACP server scans when playing
                                    // something (1)
@@ -370,6 +382,8 @@ void command_start(void);
 void command_stop(void);
 void command_execute(const char *command, const char *extra_argument, const int block);
 void command_set_volume(double volume);
+// wake the command supervisor when a child exits, returning 0 if it isn't running to reap it
+int hook_supervisor_wake(void);
 
 int mkpath(const char *path, mode_t mode);
 
@@ -37,8 +37,11 @@
 #include <memory.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -71,6 +74,9 @@ struct HttpResponse {
   ssize_t malloced_size; // this will be its allocated size
   ssize_t size;          // the current size of the content
   int code;
+  int headers_complete; // set when the status line and the headers have been parsed
+  int length_known;     // set if the response has a content length or is chunked
+  int connection_close; // set if the server will close the connection after the response
 };
 
 void *response_realloc(__attribute__((unused)) void *opaque, void *ptr, int size) {
@@ -101,15 +107,22 @@ void response_body(void *opaque, const char *data, int size) {
   response->size += size;
 }
 
-static void
-response_header(__attribute__((unused)) void *opaque, __attribute__((unused)) const char *ckey,
-                __attribute__((unused)) int nkey, __attribute__((unused)) const char *cvalue,
-                __attribute__((unused)) int nvalue) { /* example doesn't care about headers */
+static void response_header(void *opaque, const char *ckey, int nkey, const char *cvalue,
+                            int nvalue) {
+  struct HttpResponse *response = (struct HttpResponse *)opaque;
+  // the parser has put the key into lower case
+  if (((nkey == 14) && (strncmp(ckey, "content-length", nkey) == 0)) ||
+      ((nkey == 17) && (strncmp(ckey, "transfer-encoding", nkey) == 0)))
+    response->length_known = 1;
+  else if ((nkey == 10) && (strncmp(ckey, "connection", nkey) == 0) && (nvalue == 5) &&
+           (strncasecmp(cvalue, "close", nvalue) == 0))
+    response->connection_close = 1;
 }
 
 static void response_code(void *opaque, int code) {
   struct HttpResponse *response = (struct HttpResponse *)opaque;
   response->code = code;
+  response->headers_complete = 1; // the parser reports the code when it has all the headers
 }
 
 static const struct http_funcs responseFuncs = {
@@ -119,16 +132,85 @@ static const struct http_funcs responseFuncs = {
     response_code,
 };
 
+static void response_init(struct HttpResponse *response) {
+  memset(response, 0, sizeof(struct HttpResponse));
+}
+
+static void response_discard_body(struct HttpResponse *response) {
+  free(response->body);
+  response->body = NULL;
+  response->malloced_size = 0;
+  response->size = 0;
+}
+
 // static pthread_mutex_t dacp_conversation_lock = PTHREAD_MUTEX_INITIALIZER;
 // static pthread_mutex_t dacp_server_information_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t dacp_conversation_lock;
 static pthread_mutex_t dacp_server_information_lock;
 static pthread_cond_t dacp_server_information_cv = PTHREAD_COND_INITIALIZER;
 
-void addrinfo_cleanup(void *arg) {
-  // debug(1, "addrinfo cleanup called.");
-  struct addrinfo **info = (struct addrinfo **)arg;
-  freeaddrinfo(*info);
+// Commands are sent over a persistent HTTP/1.1 connection to the DACP server, so that a command
+// costs one round trip rather than an address lookup, a TCP handshake and a round trip. The
+// server's address is looked up again only when the server or its port changes. If the server
+// has closed the connection -- e.g. because it was idle for too long -- it's reopened and the
+// request is sent again. Requests on a connection are sent one after another, each after the
+// response to the previous one has arrived, as DACP servers don't all cope with pipelining.
+
+typedef struct {
+  pthread_mutex_t fd_lock;            // held while the fd is changed or interrupted
+  int fd;                             // -1 if not connected
+  int interrupted;                    // set if the fd was shut down by another thread
+  char server[INET6_ADDRSTRLEN + 16]; // the server the address was looked up for, with its scope
+  char portstring[10];                // and its port
+  struct sockaddr_storage address;
+  socklen_t address_length;
+  int address_valid;
+  int requests_on_connection;
+  char buffer[8192];
+  int buffer_start; // bytes received but not yet parsed start here...
+  int buffered;     // ...and there are this many of them
+  uint64_t connections_made;
+  uint64_t requests_made;
+  void (*while_waiting)(void); // if set, called every wait_interval_ms while awaiting a response
+  int wait_interval_ms;
+} dacp_connection;
+
+static dacp_connection dacp_command_connection = {.fd_lock = PTHREAD_MUTEX_INITIALIZER,
+                                                   .fd = -1};
+
+static void dacp_monitor_refresh_volume(void);
+
+// play status updates are long-polled on a connection of their own -- see the monitor thread
+static dacp_connection dacp_status_connection = {
+    .fd_lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .while_waiting = dacp_monitor_refresh_volume};
+
+// the longest time to wait for the reply to a long poll before asking again, in seconds
+#define dacp_long_poll_timeout 30
+
+// what's needed to make a request of the DACP server, taken together under the
+// dacp_server_information_lock, as the server can change at any time
+typedef struct {
+  char server[INET6_ADDRSTRLEN + 16]; // the address, with its scope if it's an IPv6 address
+  char ip_string[INET6_ADDRSTRLEN];
+  uint16_t port;
+  char portstring[10];
+  uint32_t active_remote_id;
+} dacp_server_address;
+
+// returns zero if no port has been discovered yet
+static int dacp_server_address_get(dacp_server_address *a) {
+  debug_mutex_lock(&dacp_server_information_lock, 500000, 2);
+  if (dacp_server.connection_family == AF_INET6) {
+    snprintf(a->server, sizeof(a->server), "%s%%%u", dacp_server.ip_string, dacp_server.scope_id);
+  } else {
+    snprintf(a->server, sizeof(a->server), "%s", dacp_server.ip_string);
+  }
+  snprintf(a->ip_string, sizeof(a->ip_string), "%s", dacp_server.ip_string);
+  a->port = dacp_server.port;
+  snprintf(a->portstring, sizeof(a->portstring), "%u", dacp_server.port);
+  a->active_remote_id = dacp_server.active_remote_id;
+  debug_mutex_unlock(&dacp_server_information_lock, 3);
+  return (a->port != 0);
 }
 
 void mutex_lock_cleanup(void *arg) {
@@ -137,23 +219,296 @@ void mutex_lock_cleanup(void *arg) {
     debug(1, "Error releasing mutex.");
 }
 
-void connect_cleanup(void *arg) {
-  int *fd = (int *)arg;
-  // debug(2, "dacp_send_command: close socket %d.",*fd);
-  close(*fd);
-}
-
 void http_cleanup(void *arg) {
   // debug(1, "http cleanup called.");
   struct http_roundtripper *rt = (struct http_roundtripper *)arg;
   http_free(rt);
 }
 
+static void dacp_connection_close(dacp_connection *c, int abort) {
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  pthread_mutex_lock(&c->fd_lock);
+  if (c->fd >= 0) {
+    if (abort) {
+      // don't leave a half-finished exchange in the server's queue
+      struct linger so_linger;
+      so_linger.l_onoff = 1; // "true"
+      so_linger.l_linger = 0;
+      if (setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger))
+        debug(1, "Could not set the dacp socket to abort on closing.");
+    }
+    // debug(2, "dacp_connection_close: close socket %d.", c->fd);
+    close(c->fd);
+    c->fd = -1;
+  }
+  pthread_mutex_unlock(&c->fd_lock);
+  pthread_setcancelstate(oldState, NULL);
+  c->buffer_start = 0;
+  c->buffered = 0;
+}
+
+// make a request in progress on the connection fail at once
+static void dacp_connection_interrupt(dacp_connection *c) {
+  pthread_mutex_lock(&c->fd_lock);
+  if (c->fd >= 0) {
+    shutdown(c->fd, SHUT_RDWR);
+    c->interrupted = 1;
+  }
+  pthread_mutex_unlock(&c->fd_lock);
+}
+
+// make sure the connection to the DACP server is open
+// returns zero or one of the custom HTTP-like codes
+static int dacp_connection_open(dacp_connection *c, const dacp_server_address *a,
+                                int timeout_us) {
+  const char *server = a->server;
+  const char *portstring = a->portstring;
+
+  if ((c->address_valid == 0) || (strcmp(server, c->server) != 0) ||
+      (strcmp(portstring, c->portstring) != 0)) {
+    // it's a different server or port, so forget the old one and look up the new one
+    dacp_connection_close(c, 0);
+    c->address_valid = 0;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    int ires = getaddrinfo(server, portstring, &hints, &res);
+    if (ires == 0) {
+      memcpy(&c->address, res->ai_addr, res->ai_addrlen);
+      c->address_length = res->ai_addrlen;
+      freeaddrinfo(res);
+    }
+    pthread_setcancelstate(oldState, NULL);
+    if (ires) {
+      // debug(1,"Error %d \"%s\" at getaddrinfo.",ires,gai_strerror(ires));
+      return 498; // Bad Address information for the DACP server
+    }
+    strcpy(c->server, server);
+    strcpy(c->portstring, portstring);
+    c->address_valid = 1;
+    debug(3, "dacp_connection_open: DACP server address for \"%s:%s\" looked up.", server,
+          portstring);
+  }
+
+  if (c->fd >= 0) {
+    // if there's anything to read on an idle connection, it's the server closing it
+    struct pollfd pfd;
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if ((c->buffered != 0) || (poll(&pfd, 1, 0) != 0)) {
+      debug(3, "dacp_connection_open: the DACP server closed the connection.");
+      dacp_connection_close(c, 0);
+    }
+  }
+
+  if (c->fd < 0) {
+    pthread_mutex_lock(&c->fd_lock);
+    c->fd = socket(c->address.ss_family, SOCK_STREAM, 0);
+    c->interrupted = 0;
+    pthread_mutex_unlock(&c->fd_lock);
+    if (c->fd == -1) {
+      // debug(1, "DACP socket could not be created -- error %d:
+      // \"%s\".",errno,strerror(errno));
+      return 497; // Can't establish a socket to the DACP server
+    }
+    // This is for limiting the time to be spent connecting and sending.
+    struct timeval tv;
+    tv.tv_sec = timeout_us / 1000000;
+    tv.tv_usec = timeout_us % 1000000;
+    if (setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof tv) == -1)
+      debug(1, "dacp_connection_open: error %d setting send timeout.", errno);
+    if (connect(c->fd, (struct sockaddr *)&c->address, c->address_length) < 0) {
+      // debug(1, "dacp_connection_open: connect failed with errno %d.", errno);
+      int connect_errno = errno;
+      dacp_connection_close(c, 0);
+      if (connect_errno == ECONNREFUSED)
+        return 491; // DACP server doesn't want to talk anymore...
+      else
+        return 496; // Can't connect to the DACP server
+    }
+    c->requests_on_connection = 0;
+    c->connections_made++;
+  }
+  return 0;
+}
+
+// wait for a response to begin, calling c->while_waiting every c->wait_interval_ms meanwhile
+// returns zero if there's something to receive, or if the connection failed, or -1 on timeout
+static int dacp_connection_wait(dacp_connection *c, int timeout_us) {
+  int remaining_ms = timeout_us / 1000;
+  while (remaining_ms > 0) {
+    int wait_ms = c->wait_interval_ms;
+    if (wait_ms > remaining_ms)
+      wait_ms = remaining_ms;
+    struct pollfd pfd;
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, wait_ms) != 0) // poll() is a cancellation point
+      return 0;                      // recv() will pick up the data or the error
+    remaining_ms -= wait_ms;
+    if (remaining_ms > 0)
+      c->while_waiting();
+  }
+  return -1;
+}
+
+// send a request on an open connection and parse the response
+// returns zero or one of the custom HTTP-like codes
+// *stale is set if the server closed the connection before responding
+static int dacp_connection_transact(dacp_connection *c, const char *message,
+                                    struct HttpResponse *response, int timeout_us, int *stale) {
+  *stale = 0;
+  // This is for limiting the time to be spent waiting for a response.
+  struct timeval tv;
+  tv.tv_sec = timeout_us / 1000000;
+  tv.tv_usec = timeout_us % 1000000;
+  if (setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
+    debug(1, "dacp_connection_transact: error %d setting receive timeout.", errno);
+
+  ssize_t wresp = send(c->fd, message, strlen(message), MSG_NOSIGNAL);
+  if (wresp != (ssize_t)strlen(message)) {
+    if (wresp == -1) {
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(2, "dacp_connection_transact: write error %d: \"%s\".", errno, (char *)errorstring);
+      *stale = (errno == EPIPE) || (errno == ECONNRESET);
+    }
+    dacp_connection_close(c, 1);
+    return 493; // Client failed to send a message
+  }
+  c->requests_on_connection++;
+  c->requests_made++;
+
+  int result = 0;
+  int parse_error = 0;
+  struct http_roundtripper rt;
+  http_init(&rt, responseFuncs, response);
+  pthread_cleanup_push(http_cleanup, &rt);
+  int needmore = 1;
+  int received = 0; // the number of bytes of the response parsed so far
+  while (needmore && (result == 0)) {
+    if (c->buffered == 0) {
+      c->buffer_start = 0;
+      ssize_t ndata;
+      if ((received == 0) && (c->while_waiting != NULL) && (c->wait_interval_ms > 0) &&
+          (dacp_connection_wait(c, timeout_us) != 0)) {
+        ndata = -1;
+        errno = EAGAIN; // as if the receive had timed out
+      } else {
+        ndata = recv(c->fd, c->buffer, sizeof(c->buffer), 0);
+      }
+      if (ndata > 0) {
+        c->buffered = ndata;
+      } else if ((ndata == 0) && (response->headers_complete) && (response->length_known == 0)) {
+        // the body of a response without a length ends when the connection closes
+        response->connection_close = 1;
+        needmore = 0;
+      } else {
+        if (ndata == -1) {
+          char errorstring[1024];
+          strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+          debug(2, "dacp_connection_transact: receiving error %d: \"%s\".", errno,
+                (char *)errorstring);
+        }
+        *stale = (received == 0) && ((ndata == 0) || (errno == ECONNRESET));
+        result = 495; // Error receiving response
+      }
+    }
+    while (needmore && (c->buffered > 0)) {
+      char *data = c->buffer + c->buffer_start;
+      if ((received == 0) && ((*data == '\r') || (*data == '\n'))) {
+        // skip the line ending that the parser leaves after the last chunk of a chunked response
+        c->buffer_start++;
+        c->buffered--;
+      } else {
+        int read;
+        needmore = http_data(&rt, data, c->buffered, &read);
+        received += read;
+        c->buffer_start += read;
+        c->buffered -= read;
+        // a response that never has a body may not have a length either
+        if ((needmore) && (response->headers_complete) && (response->length_known == 0) &&
+            ((response->code == 204) || (response->code == 304)))
+          needmore = 0;
+      }
+    }
+  }
+  parse_error = (result == 0) && (http_iserror(&rt));
+  pthread_cleanup_pop(1); // this should call http_cleanup
+
+  if (parse_error) {
+    debug(3, "dacp_connection_transact: error parsing data.");
+    response_discard_body(response);
+  }
+  if (result != 0)
+    response_discard_body(response);
+  if ((result != 0) || (parse_error) || (response->connection_close))
+    dacp_connection_close(c, result != 0);
+  return result;
+}
+
+typedef struct {
+  dacp_connection *connection;
+  struct HttpResponse *response;
+} dacp_request_cleanup_info;
+
+static void dacp_request_cleanup(void *arg) {
+  // cancelled in the middle of a request, so the connection is no longer usable
+  dacp_request_cleanup_info *info = (dacp_request_cleanup_info *)arg;
+  dacp_connection_close(info->connection, 1);
+  response_discard_body(info->response);
+}
+
+// send a request to the DACP server on the connection, opening or reopening it as needed
+// the response code is in response->code unless a custom HTTP-like code is returned
+static int dacp_connection_request(dacp_connection *c, const dacp_server_address *a,
+                                   const char *message, struct HttpResponse *response,
+                                   int timeout_us) {
+  int result, stale, retry;
+  volatile int attempts = 0; // as it's live across the setjmp in pthread_cleanup_push()
+  dacp_request_cleanup_info cleanup_info;
+  cleanup_info.connection = c;
+  cleanup_info.response = response;
+  pthread_cleanup_push(dacp_request_cleanup, (void *)&cleanup_info);
+  do {
+    retry = 0;
+    attempts++;
+    result = dacp_connection_open(c, a, timeout_us);
+    if (result == 0) {
+      int reused = (c->requests_on_connection != 0);
+      response_init(response);
+      result = dacp_connection_transact(c, message, response, timeout_us, &stale);
+      // if the server closed a connection it had kept open for us, try a fresh one
+      if ((result != 0) && (stale) && (reused) && (attempts == 1) && (c->interrupted == 0)) {
+        debug(3, "dacp_connection_request: the connection was closed by the DACP server -- "
+                 "reconnecting.");
+        retry = 1;
+      }
+    }
+  } while (retry);
+  pthread_cleanup_pop(0);
+  return result;
+}
+
+static void dacp_request_message(char *message, size_t size, const dacp_server_address *a,
+                                 const char *command) {
+  snprintf(message, size,
+           "GET /ctrl-int/1/%s HTTP/1.1\r\nHost: %s:%u\r\nActive-Remote: %u\r\n\r\n", command,
+           a->ip_string, a->port, a->active_remote_id);
+}
+
 int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
   int result;
   // debug(1,"dacp_send_command: command is: \"%s\".",command);
 
-  if (dacp_server.port == 0) {
+  dacp_server_address address;
+  if (dacp_server_address_get(&address) == 0) {
     debug(1, "No DACP port specified yet");
     result = 490; // no port specified
   } else {
@@ -170,193 +525,37 @@ int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
     //  492 Argument out of range
     //  491 Client refused connection
 
-    struct addrinfo hints, *res;
-    int sockfd;
-
     struct HttpResponse response;
-    response.body = NULL;
-    response.malloced_size = 0;
-    response.size = 0;
-    response.code = 0;
-
-    char portstring[10], server[1024], message[1024];
-    memset(&portstring, 0, sizeof(portstring));
-    if (dacp_server.connection_family == AF_INET6) {
-      snprintf(server, sizeof(server), "%s%%%u", dacp_server.ip_string, dacp_server.scope_id);
-    } else {
-      strcpy(server, dacp_server.ip_string);
-    }
-    snprintf(portstring, sizeof(portstring), "%u", dacp_server.port);
-
-    // first, load up address structs with getaddrinfo():
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    // debug(1, "DACP port string is \"%s:%s\".", server, portstring);
-
-    int ires = getaddrinfo(server, portstring, &hints, &res);
-    if (ires) {
-      // debug(1,"Error %d \"%s\" at getaddrinfo.",ires,gai_strerror(ires));
-      response.code = 498; // Bad Address information for the DACP server
+    response_init(&response);
+
+    char message[1024];
+    uint64_t start_time = get_absolute_time_in_fp();
+    // only do this one at a time, as there's only one connection
+    int mutex_reply = sps_pthread_mutex_timedlock(&dacp_conversation_lock, 2000000, command, 1);
+    // int mutex_reply = pthread_mutex_lock(&dacp_conversation_lock);
+    if (mutex_reply == 0) {
+      pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_conversation_lock);
+      dacp_request_message(message, sizeof(message), &address, command);
+      debug(3, "dacp_send_command: \"%s\".", command);
+      int reply =
+          dacp_connection_request(&dacp_command_connection, &address, message, &response, 500000);
+      if (reply)
+        response.code = reply;
+      pthread_cleanup_pop(1); // this should unlock the dacp_conversation_lock);
+      // debug(1,"Sent command\"%s\" with a response body of size %d.",command,response.size);
+      // debug(1,"dacp_conversation_lock released.");
     } else {
-      uint64_t start_time = get_absolute_time_in_fp();
-      pthread_cleanup_push(addrinfo_cleanup, (void *)&res);
-      // only do this one at a time -- not sure it is necessary, but better safe than sorry
-
-      int mutex_reply = sps_pthread_mutex_timedlock(&dacp_conversation_lock, 2000000, command, 1);
-      // int mutex_reply = pthread_mutex_lock(&dacp_conversation_lock);
-      if (mutex_reply == 0) {
-        pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_conversation_lock);
-
-        // make a socket:
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-        if (sockfd == -1) {
-          // debug(1, "DACP socket could not be created -- error %d:
-          // \"%s\".",errno,strerror(errno));
-          response.code = 497; // Can't establish a socket to the DACP server
-        } else {
-          pthread_cleanup_push(connect_cleanup, (void *)&sockfd);
-          // debug(2, "dacp_send_command: open socket %d.",sockfd);
-
-
-          // This is for limiting the time to be spent waiting for a response.
-
-          struct timeval tv;
-          tv.tv_sec = 0;
-          tv.tv_usec = 500000;
-          if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
-             debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
-          if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof tv) == -1)
-            debug(1, "dacp_send_command: error %d setting send timeout.", errno);
-
-
-          // connect!
-          // debug(1, "DACP socket created.");
-          if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-            // debug(1, "dacp_send_command: connect failed with errno %d.", errno);
-            if (errno == ECONNREFUSED)
-              response.code = 491; // DACP server doesn't want to talk anymore...
-            else
-              response.code = 496; // Can't connect to the DACP server
-          } else {
-            // debug(1,"DACP connect succeeded.");
-
-            snprintf(message, sizeof(message),
-                     "GET /ctrl-int/1/%s HTTP/1.1\r\nHost: %s:%u\r\nActive-Remote: %u\r\n\r\n",
-                     command, dacp_server.ip_string, dacp_server.port,
-                     dacp_server.active_remote_id);
-
-            // Send command
-            debug(3, "dacp_send_command: \"%s\".", command);
-            ssize_t wresp = send(sockfd, message, strlen(message), 0);
-            if (wresp == -1) {
-              char errorstring[1024];
-              strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-              debug(2, "dacp_send_command: write error %d: \"%s\".", errno, (char *)errorstring);
-              struct linger so_linger;
-              so_linger.l_onoff = 1; // "true"
-              so_linger.l_linger = 0;
-              int err = setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-              if (err)
-                debug(1, "Could not set the dacp socket to abort due to a write error on closing.");
-            }
-            if (wresp != (ssize_t)strlen(message)) {
-              // debug(1, "dacp_send_command: send failed.");
-              response.code = 493; // Client failed to send a message
-
-            } else {
-
-              response.body = malloc(2048); // it can resize this if necessary
-              response.malloced_size = 2048;
-              pthread_cleanup_push(malloc_cleanup, response.body);
-
-              struct http_roundtripper rt;
-              http_init(&rt, responseFuncs, &response);
-              pthread_cleanup_push(http_cleanup, &rt);
-
-              int needmore = 1;
-              int looperror = 0;
-              char buffer[8192];
-              memset(buffer, 0, sizeof(buffer));
-              while (needmore && !looperror) {
-                const char *data = buffer;
-                if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
-                  debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
-                ssize_t ndata = recv(sockfd, buffer, sizeof(buffer), 0);
-                // debug(3, "Received %d bytes: \"%s\".", ndata, buffer);
-                if (ndata <= 0) {
-                  if (ndata == -1) {
-                    char errorstring[1024];
-                    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-                    debug(2, "dacp_send_command: receiving error %d: \"%s\".", errno,
-                          (char *)errorstring);
-                    struct linger so_linger;
-                    so_linger.l_onoff = 1; // "true"
-                    so_linger.l_linger = 0;
-                    int err =
-                        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-                    if (err)
-                      debug(
-                          1,
-                          "Could not set the dacp socket to abort due to a read error on closing.");
-                  }
-
-                  free(response.body);
-                  response.body = NULL;
-                  response.malloced_size = 0;
-                  response.size = 0;
-                  response.code = 495; // Error receiving response
-                  looperror = 1;
-                }
-
-                while (needmore && ndata && !looperror) {
-                  int read;
-                  needmore = http_data(&rt, data, ndata, &read);
-                  ndata -= read;
-                  data += read;
-                }
-              }
-
-              if (http_iserror(&rt)) {
-                debug(3, "dacp_send_command: error parsing data.");
-                free(response.body);
-                response.body = NULL;
-                response.malloced_size = 0;
-                response.size = 0;
-              }
-              // debug(1,"Size of response body is %d",response.size);
-              pthread_cleanup_pop(1); // this should call http_cleanup
-              // http_free(&rt);
-              pthread_cleanup_pop(
-                  0); // this should *not* free the malloced buffer -- just pop the malloc cleanup
-            }
-          }
-          pthread_cleanup_pop(1); // this should close the socket
-                                  // close(sockfd);
-                                  // debug(1,"DACP socket closed.");
-        }
-        pthread_cleanup_pop(1); // this should unlock the dacp_conversation_lock);
-        // pthread_mutex_unlock(&dacp_conversation_lock);
-        // debug(1,"Sent command\"%s\" with a response body of size %d.",command,response.size);
-        // debug(1,"dacp_conversation_lock released.");
-      } else {
-        debug(3,
-              "dacp_send_command: could not acquire a lock on the dacp transmit/receive section "
-              "when attempting to "
-              "send the command \"%s\". Possible timeout?",
-              command);
-        response.code = 494; // This client is already busy
-      }
-      pthread_cleanup_pop(1); // this should free the addrinfo
-      // freeaddrinfo(res);
-      uint64_t et = get_absolute_time_in_fp() - start_time;
-      et = (et * 1000000) >> 32; // microseconds
-      debug(3, "dacp_send_command: %f seconds, response code %d, command \"%s\".",
-            (1.0 * et) / 1000000, response.code, command);
+      debug(3,
+            "dacp_send_command: could not acquire a lock on the dacp transmit/receive section "
+            "when attempting to "
+            "send the command \"%s\". Possible timeout?",
+            command);
+      response.code = 494; // This client is already busy
     }
+    uint64_t et = get_absolute_time_in_fp() - start_time;
+    et = (et * 1000000) >> 32; // microseconds
+    debug(3, "dacp_send_command: %f seconds, response code %d, command \"%s\".",
+          (1.0 * et) / 1000000, response.code, command);
     *body = response.body;
     *bodysize = response.size;
     result = response.code;
@@ -364,6 +563,30 @@ int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
   return result;
 }
 
+// Send a playstatusupdate request that the server may hold open until the play status changes.
+// It uses its own connection, and is used only by the monitor thread, so it doesn't wait for or
+// hold up other commands. While it's held, the speaker volume is refreshed every
+// refresh_interval seconds, as playstatusupdate doesn't report it.
+static int dacp_send_long_poll(const char *command, char **body, ssize_t *bodysize,
+                               int refresh_interval) {
+  dacp_server_address address;
+  if (dacp_server_address_get(&address) == 0)
+    return 490; // no port specified
+  dacp_status_connection.wait_interval_ms = refresh_interval * 1000;
+  struct HttpResponse response;
+  response_init(&response);
+  char message[1024];
+  dacp_request_message(message, sizeof(message), &address, command);
+  debug(3, "dacp_send_long_poll: \"%s\".", command);
+  int reply = dacp_connection_request(&dacp_status_connection, &address, message, &response,
+                                      dacp_long_poll_timeout * 1000000);
+  if (reply)
+    response.code = reply;
+  *body = response.body;
+  *bodysize = response.size;
+  return response.code;
+}
+
 int send_simple_dacp_command(const char *command) {
   int reply = 0;
   char *server_reply = NULL;
@@ -424,6 +647,7 @@ void set_dacp_server_information(rtsp_conn_info *conn) {
 
 
     mdns_dacp_monitor_set_id(dacp_server.dacp_id);
+    dacp_connection_interrupt(&dacp_status_connection); // stop long-polling the old server
 
     metadata_hub_modify_prolog();
     int ch = metadata_store.dacp_server_active != dacp_server.scan_enable;
@@ -462,6 +686,8 @@ void dacp_monitor_port_update_callback(char *dacp_id, uint16_t port) {
         "number %d.",
         dacp_id, dacp_server.dacp_id, port);
   if (strcmp(dacp_id, dacp_server.dacp_id) == 0) {
+    if (dacp_server.port != port)
+      dacp_connection_interrupt(&dacp_status_connection);
     dacp_server.port = port;
     if (port == 0)
       dacp_server.scan_enable = 0;
@@ -480,6 +706,18 @@ void dacp_monitor_port_update_callback(char *dacp_id, uint16_t port) {
   debug_mutex_unlock(&dacp_server_information_lock, 3);
 }
 
+// keep the metadata hub's speaker volume up to date while a long poll is held
+static void dacp_monitor_refresh_volume(void) {
+  int32_t the_volume;
+  if (dacp_get_volume(&the_volume) == 200) {
+    metadata_hub_modify_prolog();
+    int diff = metadata_store.speaker_volume != the_volume;
+    if (diff)
+      metadata_store.speaker_volume = the_volume;
+    metadata_hub_modify_epilog(diff);
+  }
+}
+
 void dacp_monitor_thread_code_cleanup(__attribute__((unused)) void *arg) {
   // debug(1, "dacp_monitor_thread_code_cleanup called.");
   pthread_mutex_unlock(&dacp_server_information_lock);
@@ -492,6 +730,9 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
   // debug(1, "DACP monitor thread started.");
   // wait until we get a valid port number to begin monitoring it
   int32_t revision_number = 1;
+  // 1 if the server supports long polling, 0 if not, -1 if not known -- volatile, as it's live
+  // across the setjmp in pthread_cleanup_push()
+  volatile int long_poll_status = -1;
   int bad_result_count = 0;
   int idle_scan_count = 0;
   while (1) {
@@ -522,12 +763,22 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
       // so dacp_server.scan_enable will be true at this point
       bad_result_count = 0;
       idle_scan_count = 0;
+      // it may be a different server, so start again
+      revision_number = 1;
+      long_poll_status = -1;
     }
 
     always_use_revision_number_1 = dacp_server.always_use_revision_number_1; // set this while access is locked
+    pthread_cleanup_pop(1);
+    // declared here, after the setjmp in pthread_cleanup_push(), so they can't be clobbered
+    int long_polled = 0;
+    uint64_t long_poll_time = 0;
+    int scan_interval = config.scan_interval_when_inactive;
+    if (metadata_store.player_thread_active)
+      scan_interval = config.scan_interval_when_active;
 
+    // not while the lock is held, as the command takes the lock to get the server's address
     result = dacp_get_volume(&the_volume); // just want the http code
-    pthread_cleanup_pop(1);
 
     scan_index++;
     // debug(1,"DACP Scan Result: %d.", result);
@@ -614,12 +865,30 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
       char *response = NULL;
       int32_t item_size;
       char command[1024] = "";
-      if (always_use_revision_number_1 != 0) // for forked-daapd
+      // A server that supports long polling replies to a request with the latest revision number
+      // only when something has changed, so there's no need to poll it. One that doesn't replies
+      // at once with a 403, so it's polled instead.
+      long_polled = (long_poll_status != 0);
+      if ((long_polled == 0) && (always_use_revision_number_1 != 0)) // for forked-daapd
         revision_number = 1;
       snprintf(command, sizeof(command) - 1, "playstatusupdate?revision-number=%d",
                revision_number);
       // debug(1,"dacp_monitor_thread_code: command: \"%s\"",command);
-      result = dacp_send_command(command, &response, &le);
+      uint64_t request_time = get_absolute_time_in_fp();
+      if (long_polled)
+        result = dacp_send_long_poll(command, &response, &le, scan_interval);
+      else
+        result = dacp_send_command(command, &response, &le);
+      long_poll_time = get_absolute_time_in_fp() - request_time;
+      if (long_polled) {
+        if (result == 403) {
+          debug(2, "The DACP server does not support long polling for play status updates.");
+          long_poll_status = 0;
+        } else if ((result == 200) && (revision_number != 1) && (long_poll_status == -1)) {
+          debug(2, "The DACP server supports long polling for play status updates.");
+          long_poll_status = 1;
+        }
+      }
       // debug(1,"Response to \"%s\" is %d.",command,result);
       // remember: unless the revision_number you pass in is 1,
       // response will be 200 only if there's something new to report.
@@ -879,10 +1148,11 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
       response = NULL;
     }
     */
-    if (metadata_store.player_thread_active)
-      sleep(config.scan_interval_when_active);
-    else
-      sleep(config.scan_interval_when_inactive);
+    // After a long poll that was held for a scan interval or more, ask again at once. Otherwise
+    // wait, so that a server that replies at once, even with a 200, isn't asked any more often
+    // than if it were polled.
+    if ((long_polled == 0) || (long_poll_time < ((uint64_t)scan_interval << 32)))
+      sleep(scan_interval);
   }
   debug(1, "DACP monitor thread exiting -- should never happen.");
   pthread_exit(NULL);
@@ -945,6 +1215,10 @@ void dacp_monitor_stop() {
     debug(2, "dacp_monitor_stop");
     pthread_cancel(dacp_monitor_thread);
     pthread_join(dacp_monitor_thread, NULL);
+    debug(2, "DACP commands were sent over %" PRIu64 " connection(s) with %" PRIu64 " request(s).",
+          dacp_command_connection.connections_made, dacp_command_connection.requests_made);
+    dacp_connection_close(&dacp_command_connection, 0);
+    dacp_connection_close(&dacp_status_connection, 0);
     pthread_mutex_destroy(&dacp_server_information_lock);
     debug(3, "DACP Conversation Lock Mutex Destroyed");
     pthread_mutex_destroy(&dacp_conversation_lock);
@@ -0,0 +1,61 @@
+#ifndef _METADATA_BINARY_H
+#define _METADATA_BINARY_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+// The binary metadata format, an alternative to XML on the metadata pipe and to the standard
+// format on the metadata UDP socket.
+
+// Each item is sent as a fixed-size header followed by its payload, unencoded.
+// All the header fields are 32-bit unsigned integers in network byte order:
+
+//  0  magic     -- 'ssbm', to help a reader find its place
+//  4  type      -- e.g. 'core' or 'ssnc'
+//  8  code      -- e.g. 'asal' or 'PICT'
+// 12  sequence  -- incremented for every item; a gap means items were missed
+// 16  length    -- the length of the item's whole payload
+// 20  offset    -- where in the payload the bytes following this header belong
+
+// On the pipe, the whole payload follows the header and the offset is always zero.
+// On the UDP socket, an item whose payload doesn't fit in one packet is sent in a number of
+// packets, each with the header, sharing the sequence number and length and with the offset of its
+// part of the payload. The number of payload bytes in a packet is the size of the packet less the
+// size of the header.
+
+#define METADATA_BINARY_MAGIC 'ssbm'
+#define METADATA_BINARY_HEADER_LENGTH 24
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t code;
+  uint32_t sequence;
+  uint32_t length;
+  uint32_t offset;
+} metadata_binary_header; // in host byte order
+
+static inline void metadata_binary_header_pack(const metadata_binary_header *header, char *buf) {
+  uint32_t v[6];
+  v[0] = htonl(header->magic);
+  v[1] = htonl(header->type);
+  v[2] = htonl(header->code);
+  v[3] = htonl(header->sequence);
+  v[4] = htonl(header->length);
+  v[5] = htonl(header->offset);
+  memcpy(buf, v, METADATA_BINARY_HEADER_LENGTH);
+}
+
+static inline void metadata_binary_header_unpack(const char *buf, metadata_binary_header *header) {
+  uint32_t v[6];
+  memcpy(v, buf, METADATA_BINARY_HEADER_LENGTH);
+  header->magic = ntohl(v[0]);
+  header->type = ntohl(v[1]);
+  header->code = ntohl(v[2]);
+  header->sequence = ntohl(v[3]);
+  header->length = ntohl(v[4]);
+  header->offset = ntohl(v[5]);
+}
+
+#endif // _METADATA_BINARY_H
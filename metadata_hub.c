@@ -29,6 +29,7 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -39,12 +40,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 #include "config.h"
 
 #include "common.h"
 #include "dacp.h"
 #include "metadata_hub.h"
+#include "metadata_shm.h"
+#include "rtsp.h"
 
 #ifdef CONFIG_MBEDTLS
 #include <mbedtls/md5.h>
@@ -65,6 +69,54 @@ int metadata_hub_initialised = 0;
 
 pthread_rwlock_t metadata_hub_re_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+// The cover art cache.
+// Pictures are stored in files named by their MD5 digest. An index of the files is kept in memory,
+// so a picture that's already in the cache doesn't touch the disk at all. New files are written by
+// the cover art writer thread, which syncs them in batches, and the least recently used files are
+// deleted to keep the cache within its budget. Unless cover art is to be retained, the budget is
+// one picture -- the current one.
+
+typedef struct {
+  uint8_t digest[16];
+  char ext[4];
+  size_t size;
+  uint64_t last_used;
+} cover_art_cache_entry;
+
+typedef struct cover_art_write_job {
+  struct cover_art_write_job *next;
+  uint8_t digest[16];
+  const char *ext;
+  char *data;
+  size_t length;
+  metadata_payload *payload; // if set, the data belongs to this, otherwise it's malloced
+  uint64_t generation; // of the picture
+  char *pathname;
+  char *temporary_pathname;
+  int fd;
+} cover_art_write_job;
+
+static pthread_mutex_t cover_art_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cover_art_cache_job_added = PTHREAD_COND_INITIALIZER;
+static cover_art_cache_entry *cover_art_cache_entries = NULL;
+static int cover_art_cache_entry_count = 0;
+static int cover_art_cache_entries_size = 0;
+static size_t cover_art_cache_bytes = 0;
+static uint64_t cover_art_cache_use_count = 0;
+static cover_art_write_job *cover_art_jobs = NULL; // in order of arrival
+// advanced, in the order of the metadata, for every picture and every new track, so that a picture
+// that's been overtaken is never announced -- accessed atomically
+static uint64_t cover_art_generation = 0;
+static int cover_art_writer_running = 0;
+static pthread_t cover_art_writer_thread;
+
+static pthread_mutex_t metadata_watchers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metadata_watchers_signal = PTHREAD_COND_INITIALIZER;
+static metadata_bundle metadata_watchers_snapshot; // the latest copy of the bundle, if pending
+static int metadata_watchers_pending = 0;
+static int metadata_watchers_running = 0;
+static pthread_t metadata_watchers_thread;
+
 int string_update(char **str, int *flag, char *s) {
   if (s)
     return string_update_with_size(str, flag, s, strlen(s));
@@ -72,13 +124,37 @@ int string_update(char **str, int *flag, char *s) {
     return string_update_with_size(str, flag, NULL, 0);
 }
 
+void *cover_art_writer_thread_function(void *arg);
+void *metadata_watchers_thread_function(void *arg);
+
 void metadata_hub_init(void) {
   // debug(1, "Metadata bundle initialisation.");
   memset(&metadata_store, 0, sizeof(metadata_store));
+  if (pthread_create(&metadata_watchers_thread, NULL, metadata_watchers_thread_function, NULL))
+    debug(1, "Failed to create the metadata watchers thread!");
+  else
+    metadata_watchers_running = 1;
+  if (strcmp(config.cover_art_cache_dir, "") != 0) { // an empty string means do not write files
+    if (pthread_create(&cover_art_writer_thread, NULL, cover_art_writer_thread_function, NULL))
+      debug(1, "Failed to create the cover art writer thread!");
+    else
+      cover_art_writer_running = 1;
+  }
   metadata_hub_initialised = 1;
 }
 
-void metadata_hub_stop(void) {}
+void metadata_hub_stop(void) {
+  if (metadata_watchers_running) {
+    pthread_cancel(metadata_watchers_thread);
+    pthread_join(metadata_watchers_thread, NULL);
+    metadata_watchers_running = 0;
+  }
+  if (cover_art_writer_running) {
+    pthread_cancel(cover_art_writer_thread);
+    pthread_join(cover_art_writer_thread, NULL);
+    cover_art_writer_running = 0;
+  }
+}
 
 void add_metadata_watcher(metadata_watcher fn, void *userdata) {
   int i;
@@ -99,34 +175,128 @@ void metadata_hub_unlock_hub_mutex_cleanup(__attribute__((unused)) void *arg) {
 }
 */
 
-void run_metadata_watchers(void) {
-  int i;
-  for (i = 0; i < number_of_watchers; i++) {
-    if (metadata_store.watchers[i]) {
-      metadata_store.watchers[i](&metadata_store, metadata_store.watchers_data[i]);
+// Watchers are run on their own thread, from a copy of the metadata bundle, so that the hub is
+// locked only while the copy is made. Changes arriving within a short interval of one another are
+// merged, so that the watchers see, e.g., all the fields of a new track in one go.
+
+#define metadata_watcher_coalescing_interval_ms 20
+
+static const size_t metadata_bundle_string_offsets[] = {
+    offsetof(metadata_bundle, client_ip),         offsetof(metadata_bundle, server_ip),
+    offsetof(metadata_bundle, progress_string),   offsetof(metadata_bundle, cover_art_pathname),
+    offsetof(metadata_bundle, track_name),        offsetof(metadata_bundle, artist_name),
+    offsetof(metadata_bundle, album_artist_name), offsetof(metadata_bundle, album_name),
+    offsetof(metadata_bundle, genre),             offsetof(metadata_bundle, comment),
+    offsetof(metadata_bundle, composer),          offsetof(metadata_bundle, file_kind),
+    offsetof(metadata_bundle, song_description),  offsetof(metadata_bundle, song_album_artist),
+    offsetof(metadata_bundle, sort_name),         offsetof(metadata_bundle, sort_artist),
+    offsetof(metadata_bundle, sort_album),        offsetof(metadata_bundle, sort_composer)};
+
+static const size_t metadata_bundle_changed_flag_offsets[] = {
+    offsetof(metadata_bundle, cover_art_pathname_changed),
+    offsetof(metadata_bundle, client_ip_changed),
+    offsetof(metadata_bundle, server_ip_changed),
+    offsetof(metadata_bundle, progress_string_changed),
+    offsetof(metadata_bundle, item_id_changed),
+    offsetof(metadata_bundle, item_composite_id_changed),
+    offsetof(metadata_bundle, artist_name_changed),
+    offsetof(metadata_bundle, album_artist_name_changed),
+    offsetof(metadata_bundle, album_name_changed),
+    offsetof(metadata_bundle, track_name_changed),
+    offsetof(metadata_bundle, genre_changed),
+    offsetof(metadata_bundle, comment_changed),
+    offsetof(metadata_bundle, composer_changed),
+    offsetof(metadata_bundle, file_kind_changed),
+    offsetof(metadata_bundle, song_description_changed),
+    offsetof(metadata_bundle, song_album_artist_changed),
+    offsetof(metadata_bundle, sort_name_changed),
+    offsetof(metadata_bundle, sort_artist_changed),
+    offsetof(metadata_bundle, sort_album_changed),
+    offsetof(metadata_bundle, sort_composer_changed),
+    offsetof(metadata_bundle, songtime_in_milliseconds_changed)};
+
+#define metadata_bundle_field(bundle, offset, type) (*(type *)((char *)(bundle) + (offset)))
+
+static void metadata_bundle_free_strings(metadata_bundle *bundle) {
+  unsigned int i;
+  for (i = 0; i < sizeof(metadata_bundle_string_offsets) / sizeof(size_t); i++) {
+    char **str = &metadata_bundle_field(bundle, metadata_bundle_string_offsets[i], char *);
+    free(*str);
+    *str = NULL;
+  }
+}
+
+// copy the store into the snapshot, keeping any change flags already in the snapshot
+// call this with the hub locked and the metadata_watchers_lock held
+static void metadata_watchers_take_snapshot(void) {
+  unsigned int i;
+  int changed_flags[sizeof(metadata_bundle_changed_flag_offsets) / sizeof(size_t)];
+  for (i = 0; i < sizeof(metadata_bundle_changed_flag_offsets) / sizeof(size_t); i++)
+    changed_flags[i] =
+        metadata_watchers_pending
+            ? metadata_bundle_field(&metadata_watchers_snapshot,
+                                    metadata_bundle_changed_flag_offsets[i], int)
+            : 0;
+  if (metadata_watchers_pending)
+    metadata_bundle_free_strings(&metadata_watchers_snapshot);
+  memcpy(&metadata_watchers_snapshot, &metadata_store, sizeof(metadata_bundle));
+  for (i = 0; i < sizeof(metadata_bundle_string_offsets) / sizeof(size_t); i++) {
+    char **str =
+        &metadata_bundle_field(&metadata_watchers_snapshot, metadata_bundle_string_offsets[i], char *);
+    if (*str)
+      *str = strdup(*str);
+  }
+  for (i = 0; i < sizeof(metadata_bundle_changed_flag_offsets) / sizeof(size_t); i++) {
+    metadata_bundle_field(&metadata_watchers_snapshot, metadata_bundle_changed_flag_offsets[i],
+                          int) |= changed_flags[i];
+    // turn off the store's changed flag
+    metadata_bundle_field(&metadata_store, metadata_bundle_changed_flag_offsets[i], int) = 0;
+  }
+  metadata_watchers_pending = 1;
+}
+
+static void metadata_watchers_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&metadata_watchers_lock);
+}
+
+void *metadata_watchers_thread_function(__attribute__((unused)) void *arg) {
+  metadata_bundle bundle;
+  while (1) {
+    pthread_mutex_lock(&metadata_watchers_lock);
+    pthread_cleanup_push(metadata_watchers_cleanup_handler, NULL);
+    while (metadata_watchers_pending == 0)
+      pthread_cond_wait(&metadata_watchers_signal, &metadata_watchers_lock);
+    pthread_cleanup_pop(0);
+    pthread_mutex_unlock(&metadata_watchers_lock);
+
+    // let further changes accumulate for a moment
+    usleep(metadata_watcher_coalescing_interval_ms * 1000);
+
+    pthread_mutex_lock(&metadata_watchers_lock);
+    memcpy(&bundle, &metadata_watchers_snapshot, sizeof(metadata_bundle));
+    metadata_watchers_pending = 0; // the strings now belong to bundle
+    pthread_mutex_unlock(&metadata_watchers_lock);
+
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    int i;
+    for (i = 0; i < number_of_watchers; i++) {
+      if (bundle.watchers[i]) {
+        bundle.watchers[i](&bundle, bundle.watchers_data[i]);
+      }
     }
+    metadata_bundle_free_strings(&bundle);
+    pthread_setcancelstate(oldState, NULL);
   }
-  // turn off changed flags
-  metadata_store.cover_art_pathname_changed = 0;
-  metadata_store.client_ip_changed = 0;
-  metadata_store.server_ip_changed = 0;
-  metadata_store.progress_string_changed = 0;
-  metadata_store.item_id_changed = 0;
-  metadata_store.item_composite_id_changed = 0;
-  metadata_store.artist_name_changed = 0;
-  metadata_store.album_artist_name_changed = 0;
-  metadata_store.album_name_changed = 0;
-  metadata_store.track_name_changed = 0;
-  metadata_store.genre_changed = 0;
-  metadata_store.comment_changed = 0;
-  metadata_store.composer_changed = 0;
-  metadata_store.file_kind_changed = 0;
-  metadata_store.song_description_changed = 0;
-  metadata_store.song_album_artist_changed = 0;
-  metadata_store.sort_artist_changed = 0;
-  metadata_store.sort_album_changed = 0;
-  metadata_store.sort_composer_changed = 0;
-  metadata_store.songtime_in_milliseconds_changed = 0;
+  pthread_exit(NULL);
+}
+
+void run_metadata_watchers(void) {
+  // called with the hub locked for writing
+  pthread_mutex_lock(&metadata_watchers_lock);
+  metadata_watchers_take_snapshot();
+  pthread_cond_signal(&metadata_watchers_signal);
+  pthread_mutex_unlock(&metadata_watchers_lock);
 }
 
 void metadata_hub_modify_prolog(void) {
@@ -145,6 +315,7 @@ void metadata_hub_modify_epilog(int modified) {
   metadata_store.dacp_server_has_been_active =
       metadata_store.dacp_server_active; // set the scanner_has_been_active now.
   if (modified) {
+    metadata_shm_update_bundle(&metadata_store);
     run_metadata_watchers();
   }
   pthread_rwlock_unlock(&metadata_hub_re_lock);
@@ -167,133 +338,338 @@ void metadata_hub_read_epilog(void) {
   pthread_rwlock_unlock(&metadata_hub_re_lock);
 }
 
-char *metadata_write_image_file(const char *buf, int len) {
-
-  // warning -- this removes all files from the directory apart from this one, if it exists
-  // it will return a path to the image file allocated with malloc.
-  // free it if you don't need it.
-
-  char *path = NULL; // this will be what is returned  
-  if (strcmp(config.cover_art_cache_dir,"") != 0) { // an empty string means do not write the file
-
-    uint8_t img_md5[16];
-    // uint8_t ap_md5[16];
-
-  #ifdef CONFIG_OPENSSL
-    MD5_CTX ctx;
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, buf, len);
-    MD5_Final(img_md5, &ctx);
-  #endif
-
-  #ifdef CONFIG_MBEDTLS
-  #if MBEDTLS_VERSION_MINOR >= 7
-    mbedtls_md5_context tctx;
-    mbedtls_md5_starts_ret(&tctx);
-    mbedtls_md5_update_ret(&tctx, (const unsigned char *)buf, len);
-    mbedtls_md5_finish_ret(&tctx, img_md5);
-  #else
-    mbedtls_md5_context tctx;
-    mbedtls_md5_starts(&tctx);
-    mbedtls_md5_update(&tctx, (const unsigned char *)buf, len);
-    mbedtls_md5_finish(&tctx, img_md5);
-  #endif
-  #endif
-
-  #ifdef CONFIG_POLARSSL
-    md5_context tctx;
-    md5_starts(&tctx);
-    md5_update(&tctx, (const unsigned char *)buf, len);
-    md5_finish(&tctx, img_md5);
-  #endif
-
-    char img_md5_str[33];
-    memset(img_md5_str, 0, sizeof(img_md5_str));
-    char *ext;
-    char png[] = "png";
-    char jpg[] = "jpg";
-    int i;
-    for (i = 0; i < 16; i++)
-      snprintf(&img_md5_str[i * 2], 3, "%02x", (uint8_t)img_md5[i]);
-    // see if the file is a jpeg or a png
-    if (strncmp(buf, "\xFF\xD8\xFF", 3) == 0)
-      ext = jpg;
-    else if (strncmp(buf, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) == 0)
-      ext = png;
-    else {
-      debug(1, "Unidentified image type of cover art -- jpg extension used.");
-      ext = jpg;
-    }
-    mode_t oldumask = umask(000);
-    int result = mkpath(config.cover_art_cache_dir, 0777);
-    umask(oldumask);
-    if ((result == 0) || (result == -EEXIST)) {
-      // see if the file exists by opening it.
-      // if it exists, we're done
-      char *prefix = "cover-";
-
-      size_t pl = strlen(config.cover_art_cache_dir) + 1 + strlen(prefix) + strlen(img_md5_str) + 1 +
-                  strlen(ext);
-
-      path = malloc(pl + 1);
-      snprintf(path, pl + 1, "%s/%s%s.%s", config.cover_art_cache_dir, prefix, img_md5_str, ext);
-      int cover_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH);
-      if (cover_fd > 0) {
-        // write the contents
-        if (write(cover_fd, buf, len) < len) {
-          warn("Writing cover art file \"%s\" failed!", path);
-          free(path);
-          path = NULL;
+void metadata_hub_cover_art_digest(const char *buf, int len, uint8_t *img_md5) {
+#ifdef CONFIG_OPENSSL
+  MD5_CTX ctx;
+  MD5_Init(&ctx);
+  MD5_Update(&ctx, buf, len);
+  MD5_Final(img_md5, &ctx);
+#endif
+
+#ifdef CONFIG_MBEDTLS
+#if MBEDTLS_VERSION_MINOR >= 7
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts_ret(&tctx);
+  mbedtls_md5_update_ret(&tctx, (const unsigned char *)buf, len);
+  mbedtls_md5_finish_ret(&tctx, img_md5);
+#else
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts(&tctx);
+  mbedtls_md5_update(&tctx, (const unsigned char *)buf, len);
+  mbedtls_md5_finish(&tctx, img_md5);
+#endif
+#endif
+
+#ifdef CONFIG_POLARSSL
+  md5_context tctx;
+  md5_starts(&tctx);
+  md5_update(&tctx, (const unsigned char *)buf, len);
+  md5_finish(&tctx, img_md5);
+#endif
+}
+
+static char *cover_art_pathname(const uint8_t *digest, const char *ext) {
+  char img_md5_str[33];
+  int i;
+  for (i = 0; i < 16; i++)
+    snprintf(&img_md5_str[i * 2], 3, "%02x", digest[i]);
+  size_t pl = strlen(config.cover_art_cache_dir) + strlen("/cover-") + 32 + 1 + strlen(ext) + 1;
+  char *path = malloc(pl);
+  if (path == NULL)
+    die("Can't allocate memory for a cover art pathname.");
+  snprintf(path, pl, "%s/cover-%s.%s", config.cover_art_cache_dir, img_md5_str, ext);
+  return path;
+}
+
+// these must be called with the cover_art_cache_lock held
+
+static int cover_art_cache_find(const uint8_t *digest) {
+  int i;
+  for (i = 0; i < cover_art_cache_entry_count; i++)
+    if (memcmp(cover_art_cache_entries[i].digest, digest, 16) == 0)
+      return i;
+  return -1;
+}
+
+static void cover_art_cache_add(const uint8_t *digest, const char *ext, size_t size,
+                                uint64_t last_used) {
+  if (cover_art_cache_entry_count == cover_art_cache_entries_size) {
+    int new_size = cover_art_cache_entries_size ? cover_art_cache_entries_size * 2 : 16;
+    cover_art_cache_entry *new_entries =
+        realloc(cover_art_cache_entries, new_size * sizeof(cover_art_cache_entry));
+    if (new_entries == NULL)
+      die("Can't allocate memory for the cover art cache index.");
+    cover_art_cache_entries = new_entries;
+    cover_art_cache_entries_size = new_size;
+  }
+  cover_art_cache_entry *entry = &cover_art_cache_entries[cover_art_cache_entry_count++];
+  memcpy(entry->digest, digest, 16);
+  snprintf(entry->ext, sizeof(entry->ext), "%s", ext);
+  entry->size = size;
+  entry->last_used = last_used;
+  cover_art_cache_bytes += size;
+}
+
+// delete the least recently used files until the cache is within its budget, but never the most
+// recently used one
+static void cover_art_cache_trim(void) {
+  int maximum_entries = config.retain_coverart ? config.cover_art_cache_maximum_entries : 1;
+  size_t maximum_bytes = config.retain_coverart ? config.cover_art_cache_maximum_size : 0;
+  while ((cover_art_cache_entry_count > 1) &&
+         (((maximum_entries > 0) && (cover_art_cache_entry_count > maximum_entries)) ||
+          ((maximum_bytes > 0) && (cover_art_cache_bytes > maximum_bytes)))) {
+    int i, oldest = 0;
+    for (i = 1; i < cover_art_cache_entry_count; i++)
+      if (cover_art_cache_entries[i].last_used < cover_art_cache_entries[oldest].last_used)
+        oldest = i;
+    cover_art_cache_entry *entry = &cover_art_cache_entries[oldest];
+    char *path = cover_art_pathname(entry->digest, entry->ext);
+    if ((unlink(path) != 0) && (errno != ENOENT))
+      debug(1, "Error %d deleting cover art file \"%s\".", errno, path);
+    free(path);
+    cover_art_cache_bytes -= entry->size;
+    *entry = cover_art_cache_entries[--cover_art_cache_entry_count];
+  }
+}
+
+// pick up the pictures already in the cache directory, treating the most recently modified as the
+// most recently used
+static void cover_art_cache_scan(void) {
+  DIR *d = opendir(config.cover_art_cache_dir);
+  if (d) {
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+      // names are of the form cover-<32 hex digits>.<jpg or png>
+      uint8_t digest[16];
+      char ext[4];
+      unsigned int byte;
+      int i, valid = 0;
+      if ((strncmp(dir->d_name, "cover-", strlen("cover-")) == 0) &&
+          (strlen(dir->d_name) == strlen("cover-") + 32 + 4) && (dir->d_name[38] == '.')) {
+        valid = 1;
+        for (i = 0; (i < 16) && (valid); i++) {
+          if (sscanf(dir->d_name + strlen("cover-") + i * 2, "%2x", &byte) == 1)
+            digest[i] = byte;
+          else
+            valid = 0;
         }
-        close(cover_fd);
-
-        // now delete all other files, if requested
-        if (config.retain_coverart == 0) {
-          DIR *d;
-          struct dirent *dir;
-          d = opendir(config.cover_art_cache_dir);
-          if (d) {
-            int fnl = strlen(prefix) + strlen(img_md5_str) + 1 + strlen(ext) + 1;
-
-            char *full_filename = malloc(fnl);
-            if (full_filename == NULL)
-              die("Can't allocate memory at metadata_write_image_file.");
-            memset(full_filename, 0, fnl);
-            snprintf(full_filename, fnl, "%s%s.%s", prefix, img_md5_str, ext);
-            int dir_fd = open(config.cover_art_cache_dir, O_DIRECTORY);
-            if (dir_fd > 0) {
-              while ((dir = readdir(d)) != NULL) {
-                if (dir->d_type == DT_REG) {
-                  if (strcmp(full_filename, dir->d_name) != 0) {
-                    if (unlinkat(dir_fd, dir->d_name, 0) != 0) {
-                      debug(1, "Error %d deleting cover art file \"%s\".", errno, dir->d_name);
-                    }
-                  }
-                }
-              }
-            } else {
-              debug(1, "Can't open the directory for deletion.");
-            }
-            free(full_filename);
-            closedir(d);
-          }
+        snprintf(ext, sizeof(ext), "%s", dir->d_name + 39);
+        if ((strcmp(ext, "jpg") != 0) && (strcmp(ext, "png") != 0))
+          valid = 0;
+      }
+      if ((valid) && (cover_art_cache_find(digest) < 0)) {
+        struct stat st;
+        if ((fstatat(dirfd(d), dir->d_name, &st, 0) == 0) && (S_ISREG(st.st_mode))) {
+          cover_art_cache_add(digest, ext, st.st_size, st.st_mtime);
+          if ((uint64_t)st.st_mtime > cover_art_cache_use_count)
+            cover_art_cache_use_count = st.st_mtime;
         }
-      } else {
-        //      if (errno == EEXIST)
-        //        debug(1, "Cover art file \"%s\" already exists!", path);
-        //      else {
-        if (errno != EEXIST) {
-          warn("Could not open file \"%s\" for writing cover art", path);
-          free(path);
-          path = NULL;
+      }
+    }
+    closedir(d);
+    debug(2, "Cover art cache has %d pictures taking %zu bytes.", cover_art_cache_entry_count,
+          cover_art_cache_bytes);
+  }
+}
+
+uint64_t metadata_hub_cover_art_generation_next(void) {
+  return __atomic_add_fetch(&cover_art_generation, 1, __ATOMIC_SEQ_CST);
+}
+
+// announce a picture, unless it has been overtaken by a later picture or a new track -- a new track
+// advances the generation with the hub locked, so the check can't be overtaken here
+static void cover_art_set_pathname(const char *path, uint64_t generation) {
+  char uri[2048];
+  if (path)
+    snprintf(uri, sizeof(uri), "file://%s", path);
+  else
+    uri[0] = '\0';
+  metadata_hub_modify_prolog();
+  if (generation != __atomic_load_n(&cover_art_generation, __ATOMIC_SEQ_CST)) {
+    debug(2, "MH Picture overtaken -- not announced.");
+    metadata_hub_modify_epilog(0);
+  } else if (string_update(&metadata_store.cover_art_pathname,
+                           &metadata_store.cover_art_pathname_changed,
+                           uri)) { // if the picture's file path is different from the stored one...
+    metadata_hub_modify_epilog(1);
+  } else {
+    metadata_hub_modify_epilog(0);
+  }
+}
+
+static void cover_art_write_job_free(cover_art_write_job *job) {
+  if (job->payload)
+    metadata_payload_release(job->payload);
+  else
+    free(job->data);
+  free(job->pathname);
+  free(job->temporary_pathname);
+  free(job);
+}
+
+static void cover_art_writer_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&cover_art_cache_lock);
+}
+
+void *cover_art_writer_thread_function(__attribute__((unused)) void *arg) {
+  mode_t oldumask = umask(000);
+  int result = mkpath(config.cover_art_cache_dir, 0777);
+  umask(oldumask);
+  if ((result != 0) && (result != -EEXIST))
+    debug(1, "Couldn't access or create the cover art cache directory \"%s\".",
+          config.cover_art_cache_dir);
+  pthread_mutex_lock(&cover_art_cache_lock);
+  cover_art_cache_scan();
+  cover_art_cache_trim();
+  pthread_mutex_unlock(&cover_art_cache_lock);
+
+  while (1) {
+    // take all the pictures waiting to be written
+    pthread_mutex_lock(&cover_art_cache_lock);
+    pthread_cleanup_push(cover_art_writer_cleanup_handler, NULL);
+    while (cover_art_jobs == NULL)
+      pthread_cond_wait(&cover_art_cache_job_added, &cover_art_cache_lock);
+    pthread_cleanup_pop(0);
+    cover_art_write_job *batch = cover_art_jobs;
+    cover_art_jobs = NULL;
+    pthread_mutex_unlock(&cover_art_cache_lock);
+
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    cover_art_write_job *job;
+    // write them to temporary files...
+    for (job = batch; job != NULL; job = job->next) {
+      job->pathname = cover_art_pathname(job->digest, job->ext);
+      size_t tl = strlen(job->pathname) + strlen(".tmp") + 1;
+      job->temporary_pathname = malloc(tl);
+      if (job->temporary_pathname == NULL)
+        die("Can't allocate memory for a cover art pathname.");
+      snprintf(job->temporary_pathname, tl, "%s.tmp", job->pathname);
+      job->fd = open(job->temporary_pathname, O_WRONLY | O_CREAT | O_TRUNC,
+                     S_IRWXU | S_IRGRP | S_IROTH);
+      if (job->fd < 0) {
+        warn("Could not open file \"%s\" for writing cover art", job->temporary_pathname);
+      } else if (write(job->fd, job->data, job->length) < (ssize_t)job->length) {
+        warn("Writing cover art file \"%s\" failed!", job->temporary_pathname);
+        close(job->fd);
+        job->fd = -1;
+        unlink(job->temporary_pathname);
+      }
+    }
+    // ...sync them all, then give them their real names, so no one ever sees a partial picture
+    for (job = batch; job != NULL; job = job->next) {
+      if (job->fd >= 0) {
+        fsync(job->fd);
+        close(job->fd);
+        if (rename(job->temporary_pathname, job->pathname) != 0) {
+          warn("Could not rename cover art file \"%s\".", job->temporary_pathname);
+          unlink(job->temporary_pathname);
+          job->fd = -1;
         }
       }
+    }
+    int dir_fd = open(config.cover_art_cache_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+
+    // index them and announce the latest picture if it's among them
+    cover_art_write_job *announcement = NULL;
+    pthread_mutex_lock(&cover_art_cache_lock);
+    for (job = batch; job != NULL; job = job->next) {
+      if ((job->fd >= 0) && (cover_art_cache_find(job->digest) < 0))
+        cover_art_cache_add(job->digest, job->ext, job->length, ++cover_art_cache_use_count);
+      if (job->generation == __atomic_load_n(&cover_art_generation, __ATOMIC_SEQ_CST))
+        announcement = job;
+    }
+    cover_art_cache_trim();
+    pthread_mutex_unlock(&cover_art_cache_lock);
+    if (announcement)
+      cover_art_set_pathname(announcement->fd >= 0 ? announcement->pathname : NULL,
+                             announcement->generation);
+
+    while (batch) {
+      job = batch;
+      batch = job->next;
+      cover_art_write_job_free(job);
+    }
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_exit(NULL);
+}
+
+void metadata_hub_process_picture(char *data, uint32_t length, metadata_payload *payload,
+                                  const uint8_t *digest, uint64_t generation) {
+  debug(2, "MH Picture received, length %u bytes.", length);
+  if (generation != __atomic_load_n(&cover_art_generation, __ATOMIC_SEQ_CST)) {
+    debug(2, "MH Picture overtaken -- discarded.");
+    return;
+  }
+  if ((length <= 16) || (cover_art_writer_running == 0)) {
+    cover_art_set_pathname(NULL, generation); // no picture, or no cache to put it in
+    return;
+  }
+
+  uint8_t img_md5[16];
+  if (digest)
+    memcpy(img_md5, digest, sizeof(img_md5));
+  else
+    metadata_hub_cover_art_digest(data, length, img_md5);
+  // see if the file is a jpeg or a png
+  const char *ext;
+  if (strncmp(data, "\xFF\xD8\xFF", 3) == 0)
+    ext = "jpg";
+  else if (strncmp(data, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) == 0)
+    ext = "png";
+  else {
+    debug(1, "Unidentified image type of cover art -- jpg extension used.");
+    ext = "jpg";
+  }
+
+  char *path = NULL;
+  pthread_mutex_lock(&cover_art_cache_lock);
+  int i = cover_art_cache_find(img_md5);
+  if (i >= 0) {
+    // it's in the cache already, so there's nothing to write
+    cover_art_cache_entries[i].last_used = ++cover_art_cache_use_count;
+    path = cover_art_pathname(cover_art_cache_entries[i].digest, cover_art_cache_entries[i].ext);
+  } else {
+    // if the same picture is waiting to be written already, let that one carry the announcement,
+    // as two writers of the same file would trip over one another's temporary file
+    cover_art_write_job **tail = &cover_art_jobs;
+    while ((*tail) && (memcmp((*tail)->digest, img_md5, sizeof(img_md5)) != 0))
+      tail = &(*tail)->next;
+    if (*tail) {
+      (*tail)->generation = generation;
     } else {
-      debug(1, "Couldn't access or create the cover art cache directory \"%s\".",
-            config.cover_art_cache_dir);
+      cover_art_write_job *job = calloc(1, sizeof(cover_art_write_job));
+      if (job == NULL)
+        die("Can't allocate memory to write cover art.");
+      if (payload) {
+        metadata_payload_retain(payload); // keep the picture, rather than copying it
+        job->payload = payload;
+        job->data = data;
+      } else {
+        job->data = malloc(length);
+        if (job->data == NULL)
+          die("Can't allocate memory to write cover art.");
+        memcpy(job->data, data, length);
+      }
+      memcpy(job->digest, img_md5, sizeof(img_md5));
+      job->ext = ext;
+      job->length = length;
+      job->generation = generation;
+      job->fd = -1;
+      *tail = job;
+      pthread_cond_signal(&cover_art_cache_job_added);
     }
   }
-  return path;
+  pthread_mutex_unlock(&cover_art_cache_lock);
+  if (path) {
+    cover_art_set_pathname(path, generation);
+    free(path);
+  } // otherwise, the writer will announce it when the file has been written
 }
 
 void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length) {
@@ -457,6 +833,8 @@ void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uin
     case 'mdst':
       debug(2, "MH Metadata stream processing start.");
       metadata_hub_modify_prolog();
+      // a picture not yet announced belongs to an earlier track
+      metadata_hub_cover_art_generation_next();
       break;
     case 'mden':
       debug(2, "MH Metadata stream processing end.");
@@ -464,22 +842,8 @@ void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uin
       debug(2, "MH Metadata stream processing epilog complete.");
       break;
     case 'PICT':
-      metadata_hub_modify_prolog();
-      debug(2, "MH Picture received, length %u bytes.", length);
-      char uri[2048];
-      if ((length > 16) && (strcmp(config.cover_art_cache_dir,"")!=0)) { // if it's okay to write the file
-        char *pathname = metadata_write_image_file(data, length);
-        snprintf(uri, sizeof(uri), "file://%s", pathname);
-        free(pathname);
-      } else {
-        uri[0] = '\0';
-      }
-      if (string_update(&metadata_store.cover_art_pathname,
-                        &metadata_store.cover_art_pathname_changed,
-                        uri)) // if the picture's file path is different from the stored one...
-        metadata_hub_modify_epilog(1);
-      else
-        metadata_hub_modify_epilog(0);
+      metadata_hub_process_picture(data, length, NULL, NULL,
+                                   metadata_hub_cover_art_generation_next());
       break;
     case 'clip':
       metadata_hub_modify_prolog();
@@ -143,6 +143,17 @@ void add_metadata_watcher(metadata_watcher fn, void *userdata);
 void metadata_hub_init(void);
 void metadata_hub_stop(void);
 void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length);
+
+// calculate the digest of a picture, as used to name its file in the cover art cache
+void metadata_hub_cover_art_digest(const char *buf, int len, uint8_t *img_md5);
+// every picture must be given a generation, in the order of the metadata, when it arrives
+uint64_t metadata_hub_cover_art_generation_next(void);
+// process a picture (the 'ssnc' 'PICT' item), which may be done later and on another thread;
+// if the data belongs to a payload, it's retained rather than copied, otherwise payload is NULL;
+// digest may be NULL if it hasn't been calculated
+struct metadata_payload;
+void metadata_hub_process_picture(char *data, uint32_t length, struct metadata_payload *payload,
+                                  const uint8_t *digest, uint64_t generation);
 void metadata_hub_reset_track_metadata(void);
 void metadata_hub_release_track_artwork(void);
 
@@ -0,0 +1,198 @@
+/*
+ * Metadata and status in shared memory. This file is part of Shairport Sync.
+ * Copyright (c) 2026 The Shairport Sync contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metadata_shm.h"
+
+static metadata_shm_header *shm_header = NULL;
+static size_t shm_size;
+
+static void section_write_begin(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED); // odd
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void section_write_end(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE); // even
+  __atomic_add_fetch(&shm_header->change_count, 1, __ATOMIC_RELEASE);
+}
+
+static void copy_string(char *destination, size_t size, const char *source) {
+  if (source) {
+    strncpy(destination, source, size - 1);
+    destination[size - 1] = '\0';
+  } else {
+    destination[0] = '\0';
+  }
+}
+
+void metadata_shm_init(void) {
+  if ((config.metadata_shm_filename == NULL) || (strcmp(config.metadata_shm_filename, "") == 0))
+    return;
+  size_t header_size = (sizeof(metadata_shm_header) + 4095) & ~((size_t)4095);
+  size_t events_size = sizeof(metadata_shm_event) * metadata_shm_event_count;
+  shm_size = header_size + events_size + metadata_shm_cover_art_area_size;
+
+  int fd = open(config.metadata_shm_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    warn("Could not open the metadata shared memory file \"%s\": error %d.",
+         config.metadata_shm_filename, errno);
+    return;
+  }
+  if (ftruncate(fd, shm_size) != 0) {
+    warn("Could not set the size of the metadata shared memory file \"%s\": error %d.",
+         config.metadata_shm_filename, errno);
+    close(fd);
+    return;
+  }
+  void *p = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    warn("Could not map the metadata shared memory file \"%s\": error %d.",
+         config.metadata_shm_filename, errno);
+    return;
+  }
+  shm_header = (metadata_shm_header *)p; // the file is all zeroes to begin with
+  shm_header->version = METADATA_SHM_VERSION;
+  shm_header->size = shm_size;
+  shm_header->events_offset = header_size;
+  shm_header->event_count = metadata_shm_event_count;
+  shm_header->event_data_length = metadata_shm_event_data_length;
+  shm_header->cover_art_offset = header_size + events_size;
+  shm_header->cover_art_area_size = metadata_shm_cover_art_area_size;
+  __atomic_store_n(&shm_header->magic, METADATA_SHM_MAGIC, __ATOMIC_RELEASE);
+  debug(1, "metadata shared memory file \"%s\" of %zu bytes set up.", config.metadata_shm_filename,
+        shm_size);
+}
+
+void metadata_shm_stop(void) {
+  if (shm_header) {
+    __atomic_store_n(&shm_header->magic, 0, __ATOMIC_RELEASE);
+    munmap(shm_header, shm_size);
+    shm_header = NULL;
+    unlink(config.metadata_shm_filename);
+  }
+}
+
+void metadata_shm_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length) {
+  if (shm_header == NULL)
+    return;
+  int is_picture = (type == 'ssnc') && (code == 'PICT');
+  if (is_picture) {
+    metadata_shm_cover_art *cover_art = &shm_header->cover_art;
+    section_write_begin(&cover_art->sequence);
+    if (length <= shm_header->cover_art_area_size) {
+      if (length)
+        memcpy((char *)shm_header + shm_header->cover_art_offset, data, length);
+      cover_art->length = length;
+    } else {
+      debug(1, "Cover art of %u bytes is too big for the metadata shared memory file.", length);
+      cover_art->length = 0;
+    }
+    cover_art->generation++;
+    section_write_end(&cover_art->sequence);
+  }
+
+  uint64_t number = shm_header->events_written;
+  metadata_shm_event *event =
+      (metadata_shm_event *)((char *)shm_header + shm_header->events_offset) +
+      (number % metadata_shm_event_count);
+  section_write_begin(&event->sequence);
+  event->type = type;
+  event->code = code;
+  event->length = length;
+  event->number = number;
+  if ((is_picture == 0) && (data) && (length)) {
+    uint32_t stored_length = length;
+    if (stored_length > metadata_shm_event_data_length)
+      stored_length = metadata_shm_event_data_length;
+    memcpy(event->data, data, stored_length);
+  }
+  __atomic_store_n(&shm_header->events_written, number + 1, __ATOMIC_RELEASE);
+  section_write_end(&event->sequence);
+}
+
+void metadata_shm_update_session(rtsp_conn_info *conn, int active, int play_number,
+                                 double sync_error_in_milliseconds) {
+  if (shm_header == NULL)
+    return;
+  metadata_shm_session *session = &shm_header->session;
+  section_write_begin(&session->sequence);
+  session->active = active;
+  session->connection_number = conn->connection_number;
+  session->play_number = play_number;
+  session->missing_packets = conn->missing_packets;
+  session->late_packets = conn->late_packets;
+  session->too_late_packets = conn->too_late_packets;
+  session->resend_requests = conn->resend_requests;
+  session->sync_error_in_milliseconds = sync_error_in_milliseconds;
+  session->input_frame_rate = conn->input_frame_rate;
+  session->output_frame_rate = conn->frame_rate;
+  session->update_time = get_absolute_time_in_fp();
+  section_write_end(&session->sequence);
+}
+
+#ifdef CONFIG_METADATA_HUB
+void metadata_shm_update_bundle(struct metadata_bundle *bundle) {
+  if (shm_header == NULL)
+    return;
+  metadata_shm_bundle *b = &shm_header->bundle;
+  section_write_begin(&b->sequence);
+  b->player_thread_active = bundle->player_thread_active;
+  b->play_status = bundle->play_status;
+  b->player_state = bundle->player_state;
+  b->active_state = bundle->active_state;
+  b->shuffle_status = bundle->shuffle_status;
+  b->repeat_status = bundle->repeat_status;
+  b->speaker_volume = bundle->speaker_volume;
+  b->airplay_volume = bundle->airplay_volume;
+  b->item_id = bundle->item_id;
+  b->songtime_in_milliseconds = bundle->songtime_in_milliseconds;
+  copy_string(b->client_ip, sizeof(b->client_ip), bundle->client_ip);
+  copy_string(b->server_ip, sizeof(b->server_ip), bundle->server_ip);
+  copy_string(b->progress_string, sizeof(b->progress_string), bundle->progress_string);
+  copy_string(b->track_name, sizeof(b->track_name), bundle->track_name);
+  copy_string(b->artist_name, sizeof(b->artist_name), bundle->artist_name);
+  copy_string(b->album_artist_name, sizeof(b->album_artist_name), bundle->album_artist_name);
+  copy_string(b->album_name, sizeof(b->album_name), bundle->album_name);
+  copy_string(b->genre, sizeof(b->genre), bundle->genre);
+  copy_string(b->composer, sizeof(b->composer), bundle->composer);
+  copy_string(b->comment, sizeof(b->comment), bundle->comment);
+  copy_string(b->file_kind, sizeof(b->file_kind), bundle->file_kind);
+  copy_string(b->song_description, sizeof(b->song_description), bundle->song_description);
+  copy_string(b->cover_art_pathname, sizeof(b->cover_art_pathname), bundle->cover_art_pathname);
+  section_write_end(&b->sequence);
+}
+#endif
@@ -0,0 +1,130 @@
+#ifndef _METADATA_SHM_H
+#define _METADATA_SHM_H
+
+#include <stdint.h>
+
+// Metadata and status in a memory-mapped file, for local readers.
+
+// The file starts with a metadata_shm_header. It's followed by a ring of metadata_shm_event
+// records, the most recent metadata items, and then by an area holding the current cover art.
+// All values are in host byte order.
+
+// Each section -- the bundle, the session, the cover art and each event -- has its own sequence
+// number, which is odd while the section is being updated. To read a section, note its sequence
+// number, wait if it's odd, copy what you need and then check that the sequence number hasn't
+// changed; if it has, read it again. The writer never waits for readers and makes no system calls
+// to update the file, so readers should poll change_count, which is incremented after every
+// update.
+
+// Events are numbered from zero; event n is in slot n % event_count and its number field is n
+// once it's been written. The data of an event is truncated to event_data_length bytes -- its
+// length field gives the original length. Cover art isn't put in events -- look in the cover art
+// area instead.
+
+#define METADATA_SHM_MAGIC 'sssm'
+#define METADATA_SHM_VERSION 1
+
+#define metadata_shm_event_count 256
+#define metadata_shm_event_data_length 232
+#define metadata_shm_cover_art_area_size (4 * 1024 * 1024)
+
+typedef struct {
+  uint32_t sequence;
+  uint32_t type;
+  uint32_t code;
+  uint32_t length;
+  uint64_t number;
+  char data[metadata_shm_event_data_length];
+} metadata_shm_event; // 256 bytes
+
+typedef struct {
+  uint32_t sequence;
+  int32_t player_thread_active;
+  int32_t play_status; // a play_status_type -- see metadata_hub.h
+  int32_t player_state;
+  int32_t active_state;
+  int32_t shuffle_status;
+  int32_t repeat_status;
+  int32_t speaker_volume;
+  double airplay_volume;
+  uint64_t item_id;
+  uint32_t songtime_in_milliseconds;
+  char client_ip[64];
+  char server_ip[64];
+  char progress_string[64];
+  char track_name[256];
+  char artist_name[256];
+  char album_artist_name[256];
+  char album_name[256];
+  char genre[128];
+  char composer[256];
+  char comment[256];
+  char file_kind[128];
+  char song_description[256];
+  char cover_art_pathname[512];
+} metadata_shm_bundle;
+
+typedef struct {
+  uint32_t sequence;
+  int32_t active; // set while a player is running
+  int32_t connection_number;
+  int32_t play_number; // the number of packets played in the session
+  uint64_t missing_packets;
+  uint64_t late_packets;
+  uint64_t too_late_packets;
+  uint64_t resend_requests;
+  double sync_error_in_milliseconds;
+  double input_frame_rate;
+  double output_frame_rate;
+  uint64_t update_time; // the value of get_absolute_time_in_fp() at the last update
+} metadata_shm_session;
+
+typedef struct {
+  uint32_t sequence;
+  uint32_t length; // zero if there is no cover art
+  uint64_t generation; // incremented for every picture
+} metadata_shm_cover_art;
+
+typedef struct {
+  uint32_t magic; // written last when the file is set up, so check it first
+  uint32_t version;
+  uint64_t size; // the size of the file
+  uint64_t change_count;
+  uint64_t events_offset; // where the ring of events starts
+  uint32_t event_count;
+  uint32_t event_data_length;
+  uint64_t events_written; // the number of the next event to be written
+  uint64_t cover_art_offset; // where the cover art area starts
+  uint64_t cover_art_area_size;
+  metadata_shm_bundle bundle;
+  metadata_shm_session session;
+  metadata_shm_cover_art cover_art;
+} metadata_shm_header;
+
+#ifndef METADATA_SHM_READER_ONLY
+
+#include "config.h"
+#include "player.h"
+
+#ifdef CONFIG_METADATA_HUB
+#include "metadata_hub.h"
+#endif
+
+void metadata_shm_init(void);
+void metadata_shm_stop(void);
+
+// these are called only from the metadata thread
+void metadata_shm_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length);
+
+// this is called only from the player thread
+void metadata_shm_update_session(rtsp_conn_info *conn, int active, int play_number,
+                                 double sync_error_in_milliseconds);
+
+#ifdef CONFIG_METADATA_HUB
+// this is called with the metadata hub locked for writing
+void metadata_shm_update_bundle(struct metadata_bundle *bundle);
+#endif
+
+#endif
+
+#endif // _METADATA_SHM_H
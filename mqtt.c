@@ -1,3 +1,6 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +22,43 @@ struct mosquitto *global_mosq = NULL;
 char *topic = NULL;
 int connected = 0;
 
+// Messages are published by a worker thread of their own, from a bounded queue, so that a slow or
+// disconnected broker never holds up the metadata thread. If the queue fills, the oldest message is
+// dropped. A message on a state topic -- e.g. artist or volume -- isn't published again if its
+// value is the same as the last one successfully published on that topic.
+// A picture isn't copied -- the message keeps a reference to the metadata payload it came in.
+
+#define mqtt_publish_queue_size 256
+#define mqtt_maximum_topic_length 16
+
+typedef struct {
+  char topic[mqtt_maximum_topic_length]; // the subtopic, appended to the main topic
+  char *data;
+  uint32_t length;
+  metadata_payload *payload; // if set, the data belongs to this, otherwise it's malloced
+  int is_state; // if set, the value is retained by the broker (if requested) and not repeated
+} mqtt_message;
+
+typedef struct {
+  char topic[mqtt_maximum_topic_length];
+  char *data;
+  uint32_t length;
+  metadata_payload *payload;
+} mqtt_published_state;
+
+static pthread_mutex_t mqtt_publish_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mqtt_publish_queue_not_empty = PTHREAD_COND_INITIALIZER;
+static mqtt_message mqtt_publish_queue[mqtt_publish_queue_size];
+static unsigned int mqtt_publish_queue_toq = 0; // the index of the oldest message
+static unsigned int mqtt_publish_queue_count = 0;
+static mqtt_publisher_statistics mqtt_statistics;
+static pthread_t mqtt_publisher_thread;
+
+// accessed only by the publisher thread, except when cleared on connection
+static mqtt_published_state *mqtt_states = NULL;
+static int mqtt_state_count = 0;
+static int mqtt_states_clear_requested = 0;
+
 // mosquitto logging
 void _cb_log(__attribute__((unused)) struct mosquitto *mosq, __attribute__((unused)) void *userdata,
              int level, const char *str) {
@@ -74,13 +114,22 @@ void on_message(__attribute__((unused)) struct mosquitto *mosq,
 void on_disconnect(__attribute__((unused)) struct mosquitto *mosq,
                    __attribute__((unused)) void *userdata, __attribute__((unused)) int rc) {
   connected = 0;
-  debug(1, "[MQTT]: disconnected");
+  mqtt_publisher_statistics s;
+  mqtt_get_publisher_statistics(&s);
+  debug(1,
+        "[MQTT]: disconnected. Messages queued: %" PRIu64 ", published: %" PRIu64
+        ", unchanged and skipped: %" PRIu64 ", dropped: %" PRIu64 ", failed: %" PRIu64
+        ", maximum queue depth: %u.",
+        s.messages_queued, s.messages_published, s.messages_unchanged, s.messages_dropped,
+        s.messages_failed, s.maximum_queue_depth);
 }
 
 void on_connect(struct mosquitto *mosq, __attribute__((unused)) void *userdata,
                 __attribute__((unused)) int rc) {
   connected = 1;
   debug(1, "[MQTT]: connected");
+  // the broker may have lost the state, so publish every state topic afresh
+  __atomic_store_n(&mqtt_states_clear_requested, 1, __ATOMIC_RELEASE);
 
   // subscribe if requested
   if (config.mqtt_enable_remote) {
@@ -90,29 +139,195 @@ void on_connect(struct mosquitto *mosq, __attribute__((unused)) void *userdata,
   }
 }
 
-// helper function to publish under a topic and automatically append the main topic
-void mqtt_publish(char *topic, char *data, uint32_t length) {
-  char fulltopic[strlen(config.mqtt_topic) + strlen(topic) + 3];
-  snprintf(fulltopic, strlen(config.mqtt_topic) + strlen(topic) + 2, "%s/%s", config.mqtt_topic,
-           topic);
-  debug(1, "[MQTT]: publishing under %s", fulltopic);
-
-  int rc;
-  if ((rc = mosquitto_publish(global_mosq, NULL, fulltopic, length, data, 0, 0)) !=
-      MOSQ_ERR_SUCCESS) {
-    switch (rc) {
-    case MOSQ_ERR_NO_CONN:
-      debug(1, "[MQTT]: Publish failed: not connected to broker");
-      break;
-    default:
-      debug(1, "[MQTT]: Publish failed: unknown error");
-      break;
+static void mqtt_data_free(char *data, metadata_payload *payload) {
+  if (payload)
+    metadata_payload_release(payload);
+  else
+    free(data);
+}
+
+static void mqtt_message_free(mqtt_message *message) {
+  mqtt_data_free(message->data, message->payload);
+  message->data = NULL;
+  message->payload = NULL;
+}
+
+static mqtt_published_state *mqtt_state_find(const char *topic) {
+  int i;
+  if (__atomic_exchange_n(&mqtt_states_clear_requested, 0, __ATOMIC_ACQ_REL)) {
+    for (i = 0; i < mqtt_state_count; i++)
+      mqtt_data_free(mqtt_states[i].data, mqtt_states[i].payload);
+    mqtt_state_count = 0;
+  }
+  for (i = 0; i < mqtt_state_count; i++)
+    if (strcmp(mqtt_states[i].topic, topic) == 0)
+      return &mqtt_states[i];
+  return NULL;
+}
+
+// returns 1 if the state is unchanged since it was last published
+static int mqtt_state_unchanged(const mqtt_message *message) {
+  mqtt_published_state *state = mqtt_state_find(message->topic);
+  return ((state) && (state->length == message->length) &&
+          ((message->length == 0) || (state->data == message->data) ||
+           (memcmp(state->data, message->data, message->length) == 0)));
+}
+
+// record the state once it has been published, taking the value from the message
+static void mqtt_state_record(mqtt_message *message) {
+  mqtt_published_state *state = mqtt_state_find(message->topic);
+  if (state) {
+    mqtt_data_free(state->data, state->payload);
+  } else {
+    mqtt_published_state *new_states =
+        realloc(mqtt_states, (mqtt_state_count + 1) * sizeof(mqtt_published_state));
+    if (new_states == NULL)
+      return; // it'll just be published again next time
+    mqtt_states = new_states;
+    state = &mqtt_states[mqtt_state_count++];
+    strcpy(state->topic, message->topic);
+  }
+  state->data = message->data;
+  state->length = message->length;
+  state->payload = message->payload;
+  message->data = NULL;
+  message->payload = NULL;
+}
+
+static void mqtt_publisher_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&mqtt_publish_queue_lock);
+}
+
+void *mqtt_publisher_thread_function(__attribute__((unused)) void *arg) {
+  size_t prefix_length = strlen(config.mqtt_topic);
+  char *fulltopic = malloc(prefix_length + 1 + mqtt_maximum_topic_length);
+  if (fulltopic == NULL)
+    die("[MQTT]: Can't allocate memory for a topic.");
+  memcpy(fulltopic, config.mqtt_topic, prefix_length);
+  fulltopic[prefix_length] = '/';
+  while (1) {
+    mqtt_message message;
+    pthread_mutex_lock(&mqtt_publish_queue_lock);
+    pthread_cleanup_push(mqtt_publisher_cleanup_handler, NULL);
+    while (mqtt_publish_queue_count == 0)
+      pthread_cond_wait(&mqtt_publish_queue_not_empty, &mqtt_publish_queue_lock);
+    pthread_cleanup_pop(0);
+    message = mqtt_publish_queue[mqtt_publish_queue_toq];
+    mqtt_publish_queue_toq = (mqtt_publish_queue_toq + 1) % mqtt_publish_queue_size;
+    mqtt_publish_queue_count--;
+    pthread_mutex_unlock(&mqtt_publish_queue_lock);
+
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    if ((message.is_state) && (mqtt_state_unchanged(&message))) {
+      __atomic_add_fetch(&mqtt_statistics.messages_unchanged, 1, __ATOMIC_RELAXED);
+    } else {
+      strcpy(fulltopic + prefix_length + 1, message.topic);
+      debug(3, "[MQTT]: publishing under %s", fulltopic);
+      int rc = mosquitto_publish(global_mosq, NULL, fulltopic, message.length, message.data, 0,
+                                 (message.is_state) && (config.mqtt_publish_retained));
+      if (rc == MOSQ_ERR_SUCCESS) {
+        __atomic_add_fetch(&mqtt_statistics.messages_published, 1, __ATOMIC_RELAXED);
+        // keep the value to compare with later ones -- a failed one will be tried again
+        if (message.is_state)
+          mqtt_state_record(&message);
+      } else {
+        __atomic_add_fetch(&mqtt_statistics.messages_failed, 1, __ATOMIC_RELAXED);
+        switch (rc) {
+        case MOSQ_ERR_NO_CONN:
+          debug(2, "[MQTT]: Publish failed: not connected to broker");
+          break;
+        default:
+          debug(1, "[MQTT]: Publish failed: unknown error");
+          break;
+        }
+      }
     }
+    mqtt_message_free(&message);
+    pthread_setcancelstate(oldState, NULL);
   }
+  pthread_exit(NULL);
 }
 
-// handler for incoming metadata
-void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length) {
+// queue a message to be published under the main topic; if the data belongs to a payload, the
+// payload is retained rather than the data copied
+static void mqtt_queue_message(const char *topic, char *data, uint32_t length,
+                               metadata_payload *payload, int is_state) {
+  mqtt_message message;
+  memset(&message, 0, sizeof(message));
+  snprintf(message.topic, sizeof(message.topic), "%s", topic);
+  if (payload) {
+    metadata_payload_retain(payload);
+    message.payload = payload;
+    message.data = data;
+  } else if (length) {
+    message.data = malloc(length);
+    if (message.data == NULL) {
+      debug(1, "[MQTT]: Can't allocate memory for a message -- dropped.");
+      __atomic_add_fetch(&mqtt_statistics.messages_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    memcpy(message.data, data, length);
+  }
+  message.length = length;
+  message.is_state = is_state;
+
+  mqtt_message dropped_message;
+  dropped_message.data = NULL;
+  int dropped = 0;
+  pthread_mutex_lock(&mqtt_publish_queue_lock);
+  if (mqtt_publish_queue_count == mqtt_publish_queue_size) {
+    // the broker isn't keeping up, so make room by dropping the oldest message
+    dropped_message = mqtt_publish_queue[mqtt_publish_queue_toq];
+    mqtt_publish_queue_toq = (mqtt_publish_queue_toq + 1) % mqtt_publish_queue_size;
+    mqtt_publish_queue_count--;
+    dropped = 1;
+  }
+  mqtt_publish_queue[(mqtt_publish_queue_toq + mqtt_publish_queue_count) %
+                     mqtt_publish_queue_size] = message;
+  mqtt_publish_queue_count++;
+  if (mqtt_publish_queue_count > mqtt_statistics.maximum_queue_depth)
+    mqtt_statistics.maximum_queue_depth = mqtt_publish_queue_count;
+  pthread_cond_signal(&mqtt_publish_queue_not_empty);
+  pthread_mutex_unlock(&mqtt_publish_queue_lock);
+
+  __atomic_add_fetch(&mqtt_statistics.messages_queued, 1, __ATOMIC_RELAXED);
+  if (dropped) {
+    uint64_t dropped_count =
+        __atomic_add_fetch(&mqtt_statistics.messages_dropped, 1, __ATOMIC_RELAXED);
+    if ((dropped_count == 1) || (dropped_count % 100 == 0))
+      debug(1, "[MQTT]: The publishing queue is full -- %" PRIu64 " messages dropped so far.",
+            dropped_count);
+    mqtt_message_free(&dropped_message);
+  }
+}
+
+void mqtt_publish_message(const char *topic, char *data, uint32_t length, int is_state) {
+  mqtt_queue_message(topic, data, length, NULL, is_state);
+}
+
+void mqtt_publish(char *topic, char *data, uint32_t length) {
+  mqtt_publish_message(topic, data, length, 0);
+}
+
+void mqtt_get_publisher_statistics(mqtt_publisher_statistics *statistics) {
+  pthread_mutex_lock(&mqtt_publish_queue_lock);
+  statistics->maximum_queue_depth = mqtt_statistics.maximum_queue_depth;
+  statistics->queue_depth = mqtt_publish_queue_count;
+  pthread_mutex_unlock(&mqtt_publish_queue_lock);
+  statistics->messages_queued = __atomic_load_n(&mqtt_statistics.messages_queued, __ATOMIC_RELAXED);
+  statistics->messages_published =
+      __atomic_load_n(&mqtt_statistics.messages_published, __ATOMIC_RELAXED);
+  statistics->messages_unchanged =
+      __atomic_load_n(&mqtt_statistics.messages_unchanged, __ATOMIC_RELAXED);
+  statistics->messages_dropped =
+      __atomic_load_n(&mqtt_statistics.messages_dropped, __ATOMIC_RELAXED);
+  statistics->messages_failed = __atomic_load_n(&mqtt_statistics.messages_failed, __ATOMIC_RELAXED);
+}
+
+// handler for incoming metadata; payload, if not NULL, is what the data belongs to
+void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length,
+                           metadata_payload *payload) {
   if (global_mosq == NULL || connected != 1) {
     debug(3, "[MQTT]: Client not connected, skipping metadata handling");
     return;
@@ -125,37 +340,37 @@ void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t le
     memcpy(topic, &val, 4);
     val = htonl(code);
     memcpy(topic + 5, &val, 4);
-    mqtt_publish(topic, data, length);
+    mqtt_queue_message(topic, data, length, payload, 0);
   }
   if (config.mqtt_publish_parsed) {
     if (type == 'core') {
       switch (code) {
       case 'asar':
-        mqtt_publish("artist", data, length);
+        mqtt_publish_message("artist", data, length, 1);
         break;
       case 'asal':
-        mqtt_publish("album", data, length);
+        mqtt_publish_message("album", data, length, 1);
         break;
       case 'minm':
-        mqtt_publish("title", data, length);
+        mqtt_publish_message("title", data, length, 1);
         break;
       case 'asgn':
-        mqtt_publish("genre", data, length);
+        mqtt_publish_message("genre", data, length, 1);
         break;
       case 'asfm':
-        mqtt_publish("format", data, length);
+        mqtt_publish_message("format", data, length, 1);
         break;
       }
     } else if (type == 'ssnc') {
       switch (code) {
       case 'asal':
-        mqtt_publish("songalbum", data, length);
+        mqtt_publish_message("songalbum", data, length, 1);
         break;
       case 'pvol':
-        mqtt_publish("volume", data, length);
+        mqtt_publish_message("volume", data, length, 1);
         break;
       case 'clip':
-        mqtt_publish("client_ip", data, length);
+        mqtt_publish_message("client_ip", data, length, 1);
         break;
       case 'abeg':
         mqtt_publish("active_start", data, length);
@@ -177,7 +392,7 @@ void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t le
         break;
       case 'PICT':
         if (config.mqtt_publish_cover) {
-          mqtt_publish("cover", data, length);
+          mqtt_queue_message("cover", data, length, payload, 1);
         }
         break;
       }
@@ -219,6 +434,9 @@ int initialise_mqtt() {
     mosquitto_message_callback_set(global_mosq, on_message);
   }
 
+  if (pthread_create(&mqtt_publisher_thread, NULL, mqtt_publisher_thread_function, NULL))
+    die("[MQTT]: Could not create the publisher thread.");
+
   mosquitto_disconnect_callback_set(global_mosq, on_disconnect);
   mosquitto_connect_callback_set(global_mosq, on_connect);
   if (mosquitto_connect(global_mosq, config.mqtt_hostname, config.mqtt_port, keepalive)) {
@@ -3,9 +3,24 @@
 #include <mosquitto.h>
 #include <stdint.h>
 
+#include "rtsp.h"
+
+typedef struct {
+  uint64_t messages_queued;
+  uint64_t messages_published;
+  uint64_t messages_unchanged; // state messages not published because their value hadn't changed
+  uint64_t messages_dropped;   // because the queue was full
+  uint64_t messages_failed;    // e.g. because the broker wasn't connected
+  unsigned int queue_depth;
+  unsigned int maximum_queue_depth;
+} mqtt_publisher_statistics;
+
 int initialise_mqtt();
-void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length);
+void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length,
+                           metadata_payload *payload);
 void mqtt_publish(char *topic, char *data, uint32_t length);
+void mqtt_publish_message(const char *topic, char *data, uint32_t length, int is_state);
+void mqtt_get_publisher_statistics(mqtt_publisher_statistics *statistics);
 void mqtt_setup();
 void on_connect(struct mosquitto *mosq, void *userdata, int rc);
 void on_disconnect(struct mosquitto *mosq, void *userdata, int rc);
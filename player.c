@@ -71,6 +71,10 @@
 #include "metadata_hub.h"
 #endif
 
+#ifdef CONFIG_METADATA
+#include "metadata_shm.h"
+#endif
+
 #ifdef CONFIG_DACP_CLIENT
 #include "dacp.h"
 #endif
@@ -706,6 +710,7 @@ static inline void process_sample(int32_t sample, char **outp, sps_format_t form
     case SPS_FORMAT_S32:
     case SPS_FORMAT_S32_LE:
     case SPS_FORMAT_S32_BE:
+    case SPS_FORMAT_F32:
       dither_mask = (int64_t)1 << (64 - 32);
       break;
     case SPS_FORMAT_S24:
@@ -787,6 +792,11 @@ static inline void process_sample(int32_t sample, char **outp, sps_format_t form
     *(int32_t *)op = hyper_sample;
     result = 4;
     break;
+  case SPS_FORMAT_F32:
+    // full scale is 2^63 here, and the sample can't exceed it, so there's nothing to clip
+    *(float *)op = (float)(hyper_sample * (1.0 / 9223372036854775808.0));
+    result = 4;
+    break;
   case SPS_FORMAT_S24_3LE:
     hyper_sample >>= (64 - 24);
     byt = (uint8_t)hyper_sample;
@@ -1384,6 +1394,82 @@ static inline int32_t mean_32(int32_t a, int32_t b) {
   return r;
 }
 
+// the output of a packet goes into conn->outbuf or, if the backend allows it, straight into the
+// backend's buffer, where it may wrap around, so it can be in two segments
+typedef struct {
+  char *p[2];
+  int frames[2];
+  int in_backend; // set if it's in the backend's buffer, which must be committed
+  int cancel_state;
+} output_region;
+
+static void output_region_get(rtsp_conn_info *conn, int frames, output_region *region) {
+  if (config.output->get_buffer) {
+    void *segments[2];
+    int segment_frames[2];
+    // the backend may hold a lock until the frames are committed, so don't be cancelled meanwhile
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &region->cancel_state);
+    if (config.output->get_buffer(frames, segments, segment_frames) == 0) {
+      region->p[0] = segments[0];
+      region->p[1] = segments[1];
+      region->frames[0] = segment_frames[0];
+      region->frames[1] = segment_frames[1];
+      region->in_backend = 1;
+      return;
+    }
+    pthread_setcancelstate(region->cancel_state, NULL);
+  }
+  region->p[0] = conn->outbuf;
+  region->p[1] = NULL;
+  region->frames[0] = frames;
+  region->frames[1] = 0;
+  region->in_backend = 0;
+}
+
+// play the first frames of the region
+static void output_region_play(rtsp_conn_info *conn, output_region *region, int frames) {
+  if ((conn->software_mute_enabled) && (frames)) {
+    int first = frames < region->frames[0] ? frames : region->frames[0];
+    generate_zero_frames(region->p[0], first, config.output_format, conn->enable_dither,
+                         conn->previous_random_number);
+    if (frames > first)
+      generate_zero_frames(region->p[1], frames - first, config.output_format,
+                           conn->enable_dither, conn->previous_random_number);
+  }
+  if (region->in_backend) {
+    config.output->commit_buffer(frames);
+    pthread_setcancelstate(region->cancel_state, NULL);
+  } else if (conn->outbuf == NULL) {
+    debug(1, "NULL outbuf to play -- skipping it.");
+  } else if (frames) {
+    config.output->play(conn->outbuf, frames);
+  }
+}
+
+// if the backend wants to know, tell it when the first of the frames about to be played should be
+// heard
+static void output_presentation_time(rtsp_conn_info *conn, uint32_t timestamp) {
+  if ((config.output->presentation_time) && (timestamp != 0) &&
+      (have_timestamp_timing_information(conn))) {
+    uint64_t time_to_play;
+    frame_to_local_time(timestamp + conn->latency +
+                            (uint32_t)(config.audio_backend_latency_offset *
+                                       conn->input_rate), // this will go modulo 2^32
+                        &time_to_play, conn);
+    config.output->presentation_time(time_to_play);
+  }
+}
+
+// process a frame and move on to the next segment of the output if the end of this one is reached
+static inline void process_frame(int32_t left, int32_t right, char **outp, char *wrap_at,
+                                 char *wrap_to, sps_format_t format, int dither,
+                                 rtsp_conn_info *conn) {
+  process_sample(left, outp, format, conn->fix_volume, dither, conn);
+  process_sample(right, outp, format, conn->fix_volume, dither, conn);
+  if (*outp == wrap_at)
+    *outp = wrap_to;
+}
+
 // this takes an array of signed 32-bit integers and (a) removes or inserts a frame as specified in
 // stuff,
 // (b) multiplies each sample by the fixedvolume (a 16-bit quantity)
@@ -1393,9 +1479,11 @@ static inline int32_t mean_32(int32_t a, int32_t b) {
 
 // stuff: 1 means add 1; 0 means do nothing; -1 means remove 1
 static int stuff_buffer_basic_32(int32_t *inptr, int length, sps_format_t l_output_format,
-                                 char *outptr, int stuff, int dither, rtsp_conn_info *conn) {
+                                 output_region *out, int stuff, int dither, rtsp_conn_info *conn) {
   int tstuff = stuff;
-  char *l_outptr = outptr;
+  char *l_outptr = out->p[0];
+  char *wrap_at = out->p[0] + out->frames[0] * conn->output_bytes_per_frame;
+  char *wrap_to = out->p[1];
   if ((stuff > 1) || (stuff < -1) || (length < 100)) {
     // debug(1, "Stuff argument to stuff_buffer must be from -1 to +1 and length >100.");
     tstuff = 0; // if any of these conditions hold, don't stuff anything/
@@ -1409,17 +1497,15 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, sps_format_t l_outp
         (rand() % (length - 2)) + 1; // ensure there's always a sample before and after the item
 
   for (i = 0; i < stuffsamp; i++) { // the whole frame, if no stuffing
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
+    process_frame(inptr[0], inptr[1], &l_outptr, wrap_at, wrap_to, l_output_format, dither, conn);
+    inptr += 2;
   };
   if (tstuff) {
     if (tstuff == 1) {
       // debug(3, "+++++++++");
       // interpolate one sample
-      process_sample(mean_32(inptr[-2], inptr[0]), &l_outptr, l_output_format, conn->fix_volume,
-                     dither, conn);
-      process_sample(mean_32(inptr[-1], inptr[1]), &l_outptr, l_output_format, conn->fix_volume,
-                     dither, conn);
+      process_frame(mean_32(inptr[-2], inptr[0]), mean_32(inptr[-1], inptr[1]), &l_outptr, wrap_at,
+                    wrap_to, l_output_format, dither, conn);
     } else if (stuff == -1) {
       // debug(3, "---------");
       inptr++;
@@ -1433,8 +1519,9 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, sps_format_t l_outp
       remainder = remainder + tstuff; // don't run over the correct end of the output buffer
 
     for (i = stuffsamp; i < remainder; i++) {
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
+      process_frame(inptr[0], inptr[1], &l_outptr, wrap_at, wrap_to, l_output_format, dither,
+                    conn);
+      inptr += 2;
     }
   }
   conn->amountStuffed = tstuff;
@@ -1458,8 +1545,10 @@ double longest_soxr_execution_time_us = 0.0;
 int64_t packets_processed = 0;
 
 int stuff_buffer_soxr_32(int32_t *inptr, int32_t *scratchBuffer, int length,
-                         sps_format_t l_output_format, char *outptr, int stuff, int dither,
+                         sps_format_t l_output_format, output_region *out, int stuff, int dither,
                          rtsp_conn_info *conn) {
+  char *wrap_at = out->p[0] + out->frames[0] * conn->output_bytes_per_frame;
+  char *wrap_to = out->p[1];
   if (scratchBuffer == NULL) {
     die("soxr scratchBuffer not initialised.");
   }
@@ -1533,22 +1622,22 @@ int stuff_buffer_soxr_32(int32_t *inptr, int32_t *scratchBuffer, int length,
 
     // now, do the volume, dither and formatting processing
     ip = scratchBuffer;
-    char *l_outptr = outptr;
+    char *l_outptr = out->p[0];
     for (i = 0; i < length + tstuff; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
+      process_frame(ip[0], ip[1], &l_outptr, wrap_at, wrap_to, l_output_format, dither, conn);
+      ip += 2;
     };
 
   } else { // the whole frame, if no stuffing
 
     // now, do the volume, dither and formatting processing
     int32_t *ip = inptr;
-    char *l_outptr = outptr;
+    char *l_outptr = out->p[0];
     int i;
 
     for (i = 0; i < length; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
+      process_frame(ip[0], ip[1], &l_outptr, wrap_at, wrap_to, l_output_format, dither, conn);
+      ip += 2;
     };
   }
 
@@ -1589,6 +1678,10 @@ void player_thread_cleanup_handler(void *arg) {
   if (config.output->stop)
     config.output->stop();
 
+#ifdef CONFIG_METADATA
+  metadata_shm_update_session(conn, 0, 0, 0.0);
+#endif
+
   if (config.statistics_requested) {
     int rawSeconds = (int)difftime(time(NULL), conn->playstart);
     int elapsedHours = rawSeconds / 3600;
@@ -1705,25 +1798,7 @@ void *player_thread_func(void *arg) {
                                      // rate, multiply it by the frame ratio.
                                      // but, on some occasions, more than one frame could be added
 
-  switch (config.output_format) {
-  case SPS_FORMAT_S24_3LE:
-  case SPS_FORMAT_S24_3BE:
-    conn->output_bytes_per_frame = 6;
-    break;
-
-  case SPS_FORMAT_S24:
-  case SPS_FORMAT_S24_LE:
-  case SPS_FORMAT_S24_BE:
-    conn->output_bytes_per_frame = 8;
-    break;
-  case SPS_FORMAT_S32:
-  case SPS_FORMAT_S32_LE:
-  case SPS_FORMAT_S32_BE:
-    conn->output_bytes_per_frame = 8;
-    break;
-  default:
-    conn->output_bytes_per_frame = 4;
-  }
+  conn->output_bytes_per_frame = sps_format_bytes_per_frame(config.output_format);
 
   debug(3, "Output frame bytes is %d.", conn->output_bytes_per_frame);
 
@@ -1810,6 +1885,7 @@ void *player_thread_func(void *arg) {
   case SPS_FORMAT_S32:
   case SPS_FORMAT_S32_LE:
   case SPS_FORMAT_S32_BE:
+  case SPS_FORMAT_F32: // as far as dither is concerned
     output_bit_depth = 32;
     break;
   case SPS_FORMAT_UNKNOWN:
@@ -1832,9 +1908,14 @@ void *player_thread_func(void *arg) {
   if (config.output->parameters == NULL) {
     debug(3, "Dithering will be enabled because the output volume is being altered in software");
   }
+  // at 32 bits, dither would be far below the resolution of any DAC and of a float sink
+  if (output_bit_depth == 32) {
+    debug(3, "Dithering will not be done because the output bit depth is 32");
+  }
 
-  if ((config.output->parameters == NULL) || (conn->input_bit_depth > output_bit_depth) ||
-      (config.playback_mode == ST_mono))
+  if (((config.output->parameters == NULL) || (conn->input_bit_depth > output_bit_depth) ||
+       (config.playback_mode == ST_mono)) &&
+      (output_bit_depth < 32))
     conn->enable_dither = 1;
 
   // remember, the output device may never have been initialised prior to this call
@@ -2007,9 +2088,10 @@ void *player_thread_func(void *arg) {
           }
         } else {
 
-          if (((config.output->parameters == NULL) && (config.ignore_volume_control == 0) &&
-               (config.airplay_volume != 0.0)) ||
-              (conn->input_bit_depth > output_bit_depth) || (config.playback_mode == ST_mono))
+          if ((((config.output->parameters == NULL) && (config.ignore_volume_control == 0) &&
+                (config.airplay_volume != 0.0)) ||
+               (conn->input_bit_depth > output_bit_depth) || (config.playback_mode == ST_mono)) &&
+              (output_bit_depth < 32))
             conn->enable_dither = 1;
           else
             conn->enable_dither = 0;
@@ -2435,6 +2517,8 @@ void *player_thread_func(void *arg) {
                 }
               }
 
+              output_region out;
+              output_region_get(conn, inbuflength + conn->max_frame_size_change, &out);
 #ifdef CONFIG_SOXR
               if ((current_delay < conn->dac_buffer_queue_minimum_length) ||
                   (config.packet_stuffing == ST_basic) ||
@@ -2446,12 +2530,12 @@ void *player_thread_func(void *arg) {
 #endif
                 play_samples =
                     stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
-                                          conn->outbuf, amount_to_stuff, conn->enable_dither, conn);
+                                          &out, amount_to_stuff, conn->enable_dither, conn);
 #ifdef CONFIG_SOXR
               } else { // soxr requested or auto requested with the index less or equal to the
                        // threshold
                 play_samples = stuff_buffer_soxr_32((int32_t *)conn->tbuf, (int32_t *)conn->sbuf,
-                                                    inbuflength, config.output_format, conn->outbuf,
+                                                    inbuflength, config.output_format, &out,
                                                     amount_to_stuff, conn->enable_dither, conn);
               }
 #endif
@@ -2471,19 +2555,10 @@ void *player_thread_func(void *arg) {
               }
               */
 
-              if (conn->outbuf == NULL)
-                debug(1, "NULL outbuf to play -- skipping it.");
-              else {
-                if (play_samples == 0)
-                  debug(1, "play_samples==0 skipping it (1).");
-                else {
-                  if (conn->software_mute_enabled) {
-                    generate_zero_frames(conn->outbuf, play_samples, config.output_format,
-                                         conn->enable_dither, conn->previous_random_number);
-                  }
-                  config.output->play(conn->outbuf, play_samples);
-                }
-              }
+              if (play_samples == 0)
+                debug(1, "play_samples==0 skipping it (1).");
+              output_presentation_time(conn, inframe->given_timestamp);
+              output_region_play(conn, &out, play_samples);
 
               // check for loss of sync
               // timestamp of zero means an inserted silent frame in place of a missing frame
@@ -2511,18 +2586,13 @@ void *player_thread_func(void *arg) {
           } else {
             // if there is no delay procedure, or it's not working or not allowed, there can be no
             // synchronising
-            play_samples =
-                stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
-                                      conn->outbuf, 0, conn->enable_dither, conn);
-            if (conn->outbuf == NULL)
-              debug(1, "NULL outbuf to play -- skipping it.");
-            else {
-              if (conn->software_mute_enabled) {
-                generate_zero_frames(conn->outbuf, play_samples, config.output_format,
-                                     conn->enable_dither, conn->previous_random_number);
-              }
-              config.output->play(conn->outbuf, play_samples); // remove the (short*)!
-            }
+            output_region out;
+            output_region_get(conn, inbuflength, &out);
+            play_samples = stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength,
+                                                 config.output_format, &out, 0,
+                                                 conn->enable_dither, conn);
+            output_presentation_time(conn, inframe->given_timestamp);
+            output_region_play(conn, &out, play_samples);
           }
 
           // mark the frame as finished
@@ -2729,6 +2799,10 @@ void *player_thread_func(void *arg) {
               inform("No frames received in the last sampling interval.");
             }
           }
+#ifdef CONFIG_METADATA
+          metadata_shm_update_session(conn, 1, play_number,
+                                      1000 * moving_average_sync_error / config.output_rate);
+#endif
           minimum_dac_queue_size = INT64_MAX;   // hack reset
           maximum_buffer_occupancy = INT32_MIN; // can't be less than this
           minimum_buffer_occupancy = INT32_MAX; // can't be more than this
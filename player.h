@@ -91,6 +91,12 @@ typedef struct {
   int fd;
   int authorized;   // set if a password is required and has been supplied
   char *auth_nonce; // the session nonce, if needed
+  char *rtsp_input_buffer; // bytes read from the RTSP channel but not yet made into a request
+  size_t rtsp_input_buffer_size, rtsp_input_buffer_occupancy;
+  size_t rtsp_input_discard; // bytes of a request that was too big still to be read and dropped
+  uint64_t rtsp_listener_activity_time; // when the listener last heard from the connection
+  void *rtsp_pending_request; // a request read by the listener, to be handled first by the
+                              // conversation thread
   stream_cfg stream;
   SOCKADDR remote, local;
   volatile int stop;
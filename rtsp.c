@@ -28,8 +28,10 @@
  */
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <memory.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -42,6 +44,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -63,6 +66,12 @@
 #include "player.h"
 #include "rtp.h"
 #include "rtsp.h"
+#include "rtsp_parse.h"
+
+#ifdef CONFIG_METADATA
+#include "metadata_binary.h"
+#include "metadata_shm.h"
+#endif
 
 #ifdef CONFIG_METADATA_HUB
 #include "metadata_hub.h"
@@ -80,6 +89,10 @@
 
 #define METADATA_SNDBUF (4 * 1024 * 1024)
 
+#define rtsp_input_buffer_increment 4096
+#define maximum_rtsp_header_length (64 * 1024)
+#define maximum_rtsp_content_length (32 * 1024 * 1024)
+
 enum rtsp_read_request_response {
   rtsp_read_request_response_ok,
   rtsp_read_request_response_immediate_shutdown_requested,
@@ -110,17 +123,33 @@ static pthread_mutex_t reference_counter_lock = PTHREAD_MUTEX_INITIALIZER;
 int RTSP_connection_index = 1;
 
 #ifdef CONFIG_METADATA
+// A bounded multi-producer queue that producers add to without taking a lock.
+// Each slot carries a sequence number: a producer claims a slot by advancing the enqueue position
+// with a compare-and-swap, copies its item in and then publishes the slot by advancing the slot's
+// sequence number. The consumer takes items in order in the same way.
+// The consumer sleeps on a pipe when the queue is empty. A producer that finds it waiting writes a
+// byte to the pipe, without blocking -- only one byte is ever outstanding. Blocking producers
+// sleep on the condition variable when the queue is full; the consumer, which may block, signals
+// them under the lock.
 typedef struct {
   pthread_mutex_t pc_queue_lock;
-  pthread_cond_t pc_queue_item_added_signal;
   pthread_cond_t pc_queue_item_removed_signal;
-  size_t item_size;  // number of bytes in each item
-  uint32_t count;    // number of items in the queue
-  uint32_t capacity; // maximum number of items
-  uint32_t toq;      // first item to take
-  uint32_t eoq;      // free space at end of queue
-  void *items;       // a pointer to where the items are actually stored
-} pc_queue;          // producer-consumer queue
+  int wakeup_pipe[2];   // the consumer reads from [0]; [1] is non-blocking
+  size_t item_size;    // number of bytes in each item
+  uint32_t capacity;   // maximum number of items -- a power of two
+  uint32_t mask;       // capacity - 1
+  uint32_t *sequences; // one per slot, giving the position at which it may next be filled or taken
+  void *items;         // a pointer to where the items are actually stored
+  uint32_t eoq;        // next slot to be claimed by a producer -- accessed atomically
+  uint32_t toq;        // next slot to be taken -- accessed atomically
+  int consumer_waiting;  // accessed atomically
+  int wakeup_pending;    // set while there's a byte in the pipe -- accessed atomically
+  int producers_waiting; // accessed atomically
+  // statistics, accessed atomically
+  uint32_t maximum_depth;
+  uint64_t items_added;
+  uint64_t items_dropped;
+} pc_queue; // producer-consumer queue
 #endif
 
 static int msg_indexes = 1;
@@ -135,37 +164,73 @@ typedef struct {
   int contentlength;
   char *content;
 
+  // for requests, the header strings and the content point into this buffer, so only it needs to
+  // be freed
+  char *request_buffer;
+
   // for requests
   char method[16];
 
   // for responses
   int respcode;
+  char *cseq; // the CSeq of the request being responded to -- not freed with the response
 } rtsp_message;
 
 #ifdef CONFIG_METADATA
+// A picture is wrapped in one of these so that it can be shared, read-only, by the metadata
+// thread, the cover art thread and whatever they pass it to. It holds the message the picture
+// came in and is freed, with the message, when the last reference to it is released.
+struct metadata_payload {
+  uint32_t reference_count; // accessed atomically
+  rtsp_message *carrier;
+  int digest_valid;
+  uint8_t digest[16]; // calculated once, when the picture arrives
+};
+
 typedef struct {
   uint32_t type;
   uint32_t code;
   char *data;
   uint32_t length;
   rtsp_message *carrier;
+  metadata_payload *payload; // if set, the data belongs to this and carrier is NULL
+  uint64_t generation;       // of a picture passed to the cover art thread
 } metadata_package;
 
-void pc_queue_init(pc_queue *the_queue, char *items, size_t item_size, uint32_t number_of_items) {
+void pc_queue_init(pc_queue *the_queue, char *items, uint32_t *sequences, size_t item_size,
+                   uint32_t number_of_items) {
+  uint32_t i;
+  if ((number_of_items == 0) || (number_of_items & (number_of_items - 1)))
+    die("pc_queue_init -- the number of items, %u, must be a power of two.", number_of_items);
   pthread_mutex_init(&the_queue->pc_queue_lock, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_added_signal, NULL);
   pthread_cond_init(&the_queue->pc_queue_item_removed_signal, NULL);
+  if (pipe(the_queue->wakeup_pipe) != 0)
+    die("pc_queue_init -- can't create a pipe.");
+  for (i = 0; i < 2; i++)
+    fcntl(the_queue->wakeup_pipe[i], F_SETFD, FD_CLOEXEC);
+  fcntl(the_queue->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+  the_queue->sequences = sequences;
+  for (i = 0; i < number_of_items; i++)
+    the_queue->sequences[i] = i;
   the_queue->item_size = item_size;
   the_queue->items = items;
-  the_queue->count = 0;
   the_queue->capacity = number_of_items;
+  the_queue->mask = number_of_items - 1;
   the_queue->toq = 0;
   the_queue->eoq = 0;
+  the_queue->consumer_waiting = 0;
+  the_queue->wakeup_pending = 0;
+  the_queue->producers_waiting = 0;
+  the_queue->maximum_depth = 0;
+  the_queue->items_added = 0;
+  the_queue->items_dropped = 0;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
 void pc_queue_delete(pc_queue *the_queue) {
+  close(the_queue->wakeup_pipe[0]);
+  close(the_queue->wakeup_pipe[1]);
   pthread_cond_destroy(&the_queue->pc_queue_item_removed_signal);
-  pthread_cond_destroy(&the_queue->pc_queue_item_added_signal);
   pthread_mutex_destroy(&the_queue->pc_queue_lock);
 }
 
@@ -181,78 +246,140 @@ void pc_queue_cleanup_handler(void *arg) {
   pc_queue *the_queue = (pc_queue *)arg;
   int rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
   if (rc)
-    debug(1, "Error unlocking for pc_queue_add_item or pc_queue_get_item.");
+    debug(1, "Error unlocking for pc_queue_add_item.");
+}
+
+void pc_queue_get_cleanup_handler(void *arg) {
+  pc_queue *the_queue = (pc_queue *)arg;
+  __atomic_store_n(&the_queue->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+uint32_t pc_queue_depth(pc_queue *the_queue) {
+  uint32_t eoq = __atomic_load_n(&the_queue->eoq, __ATOMIC_RELAXED);
+  uint32_t toq = __atomic_load_n(&the_queue->toq, __ATOMIC_RELAXED);
+  return eoq - toq;
+}
+
+// add an item without waiting; returns EWOULDBLOCK if the queue is full
+int pc_queue_try_add_item(pc_queue *the_queue, const void *the_stuff) {
+  uint32_t pos = __atomic_load_n(&the_queue->eoq, __ATOMIC_RELAXED);
+  uint32_t i;
+  while (1) {
+    i = pos & the_queue->mask;
+    uint32_t sequence = __atomic_load_n(&the_queue->sequences[i], __ATOMIC_ACQUIRE);
+    int32_t difference = (int32_t)(sequence - pos);
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&the_queue->eoq, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break; // the slot is ours
+    } else if (difference < 0) {
+      return EWOULDBLOCK; // the slot hasn't been taken yet
+    } else {
+      pos = __atomic_load_n(&the_queue->eoq, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy((char *)the_queue->items + the_queue->item_size * i, the_stuff, the_queue->item_size);
+  __atomic_store_n(&the_queue->sequences[i], pos + 1, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&the_queue->items_added, 1, __ATOMIC_RELAXED);
+  uint32_t depth = pc_queue_depth(the_queue);
+  uint32_t maximum_depth = __atomic_load_n(&the_queue->maximum_depth, __ATOMIC_RELAXED);
+  while ((depth > maximum_depth) &&
+         (__atomic_compare_exchange_n(&the_queue->maximum_depth, &maximum_depth, depth, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0))
+    ;
+  if (depth == the_queue->capacity)
+    debug(1, "pc_queue is full with %u items in it!", depth);
+
+  // Wake the consumer if it's asleep, or about to sleep. The fence pairs with the one in
+  // pc_queue_get_item(): either the consumer sees this item or this sees the consumer waiting.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if ((__atomic_load_n(&the_queue->consumer_waiting, __ATOMIC_SEQ_CST)) &&
+      (__atomic_exchange_n(&the_queue->wakeup_pending, 1, __ATOMIC_SEQ_CST) == 0)) {
+    char c = 0;
+    if (write(the_queue->wakeup_pipe[1], &c, 1) != 1)
+      debug(1, "pc_queue can't wake the consumer -- error %d.", errno);
+  }
+  return 0;
+}
+
+// take an item without waiting; returns EWOULDBLOCK if the queue is empty
+int pc_queue_try_get_item(pc_queue *the_queue, void *the_stuff) {
+  uint32_t pos = __atomic_load_n(&the_queue->toq, __ATOMIC_RELAXED);
+  uint32_t i;
+  while (1) {
+    i = pos & the_queue->mask;
+    uint32_t sequence = __atomic_load_n(&the_queue->sequences[i], __ATOMIC_ACQUIRE);
+    int32_t difference = (int32_t)(sequence - (pos + 1));
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&the_queue->toq, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    } else if (difference < 0) {
+      return EWOULDBLOCK; // the slot hasn't been filled yet
+    } else {
+      pos = __atomic_load_n(&the_queue->toq, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy(the_stuff, (char *)the_queue->items + the_queue->item_size * i, the_queue->item_size);
+  __atomic_store_n(&the_queue->sequences[i], pos + the_queue->capacity, __ATOMIC_RELEASE);
+
+  // pairs with the producer's increment of producers_waiting before it checks for room
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&the_queue->producers_waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&the_queue->pc_queue_lock);
+    pthread_cond_broadcast(&the_queue->pc_queue_item_removed_signal);
+    pthread_mutex_unlock(&the_queue->pc_queue_lock);
+  }
+  return 0;
 }
 
+// If block is zero, this never waits, returning EBUSY if the queue is full.
+// Otherwise, it waits for room. The wait is a cancellation point.
 int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff, int block) {
-  int rc;
+  int rc = 0;
   if (the_queue) {
-    if (block == 0) {
-      rc = debug_mutex_lock(&the_queue->pc_queue_lock, 10000, 2);
-      if (rc == EBUSY)
+    while (pc_queue_try_add_item(the_queue, the_stuff) != 0) {
+      if (block == 0)
         return EBUSY;
-    } else
-      rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_add_item");
-    pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
-    while (the_queue->count == the_queue->capacity) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_removed_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "Error waiting for item to be removed");
-    }
-    uint32_t i = the_queue->eoq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->eoq;
-    memcpy(p, the_stuff, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->eoq = i;
-    the_queue->count++;
-    if (the_queue->count == the_queue->capacity)
-      debug(1, "pc_queue is full with %d items in it!", the_queue->count);
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_added_signal);
-    if (rc)
-      debug(1, "Error signalling after pc_queue_add_item");
-    pthread_cleanup_pop(1); // unlock the queue lock.
+      pthread_mutex_lock(&the_queue->pc_queue_lock);
+      pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
+      __atomic_add_fetch(&the_queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+      // the consumer signals under the lock if it sees producers waiting, so this can't miss it
+      if (pc_queue_depth(the_queue) >= the_queue->capacity) {
+        rc = pthread_cond_wait(&the_queue->pc_queue_item_removed_signal, &the_queue->pc_queue_lock);
+        if (rc)
+          debug(1, "Error waiting for item to be removed");
+      }
+      __atomic_sub_fetch(&the_queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+      pthread_cleanup_pop(1); // unlock the queue lock.
+    }
   } else {
     debug(1, "Adding an item to a NULL queue");
   }
   return 0;
 }
 
+// Wait for an item. The wait is a cancellation point. Only one thread may wait for items, though
+// others may take them with pc_queue_try_get_item().
 int pc_queue_get_item(pc_queue *the_queue, void *the_stuff) {
-  int rc;
   if (the_queue) {
-    rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_get_item");
-    pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
-    while (the_queue->count == 0) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_added_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "Error waiting for item to be added");
-    }
-    uint32_t i = the_queue->toq;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->toq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    memcpy(the_stuff, p, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->toq = i;
-    the_queue->count--;
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_removed_signal);
-    if (rc)
-      debug(1, "Error signalling after pc_queue_removed_item");
-    pthread_cleanup_pop(1); // unlock the queue lock.
+    while (pc_queue_try_get_item(the_queue, the_stuff) != 0) {
+      __atomic_store_n(&the_queue->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST); // see pc_queue_try_add_item()
+      if (pc_queue_try_get_item(the_queue, the_stuff) == 0) {
+        __atomic_store_n(&the_queue->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+        break;
+      }
+      pthread_cleanup_push(pc_queue_get_cleanup_handler, (void *)the_queue);
+      char c;
+      ssize_t rc = read(the_queue->wakeup_pipe[0], &c, 1); // a cancellation point
+      if ((rc < 0) && (errno != EINTR))
+        debug(1, "Error %d waiting for an item to be added.", errno);
+      // a producer that comes along from now on must write again if the consumer sleeps again
+      __atomic_store_n(&the_queue->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+      pthread_cleanup_pop(1); // the consumer is no longer waiting
+    }
   } else {
     debug(1, "Removing an item from a NULL queue");
   }
@@ -453,7 +580,7 @@ int msg_add_header(rtsp_message *msg, char *name, char *value) {
 char *msg_get_header(rtsp_message *msg, char *name) {
   unsigned int i;
   for (i = 0; i < msg->nheaders; i++)
-    if (!strcasecmp(msg->name[i], name))
+    if ((tolower(msg->name[i][0]) == tolower(name[0])) && (!strcasecmp(msg->name[i], name)))
       return msg->value[i];
   return NULL;
 }
@@ -494,13 +621,17 @@ void msg_free(rtsp_message **msgh) {
     rtsp_message *msg = *msgh;
     msg->referenceCount--;
     if (msg->referenceCount == 0) {
-      unsigned int i;
-      for (i = 0; i < msg->nheaders; i++) {
-        free(msg->name[i]);
-        free(msg->value[i]);
+      if (msg->request_buffer) {
+        free(msg->request_buffer);
+      } else {
+        unsigned int i;
+        for (i = 0; i < msg->nheaders; i++) {
+          free(msg->name[i]);
+          free(msg->value[i]);
+        }
+        if (msg->content)
+          free(msg->content);
       }
-      if (msg->content)
-        free(msg->content);
       // debug(1,"msg_free item %d -- free.",msg->index_number);
       uintptr_t index = (msg->index_number) & 0xFFFF;
       if (index == 0)
@@ -521,166 +652,149 @@ void msg_free(rtsp_message **msgh) {
   debug_mutex_unlock(&reference_counter_lock, 0);
 }
 
-int msg_handle_line(rtsp_message **pmsg, char *line) {
-  rtsp_message *msg = *pmsg;
-
-  if (!msg) {
-    msg = msg_init();
-    *pmsg = msg;
-    char *sp, *p;
-    sp = NULL; // this is to quieten a compiler warning
-
-    debug(3, "RTSP Message Received: \"%s\".", line);
-
-    p = strtok_r(line, " ", &sp);
-    if (!p)
-      goto fail;
-    strncpy(msg->method, p, sizeof(msg->method) - 1);
-
-    p = strtok_r(NULL, " ", &sp);
-    if (!p)
-      goto fail;
+// The input buffer of a connection is used for as many requests as it takes to fill it.
+// Make sure it has room for this many bytes, plus a NUL at the end
+static int rtsp_input_buffer_reserve(rtsp_conn_info *conn, size_t size) {
+  if (conn->rtsp_input_buffer_size < size) {
+    char *new_buffer = realloc(conn->rtsp_input_buffer, size + 1);
+    if (new_buffer == NULL)
+      return -1;
+    conn->rtsp_input_buffer = new_buffer;
+    conn->rtsp_input_buffer_size = size;
+  }
+  return 0;
+}
 
-    p = strtok_r(NULL, " ", &sp);
-    if (!p)
-      goto fail;
-    if (strcmp(p, "RTSP/1.0"))
-      goto fail;
+// drop what there is of the rest of a request that was too big, returning how much is still to come
+static size_t rtsp_input_buffer_discard(rtsp_conn_info *conn) {
+  size_t n = conn->rtsp_input_discard;
+  if (n > conn->rtsp_input_buffer_occupancy)
+    n = conn->rtsp_input_buffer_occupancy;
+  if (n) {
+    memmove(conn->rtsp_input_buffer, conn->rtsp_input_buffer + n,
+            conn->rtsp_input_buffer_occupancy - n);
+    conn->rtsp_input_buffer_occupancy -= n;
+    conn->rtsp_input_discard -= n;
+  }
+  return conn->rtsp_input_discard;
+}
 
+// Try to make a request out of what is in the connection's input buffer.
+// Returns 1 and the request if it's complete, 0 if more is needed and -1 if it's malformed.
+// If the header is complete, *message_length is set to the length of the full request.
+// The request is parsed in place: its header names, values and content point into the buffer,
+// which is handed over to the request. Anything following the request stays in the input buffer.
+// A request with too much content is rejected, and the rest of it is read and dropped before
+// anything more is parsed.
+static int rtsp_parse_request(rtsp_conn_info *conn, rtsp_message **the_packet,
+                              size_t *message_length) {
+  *message_length = 0;
+  if (rtsp_input_buffer_discard(conn))
+    return 0;
+  char *buf = conn->rtsp_input_buffer;
+  size_t header_length = rtsp_header_length(buf, conn->rtsp_input_buffer_occupancy);
+  if (header_length == 0)
+    return 0;
+  size_t content_length = rtsp_header_content_length(buf, header_length);
+  if (content_length > maximum_rtsp_content_length) {
+    warn("Connection %d: too much content -- %zu bytes of it will be dropped.",
+         conn->connection_number, content_length);
+    conn->rtsp_input_discard = header_length + content_length;
+    rtsp_input_buffer_discard(conn);
     return -1;
   }
+  *message_length = header_length + content_length;
+  if (*message_length > conn->rtsp_input_buffer_occupancy)
+    return 0;
 
-  if (strlen(line)) {
-    char *p;
-    p = strstr(line, ": ");
-    if (!p) {
-      warn("bad header: >>%s<<", line);
-      goto fail;
-    }
-    *p = 0;
-    p += 2;
-    msg_add_header(msg, line, p);
-    debug(3, "    %s: %s.", line, p);
-    return -1;
+  // the request is complete
+  char *request_buffer;
+  size_t excess = conn->rtsp_input_buffer_occupancy - *message_length;
+  if (excess == 0) {
+    // the usual case -- the request takes the input buffer itself
+    request_buffer = buf;
+    conn->rtsp_input_buffer = NULL;
+    conn->rtsp_input_buffer_size = 0;
   } else {
-    char *cl = msg_get_header(msg, "Content-Length");
-    if (cl)
-      return atoi(cl);
-    else
-      return 0;
+    request_buffer = malloc(*message_length + 1);
+    if (request_buffer == NULL)
+      die("Connection %d: can not allocate memory for an RTSP request.", conn->connection_number);
+    memcpy(request_buffer, buf, *message_length);
+    memmove(buf, buf + *message_length, excess);
+  }
+  conn->rtsp_input_buffer_occupancy = excess;
+  request_buffer[*message_length] = '\0';
+
+  rtsp_message *msg = msg_init();
+  msg->request_buffer = request_buffer;
+  msg->content = request_buffer + header_length;
+  msg->contentlength = content_length;
+
+  // now the header, parsed where it lies
+  char *method = NULL;
+  int nheaders = rtsp_parse_header(request_buffer, header_length, &method, msg->name, msg->value,
+                                   sizeof(msg->name) / sizeof(char *));
+  if (nheaders < 0)
+    goto fail;
+  strncpy(msg->method, method, sizeof(msg->method) - 1);
+  debug(3, "RTSP Message Received: \"%s\".", msg->method);
+  if ((size_t)nheaders > sizeof(msg->name) / sizeof(char *)) {
+    warn("too many headers?!");
+    nheaders = sizeof(msg->name) / sizeof(char *);
   }
+  msg->nheaders = nheaders;
+  unsigned int i;
+  for (i = 0; i < msg->nheaders; i++)
+    debug(3, "    %s: %s.", msg->name[i], msg->value[i]);
+  *the_packet = msg;
+  return 1;
 
 fail:
-  debug(3,"msg_handle_line fail");
-  msg_free(pmsg);
-  *pmsg = NULL;
-  return 0;
+  debug(3, "rtsp_parse_request fail");
+  msg_free(&msg);
+  return -1;
 }
 
 enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_message **the_packet) {
 
   *the_packet = NULL; // need this for error handling
 
-  enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
-  ssize_t buflen = 4096;
-  int release_buffer = 0;         // on exit, don't deallocate the buffer if everything was okay
-  char *buf = malloc(buflen + 1); // add a NUL at the end
-  if (!buf) {
-    warn("Connection %d: rtsp_read_request: can't get a buffer.", conn->connection_number);
-    return (rtsp_read_request_response_error);
-  }
-  pthread_cleanup_push(malloc_cleanup, buf);
+  uint64_t threshold_time = 0;
+  int warning_message_sent = 0;
+  size_t message_length = 0;
   ssize_t nread;
-  ssize_t inbuf = 0;
-  int msg_size = -1;
+  int rc;
 
-  while (msg_size < 0) {
+  while ((rc = rtsp_parse_request(conn, the_packet, &message_length)) == 0) {
     if (conn->stop != 0) {
       debug(3, "Connection %d: shutdown requested.", conn->connection_number);
-      reply = rtsp_read_request_response_immediate_shutdown_requested;
-      goto shutdown;
-    }
-
-    nread = read(conn->fd, buf + inbuf, buflen - inbuf);
-
-    if (nread == 0) {
-      // a blocking read that returns zero means eof -- implies connection closed
-      debug(3, "Connection %d: -- connection closed.", conn->connection_number);
-      reply = rtsp_read_request_response_channel_closed;
-      goto shutdown;
-    }
-
-    if (nread < 0) {
-      if (errno == EINTR)
-        continue;
-      if (errno == EAGAIN) {
-        debug(1, "Connection %d: getting Error 11 -- EAGAIN from a blocking read!", conn->connection_number);
-        continue;
-      }
-      if (errno != ECONNRESET) {
-        char errorstring[1024];
-        strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-        debug(1, "Connection %d: rtsp_read_request_response_read_error %d: \"%s\".",
-              conn->connection_number, errno, (char *)errorstring);
-      }
-      reply = rtsp_read_request_response_read_error;
-      goto shutdown;
+      return rtsp_read_request_response_immediate_shutdown_requested;
     }
 
-/* // this outputs the message received
-    {
-    void *pt = malloc(nread+1);
-    memset(pt, 0, nread+1);
-    memcpy(pt, buf + inbuf, nread);
-    debug(1, "Incoming string on port: \"%s\"",pt);
-    free(pt);
-    }
-*/
-
-    inbuf += nread;
-
-    char *next;
-    while (msg_size < 0 && (next = nextline(buf, inbuf))) {
-      msg_size = msg_handle_line(the_packet, buf);
-
-      if (!(*the_packet)) {
-        debug(1,"Connection %d: rtsp_read_request can't find an RTSP header.", conn->connection_number);
-        reply = rtsp_read_request_response_bad_packet;
-        goto shutdown;
+    size_t wanted = message_length;
+    if (wanted == 0) { // still looking for the end of the header
+      if (conn->rtsp_input_buffer_occupancy >= maximum_rtsp_header_length) {
+        debug(1, "Connection %d: rtsp_read_request can't find the end of an RTSP header.",
+              conn->connection_number);
+        conn->rtsp_input_buffer_occupancy = 0;
+        return rtsp_read_request_response_bad_packet;
       }
-
-      inbuf -= next - buf;
-      if (inbuf)
-        memmove(buf, next, inbuf);
+      wanted = conn->rtsp_input_buffer_occupancy + rtsp_input_buffer_increment;
     }
-  }
-
-  if (msg_size > buflen) {
-    buf = realloc(buf, msg_size + 1);
-    if (!buf) {
+    if (rtsp_input_buffer_reserve(conn, wanted)) {
       warn("Connection %d: too much content.", conn->connection_number);
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
+      return rtsp_read_request_response_error;
     }
-    buflen = msg_size;
-  }
-
-  uint64_t threshold_time =
-      get_absolute_time_in_fp() + ((uint64_t)15 << 32); // i.e. fifteen seconds from now
-  int warning_message_sent = 0;
 
-  const size_t max_read_chunk = 1024 * 1024 / 16;
-  while (inbuf < msg_size) {
-
-    // we are going to read the stream in chunks and time how long it takes to
-    // do so.
-    // If it's taking too long, (and we find out about it), we will send an
-    // error message as
-    // metadata
-
-    if (warning_message_sent == 0) {
+    if (message_length) {
+      // We are reading the content, which may be large -- e.g. cover art.
+      // Wait for it to arrive rather than sleeping for a fixed time between reads.
+      // If it's taking too long, (and we find out about it), we will send an
+      // error message as metadata.
       uint64_t time_now = get_absolute_time_in_fp();
-      if (time_now > threshold_time) { // it's taking too long
+      if (threshold_time == 0) {
+        threshold_time = time_now + ((uint64_t)15 << 32); // i.e. fifteen seconds from now
+      } else if ((warning_message_sent == 0) && (time_now > threshold_time)) {
         debug(1, "Error receiving metadata from source -- transmission seems "
                  "to be stalled.");
 #ifdef CONFIG_METADATA
@@ -688,27 +802,33 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
 #endif
         warning_message_sent = 1;
       }
+      struct pollfd pfd;
+      pfd.fd = conn->fd;
+      pfd.events = POLLIN;
+      int prc = poll(&pfd, 1, 1000);
+      if (prc == 0)
+        continue; // check for a shutdown request and a stall, then wait again
+      if ((prc < 0) && (errno == EINTR))
+        continue;
     }
 
-    if (conn->stop != 0) {
-      debug(1, "RTSP shutdown requested.");
-      reply = rtsp_read_request_response_immediate_shutdown_requested;
-      goto shutdown;
-    }
-    size_t read_chunk = msg_size - inbuf;
-    if (read_chunk > max_read_chunk)
-      read_chunk = max_read_chunk;
-    usleep(80000); // wait about 80 milliseconds between reads of up to about 64 kB
-    nread = read(conn->fd, buf + inbuf, read_chunk);
-    if (!nread) {
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
+    nread = read(conn->fd, conn->rtsp_input_buffer + conn->rtsp_input_buffer_occupancy,
+                 conn->rtsp_input_buffer_size - conn->rtsp_input_buffer_occupancy);
+
+    if (nread == 0) {
+      if (message_length)
+        return rtsp_read_request_response_error;
+      // a blocking read that returns zero means eof -- implies connection closed
+      debug(3, "Connection %d: -- connection closed.", conn->connection_number);
+      return rtsp_read_request_response_channel_closed;
     }
+
     if (nread < 0) {
       if (errno == EINTR)
         continue;
       if (errno == EAGAIN) {
-        debug(1, "Getting Error 11 -- EAGAIN from a blocking read!");
+        debug(1, "Connection %d: getting Error 11 -- EAGAIN from a blocking read!",
+              conn->connection_number);
         continue;
       }
       if (errno != ECONNRESET) {
@@ -717,86 +837,123 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
         debug(1, "Connection %d: rtsp_read_request_response_read_error %d: \"%s\".",
               conn->connection_number, errno, (char *)errorstring);
       }
-      reply = rtsp_read_request_response_read_error;
-      goto shutdown;
+      return rtsp_read_request_response_read_error;
     }
-    inbuf += nread;
+    conn->rtsp_input_buffer_occupancy += nread;
   }
 
-  rtsp_message *msg = *the_packet;
-  msg->contentlength = inbuf;
-  msg->content = buf;
-  char *jp = inbuf + buf;
-  *jp = '\0';
-  *the_packet = msg;
-shutdown:
-  if (reply != rtsp_read_request_response_ok) {
-    msg_free(the_packet);
-    release_buffer = 1; // allow the buffer to be released
+  if (rc < 0) {
+    debug(1, "Connection %d: rtsp_read_request can't find an RTSP header.",
+          conn->connection_number);
+    return rtsp_read_request_response_bad_packet;
+  }
+  return rtsp_read_request_response_ok;
+}
+
+// preformatted parts of responses
+static const char rtsp_status_line_ok[] = "RTSP/1.0 200 OK\r\n";
+static const char rtsp_header_server[] = "Server: AirTunes/105.1\r\n";
+static const char rtsp_header_cseq[] = "CSeq: ";
+static const char rtsp_header_separator[] = ": ";
+static const char rtsp_line_end[] = "\r\n";
+
+// room for the status line, the CSeq and Server headers, the headers, the Content-Length header, the
+// blank line and the content
+#define rtsp_response_iovecs (1 + 3 + 1 + 4 * 16 + 1 + 1 + 1)
+
+static int iovec_append(struct iovec *iov, int iovcnt, const void *base, size_t len) {
+  iov[iovcnt].iov_base = (void *)base;
+  iov[iovcnt].iov_len = len;
+  return iovcnt + 1;
+}
+
+// write all the iovecs, picking up where a partial write left off
+static ssize_t writev_fully(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  while (iovcnt) {
+    ssize_t reply = writev(fd, iov, iovcnt);
+    if (reply < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (reply == 0)
+      break;
+    total += reply;
+    while ((iovcnt) && ((size_t)reply >= iov->iov_len)) {
+      reply -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base = (char *)iov->iov_base + reply;
+      iov->iov_len -= reply;
+    }
   }
-  pthread_cleanup_pop(release_buffer);
-  return reply;
+  return total;
 }
 
+// The response is written with a single writev() straight from where its parts lie, so there is
+// no limit to the size of the content.
 int msg_write_response(int fd, rtsp_message *resp) {
-  char pkt[2048];
-  int pktfree = sizeof(pkt);
-  char *p = pkt;
-  int n;
+  struct iovec iov[rtsp_response_iovecs];
+  int iovcnt = 0;
+  char status_line[64];
+  char content_length_line[64];
   unsigned int i;
 
-  n = snprintf(p, pktfree, "RTSP/1.0 %d %s\r\n", resp->respcode,
-               resp->respcode == 200 ? "OK" : "Unauthorized");
+  if (resp->respcode == 200) {
+    iovcnt = iovec_append(iov, iovcnt, rtsp_status_line_ok, strlen(rtsp_status_line_ok));
+  } else {
+    int n = snprintf(status_line, sizeof(status_line), "RTSP/1.0 %d %s\r\n", resp->respcode,
+                     "Unauthorized");
+    iovcnt = iovec_append(iov, iovcnt, status_line, n);
+  }
   // debug(1, "sending response: %s", pkt);
-  pktfree -= n;
-  p += n;
+
+  if (resp->cseq) {
+    iovcnt = iovec_append(iov, iovcnt, rtsp_header_cseq, strlen(rtsp_header_cseq));
+    iovcnt = iovec_append(iov, iovcnt, resp->cseq, strlen(resp->cseq));
+    iovcnt = iovec_append(iov, iovcnt, rtsp_line_end, strlen(rtsp_line_end));
+  }
+  iovcnt = iovec_append(iov, iovcnt, rtsp_header_server, strlen(rtsp_header_server));
 
   for (i = 0; i < resp->nheaders; i++) {
     //    debug(3, "    %s: %s.", resp->name[i], resp->value[i]);
-    n = snprintf(p, pktfree, "%s: %s\r\n", resp->name[i], resp->value[i]);
-    pktfree -= n;
-    p += n;
-    if (pktfree <= 1024) {
-      debug(1, "Attempted to write overlong RTSP packet 1");
-      return -1;
-    }
+    iovcnt = iovec_append(iov, iovcnt, resp->name[i], strlen(resp->name[i]));
+    iovcnt = iovec_append(iov, iovcnt, rtsp_header_separator, strlen(rtsp_header_separator));
+    iovcnt = iovec_append(iov, iovcnt, resp->value[i], strlen(resp->value[i]));
+    iovcnt = iovec_append(iov, iovcnt, rtsp_line_end, strlen(rtsp_line_end));
   }
 
   // Here, if there's content, write the Content-Length header ...
 
   if (resp->contentlength) {
-    debug(1, "Responding with content of length %d", resp->contentlength);
-    n = snprintf(p, pktfree, "Content-Length: %d\r\n", resp->contentlength);
-    pktfree -= n;
-    p += n;
-    if (pktfree <= 1024) {
-      debug(1, "Attempted to write overlong RTSP packet 2");
-      return -2;
-    }
-    debug(1, "Content is \"%s\"", resp->content);
-    memcpy(p, resp->content, resp->contentlength);
-    pktfree -= resp->contentlength;
-    p += resp->contentlength;
+    debug(2, "Responding with content of length %d", resp->contentlength);
+    int n = snprintf(content_length_line, sizeof(content_length_line), "Content-Length: %d\r\n",
+                     resp->contentlength);
+    iovcnt = iovec_append(iov, iovcnt, content_length_line, n);
   }
 
-  n = snprintf(p, pktfree, "\r\n");
-  pktfree -= n;
-  p += n;
+  iovcnt = iovec_append(iov, iovcnt, rtsp_line_end, strlen(rtsp_line_end));
 
-  if (pktfree <= 1024) {
-    debug(1, "Attempted to write overlong RTSP packet 3");
-    return -3;
-  }
-  ssize_t reply = write(fd, pkt, p - pkt);
+  if (resp->contentlength)
+    iovcnt = iovec_append(iov, iovcnt, resp->content, resp->contentlength);
+
+  size_t response_length = 0;
+  for (i = 0; i < (unsigned int)iovcnt; i++)
+    response_length += iov[i].iov_len;
+
+  ssize_t reply = writev_fully(fd, iov, iovcnt);
   if (reply == -1) {
     char errorstring[1024];
     strerror_r(errno, (char *)errorstring, sizeof(errorstring));
     debug(1, "msg_write_response error %d: \"%s\".", errno, (char *)errorstring);
     return -4;
   }
-  if (reply != p - pkt) {
-    debug(1, "msg_write_response error -- requested bytes: %d not fully written: %d.", p - pkt,
-          reply);
+  if ((size_t)reply != response_length) {
+    debug(1, "msg_write_response error -- requested bytes: %zu not fully written: %zd.",
+          response_length, reply);
     return -5;
   }
   return 0;
@@ -1178,6 +1335,19 @@ static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J'
 
 static size_t mod_table[] = {0, 2, 1};
 
+// Each group of three input bytes is encoded as two 12-bit halves, each looked up in this table
+// of pairs of output characters. This halves the number of lookups and stores.
+static char encoding_pair_table[4096][2];
+static pthread_once_t encoding_pair_table_once = PTHREAD_ONCE_INIT;
+
+static void encoding_pair_table_init(void) {
+  int i;
+  for (i = 0; i < 4096; i++) {
+    encoding_pair_table[i][0] = encoding_table[i >> 6];
+    encoding_pair_table[i][1] = encoding_table[i & 0x3F];
+  }
+}
+
 // pass in a pointer to the data, its length, a pointer to the output buffer and
 // a pointer to an int
 // containing its maximum length
@@ -1191,8 +1361,17 @@ char *base64_encode_so(const unsigned char *data, size_t input_length, char *enc
     return (NULL);
   *output_length = calculated_output_length;
 
+  pthread_once(&encoding_pair_table_once, encoding_pair_table_init);
+
   size_t i, j;
-  for (i = 0, j = 0; i < input_length;) {
+  for (i = 0, j = 0; i + 3 <= input_length; i += 3, j += 4) {
+    uint32_t triple = (data[i] << 0x10) + (data[i + 1] << 0x08) + data[i + 2];
+    memcpy(encoded_data + j, encoding_pair_table[triple >> 12], 2);
+    memcpy(encoded_data + j + 2, encoding_pair_table[triple & 0xFFF], 2);
+  }
+
+  // the last one or two bytes, if any
+  while (i < input_length) {
 
     uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
     uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
@@ -1221,8 +1400,12 @@ pc_queue metadata_queue;
 static int metadata_sock = -1;
 static struct sockaddr_in metadata_sockaddr;
 static char *metadata_sockmsg;
-#define metadata_queue_size 500
+static char *metadata_pipe_buffer; // where items are rendered for the metadata pipe
+static size_t metadata_pipe_buffer_size;
+static uint32_t metadata_binary_sequence; // the sequence number of the next item
+#define metadata_queue_size 512
 metadata_package metadata_queue_items[metadata_queue_size];
+uint32_t metadata_queue_sequences[metadata_queue_size];
 
 pthread_t metadata_thread;
 
@@ -1303,8 +1486,30 @@ static void metadata_close(void) {
 void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
   // debug(2, "Process metadata with type %x, code %x and length %u.", type, code, length);
   int ret;
-
-  if (metadata_sock >= 0 && length < config.metadata_sockmsglength - 8) {
+  metadata_binary_header header;
+  header.magic = METADATA_BINARY_MAGIC;
+  header.type = type;
+  header.code = code;
+  header.sequence = metadata_binary_sequence++;
+  header.length = length;
+  header.offset = 0;
+
+  if ((metadata_sock >= 0) && (config.metadata_socket_binary_format)) {
+    // send the item in as many packets as needed, each with a binary header
+    size_t payload_capacity = config.metadata_sockmsglength - METADATA_BINARY_HEADER_LENGTH;
+    do {
+      size_t datalen = length - header.offset;
+      if (datalen > payload_capacity)
+        datalen = payload_capacity;
+      metadata_binary_header_pack(&header, metadata_sockmsg);
+      if (datalen)
+        memcpy(metadata_sockmsg + METADATA_BINARY_HEADER_LENGTH, data + header.offset, datalen);
+      sendto(metadata_sock, metadata_sockmsg, datalen + METADATA_BINARY_HEADER_LENGTH, 0,
+             (struct sockaddr *)&metadata_sockaddr, sizeof(metadata_sockaddr));
+      header.offset += datalen;
+    } while (header.offset < length);
+    header.offset = 0;
+  } else if (metadata_sock >= 0 && length < config.metadata_sockmsglength - 8) {
     char *ptr = metadata_sockmsg;
     uint32_t v;
     v = htonl(type);
@@ -1364,58 +1569,51 @@ void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length)
     metadata_open();
   if (fd < 0)
     return;
-  char thestring[1024];
-  snprintf(thestring, 1024, "<item><type>%x</type><code>%x</code><length>%u</length>", type, code,
-           length);
-  ret = non_blocking_write(fd, thestring, strlen(thestring));
-  if (ret < 0) {
-    // debug(1,"metadata_process error %d exit 1",ret);
+
+  // The whole item is rendered into one buffer, kept from item to item, and written in one go.
+  // The base64 data is not broken into lines.
+  size_t required_size;
+  if (config.metadata_pipe_binary_format)
+    required_size = METADATA_BINARY_HEADER_LENGTH + length;
+  else
+    required_size = 128 + 4 * ((length + 2) / 3);
+  if (required_size > metadata_pipe_buffer_size) {
+    char *new_buffer = realloc(metadata_pipe_buffer, required_size);
+    if (new_buffer == NULL) {
+      debug(1, "Can not allocate %zu bytes to render a metadata item.", required_size);
+      return;
+    }
+    metadata_pipe_buffer = new_buffer;
+    metadata_pipe_buffer_size = required_size;
+  }
+  char *p = metadata_pipe_buffer;
+  if (config.metadata_pipe_binary_format) {
+    metadata_binary_header_pack(&header, p);
+    if (length)
+      memcpy(p + METADATA_BINARY_HEADER_LENGTH, data, length);
+    ret = non_blocking_write(fd, p, METADATA_BINARY_HEADER_LENGTH + length);
     return;
   }
+  p += snprintf(p, 128, "<item><type>%x</type><code>%x</code><length>%u</length>", type, code,
+                length);
   if ((data != NULL) && (length > 0)) {
-    snprintf(thestring, 1024, "\n<data encoding=\"base64\">\n");
-    ret = non_blocking_write(fd, thestring, strlen(thestring));
-    if (ret < 0) {
-      // debug(1,"metadata_process error %d exit 2",ret);
-      return;
-    }
-    // here, we write the data in base64 form using our nice base64 encoder
-    // but, we break it into lines of 76 output characters, except for the last
-    // one.
-    // thus, we send groups of (76/4)*3 =  57 bytes to the encoder at a time
-    size_t remaining_count = length;
-    char *remaining_data = data;
-    // size_t towrite_count;
-    char outbuf[76];
-    while ((remaining_count) && (ret >= 0)) {
-      size_t towrite_count = remaining_count;
-      if (towrite_count > 57)
-        towrite_count = 57;
-      size_t outbuf_size = 76; // size of output buffer on entry, length of result on exit
-      if (base64_encode_so((unsigned char *)remaining_data, towrite_count, outbuf, &outbuf_size) ==
-          NULL)
-        debug(1, "Error encoding base64 data.");
-      // debug(1,"Remaining count: %d ret: %d, outbuf_size:
-      // %d.",remaining_count,ret,outbuf_size);
-      ret = non_blocking_write(fd, outbuf, outbuf_size);
-      if (ret < 0) {
-        // debug(1,"metadata_process error %d exit 3",ret);
-        return;
-      }
-      remaining_data += towrite_count;
-      remaining_count -= towrite_count;
-    }
-    snprintf(thestring, 1024, "</data>");
-    ret = non_blocking_write(fd, thestring, strlen(thestring));
-    if (ret < 0) {
-      // debug(1,"metadata_process error %d exit 4",ret);
+    static const char data_start[] = "\n<data encoding=\"base64\">\n";
+    memcpy(p, data_start, sizeof(data_start) - 1);
+    p += sizeof(data_start) - 1;
+    size_t outbuf_size = metadata_pipe_buffer_size - (p - metadata_pipe_buffer);
+    if (base64_encode_so((unsigned char *)data, length, p, &outbuf_size) == NULL) {
+      debug(1, "Error encoding base64 data.");
       return;
     }
+    p += outbuf_size;
+    memcpy(p, "</data>", strlen("</data>"));
+    p += strlen("</data>");
   }
-  snprintf(thestring, 1024, "</item>\n");
-  ret = non_blocking_write(fd, thestring, strlen(thestring));
+  memcpy(p, "</item>\n", strlen("</item>\n"));
+  p += strlen("</item>\n");
+  ret = non_blocking_write(fd, metadata_pipe_buffer, p - metadata_pipe_buffer);
   if (ret < 0) {
-    // debug(1,"metadata_process error %d exit 5",ret);
+    // debug(1,"metadata_process error %d",ret);
     return;
   }
 }
@@ -1424,22 +1622,106 @@ void metadata_thread_cleanup_function(__attribute__((unused)) void *arg) {
   debug(2, "metadata_thread_cleanup_function called");
   metadata_delete_multicast_socket();
   metadata_close();
-  pc_queue_delete(&metadata_queue);
+  free(metadata_pipe_buffer);
+  metadata_pipe_buffer = NULL;
+  metadata_pipe_buffer_size = 0;
+  debug(2, "metadata queue: %" PRIu64 " items added, %" PRIu64 " dropped, maximum depth %u.",
+        metadata_queue.items_added, metadata_queue.items_dropped, metadata_queue.maximum_depth);
+}
+
+static metadata_payload *metadata_payload_new(rtsp_message *carrier, char *data,
+                                              uint32_t length) {
+  metadata_payload *payload = calloc(1, sizeof(metadata_payload));
+  if (payload) {
+    payload->reference_count = 1;
+    payload->carrier = carrier;
+#ifdef CONFIG_METADATA_HUB
+    metadata_hub_cover_art_digest(data, length, payload->digest);
+    payload->digest_valid = 1;
+#else
+    (void)data;
+    (void)length;
+#endif
+  }
+  return payload;
+}
+
+void metadata_payload_retain(metadata_payload *payload) {
+  __atomic_add_fetch(&payload->reference_count, 1, __ATOMIC_RELAXED);
+}
+
+void metadata_payload_release(metadata_payload *payload) {
+  if (__atomic_sub_fetch(&payload->reference_count, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (payload->carrier)
+      msg_free(&payload->carrier);
+    free(payload);
+  }
 }
 
 void metadata_pack_cleanup_function(void *arg) {
   // debug(1, "metadata_pack_cleanup_function called");
   metadata_package *pack = (metadata_package *)arg;
-  if (pack->carrier)
+  if (pack->payload)
+    metadata_payload_release(pack->payload);
+  else if (pack->carrier)
     msg_free(&pack->carrier); // release the message
   else if (pack->data)
     free(pack->data);
 }
 
+// Pictures are passed to the metadata hub and to MQTT on a thread of their own, so that writing
+// the cover art file and publishing the picture doesn't hold up the items behind it.
+
+#define cover_art_queue_size 8
+pc_queue cover_art_queue;
+metadata_package cover_art_queue_items[cover_art_queue_size];
+uint32_t cover_art_queue_sequences[cover_art_queue_size];
+pthread_t cover_art_thread;
+
+void *cover_art_thread_function(__attribute__((unused)) void *ignore) {
+  metadata_package pack;
+  while (1) {
+    pc_queue_get_item(&cover_art_queue, &pack);
+    pthread_cleanup_push(metadata_pack_cleanup_function, (void *)&pack);
+#ifdef CONFIG_METADATA_HUB
+    metadata_hub_process_picture(pack.data, pack.length, pack.payload,
+                                 pack.payload->digest_valid ? pack.payload->digest : NULL,
+                                 pack.generation);
+#endif
+
+#ifdef CONFIG_MQTT
+    if (config.mqtt_enabled) {
+      mqtt_process_metadata(pack.type, pack.code, pack.data, pack.length, pack.payload);
+    }
+#endif
+    pthread_cleanup_pop(1);
+  }
+  pthread_exit(NULL);
+}
+
+// The picture is given its generation here, in the order of the metadata, so that the hub won't
+// announce it if a later picture or a new track comes along before the cover art thread gets to it.
+static void cover_art_hand_over(metadata_package *pack) {
+  metadata_package cover_art_pack = *pack;
+  metadata_payload_retain(cover_art_pack.payload);
+#ifdef CONFIG_METADATA_HUB
+  cover_art_pack.generation = metadata_hub_cover_art_generation_next();
+#endif
+  if (pc_queue_add_item(&cover_art_queue, &cover_art_pack, 0) == EBUSY) {
+    // a later picture supersedes an earlier one, so make room by dropping the oldest
+    metadata_package oldest_pack;
+    if (pc_queue_try_get_item(&cover_art_queue, &oldest_pack) == 0) {
+      debug(2, "Cover art queue is full, discarding the oldest picture.");
+      metadata_pack_cleanup_function(&oldest_pack);
+    }
+    if (pc_queue_add_item(&cover_art_queue, &cover_art_pack, 0) == EBUSY) {
+      debug(1, "Cover art queue is busy, discarding a picture.");
+      metadata_pack_cleanup_function(&cover_art_pack);
+    }
+  }
+}
+
 void *metadata_thread_function(__attribute__((unused)) void *ignore) {
-  // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_queue, (char *)&metadata_queue_items, sizeof(metadata_package),
-                metadata_queue_size);
   metadata_create_multicast_socket();
   metadata_package pack;
   pthread_cleanup_push(metadata_thread_cleanup_function, NULL);
@@ -1448,15 +1730,20 @@ void *metadata_thread_function(__attribute__((unused)) void *ignore) {
     pthread_cleanup_push(metadata_pack_cleanup_function, (void *)&pack);
     if (config.metadata_enabled) {
       metadata_process(pack.type, pack.code, pack.data, pack.length);
+      metadata_shm_process_metadata(pack.type, pack.code, pack.data, pack.length);
+      if (pack.payload) {
+        cover_art_hand_over(&pack); // the hub and MQTT will get it on the cover art thread
+      } else {
 #ifdef CONFIG_METADATA_HUB
-      metadata_hub_process_metadata(pack.type, pack.code, pack.data, pack.length);
+        metadata_hub_process_metadata(pack.type, pack.code, pack.data, pack.length);
 #endif
 
 #ifdef CONFIG_MQTT
-      if (config.mqtt_enabled) {
-        mqtt_process_metadata(pack.type, pack.code, pack.data, pack.length);
-      }
+        if (config.mqtt_enabled) {
+          mqtt_process_metadata(pack.type, pack.code, pack.data, pack.length, NULL);
+        }
 #endif
+      }
     }
     pthread_cleanup_pop(1);
   }
@@ -1465,7 +1752,17 @@ void *metadata_thread_function(__attribute__((unused)) void *ignore) {
 }
 
 void metadata_init(void) {
-  int ret = pthread_create(&metadata_thread, NULL, metadata_thread_function, NULL);
+  // create a pc_queue for passing information to a threaded metadata handler
+  pc_queue_init(&metadata_queue, (char *)&metadata_queue_items, metadata_queue_sequences,
+                sizeof(metadata_package), metadata_queue_size);
+  pc_queue_init(&cover_art_queue, (char *)&cover_art_queue_items, cover_art_queue_sequences,
+                sizeof(metadata_package), cover_art_queue_size);
+  if (config.metadata_enabled)
+    metadata_shm_init();
+  int ret = pthread_create(&cover_art_thread, NULL, cover_art_thread_function, NULL);
+  if (ret)
+    debug(1, "Failed to create cover art thread!");
+  ret = pthread_create(&metadata_thread, NULL, metadata_thread_function, NULL);
   if (ret)
     debug(1, "Failed to create metadata thread!");
   metadata_running = 1;
@@ -1476,6 +1773,11 @@ void metadata_stop(void) {
     debug(2, "metadata_stop called.");
     pthread_cancel(metadata_thread);
     pthread_join(metadata_thread, NULL);
+    pthread_cancel(cover_art_thread);
+    pthread_join(cover_art_thread, NULL);
+    pc_queue_delete(&cover_art_queue);
+    pc_queue_delete(&metadata_queue);
+    metadata_shm_stop();
   }
 }
 
@@ -1514,15 +1816,29 @@ int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rts
   pack.data = data;
   pack.length = length;
   pack.carrier = carrier;
+  pack.payload = NULL;
+  pack.generation = 0;
   if (pack.carrier)
     msg_retain(pack.carrier);
-  int rc = pc_queue_add_item(&metadata_queue, &pack, block);
+  // a picture, which is big, is shared with the cover art thread rather than copied
+  if ((type == 'ssnc') && (code == 'PICT') && (pack.carrier) && (data) && (length)) {
+    pack.payload = metadata_payload_new(pack.carrier, data, length);
+    if (pack.payload)
+      pack.carrier = NULL; // it's now held by the payload
+  }
+
+  // Progress and volume items are superseded by the next one, so they never wait for room. If the
+  // queue is full, the new one is dropped -- never anything already queued.
+  int low_priority = (type == 'ssnc') && ((code == 'prgr') || (code == 'pvol'));
+  int rc = pc_queue_add_item(&metadata_queue, &pack, low_priority ? 0 : block);
   if (rc == EBUSY) {
-    if (pack.carrier)
-      msg_free(&pack.carrier);
-    else if (data)
-      free(data);
-    warn("Metadata queue is busy, discarding message of type 0x%08X, code 0x%08X.", type, code);
+    __atomic_add_fetch(&metadata_queue.items_dropped, 1, __ATOMIC_RELAXED);
+    metadata_pack_cleanup_function(&pack);
+    if (low_priority)
+      debug(2, "Metadata queue is full, discarding message of type 0x%08X, code 0x%08X.", type,
+            code);
+    else
+      warn("Metadata queue is busy, discarding message of type 0x%08X, code 0x%08X.", type, code);
   }
   return rc;
 }
@@ -1572,7 +1888,7 @@ static void handle_get_parameter(__attribute__((unused)) rtsp_conn_info *conn, r
     char *p = malloc(128); // will be automatically deallocated with the response is deleted
     if (p) {
       resp->content = p;
-      resp->contentlength = snprintf(p, 128, "\r\nvolume: %.6f\r\n", config.airplay_volume);
+      resp->contentlength = snprintf(p, 128, "volume: %.6f\r\n", config.airplay_volume);
     } else {
       debug(1, "Couldn't allocate space for a response.");
     }
@@ -2262,6 +2578,15 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
     free(conn->auth_nonce);
     conn->auth_nonce = NULL;
   }
+  if (conn->rtsp_pending_request) {
+    msg_free((rtsp_message **)&conn->rtsp_pending_request);
+    conn->rtsp_pending_request = NULL;
+  }
+  if (conn->rtsp_input_buffer) {
+    free(conn->rtsp_input_buffer);
+    conn->rtsp_input_buffer = NULL;
+    conn->rtsp_input_buffer_size = 0;
+  }
   rtp_terminate(conn);
 
   if (conn->dacp_id) {
@@ -2315,6 +2640,93 @@ void msg_cleanup_function(void *arg) {
   msg_free((rtsp_message **)arg);
 }
 
+// Reply to a request on the RTSP channel.
+// If handover_allowed is set, an authorised request other than OPTIONS is not acted upon --
+// 1 is returned and the caller must pass it to a conversation thread of its own.
+// Otherwise 0 is returned if a response has been sent, or -1 if the response couldn't be sent.
+static int rtsp_reply_to_request(rtsp_conn_info *conn, rtsp_message *req, int handover_allowed) {
+  // these are volatile, as they're live across the setjmp in pthread_cleanup_push()
+  volatile int response = 0;
+  volatile int debug_level = 3; // for printing the request and response
+  rtsp_message *resp = msg_init();
+  pthread_cleanup_push(msg_cleanup_function, (void *)&resp);
+  resp->respcode = 400;
+
+  if (strcmp(req->method, "OPTIONS") !=
+      0) // the options message is very common, so don't log it until level 3
+    debug_level = 2;
+  debug(debug_level, "Connection %d: Received an RTSP Packet of type \"%s\":",
+        conn->connection_number, req->method),
+      debug_print_msg_headers(debug_level, req);
+
+  apple_challenge(conn->fd, req, resp);
+  resp->cseq = msg_get_header(req, "CSeq"); // the Server header is added when it's written
+  //      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
+
+  if ((conn->authorized == 1) || (rtsp_auth(&conn->auth_nonce, req, resp)) == 0) {
+    conn->authorized = 1; // it must have been authorized or didn't need a password
+    if ((handover_allowed) && (strcmp(req->method, "OPTIONS") != 0)) {
+      response = 1;
+    } else {
+      struct method_handler *mh;
+      int method_selected = 0;
+      for (mh = method_handlers; mh->method; mh++) {
+        if (!strcmp(mh->method, req->method)) {
+          method_selected = 1;
+          mh->handler(conn, req, resp);
+          break;
+        }
+      }
+      if (method_selected == 0) {
+        debug(3, "Connection %d: Unrecognised and unhandled rtsp request \"%s\".",
+              conn->connection_number, req->method);
+
+        int y = req->contentlength;
+        if (y > 0) {
+          char obf[4096];
+          if (y > 4096)
+            y = 4096;
+          char *p = req->content;
+          char *obfp = obf;
+          int obfc;
+          for (obfc = 0; obfc < y; obfc++) {
+            snprintf(obfp, 3, "%02X", (unsigned int)*p);
+            p++;
+            obfp += 2;
+          };
+          *obfp = 0;
+          debug(3, "Content: \"%s\".", obf);
+        }
+      }
+    }
+  }
+  if (response == 0) {
+    debug(debug_level, "Connection %d: RTSP Response:", conn->connection_number);
+    debug_print_msg_headers(debug_level, resp);
+
+    if (conn->stop == 0) {
+      int err = msg_write_response(conn->fd, resp);
+      if (err) {
+        debug(1, "Connection %d: Unable to write an RTSP message response. Terminating the "
+                 "connection.",
+              conn->connection_number);
+        struct linger so_linger;
+        so_linger.l_onoff = 1; // "true"
+        so_linger.l_linger = 0;
+        err = setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
+        if (err)
+          debug(1, "Could not set the RTSP socket to abort due to a write error on closing.");
+        conn->stop = 1;
+        response = -1;
+        // if (debuglev >= 1)
+        //  debuglev = 3; // see what happens next
+      }
+    }
+  }
+  pthread_cleanup_pop(1);
+  return response;
+}
+
 static void *rtsp_conversation_thread_func(void *pconn) {
   rtsp_conn_info *conn = pconn;
 
@@ -2350,90 +2762,23 @@ static void *rtsp_conversation_thread_func(void *pconn) {
   pthread_cleanup_push(rtsp_conversation_thread_cleanup_function, (void *)conn);
 
   rtp_initialise(conn);
-  char *hdr = NULL;
 
   enum rtsp_read_request_response reply;
 
   int rtsp_read_request_attempt_count = 1; // 1 means exit immediately
-  rtsp_message *req, *resp;
+  rtsp_message *req;
 
   while (conn->stop == 0) {
-    int debug_level = 3; // for printing the request and response
-    reply = rtsp_read_request(conn, &req);
+    if (conn->rtsp_pending_request) {
+      req = (rtsp_message *)conn->rtsp_pending_request;
+      conn->rtsp_pending_request = NULL;
+      reply = rtsp_read_request_response_ok;
+    } else {
+      reply = rtsp_read_request(conn, &req);
+    }
     if (reply == rtsp_read_request_response_ok) {
       pthread_cleanup_push(msg_cleanup_function, (void *)&req);
-      resp = msg_init();
-      pthread_cleanup_push(msg_cleanup_function, (void *)&resp);
-      resp->respcode = 400;
-
-      if (strcmp(req->method, "OPTIONS") !=
-          0) // the options message is very common, so don't log it until level 3
-        debug_level = 2;
-      debug(debug_level, "Connection %d: Received an RTSP Packet of type \"%s\":",
-            conn->connection_number, req->method),
-          debug_print_msg_headers(debug_level, req);
-
-      apple_challenge(conn->fd, req, resp);
-      hdr = msg_get_header(req, "CSeq");
-      if (hdr)
-        msg_add_header(resp, "CSeq", hdr);
-      //      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
-      msg_add_header(resp, "Server", "AirTunes/105.1");
-
-      if ((conn->authorized == 1) || (rtsp_auth(&conn->auth_nonce, req, resp)) == 0) {
-        conn->authorized = 1; // it must have been authorized or didn't need a password
-        struct method_handler *mh;
-        int method_selected = 0;
-        for (mh = method_handlers; mh->method; mh++) {
-          if (!strcmp(mh->method, req->method)) {
-            method_selected = 1;
-            mh->handler(conn, req, resp);
-            break;
-          }
-        }
-        if (method_selected == 0) {
-          debug(3, "Connection %d: Unrecognised and unhandled rtsp request \"%s\".",
-                conn->connection_number, req->method);
-
-          int y = req->contentlength;
-          if (y > 0) {
-            char obf[4096];
-            if (y > 4096)
-              y = 4096;
-            char *p = req->content;
-            char *obfp = obf;
-            int obfc;
-            for (obfc = 0; obfc < y; obfc++) {
-              snprintf(obfp, 3, "%02X", (unsigned int)*p);
-              p++;
-              obfp += 2;
-            };
-            *obfp = 0;
-            debug(3, "Content: \"%s\".", obf);
-          }
-        }
-      }
-      debug(debug_level, "Connection %d: RTSP Response:", conn->connection_number);
-      debug_print_msg_headers(debug_level, resp);
-
-      if (conn->stop == 0) {
-        int err = msg_write_response(conn->fd, resp);
-        if (err) {
-          debug(1, "Connection %d: Unable to write an RTSP message response. Terminating the "
-                   "connection.",
-                conn->connection_number);
-          struct linger so_linger;
-          so_linger.l_onoff = 1; // "true"
-          so_linger.l_linger = 0;
-          err = setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-          if (err)
-            debug(1, "Could not set the RTSP socket to abort due to a write error on closing.");
-          conn->stop = 1;
-          // if (debuglev >= 1)
-          //  debuglev = 3; // see what happens next
-        }
-      }
-      pthread_cleanup_pop(1);
+      rtsp_reply_to_request(conn, req, 0);
       pthread_cleanup_pop(1);
     } else {
       int tstop = 0;
@@ -2511,10 +2856,136 @@ static const char *format_address(struct sockaddr *fsa) {
 }
 */
 
+// Connections are looked after by the listener itself until they ask for something other than
+// OPTIONS (or fail to authorise). Only then is a conversation thread created for them.
+// This avoids creating a thread for every device that merely probes the service.
+// While the listener has them, connections are non-blocking, so that one slow client can't hold
+// up the others -- a client that won't take a short reply is dropped -- and they are closed if
+// they stay silent for too long.
+
+#define maximum_number_of_listener_connections 32
+#define listener_maximum_message_length 4096
+#define listener_default_idle_timeout 120 // seconds, if config.timeout doesn't say
+
+static rtsp_conn_info *listener_conns[maximum_number_of_listener_connections];
+static int nlistener_conns = 0;
+
+static void listener_connection_delete(int i) {
+  rtsp_conn_info *conn = listener_conns[i];
+  debug(3, "Connection %d: closed by the listener.", conn->connection_number);
+  if (conn->fd > 0)
+    close(conn->fd);
+  if (conn->auth_nonce)
+    free(conn->auth_nonce);
+  if (conn->rtsp_input_buffer)
+    free(conn->rtsp_input_buffer);
+  free(conn);
+  nlistener_conns--;
+  if (i < nlistener_conns)
+    memmove(&listener_conns[i], &listener_conns[i + 1],
+            (nlistener_conns - i) * sizeof(rtsp_conn_info *));
+}
+
+static void listener_connections_delete_all(void) {
+  while (nlistener_conns)
+    listener_connection_delete(nlistener_conns - 1);
+}
+
+static void rtsp_start_conversation_thread(rtsp_conn_info *conn) {
+  int ret = pthread_create(&conn->thread, NULL, rtsp_conversation_thread_func,
+                           conn); // also acts as a memory barrier
+  if (ret) {
+    char errorstring[1024];
+    strerror_r(ret, (char *)errorstring, sizeof(errorstring));
+    die("Connection %d: cannot create an RTSP conversation thread. Error %d: \"%s\".",
+        conn->connection_number, ret, (char *)errorstring);
+  }
+  debug(3, "Successfully created RTSP receiver thread %d.", conn->connection_number);
+  conn->running = 1; // this must happen before the thread is tracked
+  track_thread(conn);
+}
+
+// Read whatever has arrived on a connection looked after by the listener and act on any complete
+// request in it. Returns 0 if the connection should stay with the listener, 1 if it should be
+// handed to a conversation thread and -1 if it should be closed.
+static int listener_connection_service(rtsp_conn_info *conn) {
+  if (conn->rtsp_input_buffer_occupancy >= listener_maximum_message_length)
+    return 1; // an overlong header -- let a conversation thread deal with it
+  if (rtsp_input_buffer_reserve(conn, listener_maximum_message_length)) {
+    warn("Connection %d: can't allocate an input buffer.", conn->connection_number);
+    return -1;
+  }
+  ssize_t nread = recv(conn->fd, conn->rtsp_input_buffer + conn->rtsp_input_buffer_occupancy,
+                       conn->rtsp_input_buffer_size - conn->rtsp_input_buffer_occupancy,
+                       MSG_DONTWAIT);
+  if (nread == 0) {
+    debug(3, "Connection %d: -- connection closed.", conn->connection_number);
+    return -1;
+  }
+  if (nread < 0) {
+    if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return 0;
+    if (errno != ECONNRESET) {
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "Connection %d: listener read error %d: \"%s\".", conn->connection_number, errno,
+            (char *)errorstring);
+    }
+    return -1;
+  }
+  conn->rtsp_input_buffer_occupancy += nread;
+  conn->rtsp_listener_activity_time = get_absolute_time_in_fp();
+
+  int response = 0;
+  while ((response == 0) && (conn->rtsp_input_buffer_occupancy)) {
+    size_t header_length =
+        rtsp_header_length(conn->rtsp_input_buffer, conn->rtsp_input_buffer_occupancy);
+    if (header_length == 0) {
+      if (conn->rtsp_input_buffer_occupancy >= listener_maximum_message_length)
+        response = 1;
+      break; // wait for the rest of the header
+    }
+    // only requests that can be dealt with here need to be parsed here -- anything else is
+    // handed over as it stands
+    if ((strncmp(conn->rtsp_input_buffer, "OPTIONS ", strlen("OPTIONS ")) != 0) &&
+        ((config.password == NULL) || (conn->authorized != 0))) {
+      response = 1;
+      break;
+    }
+    size_t message_length =
+        header_length + rtsp_header_content_length(conn->rtsp_input_buffer, header_length);
+    if (message_length > listener_maximum_message_length) {
+      response = 1;
+      break;
+    }
+    rtsp_message *req = NULL;
+    int rc = rtsp_parse_request(conn, &req, &message_length);
+    if (rc == 0)
+      break; // wait for the rest of the content
+    if (rc == 1) {
+      rc = rtsp_reply_to_request(conn, req, 1);
+      if (rc == 1) {
+        conn->rtsp_pending_request = req; // the conversation thread will act on it
+        response = 1;
+      } else {
+        msg_free(&req);
+        if (rc < 0)
+          response = -1;
+      }
+    } else {
+      char *response_text = "RTSP/1.0 400 Bad Request\r\nServer: AirTunes/105.1\r\n\r\n";
+      if (write(conn->fd, response_text, strlen(response_text)) != (ssize_t)strlen(response_text))
+        response = -1;
+    }
+  }
+  return response;
+}
+
 void rtsp_listen_loop_cleanup_handler(__attribute__((unused)) void *arg) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
   debug(1, "rtsp_listen_loop_cleanup_handler called.");
+  listener_connections_delete_all();
   cancel_all_RTSP_threads();
   int *sockfd = (int *)arg;
   mdns_unregister();
@@ -2616,29 +3087,49 @@ void rtsp_listen_loop(void) {
   freeaddrinfo(info);
 
   if (nsock) {
-    int maxfd = -1;
-    fd_set fds;
-    FD_ZERO(&fds);
-    for (i = 0; i < nsock; i++) {
-      if (sockfd[i] > maxfd)
-        maxfd = sockfd[i];
-    }
+    struct pollfd fds[nsock + maximum_number_of_listener_connections];
 
     mdns_register();
 
+    int idle_timeout = listener_default_idle_timeout;
+    if ((config.dont_check_timeout == 0) && (config.timeout != 0))
+      idle_timeout = config.timeout;
+    uint64_t idle_timeout_fp = (uint64_t)idle_timeout << 32;
+
     pthread_setcancelstate(oldState, NULL);
     int acceptfd;
-    struct timeval tv;
     pthread_cleanup_push(rtsp_listen_loop_cleanup_handler, (void *)sockfd);
     do {
       pthread_testcancel();
-      tv.tv_sec = 60;
-      tv.tv_usec = 0;
 
-      for (i = 0; i < nsock; i++)
-        FD_SET(sockfd[i], &fds);
+      // close connections that have been idle for too long, and wake up in time for the next
+      int poll_timeout = 60000;
+      uint64_t time_now = get_absolute_time_in_fp();
+      for (i = nlistener_conns - 1; i >= 0; i--) {
+        uint64_t idle_time = time_now - listener_conns[i]->rtsp_listener_activity_time;
+        if (idle_time >= idle_timeout_fp) {
+          debug(2, "Connection %d: closing an idle connection.",
+                listener_conns[i]->connection_number);
+          listener_connection_delete(i);
+        } else {
+          int time_left = (((idle_timeout_fp - idle_time) * 1000) >> 32) + 1; // ms
+          if (time_left < poll_timeout)
+            poll_timeout = time_left;
+        }
+      }
 
-      ret = select(maxfd + 1, &fds, 0, 0, &tv);
+      for (i = 0; i < nsock; i++) {
+        fds[i].fd = sockfd[i];
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+      }
+      for (i = 0; i < nlistener_conns; i++) {
+        fds[nsock + i].fd = listener_conns[i]->fd;
+        fds[nsock + i].events = POLLIN;
+        fds[nsock + i].revents = 0;
+      }
+
+      ret = poll(fds, nsock + nlistener_conns, poll_timeout);
       if (ret < 0) {
         if (errno == EINTR)
           continue;
@@ -2647,14 +3138,39 @@ void rtsp_listen_loop(void) {
 
       cleanup_threads();
 
+      // service the connections the listener is looking after, last first, so that deleting one
+      // doesn't disturb the indices of those yet to be serviced
+      for (i = nlistener_conns - 1; i >= 0; i--) {
+        if (fds[nsock + i].revents) {
+          rtsp_conn_info *conn = listener_conns[i];
+          int rc = -1;
+          if ((fds[nsock + i].revents & POLLIN) != 0)
+            rc = listener_connection_service(conn);
+          if (rc == 1) {
+            debug(3, "Connection %d: handed over to a conversation thread.",
+                  conn->connection_number);
+            nlistener_conns--;
+            if (i < nlistener_conns)
+              memmove(&listener_conns[i], &listener_conns[i + 1],
+                      (nlistener_conns - i) * sizeof(rtsp_conn_info *));
+            int flags = fcntl(conn->fd, F_GETFL);
+            if (flags != -1)
+              fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK); // the thread blocks as it likes
+            rtsp_start_conversation_thread(conn);
+          } else if (rc < 0) {
+            listener_connection_delete(i);
+          }
+        }
+      }
+
       acceptfd = -1;
       for (i = 0; i < nsock; i++) {
-        if (FD_ISSET(sockfd[i], &fds)) {
+        if (fds[i].revents & POLLIN) {
           acceptfd = sockfd[i];
           break;
         }
       }
-      if (acceptfd < 0) // timeout
+      if (acceptfd < 0) // timeout or nothing new
         continue;
 
       rtsp_conn_info *conn = malloc(sizeof(rtsp_conn_info));
@@ -2711,24 +3227,18 @@ void rtsp_listen_loop(void) {
         } else {
           debug(1, "Error figuring out Shairport Sync's own IP number.");
         }
-        //      usleep(500000);
-        //      pthread_t rtsp_conversation_thread;
-        //      conn->thread = rtsp_conversation_thread;
-        //      conn->stop = 0; // record's memory has been zeroed
-        //      conn->authorized = 0; // record's memory has been zeroed
-        // fcntl(conn->fd, F_SETFL, O_NONBLOCK);
-
-        ret = pthread_create(&conn->thread, NULL, rtsp_conversation_thread_func,
-                             conn); // also acts as a memory barrier
-        if (ret) {
-          char errorstring[1024];
-          strerror_r(ret, (char *)errorstring, sizeof(errorstring));
-          die("Connection %d: cannot create an RTSP conversation thread. Error %d: \"%s\".",
-              conn->connection_number, ret, (char *)errorstring);
+        // look after it here until it needs a conversation thread of its own
+        int flags = fcntl(conn->fd, F_GETFL);
+        if ((flags == -1) || (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1))
+          debug(1, "Connection %d: can't make the connection non-blocking.",
+                conn->connection_number);
+        conn->rtsp_listener_activity_time = get_absolute_time_in_fp();
+        if (nlistener_conns == maximum_number_of_listener_connections) {
+          debug(2, "Connection %d: closing the oldest idle connection to make room.",
+                listener_conns[0]->connection_number);
+          listener_connection_delete(0);
         }
-        debug(3, "Successfully created RTSP receiver thread %d.", conn->connection_number);
-        conn->running = 1; // this must happen before the thread is tracked
-        track_thread(conn);
+        listener_conns[nlistener_conns++] = conn;
       }
     } while (1);
     pthread_cleanup_pop(1); // should never happen
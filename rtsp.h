@@ -25,4 +25,12 @@ void metadata_stop(void);
 
 int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block);
 
+#ifdef CONFIG_METADATA
+// The data of a picture belongs to a metadata_payload, which can be retained to keep the data
+// after the item has been processed, and must then be released.
+typedef struct metadata_payload metadata_payload;
+void metadata_payload_retain(metadata_payload *payload);
+void metadata_payload_release(metadata_payload *payload);
+#endif
+
 #endif // _RTSP_H
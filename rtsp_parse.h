@@ -0,0 +1,92 @@
+#ifndef _RTSP_PARSE_H
+#define _RTSP_PARSE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// The in-place parsing of RTSP requests, used by rtsp.c and by
+// shairport-sync-rtsp-parse-benchmark.c. Nothing here allocates memory or logs anything.
+
+// returns the length of the RTSP header at the start of the buffer, including the blank line
+// that terminates it, or zero if the header is not yet complete
+static inline size_t rtsp_header_length(const char *buf, size_t buflen) {
+  size_t i;
+  for (i = 0; i + 1 < buflen; i++) {
+    if (buf[i] == '\n') {
+      if (buf[i + 1] == '\n')
+        return i + 2;
+      if ((i + 2 < buflen) && (buf[i + 1] == '\r') && (buf[i + 2] == '\n'))
+        return i + 3;
+    }
+  }
+  return 0;
+}
+
+// look for a Content-Length header in a complete RTSP header
+static inline size_t rtsp_header_content_length(const char *buf, size_t header_length) {
+  const char *content_length_tag = "\nContent-Length:";
+  size_t tag_length = strlen(content_length_tag);
+  size_t i;
+  for (i = 0; i + tag_length < header_length; i++) {
+    if (strncasecmp(buf + i, content_length_tag, tag_length) == 0)
+      return strtoul(buf + i + tag_length, NULL, 10);
+  }
+  return 0;
+}
+
+// Split a complete RTSP header into its request line and header lines, where they lie.
+// Lines are terminated with \r\n or \n; the terminators and the ": " after each header name are
+// replaced with NULs. *method points to the method in the request line. Up to maximum_headers
+// names and values are recorded.
+// Returns the number of headers found, which may be more than maximum_headers, or -1 if the
+// request line or a header is malformed.
+static inline int rtsp_parse_header(char *buf, size_t header_length, char **method, char **names,
+                                    char **values, unsigned int maximum_headers) {
+  char *line = buf;
+  char *header_end = buf + header_length;
+  int line_number = 0;
+  int nheaders = 0;
+  while (line < header_end) {
+    char *eol = memchr(line, '\n', header_end - line);
+    if (eol == NULL)
+      break;
+    *eol = '\0';
+    if ((eol > line) && (*(eol - 1) == '\r'))
+      *(eol - 1) = '\0';
+    if (*line) {
+      if (line_number == 0) {
+        char *sp = NULL, *p;
+        p = strtok_r(line, " ", &sp);
+        if (!p)
+          return -1;
+        *method = p;
+        p = strtok_r(NULL, " ", &sp);
+        if (!p)
+          return -1;
+        p = strtok_r(NULL, " ", &sp);
+        if (!p)
+          return -1;
+        if (strcmp(p, "RTSP/1.0"))
+          return -1;
+      } else {
+        char *p = strstr(line, ": ");
+        if (!p)
+          return -1;
+        *p = 0;
+        if ((unsigned int)nheaders < maximum_headers) {
+          names[nheaders] = line;
+          values[nheaders] = p + 2;
+        }
+        nheaders++;
+      }
+      line_number++;
+    }
+    line = eol + 1;
+  }
+  if (line_number == 0)
+    return -1;
+  return nheaders;
+}
+
+#endif // _RTSP_PARSE_H
@@ -0,0 +1,214 @@
+/*
+ * This file is part of Shairport Sync.
+ * Copyright (c) 2026 The Shairport Sync contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A reference reader for the binary metadata format defined in metadata_binary.h.
+// Usage:
+//   shairport-sync-metadata-binary-reader < /tmp/shairport-sync-metadata
+//   shairport-sync-metadata-binary-reader -u 5555 [-g 226.0.0.1]
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metadata_binary.h"
+
+static char *payload = NULL;
+static size_t payload_size = 0;
+
+static int payload_reserve(size_t size) {
+  if (size > payload_size) {
+    char *p = realloc(payload, size);
+    if (p == NULL) {
+      fprintf(stderr, "Can not allocate %zu bytes for a payload.\n", size);
+      return -1;
+    }
+    payload = p;
+    payload_size = size;
+  }
+  return 0;
+}
+
+static void print_fourcc(uint32_t v) {
+  int i;
+  for (i = 3; i >= 0; i--) {
+    char c = (v >> (i * 8)) & 0xFF;
+    putchar(((c >= ' ') && (c <= '~')) ? c : '.');
+  }
+}
+
+static void print_item(const metadata_binary_header *header, const char *data) {
+  static int sequence_valid = 0;
+  static uint32_t expected_sequence;
+  if ((sequence_valid) && (header->sequence != expected_sequence))
+    printf("(%u item(s) missed)\n", header->sequence - expected_sequence);
+  expected_sequence = header->sequence + 1;
+  sequence_valid = 1;
+
+  print_fourcc(header->type);
+  putchar(' ');
+  print_fourcc(header->code);
+  printf(" #%u, %u bytes", header->sequence, header->length);
+  if (header->length) {
+    uint32_t i;
+    int printable = 1;
+    for (i = 0; (i < header->length) && (printable); i++)
+      if (((unsigned char)data[i] < ' ') || ((unsigned char)data[i] > '~'))
+        printable = 0;
+    if (printable)
+      printf(": \"%.*s\"", (int)header->length, data);
+  }
+  putchar('\n');
+  fflush(stdout);
+}
+
+static int read_fully(int fd, char *buf, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t n = read(fd, buf + done, count - done);
+    if (n == 0)
+      return 0;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += n;
+  }
+  return 1;
+}
+
+static int read_stream(int fd) {
+  char buf[METADATA_BINARY_HEADER_LENGTH];
+  metadata_binary_header header;
+  while (read_fully(fd, buf, METADATA_BINARY_HEADER_LENGTH) == 1) {
+    metadata_binary_header_unpack(buf, &header);
+    if (header.magic != METADATA_BINARY_MAGIC) {
+      fprintf(stderr, "Lost synchronisation with the metadata stream.\n");
+      return 1;
+    }
+    if (payload_reserve(header.length + 1))
+      return 1;
+    if ((header.length) && (read_fully(fd, payload, header.length) != 1))
+      return 1;
+    print_item(&header, payload);
+  }
+  return 0;
+}
+
+static int read_udp(int port, const char *group) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+  if (group) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      perror("IP_ADD_MEMBERSHIP");
+      return 1;
+    }
+  }
+
+  static char packet[65536];
+  metadata_binary_header header;
+  int assembling = 0; // set while the parts of an item are arriving
+  uint32_t assembling_sequence = 0;
+  uint32_t received = 0;
+  while (1) {
+    ssize_t n = recv(sock, packet, sizeof(packet), 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("recv");
+      return 1;
+    }
+    if (n < METADATA_BINARY_HEADER_LENGTH)
+      continue;
+    metadata_binary_header_unpack(packet, &header);
+    if (header.magic != METADATA_BINARY_MAGIC)
+      continue;
+    size_t datalen = n - METADATA_BINARY_HEADER_LENGTH;
+    if ((header.offset > header.length) || (datalen > header.length - header.offset))
+      continue;
+    if ((assembling == 0) || (header.sequence != assembling_sequence)) {
+      if (assembling)
+        fprintf(stderr, "Item #%u was incomplete.\n", assembling_sequence);
+      if (payload_reserve(header.length + 1))
+        return 1;
+      assembling = 1;
+      assembling_sequence = header.sequence;
+      received = 0;
+    }
+    memcpy(payload + header.offset, packet + METADATA_BINARY_HEADER_LENGTH, datalen);
+    received += datalen;
+    if (received >= header.length) {
+      print_item(&header, payload);
+      assembling = 0;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int port = 0;
+  const char *group = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "u:g:")) != -1) {
+    switch (c) {
+    case 'u':
+      port = atoi(optarg);
+      break;
+    case 'g':
+      group = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-u port [-g multicast_group]] -- reads from stdin unless a UDP "
+                      "port is given.\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (port)
+    return read_udp(port, group);
+  else
+    return read_stream(STDIN_FILENO);
+}
@@ -408,6 +408,8 @@ int parse_options(int argc, char **argv) {
 
 #ifdef CONFIG_METADATA_HUB
   config.cover_art_cache_dir = "/tmp/shairport-sync/.cache/coverart";
+  config.cover_art_cache_maximum_entries = 100;
+  config.cover_art_cache_maximum_size = 50 * 1024 * 1024;
   config.scan_interval_when_active =
       1; // number of seconds between DACP server scans when playing something
   config.scan_interval_when_inactive =
@@ -847,6 +849,32 @@ int parse_options(int argc, char **argv) {
         config.metadata_sockmsglength = value < 500 ? 500 : value > 65000 ? 65000 : value;
       }
 
+      if (config_lookup_string(config.cfg, "metadata.shared_memory_file", &str)) {
+        config.metadata_shm_filename = (char *)str;
+      }
+
+      if (config_lookup_string(config.cfg, "metadata.pipe_format", &str)) {
+        if (strcasecmp(str, "xml") == 0)
+          config.metadata_pipe_binary_format = 0;
+        else if (strcasecmp(str, "binary") == 0)
+          config.metadata_pipe_binary_format = 1;
+        else
+          die("Invalid metadata pipe_format option choice \"%s\". It should be \"xml\" or "
+              "\"binary\"",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "metadata.socket_format", &str)) {
+        if (strcasecmp(str, "standard") == 0)
+          config.metadata_socket_binary_format = 0;
+        else if (strcasecmp(str, "binary") == 0)
+          config.metadata_socket_binary_format = 1;
+        else
+          die("Invalid metadata socket_format option choice \"%s\". It should be \"standard\" "
+              "or \"binary\"",
+              str);
+      }
+
 #endif
 
 #ifdef CONFIG_METADATA_HUB
@@ -854,6 +882,22 @@ int parse_options(int argc, char **argv) {
         config.cover_art_cache_dir = (char *)str;
       }
 
+      if (config_lookup_int(config.cfg, "metadata.cover_art_cache_maximum_entries", &value)) {
+        if (value < 0)
+          die("Invalid metadata cover_art_cache_maximum_entries setting %d. It should be 0 (no "
+              "limit) or more.",
+              value);
+        config.cover_art_cache_maximum_entries = value;
+      }
+
+      if (config_lookup_int(config.cfg, "metadata.cover_art_cache_maximum_size", &value)) {
+        if (value < 0)
+          die("Invalid metadata cover_art_cache_maximum_size setting %d. It should be 0 (no "
+              "limit) or more.",
+              value);
+        config.cover_art_cache_maximum_size = value;
+      }
+
       if (config_lookup_string(config.cfg, "diagnostics.retain_cover_art", &str)) {
         if (strcasecmp(str, "no") == 0)
           config.retain_coverart = 0;
@@ -1082,6 +1126,7 @@ int parse_options(int argc, char **argv) {
     config_set_lookup_bool(config.cfg, "mqtt.publish_raw", &config.mqtt_publish_raw);
     config_set_lookup_bool(config.cfg, "mqtt.publish_parsed", &config.mqtt_publish_parsed);
     config_set_lookup_bool(config.cfg, "mqtt.publish_cover", &config.mqtt_publish_cover);
+    config_set_lookup_bool(config.cfg, "mqtt.publish_retained", &config.mqtt_publish_retained);
     if (config.mqtt_publish_cover && !config.get_coverart) {
       die("You need to have metadata.include_cover_art enabled in order to use mqtt.publish_cover");
     }
@@ -1367,10 +1412,13 @@ Actually, there is no stop_mpris_service() function.
 // for removing zombie script processes
 // see: http://www.microhowto.info/howto/reap_zombie_processes_using_a_sigchld_handler.html
 // used with thanks.
+// Once the command supervisor is running, it reaps the children instead, so that it can tell how
+// the hooks exited.
 
 void handle_sigchld(__attribute__((unused)) int sig) {
   int saved_errno = errno;
-  while (waitpid((pid_t)(-1), 0, WNOHANG) > 0) {}
+  if (hook_supervisor_wake() == 0)
+    while (waitpid((pid_t)(-1), 0, WNOHANG) > 0) {}
   errno = saved_errno;
 }
 
@@ -1795,6 +1843,11 @@ int main(int argc, char **argv) {
   debug(1, "metadata socket address is \"%s\" port %d.", config.metadata_sockaddr,
         config.metadata_sockport);
   debug(1, "metadata socket packet size is \"%d\".", config.metadata_sockmsglength);
+  debug(1, "metadata pipe format is %s.", config.metadata_pipe_binary_format ? "binary" : "xml");
+  debug(1, "metadata socket format is %s.",
+        config.metadata_socket_binary_format ? "binary" : "standard");
+  debug(1, "metadata shared memory file is \"%s\".",
+        config.metadata_shm_filename ? config.metadata_shm_filename : "");
   debug(1, "get-coverart is %d.", config.get_coverart);
 #endif
 #ifdef CONFIG_MQTT
@@ -1804,6 +1857,7 @@ int main(int argc, char **argv) {
   debug(1, "mqtt will%s publish raw metadata.", config.mqtt_publish_raw ? "" : " not");
   debug(1, "mqtt will%s publish parsed metadata.", config.mqtt_publish_parsed ? "" : " not");
   debug(1, "mqtt will%s publish cover Art.", config.mqtt_publish_cover ? "" : " not");
+  debug(1, "mqtt will%s retain state messages.", config.mqtt_publish_retained ? "" : " not");
   debug(1, "mqtt remote control is %sabled.", config.mqtt_enable_remote ? "en" : "dis");
 #endif
 
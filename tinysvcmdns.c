@@ -1161,6 +1161,46 @@ struct mdnsd {
   struct rr_list *announce;
   struct rr_list *services;
   uint8_t *hostname;
+  uint32_t generation; // incremented, under data_lock, whenever the records change
+};
+
+// the records answering a query, in the order they go into the reply
+#define MDNS_MAX_ANSWERS 32
+
+struct mdns_answer_set {
+  int count;
+  struct rr_entry *e[MDNS_MAX_ANSWERS];
+};
+
+// replies are encoded once and kept, keyed by their answers, until the records change
+#define MDNS_RESPONSE_CACHE_SIZE 8
+
+struct mdns_cached_response {
+  uint32_t generation; // zero if the slot is empty
+  uint32_t last_used;
+  struct mdns_answer_set answers;
+  size_t len;
+  uint8_t *pkt; // encoded with an ID of zero
+};
+
+// a reply to a truncated query is held back while the rest of its known answers arrive
+#define MDNS_KNOWN_ANSWER_WAIT_MS 450 // RFC 6762, 7.2: 400 to 500 ms
+
+struct mdns_pending_response {
+  int active;
+  struct in_addr from;
+  uint16_t id;
+  uint64_t deadline; // in get_absolute_time_in_fp() units
+  struct mdns_answer_set answers;
+};
+
+// these are used only by the main loop
+struct mdns_responder {
+  struct mdns_cached_response cache[MDNS_RESPONSE_CACHE_SIZE];
+  uint32_t use_count;
+  uint32_t primed_generation;
+  struct mdns_pending_response pending;
+  uint64_t cache_hits, cache_misses;
 };
 
 struct mdns_service {
@@ -1311,84 +1351,215 @@ static void announce_srv(struct mdnsd *svr, struct mdns_pkt *reply, uint8_t *nam
   add_related_rr(svr, reply->rr_add, reply);
 }
 
-// processes the incoming MDNS packet
-// returns >0 if processed, 0 otherwise
-static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns_pkt *reply) {
+// adds the records matching the RR name and type to the answer set, skipping duplicates
+// type can be RR_ANY, which adds all entries EXCEPT RR_NSEC
+// must be called with the data_lock held
+static int collect_answers(struct mdnsd *svr, struct mdns_answer_set *set, uint8_t *name,
+                           enum rr_type type) {
+  int num_ans = 0;
+  struct rr_group *ans_grp = rr_group_find(svr->group, name);
+  if (ans_grp == NULL)
+    return num_ans;
+
+  struct rr_list *n = ans_grp->rr;
+  for (; n; n = n->next) {
+    if (type == RR_ANY && n->e->type == RR_NSEC)
+      continue;
+
+    if ((type == n->e->type || type == RR_ANY) && cmp_nlabel(name, n->e->name) == 0) {
+      int i;
+      for (i = 0; i < set->count && set->e[i] != n->e; i++)
+        ;
+      if (i < set->count)
+        continue; // already there
+      if (set->count == MDNS_MAX_ANSWERS) {
+        DEBUG_PRINTF("too many answers, some dropped\n");
+        break;
+      }
+      set->e[set->count++] = n->e;
+      num_ans++;
+    }
+  }
+  return num_ans;
+}
+
+// removes the answers the querier already knows about, i.e. those it lists with at least half
+// of their actual TTL remaining
+static void suppress_known_answers(struct mdns_answer_set *set, struct rr_list *known) {
+  int i, j;
+  if (known == NULL)
+    return;
+  for (i = 0, j = 0; i < set->count; i++) {
+    struct rr_entry *known_ans = rr_entry_match(known, set->e[i]);
+    if (known_ans != NULL && known_ans->ttl >= set->e[i]->ttl / 2) {
+      char *namestr = nlabel_to_str(set->e[i]->name);
+      DEBUG_PRINTF("removing answer for %s\n", namestr);
+      free(namestr);
+    } else {
+      set->e[j++] = set->e[i];
+    }
+  }
+  set->count = j;
+}
+
+// finds the answers to the questions in an incoming standard query
+// returns the number of answers
+static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt,
+                            struct mdns_answer_set *set) {
   int i;
 
   assert(pkt != NULL);
 
-  // is it standard query?
-  if ((pkt->flags & MDNS_FLAG_RESP) == 0 && MDNS_FLAG_GET_OPCODE(pkt->flags) == 0) {
-    mdns_init_reply(reply, pkt->id);
+  set->count = 0;
 
-    DEBUG_PRINTF("flags = %04x, qn = %d, ans = %d, add = %d\n", pkt->flags, pkt->num_qn,
-                 pkt->num_ans_rr, pkt->num_add_rr);
+  DEBUG_PRINTF("flags = %04x, qn = %d, ans = %d, add = %d\n", pkt->flags, pkt->num_qn,
+               pkt->num_ans_rr, pkt->num_add_rr);
 
-    // loop through questions
-    struct rr_list *qnl = pkt->rr_qn;
-    for (i = 0; i < pkt->num_qn; i++, qnl = qnl->next) {
-      struct rr_entry *qn = qnl->e;
-      int num_ans_added = 0;
+  // loop through questions
+  pthread_mutex_lock(&svr->data_lock);
+  struct rr_list *qnl = pkt->rr_qn;
+  for (i = 0; i < pkt->num_qn; i++, qnl = qnl->next) {
+    struct rr_entry *qn = qnl->e;
+
+    char *namestr = nlabel_to_str(qn->name);
+    DEBUG_PRINTF("qn #%d: type %s (%02x) %s - ", i, rr_get_type_name(qn->type), qn->type,
+                 namestr);
+    free(namestr);
+
+    // check if it's a unicast query - we ignore those
+    if (qn->unicast_query) {
+      DEBUG_PRINTF("skipping unicast query\n");
+      continue;
+    }
 
-      char *namestr = nlabel_to_str(qn->name);
-      DEBUG_PRINTF("qn #%d: type %s (%02x) %s - ", i, rr_get_type_name(qn->type), qn->type,
-                   namestr);
-      free(namestr);
+    int num_ans_added = collect_answers(svr, set, qn->name, qn->type);
+    DEBUG_PRINTF("added %d answers\n", num_ans_added);
+  }
+  pthread_mutex_unlock(&svr->data_lock);
 
-      // check if it's a unicast query - we ignore those
-      if (qn->unicast_query) {
-        DEBUG_PRINTF("skipping unicast query\n");
-        continue;
-      }
+  // remove our replies if they were already in their answers
+  suppress_known_answers(set, pkt->rr_ans);
 
-      num_ans_added = populate_answers(svr, &reply->rr_ans, qn->name, qn->type);
-      reply->num_ans_rr += num_ans_added;
+  DEBUG_PRINTF("\n");
 
-      DEBUG_PRINTF("added %d answers\n", num_ans_added);
-    }
+  return set->count;
+}
 
-    // remove our replies if they were already in their answers
-    struct rr_list *ans = NULL, *prev_ans = NULL;
-    for (ans = reply->rr_ans; ans;) {
-      struct rr_list *next_ans = ans->next;
-      struct rr_entry *known_ans = rr_entry_match(pkt->rr_ans, ans->e);
-
-      // discard answers that have at least half of the actual TTL
-      if (known_ans != NULL && known_ans->ttl >= ans->e->ttl / 2) {
-        char *namestr = nlabel_to_str(ans->e->name);
-        DEBUG_PRINTF("removing answer for %s\n", namestr);
-        free(namestr);
-
-        // check if list item is head
-        if (prev_ans == NULL)
-          reply->rr_ans = ans->next;
-        else
-          prev_ans->next = ans->next;
-        free(ans);
-
-        ans = prev_ans;
-
-        // adjust answer count
-        reply->num_ans_rr--;
-      }
+// encodes a reply carrying the answer set, with its related records, into pkt_buf
+// returns the size of the packet, or 0 if there's nothing to send
+static size_t encode_answers(struct mdnsd *svr, struct mdns_answer_set *set,
+                             struct mdns_pkt *reply, uint8_t *pkt_buf, uint16_t id) {
+  int i;
+  mdns_init_reply(reply, id);
+  for (i = 0; i < set->count; i++)
+    reply->num_ans_rr += rr_list_append(&reply->rr_ans, set->e[i]);
 
-      prev_ans = ans;
-      ans = next_ans;
-    }
+  // see if we can match additional records for answers
+  add_related_rr(svr, reply->rr_ans, reply);
 
-    // see if we can match additional records for answers
-    add_related_rr(svr, reply->rr_ans, reply);
+  // additional records for additional records
+  add_related_rr(svr, reply->rr_add, reply);
 
-    // additional records for additional records
-    add_related_rr(svr, reply->rr_add, reply);
+  if (reply->num_ans_rr == 0)
+    return 0;
+  size_t replylen = mdns_encode_pkt(reply, pkt_buf, PACKET_SIZE);
+  if (replylen == (size_t)-1)
+    return 0;
+  return replylen;
+}
+
+static uint32_t current_generation(struct mdnsd *svr) {
+  pthread_mutex_lock(&svr->data_lock);
+  uint32_t generation = svr->generation;
+  pthread_mutex_unlock(&svr->data_lock);
+  return generation;
+}
 
-    DEBUG_PRINTF("\n");
+static int answer_sets_equal(struct mdns_answer_set *a, struct mdns_answer_set *b) {
+  return a->count == b->count && memcmp(a->e, b->e, a->count * sizeof(a->e[0])) == 0;
+}
 
-    return reply->num_ans_rr;
+// looks for the encoded reply carrying exactly this answer set, encoding and keeping it if need
+// be; the reply is left in pkt_buf with the given ID
+// returns the size of the packet, or 0 if there's nothing to send
+static size_t cached_reply(struct mdnsd *svr, struct mdns_responder *responder,
+                           struct mdns_answer_set *set, struct mdns_pkt *reply, uint8_t *pkt_buf,
+                           uint16_t id) {
+  uint32_t generation = current_generation(svr);
+  struct mdns_cached_response *slot = &responder->cache[0];
+  int i;
+  for (i = 0; i < MDNS_RESPONSE_CACHE_SIZE; i++) {
+    struct mdns_cached_response *c = &responder->cache[i];
+    if (c->generation == generation && answer_sets_equal(&c->answers, set)) {
+      c->last_used = ++responder->use_count;
+      responder->cache_hits++;
+      memcpy(pkt_buf, c->pkt, c->len);
+      mdns_write_u16(pkt_buf, id);
+      return c->len;
+    }
+    // otherwise look for an empty or out-of-date slot, or else the least recently used one
+    if (slot->generation == generation &&
+        (c->generation != generation || c->last_used < slot->last_used))
+      slot = c;
   }
 
-  return 0;
+  responder->cache_misses++;
+  size_t replylen = encode_answers(svr, set, reply, pkt_buf, 0);
+  if (replylen == 0)
+    return 0;
+  uint8_t *pkt = realloc(slot->pkt, replylen);
+  if (pkt) {
+    memcpy(pkt, pkt_buf, replylen);
+    slot->pkt = pkt;
+    slot->len = replylen;
+    slot->answers = *set;
+    slot->generation = generation;
+    slot->last_used = ++responder->use_count;
+  } else {
+    slot->generation = 0; // don't keep it, but send it anyway
+  }
+  mdns_write_u16(pkt_buf, id);
+  return replylen;
+}
+
+// when the records have changed, encode the replies to the queries we expect most -- the PTR
+// query for each service type and the service type enumeration -- ahead of time
+static void prime_response_cache(struct mdnsd *svr, struct mdns_responder *responder,
+                                 struct mdns_pkt *reply, uint8_t *pkt_buf) {
+  struct mdns_answer_set sets[MDNS_RESPONSE_CACHE_SIZE];
+  int num_sets = 0;
+  uint32_t generation;
+
+  pthread_mutex_lock(&svr->data_lock);
+  generation = svr->generation;
+  struct rr_list *svc_le = svr->services;
+  for (; svc_le && num_sets < MDNS_RESPONSE_CACHE_SIZE - 1; svc_le = svc_le->next) {
+    sets[num_sets].count = 0;
+    if (collect_answers(svr, &sets[num_sets], svc_le->e->name, RR_PTR))
+      num_sets++;
+  }
+  sets[num_sets].count = 0;
+  if (collect_answers(svr, &sets[num_sets], SERVICES_DNS_SD_NLABEL, RR_PTR))
+    num_sets++;
+  pthread_mutex_unlock(&svr->data_lock);
+
+  int i;
+  for (i = 0; i < num_sets; i++)
+    cached_reply(svr, responder, &sets[i], reply, pkt_buf, 0);
+  responder->primed_generation = generation;
+  DEBUG_PRINTF("primed %d replies for generation %u\n", num_sets, generation);
+}
+
+static void send_pending_response(struct mdnsd *svr, struct mdns_responder *responder,
+                                  struct mdns_pkt *reply, uint8_t *pkt_buf) {
+  struct mdns_pending_response *pending = &responder->pending;
+  if (pending->active) {
+    pending->active = 0;
+    size_t replylen =
+        cached_reply(svr, responder, &pending->answers, reply, pkt_buf, pending->id);
+    if (replylen)
+      send_packet(svr->sockfd, pkt_buf, replylen);
+  }
 }
 
 int create_pipe(int handles[2]) {
@@ -1482,11 +1653,39 @@ void* main_loop(struct mdnsd *svr) {
   else
     die("could not allocate memory for \"mdns_reply\" in tinysvcmdns");
 
+  struct mdns_responder *responder = calloc(1, sizeof(struct mdns_responder));
+  if (responder == NULL)
+    die("could not allocate memory for \"responder\" in tinysvcmdns");
+
+  // scratch space for the answers to the current query
+  struct mdns_answer_set *answers = malloc(sizeof(struct mdns_answer_set));
+  if (answers == NULL)
+    die("could not allocate memory for \"answers\" in tinysvcmdns");
+
   while (!svr->stop_flag) {
+    if (responder->primed_generation != current_generation(svr))
+      prime_response_cache(svr, responder, mdns_reply, pkt_buffer);
+
+    // wait no longer than the deadline of a reply that's being held back
+    struct timeval timeout, *timeoutp = NULL;
+    if (responder->pending.active) {
+      uint64_t time_now = get_absolute_time_in_fp();
+      uint64_t wait = 0;
+      if (responder->pending.deadline > time_now)
+        wait = responder->pending.deadline - time_now;
+      timeout.tv_sec = wait >> 32;
+      timeout.tv_usec = ((wait & 0xffffffff) * 1000000) >> 32;
+      timeoutp = &timeout;
+    }
+
     FD_ZERO(&sockfd_set);
     FD_SET(svr->sockfd, &sockfd_set);
     FD_SET(svr->notify_pipe[0], &sockfd_set);
-    select(max_fd + 1, &sockfd_set, NULL, NULL, NULL);
+    if (select(max_fd + 1, &sockfd_set, NULL, NULL, timeoutp) <= 0)
+      FD_ZERO(&sockfd_set);
+
+    if (responder->pending.active && get_absolute_time_in_fp() >= responder->pending.deadline)
+      send_pending_response(svr, responder, mdns_reply, pkt_buffer);
 
     if (FD_ISSET(svr->notify_pipe[0], &sockfd_set)) {
       // flush the notify_pipe
@@ -1504,11 +1703,35 @@ void* main_loop(struct mdnsd *svr) {
       DEBUG_PRINTF("data from=%s size=%ld\n", inet_ntoa(fromaddr.sin_addr), (long)recvsize);
       struct mdns_pkt *mdns = mdns_parse_pkt(pkt_buffer, recvsize);
       if (mdns != NULL) {
-        if (process_mdns_pkt(svr, mdns, mdns_reply)) {
-          size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
-          send_packet(svr->sockfd, pkt_buffer, replylen);
-        } else if (mdns->num_qn == 0) {
-          DEBUG_PRINTF("(no questions in packet)\n\n");
+        struct mdns_pending_response *pending = &responder->pending;
+        // is it standard query?
+        if ((mdns->flags & MDNS_FLAG_RESP) == 0 && MDNS_FLAG_GET_OPCODE(mdns->flags) == 0) {
+          if (mdns->num_qn == 0) {
+            // a continuation of a truncated query carries only known answers
+            if (pending->active && pending->from.s_addr == fromaddr.sin_addr.s_addr) {
+              suppress_known_answers(&pending->answers, mdns->rr_ans);
+              if (pending->answers.count == 0)
+                pending->active = 0;
+            } else {
+              DEBUG_PRINTF("(no questions in packet)\n\n");
+            }
+          } else if (process_mdns_pkt(svr, mdns, answers)) {
+            if (mdns->flags & MDNS_FLAG_TC) {
+              // more known answers are coming, so hold the reply back for them
+              send_pending_response(svr, responder, mdns_reply, pkt_buffer);
+              pending->active = 1;
+              pending->from = fromaddr.sin_addr;
+              pending->id = mdns->id;
+              pending->deadline =
+                  get_absolute_time_in_fp() + ((uint64_t)MDNS_KNOWN_ANSWER_WAIT_MS << 32) / 1000;
+              pending->answers = *answers;
+            } else {
+              size_t replylen =
+                  cached_reply(svr, responder, answers, mdns_reply, pkt_buffer, mdns->id);
+              if (replylen)
+                send_packet(svr->sockfd, pkt_buffer, replylen);
+            }
+          }
         }
 
         mdns_pkt_destroy(mdns);
@@ -1563,6 +1786,15 @@ void* main_loop(struct mdnsd *svr) {
   mdns_init_reply(mdns_reply, 0);
   free(mdns_reply);
 
+  DEBUG_PRINTF("response cache: %llu hits, %llu misses\n",
+               (unsigned long long)responder->cache_hits,
+               (unsigned long long)responder->cache_misses);
+  int i;
+  for (i = 0; i < MDNS_RESPONSE_CACHE_SIZE; i++)
+    free(responder->cache[i].pkt);
+  free(responder);
+  free(answers);
+
   free(pkt_buffer);
 
   close_pipe(svr->sockfd);
@@ -1590,6 +1822,7 @@ void mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, uint32_t ip) {
   svr->hostname = create_nlabel(hostname);
   rr_group_add(&svr->group, a_e);
   rr_group_add(&svr->group, nsec_e);
+  svr->generation++;
   pthread_mutex_unlock(&svr->data_lock);
 }
 
@@ -1610,12 +1843,14 @@ void mdnsd_set_hostname_v6(struct mdnsd *svr, const char *hostname, struct in6_a
   svr->hostname = create_nlabel(hostname);
   rr_group_add(&svr->group, aaaa_e);
   rr_group_add(&svr->group, nsec_e);
+  svr->generation++;
   pthread_mutex_unlock(&svr->data_lock);
 }
 
 void mdnsd_add_rr(struct mdnsd *svr, struct rr_entry *rr) {
   pthread_mutex_lock(&svr->data_lock);
   rr_group_add(&svr->group, rr);
+  svr->generation++;
   pthread_mutex_unlock(&svr->data_lock);
 }
 
@@ -1675,6 +1910,7 @@ struct mdns_service *mdnsd_register_svc(struct mdnsd *svr, const char *instance_
   // append PTR entry to announce list
   rr_list_append(&svr->announce, ptr_e);
   rr_list_append(&svr->services, ptr_e);
+  svr->generation++;
 
   pthread_mutex_unlock(&svr->data_lock);
 
@@ -1719,6 +1955,7 @@ struct mdnsd *mdnsd_start() {
   }
 
   pthread_mutex_init(&server->data_lock, NULL);
+  server->generation = 1; // a cache slot with a generation of zero is empty
 
   // init thread
   pthread_attr_init(&attr);